@@ -24,6 +24,8 @@ typedef enum {
 	S4_NEW    = 1 << 0,
 	S4_EXISTS = 1 << 1,
 	S4_MEMORY = 1 << 2,
+	S4_QUERY_CACHE = 1 << 3,
+	S4_FOLLOWER = 1 << 4,
 } s4_open_flag_t;
 
 /**
@@ -31,8 +33,19 @@ typedef enum {
  */
 typedef enum {
 	S4_TRANS_READONLY = 1 << 0,
+	S4_TRANS_DEFERRED = 1 << 1, /**< Writes are staged and applied when the transaction commits or first reads */
+	S4_TRANS_OPTIMISTIC = 1 << 2, /**< Reads take no locks past the query, and are checked when the transaction commits */
 } s4_transaction_flag_t;
 
+/**
+ * How hard s4_commit works to make a transaction survive a crash
+ */
+typedef enum {
+	S4_DURABILITY_FULL, /**< The log is synced to disk before s4_commit returns */
+	S4_DURABILITY_ASYNC, /**< The log is written, and synced to disk by a background thread shortly after */
+	S4_DURABILITY_NONE /**< The log is written, but not synced to disk */
+} s4_durability_t;
+
 /**
  * Error codes
  */
@@ -50,6 +63,8 @@ typedef enum {
 	S4E_EXECUTE, /**< One of the operations in the transaction failed */
 	S4E_LOGFULL, /**< Not enough room in the log for the transaction. */
 	S4E_READONLY, /**< Tried to use s4_add or s4_del on a read-only transaction */
+	S4E_NOINDEX, /**< Tried to use an index on a key that is not indexed */
+	S4E_CONFLICT, /**< Something an optimistic transaction read was changed before it committed */
 } s4_errno_t;
 
 typedef enum {
@@ -59,6 +74,7 @@ typedef enum {
 } s4_cmp_mode_t;
 
 typedef struct s4_St s4_t;
+typedef struct s4_sourcepref_St s4_sourcepref_t;
 
 /* val.c */
 typedef struct s4_val_St s4_val_t;
@@ -82,6 +98,17 @@ s4_t *s4_open (const char *name, const char **indices, int flags);
 int s4_close (s4_t *s4);
 void s4_sync (s4_t *s4);
 s4_errno_t s4_errno (void);
+void s4_set_durability (s4_t *s4, s4_durability_t durability);
+s4_durability_t s4_get_durability (s4_t *s4);
+s4_durability_t s4_last_durability (void);
+void s4_flush (s4_t *s4);
+int s4_index_create (s4_t *s4, const char *key);
+int s4_index_drop (s4_t *s4, const char *key);
+int s4_index_create_composite (s4_t *s4, const char **keys,
+		s4_sourcepref_t *sp, s4_cmp_mode_t mode);
+int s4_index_create_covering (s4_t *s4, const char **keys, const char **include,
+		s4_sourcepref_t *sp, s4_cmp_mode_t mode);
+int s4_index_drop_composite (s4_t *s4, const char **keys);
 
 
 /* uuid.c */
@@ -90,8 +117,6 @@ void s4_get_uuid (s4_t *s4, unsigned char uuid[16]);
 char *s4_get_uuid_string (s4_t* s4);
 
 /* sourcepref.c */
-typedef struct s4_sourcepref_St s4_sourcepref_t;
-
 s4_sourcepref_t *s4_sourcepref_create (const char **sourcepref);
 void s4_sourcepref_unref (s4_sourcepref_t *sourcepref);
 s4_sourcepref_t *s4_sourcepref_ref (s4_sourcepref_t *sp);
@@ -201,6 +226,7 @@ void s4_resultset_free (s4_resultset_t *set);
 s4_resultset_t *s4_resultset_ref (s4_resultset_t *set);
 void s4_resultset_unref (s4_resultset_t *set);
 void s4_resultset_sort (s4_resultset_t *set, s4_order_t *order);
+void s4_resultset_sort_window (s4_resultset_t *set, s4_order_t *order, int offset, int limit);
 void s4_resultset_shuffle (s4_resultset_t *set);
 
 typedef enum {
@@ -225,9 +251,111 @@ void s4_pattern_free (s4_pattern_t *pattern);
 char *s4_string_collate (const char *str);
 char *s4_string_casefold (const char *str);
 
+/* prepared.c */
+typedef struct s4_prepared_St s4_prepared_t;
+s4_prepared_t *s4_prepare (s4_t *s4, s4_fetchspec_t *fs, s4_condition_t *cond);
+int s4_prepared_bind (s4_prepared_t *prep, int param, const s4_val_t *val);
+void s4_prepared_free (s4_prepared_t *prep);
+
+/* aggregate.c */
+typedef enum {
+	S4_AGGREGATE_COUNT, /**< Number of entries (with the key, if given) */
+	S4_AGGREGATE_COUNT_DISTINCT, /**< Number of distinct values */
+	S4_AGGREGATE_SUM, /**< Sum of the integer values */
+	S4_AGGREGATE_MIN, /**< Smallest value */
+	S4_AGGREGATE_MAX /**< Largest value */
+} s4_aggregate_type_t;
+
+typedef struct s4_aggspec_St s4_aggspec_t;
+typedef struct s4_aggresult_St s4_aggresult_t;
+
+s4_aggspec_t *s4_aggspec_create (const char *group_key, s4_sourcepref_t *sp);
+int s4_aggspec_add (s4_aggspec_t *spec, s4_aggregate_type_t type,
+		const char *key, s4_sourcepref_t *sp);
+void s4_aggspec_free (s4_aggspec_t *spec);
+int s4_aggresult_get_groupcount (const s4_aggresult_t *res);
+const s4_val_t *s4_aggresult_get_group (const s4_aggresult_t *res, int group);
+int s4_aggresult_get_int (const s4_aggresult_t *res, int group, int col, int64_t *i);
+const s4_val_t *s4_aggresult_get_val (const s4_aggresult_t *res, int group, int col);
+void s4_aggresult_free (s4_aggresult_t *res);
+
+/* stats.c */
+typedef enum {
+	S4_STATS_LOCKS, /**< Locks acquired, counted when the transaction is done */
+	S4_STATS_LOCK_WAITS, /**< Lock acquisitions that had to wait for another transaction */
+	S4_STATS_LOCK_UPGRADES, /**< Shared locks upgraded to exclusive locks */
+	S4_STATS_DEADLOCKS, /**< Transactions aborted because they would deadlock */
+	S4_STATS_COMMITS, /**< Transactions committed */
+	S4_STATS_COMMIT_FAILURES, /**< Calls to s4_commit that failed */
+	S4_STATS_ABORTS, /**< Transactions aborted with s4_abort */
+	S4_STATS_LOGFULL_SYNCS, /**< Syncs forced by a full log */
+	S4_STATS_LOG_SYNCS, /**< Times the log was synced to disk */
+	S4_STATS_CHECKPOINTS, /**< Times the database file was written */
+	S4_STATS_CONFLICTS, /**< Optimistic transactions that failed to commit because of a conflict */
+	S4_STATS_COUNTER_COUNT
+} s4_stats_counter_t;
+
+typedef enum {
+	S4_STATS_LOCK_WAIT, /**< Time spent waiting for a lock */
+	S4_STATS_COMMIT, /**< Time spent in s4_commit */
+	S4_STATS_LOG_SYNC, /**< Time spent syncing the log to disk */
+	S4_STATS_CHECKPOINT, /**< Time spent writing the database file */
+	S4_STATS_HISTOGRAM_COUNT
+} s4_stats_histogram_t;
+
+#define S4_STATS_BUCKETS 32
+
+typedef struct s4_stats_St s4_stats_t;
+s4_stats_t *s4_stats_snapshot (s4_t *s4);
+void s4_stats_reset (s4_t *s4);
+void s4_stats_free (s4_stats_t *stats);
+uint64_t s4_stats_get_counter (const s4_stats_t *stats, s4_stats_counter_t counter);
+uint64_t s4_stats_get_count (const s4_stats_t *stats, s4_stats_histogram_t hist);
+uint64_t s4_stats_get_sum_us (const s4_stats_t *stats, s4_stats_histogram_t hist);
+uint64_t s4_stats_get_bucket (const s4_stats_t *stats, s4_stats_histogram_t hist, int bucket);
+uint64_t s4_stats_get_percentile (const s4_stats_t *stats, s4_stats_histogram_t hist, double p);
+const char *s4_stats_counter_name (s4_stats_counter_t counter);
+const char *s4_stats_histogram_name (s4_stats_histogram_t hist);
+
+/* querystats.c */
+typedef enum {
+	S4_PATH_NONE, /**< No query has been run */
+	S4_PATH_INDEX_A, /**< Entries were looked up by their own key and value */
+	S4_PATH_INDEX_B, /**< Entries were looked up in a b-index */
+	S4_PATH_SCAN, /**< Every entry was checked */
+	S4_PATH_CACHE, /**< The result came from the query cache */
+	S4_PATH_INDEX_COMPOSITE /**< Entries were looked up in an index over several keys */
+} s4_access_path_t;
+
+typedef struct s4_query_stats_St s4_query_stats_t;
+s4_query_stats_t *s4_query_stats_create (void);
+s4_query_stats_t *s4_query_stats_ref (s4_query_stats_t *stats);
+void s4_query_stats_unref (s4_query_stats_t *stats);
+s4_access_path_t s4_query_stats_get_path (const s4_query_stats_t *stats);
+int s4_query_stats_get_candidates (const s4_query_stats_t *stats);
+int s4_query_stats_get_rows (const s4_query_stats_t *stats);
+int s4_query_stats_get_locks (const s4_query_stats_t *stats);
+int64_t s4_query_stats_get_total_us (const s4_query_stats_t *stats);
+int64_t s4_query_stats_get_lock_wait_us (const s4_query_stats_t *stats);
+int64_t s4_query_stats_get_fetch_us (const s4_query_stats_t *stats);
+int64_t s4_query_stats_get_sort_us (const s4_query_stats_t *stats);
+
 /* transaction.c */
 typedef struct s4_transaction_St s4_transaction_t;
+
+/**
+ * A relationship, as passed to s4_add_many and s4_del_many
+ */
+typedef struct {
+	const char *key_a;
+	const s4_val_t *val_a;
+	const char *key_b;
+	const s4_val_t *val_b;
+	const char *src;
+} s4_tuple_t;
 s4_transaction_t *s4_begin (s4_t *s4, int flags);
+void s4_transaction_set_stats (s4_transaction_t *trans, s4_query_stats_t *stats);
+void s4_transaction_set_durability (s4_transaction_t *trans, s4_durability_t durability);
 int s4_commit (s4_transaction_t *trans);
 int s4_abort (s4_transaction_t *trans);
 int s4_add (s4_transaction_t *trans,
@@ -238,8 +366,21 @@ int s4_del (s4_transaction_t *trans,
 		const char *key_a, const s4_val_t *val_a,
 		const char *key_b, const s4_val_t *val_b,
 		const char *src);
+int s4_add_many (s4_transaction_t *trans, const s4_tuple_t *tuples, int count);
+int s4_del_many (s4_transaction_t *trans, const s4_tuple_t *tuples, int count);
+int s4_del_source (s4_transaction_t *trans, const char *src, s4_condition_t *cond);
+int s4_del_where (s4_transaction_t *trans, s4_condition_t *cond);
 s4_resultset_t *s4_query (s4_transaction_t *trans,
 		s4_fetchspec_t *fs, s4_condition_t *cond);
+s4_resultset_t *s4_query_prepared (s4_transaction_t *trans,
+		s4_prepared_t *prep);
+s4_aggresult_t *s4_aggregate (s4_transaction_t *trans,
+		s4_aggspec_t *spec, s4_condition_t *cond);
+
+typedef int (*s4_value_func_t)(const s4_val_t *val, int count, void *userdata);
+int s4_index_foreach_value (s4_transaction_t *trans, const char *key,
+		const s4_val_t *start, const s4_val_t *end, const char *prefix,
+		s4_value_func_t func, void *userdata);
 
 
 #endif /* _S4_H */
@@ -0,0 +1,414 @@
+/*  S4 - An XMMS2 medialib backend
+ *  Copyright (C) 2009, 2010 Sivert Berg
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include "s4_priv.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+	s4_aggregate_type_t type;
+	char *key;
+	s4_sourcepref_t *sp;
+} agg_column_t;
+
+struct s4_aggspec_St {
+	char *group_key;
+	s4_sourcepref_t *group_sp;
+	GArray *columns;
+};
+
+typedef struct {
+	int64_t i;
+	const s4_val_t *val;
+	GHashTable *distinct;
+} agg_value_t;
+
+typedef struct {
+	const s4_val_t *val;
+	agg_value_t cols[0];
+} agg_group_t;
+
+struct s4_aggresult_St {
+	int col_count;
+	GPtrArray *groups;
+};
+
+/**
+ * @defgroup Aggregate Aggregate Queries
+ * @ingroup S4
+ * @brief Counts and folds values without fetching them into a resultset
+ *
+ * @{
+ */
+
+/**
+ * Creates a new aggregate specification.
+ *
+ * @param group_key The key to group entries by. Entries with several
+ * values for the key are counted in every group. If NULL every entry
+ * goes in a single group.
+ * @param sp The sourcepref used to pick the values of group_key
+ * @return A new aggregate specification
+ */
+s4_aggspec_t *s4_aggspec_create (const char *group_key, s4_sourcepref_t *sp)
+{
+	s4_aggspec_t *spec = malloc (sizeof (s4_aggspec_t));
+
+	spec->group_key = (group_key == NULL)?NULL:strdup (group_key);
+	spec->group_sp = (sp == NULL)?NULL:s4_sourcepref_ref (sp);
+	spec->columns = g_array_new (FALSE, FALSE, sizeof (agg_column_t));
+
+	return spec;
+}
+
+/**
+ * Adds a column to an aggregate specification.
+ *
+ * S4_AGGREGATE_COUNT counts the matching entries that have key, or
+ * every matching entry if key is NULL. The other types fold the values
+ * of key from the most preferred source, just like a fetch would return
+ * them. If key is the key of the entries themselves (like "song_id")
+ * the value of the entry is used. Sums only include integer values,
+ * min and max compare values caselessly.
+ *
+ * @param spec The specification to add to
+ * @param type What to compute
+ * @param key The key to look at
+ * @param sp The sourcepref used to pick the values of key
+ * @return The column number of the new column
+ */
+int s4_aggspec_add (s4_aggspec_t *spec, s4_aggregate_type_t type,
+		const char *key, s4_sourcepref_t *sp)
+{
+	agg_column_t col;
+
+	col.type = type;
+	col.key = (key == NULL)?NULL:strdup (key);
+	col.sp = (sp == NULL)?NULL:s4_sourcepref_ref (sp);
+
+	g_array_append_val (spec->columns, col);
+
+	return spec->columns->len - 1;
+}
+
+/**
+ * Frees an aggregate specification.
+ *
+ * @param spec The specification to free
+ */
+void s4_aggspec_free (s4_aggspec_t *spec)
+{
+	int i;
+
+	for (i = 0; i < spec->columns->len; i++) {
+		agg_column_t *col = &g_array_index (spec->columns, agg_column_t, i);
+		free (col->key);
+		if (col->sp != NULL)
+			s4_sourcepref_unref (col->sp);
+	}
+
+	if (spec->group_sp != NULL)
+		s4_sourcepref_unref (spec->group_sp);
+
+	g_array_free (spec->columns, TRUE);
+	free (spec->group_key);
+	free (spec);
+}
+
+/**
+ * Gets the number of groups in an aggregate result.
+ * The groups are sorted caselessly by their value, with
+ * the group of entries lacking the group key first.
+ *
+ * @param res The result
+ * @return The number of groups
+ */
+int s4_aggresult_get_groupcount (const s4_aggresult_t *res)
+{
+	return res->groups->len;
+}
+
+/**
+ * Gets the value a group was made from.
+ *
+ * @param res The result
+ * @param group The group number
+ * @return The value, or NULL if the group holds the entries
+ * lacking the group key (or there is no group key).
+ */
+const s4_val_t *s4_aggresult_get_group (const s4_aggresult_t *res, int group)
+{
+	if (group < 0 || group >= res->groups->len)
+		return NULL;
+
+	return ((agg_group_t*)g_ptr_array_index (res->groups, group))->val;
+}
+
+/**
+ * Gets an integer from a count, count distinct or sum column.
+ *
+ * @param res The result
+ * @param group The group number
+ * @param col The column number
+ * @param i A pointer to an int64_t to store the result in
+ * @return 0 if group or col is out of bounds, non-zero otherwise
+ */
+int s4_aggresult_get_int (const s4_aggresult_t *res, int group, int col, int64_t *i)
+{
+	if (group < 0 || group >= res->groups->len || col < 0 || col >= res->col_count)
+		return 0;
+
+	*i = ((agg_group_t*)g_ptr_array_index (res->groups, group))->cols[col].i;
+	return 1;
+}
+
+/**
+ * Gets the value of a min or max column.
+ *
+ * @param res The result
+ * @param group The group number
+ * @param col The column number
+ * @return The value, or NULL if no entry in the group had one
+ */
+const s4_val_t *s4_aggresult_get_val (const s4_aggresult_t *res, int group, int col)
+{
+	if (group < 0 || group >= res->groups->len || col < 0 || col >= res->col_count)
+		return NULL;
+
+	return ((agg_group_t*)g_ptr_array_index (res->groups, group))->cols[col].val;
+}
+
+/**
+ * Frees an aggregate result.
+ *
+ * @param res The result to free
+ */
+void s4_aggresult_free (s4_aggresult_t *res)
+{
+	g_ptr_array_free (res->groups, TRUE);
+	free (res);
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @{
+ * @internal
+ */
+
+/**
+ * Creates an aggregate result without any groups.
+ *
+ * @param col_count The number of columns in the result
+ * @return A new result
+ */
+s4_aggresult_t *_aggresult_create (int col_count)
+{
+	s4_aggresult_t *res = malloc (sizeof (s4_aggresult_t));
+
+	res->col_count = col_count;
+	res->groups = g_ptr_array_new_with_free_func (free);
+
+	return res;
+}
+
+typedef struct {
+	s4_t *s4;
+	s4_aggspec_t *spec;
+	s4_aggresult_t *res;
+
+	/* The constant keys of the spec */
+	const char *group_key;
+	const char **keys;
+
+	/* Value pointer -> group, the NULL group is kept on the side */
+	GHashTable *group_table;
+	agg_group_t *null_group;
+
+	/* The groups of the current entry */
+	GPtrArray *entry_groups;
+	agg_value_t *cur;
+	s4_aggregate_type_t cur_type;
+} agg_data_t;
+
+static agg_group_t *_group_create (agg_data_t *data, const s4_val_t *val)
+{
+	agg_group_t *group = calloc (1, sizeof (agg_group_t)
+			+ sizeof (agg_value_t) * data->res->col_count);
+
+	group->val = val;
+	g_ptr_array_add (data->res->groups, group);
+
+	return group;
+}
+
+static void _add_group (const s4_val_t *val, void *d)
+{
+	agg_data_t *data = d;
+	agg_group_t *group = g_hash_table_lookup (data->group_table, val);
+
+	if (group == NULL) {
+		group = _group_create (data, val);
+		g_hash_table_insert (data->group_table, (void*)val, group);
+	}
+
+	g_ptr_array_add (data->entry_groups, group);
+}
+
+static void _fold_value (const s4_val_t *val, void *d)
+{
+	agg_data_t *data = d;
+	agg_value_t *cur = data->cur;
+	int32_t i;
+
+	switch (data->cur_type) {
+	case S4_AGGREGATE_COUNT:
+		break;
+	case S4_AGGREGATE_COUNT_DISTINCT:
+		if (cur->distinct == NULL)
+			cur->distinct = g_hash_table_new (NULL, NULL);
+		g_hash_table_insert (cur->distinct, (void*)val, (void*)val);
+		break;
+	case S4_AGGREGATE_SUM:
+		if (s4_val_get_int (val, &i))
+			cur->i += i;
+		break;
+	case S4_AGGREGATE_MIN:
+		if (cur->val == NULL || s4_val_cmp (val, cur->val, S4_CMP_CASELESS) < 0)
+			cur->val = val;
+		break;
+	case S4_AGGREGATE_MAX:
+		if (cur->val == NULL || s4_val_cmp (val, cur->val, S4_CMP_CASELESS) > 0)
+			cur->val = val;
+		break;
+	}
+}
+
+static void _fold_entry (s4_entry_t *entry, void *d)
+{
+	agg_data_t *data = d;
+	int i, j;
+
+	g_ptr_array_set_size (data->entry_groups, 0);
+
+	if (data->group_key != NULL) {
+		if (data->group_key == _entry_get_key (entry)) {
+			_add_group (_entry_get_val (entry), data);
+		} else {
+			_entry_foreach_value (data->s4, entry, data->group_key,
+					data->spec->group_sp, _add_group, data);
+		}
+	}
+
+	if (data->entry_groups->len == 0) {
+		if (data->null_group == NULL)
+			data->null_group = _group_create (data, NULL);
+		g_ptr_array_add (data->entry_groups, data->null_group);
+	}
+
+	for (i = 0; i < data->entry_groups->len; i++) {
+		agg_group_t *group = g_ptr_array_index (data->entry_groups, i);
+
+		for (j = 0; j < data->res->col_count; j++) {
+			agg_column_t *col = &g_array_index (data->spec->columns, agg_column_t, j);
+
+			int found = 1;
+
+			data->cur = &group->cols[j];
+			data->cur_type = col->type;
+
+			if (data->keys[j] == _entry_get_key (entry)) {
+				_fold_value (_entry_get_val (entry), data);
+			} else if (data->keys[j] != NULL) {
+				found = _entry_foreach_value (data->s4, entry, data->keys[j], col->sp, _fold_value, data);
+			}
+
+			if (found && col->type == S4_AGGREGATE_COUNT)
+				data->cur->i++;
+		}
+	}
+}
+
+static int _group_compare (const void *a, const void *b)
+{
+	const agg_group_t *g1 = *(agg_group_t**)a;
+	const agg_group_t *g2 = *(agg_group_t**)b;
+
+	if (g1->val == NULL)
+		return (g2->val == NULL)?0:-1;
+	if (g2->val == NULL)
+		return 1;
+
+	return s4_val_cmp (g1->val, g2->val, S4_CMP_CASELESS);
+}
+
+/**
+ * Runs an aggregate query.
+ *
+ * @param trans The transaction to run the query in
+ * @param spec What to compute
+ * @param cond The condition entries must match to be counted
+ * @return The result of the query
+ */
+s4_aggresult_t *_aggregate_run (s4_transaction_t *trans,
+		s4_aggspec_t *spec, s4_condition_t *cond)
+{
+	s4_t *s4 = _transaction_get_db (trans);
+	agg_data_t data;
+	int i, j;
+
+	data.s4 = s4;
+	data.spec = spec;
+	data.res = _aggresult_create (spec->columns->len);
+	data.group_key = (spec->group_key == NULL)?NULL:_string_lookup (s4, spec->group_key);
+	data.keys = malloc (sizeof (char*) * (spec->columns->len + 1));
+	data.group_table = g_hash_table_new (NULL, NULL);
+	data.null_group = NULL;
+	data.entry_groups = g_ptr_array_new ();
+
+	for (i = 0; i < spec->columns->len; i++) {
+		const char *key = g_array_index (spec->columns, agg_column_t, i).key;
+		data.keys[i] = (key == NULL)?NULL:_string_lookup (s4, key);
+	}
+
+	s4_cond_update_key (cond, s4);
+	_s4_query_foreach (trans, cond, _s4_query_path (s4, cond), _fold_entry, &data);
+
+	for (i = 0; i < data.res->groups->len; i++) {
+		agg_group_t *group = g_ptr_array_index (data.res->groups, i);
+
+		for (j = 0; j < data.res->col_count; j++) {
+			if (group->cols[j].distinct != NULL) {
+				group->cols[j].i = g_hash_table_size (group->cols[j].distinct);
+				g_hash_table_destroy (group->cols[j].distinct);
+				group->cols[j].distinct = NULL;
+			}
+		}
+	}
+
+	qsort (data.res->groups->pdata, data.res->groups->len,
+			sizeof (void*), _group_compare);
+
+	g_ptr_array_free (data.entry_groups, TRUE);
+	g_hash_table_destroy (data.group_table);
+	free (data.keys);
+
+	return data.res;
+}
+
+/**
+ * @}
+ */
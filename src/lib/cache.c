@@ -0,0 +1,347 @@
+/*  S4 - An XMMS2 medialib backend
+ *  Copyright (C) 2009, 2010 Sivert Berg
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include "s4_priv.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ *
+ * @internal
+ * @defgroup Cache Query Cache
+ * @ingroup S4
+ * @brief Caches the results of read-only queries
+ *
+ * Resultsets are cached by a normalized description of the fetchspec
+ * and condition used. Every cached set remembers the keys it depends
+ * on, and is thrown out as soon as a committed transaction touches one
+ * of them.
+ *
+ * @{
+ */
+
+#define CACHE_SIZE 64
+
+typedef struct {
+	char *query;
+	s4_resultset_t *set;
+
+	/* The keys the query depends on, NULL terminated.
+	 * If NULL the query depends on every key.
+	 */
+	const char **keys;
+
+	GList *link;
+} cache_entry_t;
+
+struct s4_cache_data_St {
+	GMutex lock;
+	GHashTable *entries;
+
+	/* The cache entries, most recently used first */
+	GList *lru;
+
+	/* Incremented every time something is invalidated */
+	unsigned int generation;
+};
+
+static void _cache_entry_free (cache_entry_t *entry)
+{
+	s4_resultset_free (entry->set);
+	free (entry->keys);
+	g_free (entry->query);
+	free (entry);
+}
+
+s4_cache_data_t *_cache_create_data (void)
+{
+	s4_cache_data_t *data = calloc (1, sizeof (s4_cache_data_t));
+
+	g_mutex_init (&data->lock);
+	data->entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+			NULL, (GDestroyNotify)_cache_entry_free);
+
+	return data;
+}
+
+void _cache_free_data (s4_cache_data_t *data)
+{
+	if (data == NULL)
+		return;
+
+	g_hash_table_destroy (data->entries);
+	g_list_free (data->lru);
+	g_mutex_clear (&data->lock);
+	free (data);
+}
+
+/**
+ * Removes an entry from the cache. Must be called with the cache locked.
+ *
+ * @param data The cache to remove from
+ * @param entry The entry to remove
+ */
+static void _cache_remove (s4_cache_data_t *data, cache_entry_t *entry)
+{
+	data->lru = g_list_delete_link (data->lru, entry->link);
+	g_hash_table_remove (data->entries, entry->query);
+}
+
+/**
+ * Appends a string to a normalized query description.
+ * The string is length prefixed so it can not be confused
+ * with the characters following it.
+ *
+ * @param str The string to append to
+ * @param s The string to append, may be NULL
+ */
+void _normalize_string (GString *str, const char *s)
+{
+	if (s == NULL) {
+		g_string_append_c (str, '-');
+	} else {
+		g_string_append_printf (str, "%i:", (int)strlen (s));
+		g_string_append (str, s);
+	}
+}
+
+/**
+ * Appends a value to a normalized query description.
+ *
+ * @param str The string to append to
+ * @param val The value to append, may be NULL
+ */
+void _normalize_val (GString *str, const s4_val_t *val)
+{
+	const char *s;
+	int32_t i;
+
+	if (val == NULL) {
+		g_string_append_c (str, '-');
+	} else if (s4_val_get_int (val, &i)) {
+		g_string_append_printf (str, "i%i;", i);
+	} else if (s4_val_get_str (val, &s)) {
+		g_string_append_c (str, 's');
+		_normalize_string (str, s);
+	}
+}
+
+/**
+ * Inserts a resultset into the cache, unless something was
+ * invalidated since the query was started.
+ *
+ * @param s4 The database the query was run on
+ * @param query The normalized query
+ * @param keys The constant keys the query depends on
+ * @param set The result of the query
+ * @param generation The cache generation when the query started
+ */
+static void _cache_insert (s4_t *s4, GString *query, GList *keys,
+		s4_resultset_t *set, unsigned int generation)
+{
+	s4_cache_data_t *data = s4->cache_data;
+	cache_entry_t *entry = malloc (sizeof (cache_entry_t));
+	int i;
+
+	entry->keys = NULL;
+
+	if (g_list_find (keys, NULL) == NULL) {
+		entry->keys = malloc (sizeof (char*) * (g_list_length (keys) + 1));
+
+		for (i = 0; keys != NULL; keys = g_list_next (keys), i++) {
+			entry->keys[i] = keys->data;
+		}
+		entry->keys[i] = NULL;
+	}
+
+	entry->query = g_strdup (query->str);
+	entry->set = s4_resultset_copy (set);
+
+	g_mutex_lock (&data->lock);
+
+	if (generation != data->generation
+			|| g_hash_table_lookup (data->entries, entry->query) != NULL) {
+		g_mutex_unlock (&data->lock);
+		_cache_entry_free (entry);
+		return;
+	}
+
+	if (g_hash_table_size (data->entries) >= CACHE_SIZE) {
+		_cache_remove (data, g_list_last (data->lru)->data);
+	}
+
+	data->lru = g_list_prepend (data->lru, entry);
+	entry->link = data->lru;
+	g_hash_table_insert (data->entries, entry->query, entry);
+
+	g_mutex_unlock (&data->lock);
+}
+
+/**
+ * Runs a query, serving it from the cache if an identical query
+ * has been run since the data it depends on last changed.
+ *
+ * The keys in the fetchspec and condition must already be constant,
+ * so they can be compared against the keys in committed oplists by pointer.
+ *
+ * @param trans The transaction to run the query in
+ * @param fs The fetchspec to use
+ * @param cond The condition to check entries against
+ * @param path The access path to use if the query is not cached
+ * @return A resultset owned by the caller
+ */
+s4_resultset_t *_cache_query (s4_transaction_t *trans,
+		s4_fetchspec_t *fs, s4_condition_t *cond, query_path_t path)
+{
+	s4_t *s4 = _transaction_get_db (trans);
+	s4_cache_data_t *data = s4->cache_data;
+	GString *query = g_string_new (NULL);
+	GList *keys = NULL;
+	cache_entry_t *entry;
+	s4_resultset_t *ret;
+	unsigned int generation;
+
+	_fetchspec_normalize (fs, query, &keys);
+	g_string_append_c (query, '|');
+
+	if (!_cond_normalize (cond, query, &keys)) {
+		g_string_free (query, TRUE);
+		g_list_free (keys);
+		return _s4_query_prepared (trans, fs, cond, path);
+	}
+
+	g_mutex_lock (&data->lock);
+	entry = g_hash_table_lookup (data->entries, query->str);
+
+	if (entry != NULL) {
+		s4_query_stats_t *stats = _transaction_get_stats (trans);
+
+		ret = s4_resultset_copy (entry->set);
+		_query_stats_set_path (stats, S4_PATH_CACHE);
+		_query_stats_add_rows (stats, s4_resultset_get_rowcount (ret));
+
+		data->lru = g_list_remove_link (data->lru, entry->link);
+		data->lru = g_list_concat (entry->link, data->lru);
+
+		g_mutex_unlock (&data->lock);
+		g_string_free (query, TRUE);
+		g_list_free (keys);
+		return ret;
+	}
+
+	generation = data->generation;
+	g_mutex_unlock (&data->lock);
+
+	ret = _s4_query_prepared (trans, fs, cond, path);
+
+	if (!_transaction_is_failed (trans)) {
+		_cache_insert (s4, query, keys, ret, generation);
+	}
+
+	g_string_free (query, TRUE);
+	g_list_free (keys);
+	return ret;
+}
+
+/**
+ * Throws out every cached query that depends on a key touched
+ * by the operations in an oplist.
+ *
+ * @param s4 The database the operations were committed to
+ * @param list The committed operations
+ */
+void _cache_invalidate (s4_t *s4, oplist_t *list)
+{
+	s4_cache_data_t *data = s4->cache_data;
+	GHashTable *touched = NULL;
+	GList *cur, *next;
+
+	if (data == NULL)
+		return;
+
+	_oplist_first (list);
+	while (_oplist_next (list)) {
+		const char *key_a, *key_b, *src;
+		const s4_val_t *val_a, *val_b;
+		GPtrArray *deleted;
+		int i;
+
+		if (_oplist_get_add (list, &key_a, &val_a, &key_b, &val_b, &src)
+				|| _oplist_get_del (list, &key_a, &val_a, &key_b, &val_b, &src)) {
+			if (touched == NULL)
+				touched = g_hash_table_new (NULL, NULL);
+
+			g_hash_table_insert (touched, (void*)key_a, (void*)key_a);
+			g_hash_table_insert (touched, (void*)key_b, (void*)key_b);
+		} else if (_oplist_get_del_source (list, &key_a, &val_a, &src, &deleted)
+				&& deleted->len > 0) {
+			if (touched == NULL)
+				touched = g_hash_table_new (NULL, NULL);
+
+			g_hash_table_insert (touched, (void*)key_a, (void*)key_a);
+			for (i = 0; i < deleted->len; i += 3) {
+				key_b = g_ptr_array_index (deleted, i);
+				g_hash_table_insert (touched, (void*)key_b, (void*)key_b);
+			}
+		}
+	}
+
+	if (touched == NULL)
+		return;
+
+	g_mutex_lock (&data->lock);
+	data->generation++;
+
+	for (cur = data->lru; cur != NULL; cur = next) {
+		cache_entry_t *entry = cur->data;
+		int i, hit = (entry->keys == NULL);
+
+		next = g_list_next (cur);
+
+		for (i = 0; !hit && entry->keys[i] != NULL; i++) {
+			hit = g_hash_table_lookup (touched, entry->keys[i]) != NULL;
+		}
+
+		if (hit) {
+			_cache_remove (data, entry);
+		}
+	}
+
+	g_mutex_unlock (&data->lock);
+	g_hash_table_destroy (touched);
+}
+
+/**
+ * Throws out everything in the cache.
+ *
+ * @param s4 The database to clear the cache of
+ */
+void _cache_clear (s4_t *s4)
+{
+	s4_cache_data_t *data = s4->cache_data;
+
+	if (data == NULL)
+		return;
+
+	g_mutex_lock (&data->lock);
+	data->generation++;
+	g_hash_table_remove_all (data->entries);
+	g_list_free (data->lru);
+	data->lru = NULL;
+	g_mutex_unlock (&data->lock);
+}
+
+/**
+ * @}
+ */
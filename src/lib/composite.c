@@ -0,0 +1,821 @@
+/*  S4 - An XMMS2 medialib backend
+ *  Copyright (C) 2009, 2010 Sivert Berg
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include "s4_priv.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* One combination of values an entry has for the keys of the index.
+ * A NULL value means the entry has no value for that key.
+ */
+typedef struct {
+	void *data;
+	int count;
+
+	/* The values of the covered keys, only kept by covering indexes */
+	int value_count;
+	composite_value_t *values;
+
+	const s4_val_t *vals[];
+} comp_row_t;
+
+struct s4_composite_St {
+	int key_count;
+	const char **keys;
+
+	/* The keys followed by the included keys. Covering indexes
+	 * keep the values of all of them in every row.
+	 */
+	int covering;
+	int cover_count;
+	const char **cover_keys;
+	s4_sourcepref_t *sp;
+	s4_cmp_mode_t mode;
+	s4_lock_t *lock;
+
+	/* Sorted by the values, key by key, then by data */
+	int size, alloc;
+	comp_row_t **rows;
+
+	/* Like the flags of b-indexes, only changed with the index
+	 * locked exclusively
+	 */
+	int building, dropped;
+};
+
+struct s4_composite_data_St {
+	GPtrArray *indexes;
+	GMutex lock;
+
+	/* The length of indexes, so writers can skip taking the lock
+	 * when there are no composite indexes
+	 */
+	int count;
+
+	/* Dropped indexes are kept until the database is closed,
+	 * like dropped b-indexes
+	 */
+	GList *dropped;
+};
+
+/**
+ *
+ * @internal
+ * @defgroup Composite Composite Index
+ * @ingroup S4
+ * @brief Indexes over an ordered list of keys
+ *
+ * A composite index holds a row for every combination of values an
+ * entry has for the keys of the index, sorted key by key. Only the
+ * values from the most preferred source are used, like when checking
+ * conditions, and they are compared with the comparison mode of the index.
+ *
+ * A query with equality filters on the first keys and a monotonic
+ * filter on the next one finds its entries in a single run of rows,
+ * and gets them in the order of the index.
+ *
+ * A covering index also copies the values of its keys, and of a list
+ * of included keys, into its rows. Queries that only check and fetch
+ * those are answered from the rows without looking at the entries.
+ *
+ * @{
+ */
+
+s4_composite_data_t *_composite_create_data (void)
+{
+	s4_composite_data_t *ret = calloc (1, sizeof (s4_composite_data_t));
+
+	ret->indexes = g_ptr_array_new ();
+	g_mutex_init (&ret->lock);
+
+	return ret;
+}
+
+void _composite_free_data (s4_composite_data_t *data)
+{
+	int i;
+
+	for (i = 0; i < data->indexes->len; i++) {
+		_composite_free (g_ptr_array_index (data->indexes, i));
+	}
+
+	g_ptr_array_free (data->indexes, TRUE);
+	g_list_free_full (data->dropped, (GDestroyNotify)_composite_free);
+	g_mutex_clear (&data->lock);
+	free (data);
+}
+
+/* Checks if a key is among the first n keys */
+static int _has_key (const char **keys, int n, const char *key)
+{
+	int i;
+
+	for (i = 0; i < n && keys[i] != key; i++);
+
+	return i < n;
+}
+
+/**
+ * Creates a new composite index. It is not added to the database.
+ *
+ * @param s4 The database the index will belong to
+ * @param keys A NULL terminated list of the keys to index, in order
+ * @param include A NULL terminated list of other keys to copy into
+ * the index, or NULL if the index should not be covering
+ * @param sp The sourcepref deciding which values are indexed, may be NULL
+ * @param mode The comparison mode used to sort the values
+ * @return A new empty index
+ */
+s4_composite_t *_composite_create (s4_t *s4, const char **keys,
+		const char **include, s4_sourcepref_t *sp, s4_cmp_mode_t mode)
+{
+	s4_composite_t *ret = calloc (1, sizeof (s4_composite_t));
+	int i, j;
+
+	for (i = 0; keys[i] != NULL; i++);
+	for (j = 0; include != NULL && include[j] != NULL; j++);
+
+	ret->key_count = i;
+	ret->keys = malloc (sizeof (const char*) * i);
+	for (i = 0; i < ret->key_count; i++) {
+		ret->keys[i] = _string_lookup (s4, keys[i]);
+	}
+
+	ret->covering = include != NULL;
+	ret->cover_keys = malloc (sizeof (const char*) * (ret->key_count + j));
+	for (i = 0; i < ret->key_count; i++) {
+		ret->cover_keys[i] = ret->keys[i];
+	}
+	for (j = 0; include != NULL && include[j] != NULL; j++) {
+		const char *key = _string_lookup (s4, include[j]);
+
+		if (!_has_key (ret->cover_keys, i, key))
+			ret->cover_keys[i++] = key;
+	}
+	ret->cover_count = i;
+
+	ret->sp = (sp == NULL)?NULL:s4_sourcepref_ref (sp);
+	ret->mode = mode;
+	ret->lock = _lock_alloc ();
+	ret->alloc = 1;
+	ret->rows = malloc (sizeof (comp_row_t*) * ret->alloc);
+
+	return ret;
+}
+
+static void _row_free (comp_row_t *row)
+{
+	free (row->values);
+	free (row);
+}
+
+/**
+ * Frees a composite index. The values and data are NOT freed.
+ *
+ * @param index The index to free
+ */
+void _composite_free (s4_composite_t *index)
+{
+	int i;
+
+	for (i = 0; i < index->size; i++) {
+		_row_free (index->rows[i]);
+	}
+
+	if (index->sp != NULL)
+		s4_sourcepref_unref (index->sp);
+
+	_lock_free (index->lock);
+	free (index->rows);
+	free (index->keys);
+	free (index->cover_keys);
+	free (index);
+}
+
+/* Checks if index is over the keys, in the same order */
+static int _has_keys (s4_composite_t *index, const char **keys)
+{
+	int i;
+
+	for (i = 0; i < index->key_count && keys[i] != NULL; i++) {
+		if (index->keys[i] != keys[i])
+			return 0;
+	}
+
+	return i == index->key_count && keys[i] == NULL;
+}
+
+/* Finds the index over keys, keys must be constant */
+static int _find_keys (s4_composite_data_t *data, const char **keys)
+{
+	int i;
+
+	for (i = 0; i < data->indexes->len; i++) {
+		if (_has_keys (g_ptr_array_index (data->indexes, i), keys))
+			return i;
+	}
+
+	return -1;
+}
+
+/**
+ * Adds a composite index to a database.
+ *
+ * @param s4 The database to add the index to
+ * @param index The index to add
+ * @return 0 if there already is an index over the same keys, non-zero otherwise
+ */
+int _composite_add (s4_t *s4, s4_composite_t *index)
+{
+	s4_composite_data_t *data = s4->composite_data;
+	const char **keys = g_newa (const char*, index->key_count + 1);
+	int ret = 0;
+
+	memcpy (keys, index->keys, sizeof (const char*) * index->key_count);
+	keys[index->key_count] = NULL;
+
+	g_mutex_lock (&data->lock);
+	if (_find_keys (data, keys) < 0) {
+		g_ptr_array_add (data->indexes, index);
+		g_atomic_int_set (&data->count, data->indexes->len);
+		ret = 1;
+	}
+	g_mutex_unlock (&data->lock);
+
+	return ret;
+}
+
+/**
+ * Drops the composite index over a list of keys.
+ * It waits for the transactions using the index to finish,
+ * the ones finding it after that see it has been dropped.
+ *
+ * @param s4 The database to drop the index from
+ * @param keys A NULL terminated list of the keys of the index
+ * @return 0 if there is no such index, non-zero otherwise
+ */
+int _composite_drop (s4_t *s4, const char **keys)
+{
+	s4_composite_data_t *data = s4->composite_data;
+	s4_composite_t *index = NULL;
+	s4_transaction_t *trans;
+	const char **const_keys;
+	int i, ret = 0;
+
+	for (i = 0; keys[i] != NULL; i++);
+	const_keys = g_newa (const char*, i + 1);
+	for (i = 0; keys[i] != NULL; i++) {
+		const_keys[i] = _string_lookup (s4, keys[i]);
+	}
+	const_keys[i] = NULL;
+
+	g_mutex_lock (&data->lock);
+	i = _find_keys (data, const_keys);
+	if (i >= 0)
+		index = g_ptr_array_index (data->indexes, i);
+	g_mutex_unlock (&data->lock);
+
+	if (index == NULL)
+		return 0;
+
+	/* We hold no other locks, so this can not deadlock */
+	trans = _transaction_dummy_alloc (s4);
+	_composite_lock_exclusive (index, trans);
+
+	g_mutex_lock (&data->lock);
+	if (!index->dropped && g_ptr_array_remove_fast (data->indexes, index)) {
+		for (i = 0; i < index->size; i++) {
+			_row_free (index->rows[i]);
+		}
+		index->size = 0;
+		index->dropped = 1;
+
+		g_atomic_int_set (&data->count, data->indexes->len);
+		data->dropped = g_list_prepend (data->dropped, index);
+		ret = 1;
+	}
+	g_mutex_unlock (&data->lock);
+
+	_transaction_dummy_free (trans);
+
+	return ret;
+}
+
+/**
+ * Gets the composite indexes that index or cover a key, also the ones
+ * being built. The indexes are not locked.
+ *
+ * @param s4 The database to look in
+ * @param key The constant key
+ * @return A list of indexes, NULL if no index includes key
+ */
+GList *_composite_get_for_key (s4_t *s4, const char *key)
+{
+	s4_composite_data_t *data = s4->composite_data;
+	GList *ret = NULL;
+	int i;
+
+	if (g_atomic_int_get (&data->count) == 0)
+		return NULL;
+
+	g_mutex_lock (&data->lock);
+	for (i = 0; i < data->indexes->len; i++) {
+		s4_composite_t *index = g_ptr_array_index (data->indexes, i);
+
+		if (_has_key (index->cover_keys, index->cover_count, key))
+			ret = g_list_prepend (ret, index);
+	}
+	g_mutex_unlock (&data->lock);
+
+	return ret;
+}
+
+/* Gets the i-th filter of a condition that is a filter or a combiner */
+static s4_condition_t *_get_filter (s4_condition_t *cond, int i)
+{
+	if (s4_cond_is_filter (cond))
+		return (i == 0)?cond:NULL;
+
+	return s4_cond_get_operand (cond, i);
+}
+
+/**
+ * Finds the filters of a condition a composite index can narrow by.
+ * A condition can use the index if it is a filter, or an AND of
+ * filters, with the same sourcepref and comparison mode as the index.
+ *
+ * @param index The index
+ * @param cond The condition, its keys must be constant
+ * @param filters Set to the filter on each key of the index,
+ * or NULL if it can not be used
+ * @return The number of keys, counted from the first one, the
+ * condition can be narrowed by. All of them have equality filters
+ * except for the last one.
+ */
+static int _match_filters (s4_composite_t *index, s4_condition_t *cond,
+		s4_condition_t **filters)
+{
+	s4_condition_t *op;
+	int i, j, ret;
+
+	memset (filters, 0, sizeof (s4_condition_t*) * index->key_count);
+
+	if (s4_cond_is_combiner (cond) && s4_cond_get_combiner_type (cond) != S4_COMBINE_AND)
+		return 0;
+
+	for (i = 0; (op = _get_filter (cond, i)) != NULL; i++) {
+		if (!s4_cond_is_filter (op)
+				|| s4_cond_get_key (op) == NULL
+				|| (s4_cond_get_flags (op) & S4_COND_PARENT)
+				|| s4_cond_get_filter_type (op) == S4_FILTER_CUSTOM
+				|| !s4_cond_is_monotonic (op)
+				|| s4_cond_get_cmp_mode (op) != index->mode
+				|| !_sourcepref_equal (s4_cond_get_sourcepref (op), index->sp))
+			continue;
+
+		for (j = 0; j < index->key_count; j++) {
+			if (index->keys[j] == s4_cond_get_key (op)
+					&& (filters[j] == NULL || s4_cond_get_filter_type (op) == S4_FILTER_EQUAL))
+				filters[j] = op;
+		}
+	}
+
+	for (ret = 0; ret < index->key_count && filters[ret] != NULL; ret++) {
+		if (s4_cond_get_filter_type (filters[ret]) != S4_FILTER_EQUAL) {
+			ret++;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Finds the ready composite index that narrows a condition the most.
+ *
+ * @param s4 The database to look in
+ * @param cond The condition, its keys must be constant
+ * @param keys Set to the number of keys the index narrows by
+ * @return The index, or NULL if none can be used
+ */
+s4_composite_t *_composite_find (s4_t *s4, s4_condition_t *cond, int *keys)
+{
+	s4_composite_data_t *data = s4->composite_data;
+	s4_composite_t *ret = NULL;
+	int i, n;
+
+	*keys = 0;
+
+	if (g_atomic_int_get (&data->count) == 0)
+		return NULL;
+
+	g_mutex_lock (&data->lock);
+	for (i = 0; i < data->indexes->len; i++) {
+		s4_composite_t *index = g_ptr_array_index (data->indexes, i);
+		s4_condition_t **filters = g_newa (s4_condition_t*, index->key_count);
+
+		if (g_atomic_int_get (&index->building))
+			continue;
+
+		n = _match_filters (index, cond, filters);
+		if (n > *keys) {
+			*keys = n;
+			ret = index;
+		}
+	}
+	g_mutex_unlock (&data->lock);
+
+	return ret;
+}
+
+/**
+ * Finds the composite index to answer a condition with and locks it shared.
+ *
+ * @param s4 The database to look in
+ * @param cond The condition, its keys must be constant
+ * @param trans The transaction to lock the index for
+ * @param index Set to the index, or NULL if there is none, or it was
+ * dropped before we got the lock
+ * @return 0 if the transaction deadlocked, non-zero otherwise
+ */
+int _composite_get_shared (s4_t *s4, s4_condition_t *cond,
+		s4_transaction_t *trans, s4_composite_t **index)
+{
+	int keys;
+
+	*index = _composite_find (s4, cond, &keys);
+
+	if (*index == NULL)
+		return 1;
+	if (!_composite_lock_shared (*index, trans))
+		return 0;
+	if ((*index)->building || (*index)->dropped)
+		*index = NULL;
+
+	return 1;
+}
+
+/**
+ * Marks an index as being built, or as ready to be used.
+ *
+ * @param index The index
+ * @param building Non-zero if it is being built
+ */
+void _composite_set_building (s4_composite_t *index, int building)
+{
+	g_atomic_int_set (&index->building, building);
+}
+
+/**
+ * Checks if an index has been dropped.
+ * The index must be locked.
+ *
+ * @param index The index
+ * @return non-zero if it has been dropped, 0 otherwise
+ */
+int _composite_is_dropped (s4_composite_t *index)
+{
+	return index->dropped;
+}
+
+int _composite_get_key_count (s4_composite_t *index)
+{
+	return index->key_count;
+}
+
+const char *_composite_get_key (s4_composite_t *index, int key)
+{
+	return index->keys[key];
+}
+
+s4_sourcepref_t *_composite_get_sourcepref (s4_composite_t *index)
+{
+	return index->sp;
+}
+
+/**
+ * Gets the number of keys whose values an entry has to give
+ * _composite_insert, the keys of the index followed by the included keys.
+ *
+ * @param index The index
+ * @return The number of keys
+ */
+int _composite_get_cover_count (s4_composite_t *index)
+{
+	return index->cover_count;
+}
+
+const char *_composite_get_cover_key (s4_composite_t *index, int key)
+{
+	return index->cover_keys[key];
+}
+
+/* Compares two values of a key, no value comes before every value */
+static int _val_cmp (s4_composite_t *index, const s4_val_t *v1, const s4_val_t *v2)
+{
+	if (v1 == NULL || v2 == NULL)
+		return (v1 != NULL) - (v2 != NULL);
+
+	return s4_val_cmp (v1, v2, index->mode);
+}
+
+static int _row_cmp (s4_composite_t *index, comp_row_t *row,
+		const s4_val_t **vals, void *data)
+{
+	int i, c;
+
+	for (i = 0; i < index->key_count; i++) {
+		c = _val_cmp (index, row->vals[i], vals[i]);
+		if (c)
+			return c;
+	}
+
+	return (row->data > data) - (row->data < data);
+}
+
+/* Finds the row of vals and data, or where it should be */
+static int _row_search (s4_composite_t *index, const s4_val_t **vals, void *data)
+{
+	int lo = 0;
+	int hi = index->size;
+
+	while (hi > lo) {
+		int m = (hi + lo) / 2;
+
+		if (_row_cmp (index, index->rows[m], vals, data) < 0)
+			lo = m + 1;
+		else
+			hi = m;
+	}
+
+	return lo;
+}
+
+/**
+ * Inserts a combination of values of an entry into the index.
+ *
+ * @param index The index to insert into
+ * @param vals The values, one per key. NULL if the entry has no value.
+ * @param data The entry
+ * @param values The values the entry has for the covered keys, in the
+ * order of the keys. Copied if the index is covering.
+ * @param value_count The number of values
+ */
+void _composite_insert (s4_composite_t *index, const s4_val_t **vals, void *data,
+		const composite_value_t *values, int value_count)
+{
+	int i = _row_search (index, vals, data);
+	comp_row_t *row;
+
+	if (i < index->size && !_row_cmp (index, index->rows[i], vals, data)) {
+		index->rows[i]->count++;
+		return;
+	}
+
+	if (index->size >= index->alloc) {
+		index->alloc *= 2;
+		index->rows = realloc (index->rows, sizeof (comp_row_t*) * index->alloc);
+	}
+
+	row = malloc (sizeof (comp_row_t) + sizeof (const s4_val_t*) * index->key_count);
+	row->data = data;
+	row->count = 1;
+	row->value_count = 0;
+	row->values = NULL;
+	memcpy (row->vals, vals, sizeof (const s4_val_t*) * index->key_count);
+
+	if (index->covering && value_count > 0) {
+		row->value_count = value_count;
+		row->values = malloc (sizeof (composite_value_t) * value_count);
+		memcpy (row->values, values, sizeof (composite_value_t) * value_count);
+	}
+
+	memmove (index->rows + i + 1, index->rows + i, (index->size - i) * sizeof (comp_row_t*));
+	index->rows[i] = row;
+	index->size++;
+}
+
+/**
+ * Removes a combination of values of an entry from the index.
+ *
+ * @param index The index to remove from
+ * @param vals The values, one per key. NULL if the entry has no value.
+ * @param data The entry
+ * @return 0 if the row was not found, 1 otherwise
+ */
+int _composite_delete (s4_composite_t *index, const s4_val_t **vals, void *data)
+{
+	int i = _row_search (index, vals, data);
+
+	if (i >= index->size || _row_cmp (index, index->rows[i], vals, data))
+		return 0;
+
+	if (--index->rows[i]->count <= 0) {
+		_row_free (index->rows[i]);
+		memmove (index->rows + i, index->rows + i + 1, (index->size - i - 1) * sizeof (comp_row_t*));
+		index->size--;
+	}
+
+	return 1;
+}
+
+/* Checks a row against the filters on the first n keys.
+ * Returns <0 if the row comes before the matching rows, 0 if it
+ * matches and >0 if it comes after them.
+ */
+static int _row_match (comp_row_t *row, s4_condition_t **filters, int n)
+{
+	int i, c;
+
+	for (i = 0; i < n; i++) {
+		if (row->vals[i] == NULL)
+			return -1;
+
+		c = s4_cond_get_filter_function (filters[i])(row->vals[i], filters[i]);
+		if (c)
+			return c;
+	}
+
+	return 0;
+}
+
+/* Finds the first row matching the filters on the first n keys */
+static int _first_match (s4_composite_t *index, s4_condition_t **filters, int n)
+{
+	int lo = 0;
+	int hi = index->size;
+
+	while (hi > lo) {
+		int m = (hi + lo) / 2;
+
+		if (_row_match (index->rows[m], filters, n) < 0)
+			lo = m + 1;
+		else
+			hi = m;
+	}
+
+	return lo;
+}
+
+/**
+ * Finds the entries that may match a condition.
+ * The index must be locked.
+ *
+ * @param index The index to search
+ * @param cond The condition, its keys must be constant
+ * @return A list of the distinct entries found, in the order of the index
+ */
+GList *_composite_search (s4_composite_t *index, s4_condition_t *cond)
+{
+	s4_condition_t **filters = g_newa (s4_condition_t*, index->key_count);
+	GHashTable *found;
+	GList *ret = NULL;
+	int i, n;
+
+	n = _match_filters (index, cond, filters);
+	found = g_hash_table_new (NULL, NULL);
+
+	for (i = _first_match (index, filters, n);
+			i < index->size && !_row_match (index->rows[i], filters, n); i++) {
+		void *data = index->rows[i]->data;
+
+		if (!g_hash_table_contains (found, data)) {
+			g_hash_table_add (found, data);
+			ret = g_list_prepend (ret, data);
+		}
+	}
+
+	g_hash_table_destroy (found);
+
+	return g_list_reverse (ret);
+}
+
+/**
+ * Checks if a query can be answered from a covering index alone.
+ * Every filter in the condition must be used to find the rows, and
+ * every key fetched must be covered and fetched with the sourcepref
+ * of the index.
+ *
+ * @param index The index
+ * @param cond The condition, its keys must be constant
+ * @param fs The fetchspec, its keys must be constant
+ * @return non-zero if the index covers the query, 0 otherwise
+ */
+int _composite_covers (s4_composite_t *index, s4_condition_t *cond, s4_fetchspec_t *fs)
+{
+	s4_condition_t **filters = g_newa (s4_condition_t*, index->key_count);
+	s4_condition_t *op;
+	int i, j, n;
+
+	if (!index->covering)
+		return 0;
+
+	n = _match_filters (index, cond, filters);
+	for (i = 0; (op = _get_filter (cond, i)) != NULL; i++) {
+		for (j = 0; j < n && filters[j] != op; j++);
+		if (j == n)
+			return 0;
+	}
+
+	for (i = 0; i < s4_fetchspec_size (fs); i++) {
+		const char *key = s4_fetchspec_get_key (fs, i);
+
+		if (key == NULL)
+			return 0;
+		if ((s4_fetchspec_get_flags (fs, i) & S4_FETCH_DATA)
+				&& (!_has_key (index->cover_keys, index->cover_count, key)
+					|| !_sourcepref_equal (s4_fetchspec_get_sourcepref (fs, i), index->sp)))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Makes a resultrow out of the values copied into a row, like _fetch */
+static s4_resultrow_t *_row_fetch (comp_row_t *row, s4_fetchspec_t *fs)
+{
+	int k, i, fetch_size = s4_fetchspec_size (fs);
+	s4_resultrow_t *ret = s4_resultrow_create (fetch_size);
+
+	for (k = 0; k < fetch_size; k++) {
+		const char *key = s4_fetchspec_get_key (fs, k);
+		int flags = s4_fetchspec_get_flags (fs, k);
+		s4_result_t *result = NULL;
+
+		if ((flags & S4_FETCH_PARENT) && key == _entry_get_key (row->data)) {
+			result = s4_result_create (result, key, _entry_get_val (row->data), NULL);
+		}
+		if (flags & S4_FETCH_DATA) {
+			for (i = 0; i < row->value_count; i++) {
+				if (row->values[i].key == key)
+					result = s4_result_create (result, key, row->values[i].val, row->values[i].src);
+			}
+		}
+
+		s4_resultrow_set_col (ret, k, result);
+	}
+
+	return ret;
+}
+
+/**
+ * Answers a query covered by the index, see _composite_covers.
+ * The entries are not looked at or locked, the index must be locked.
+ *
+ * @param index The index
+ * @param cond The condition, its keys must be constant
+ * @param fs The fetchspec, its keys must be constant
+ * @param set The resultset to add a row to for every entry found,
+ * in the order of the index
+ * @return The number of rows added
+ */
+int _composite_fetch (s4_composite_t *index, s4_condition_t *cond,
+		s4_fetchspec_t *fs, s4_resultset_t *set)
+{
+	s4_condition_t **filters = g_newa (s4_condition_t*, index->key_count);
+	GHashTable *found;
+	int i, n, ret = 0;
+
+	n = _match_filters (index, cond, filters);
+	found = g_hash_table_new (NULL, NULL);
+
+	for (i = _first_match (index, filters, n);
+			i < index->size && !_row_match (index->rows[i], filters, n); i++) {
+		comp_row_t *row = index->rows[i];
+
+		if (!g_hash_table_contains (found, row->data)) {
+			g_hash_table_add (found, row->data);
+			s4_resultset_add_row (set, _row_fetch (row, fs));
+			ret++;
+		}
+	}
+
+	g_hash_table_destroy (found);
+
+	return ret;
+}
+
+int _composite_lock_shared (s4_composite_t *index, s4_transaction_t *trans)
+{
+	return _lock_shared (index->lock, trans);
+}
+
+int _composite_lock_exclusive (s4_composite_t *index, s4_transaction_t *trans)
+{
+	return _lock_exclusive (index->lock, trans);
+}
+
+/**
+ * @}
+ */
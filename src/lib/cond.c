@@ -36,6 +36,7 @@ struct s4_condition_St {
 			s4_filter_type_t type;
 			filter_function_t func;
 			void *funcdata;
+			s4_val_t *val;
 			free_func_t free_func;
 			const char *key;
 			s4_sourcepref_t *sp;
@@ -435,6 +436,7 @@ s4_condition_t *s4_cond_new_filter (s4_filter_type_t type,
 	cond->u.filter.flags = flags;
 	cond->u.filter.cmp_mode = cmp_mode;
 	cond->u.filter.const_key = 0;
+	cond->u.filter.val = (value == NULL) ? NULL : s4_val_copy (value);
 
 	if (sourcepref != NULL) {
 		cond->u.filter.sp = s4_sourcepref_ref (sourcepref);
@@ -479,6 +481,7 @@ s4_condition_t *s4_cond_new_custom_filter (filter_function_t func, void *userdat
 	cond->u.filter.monotonic = monotonic;
 	cond->u.filter.cmp_mode = cmp_mode;
 	cond->u.filter.const_key = 0;
+	cond->u.filter.val = NULL;
 
 	if (sourcepref != NULL) {
 		cond->u.filter.sp = s4_sourcepref_ref (sourcepref);
@@ -578,6 +581,8 @@ void s4_cond_free (s4_condition_t *cond)
 	} else if (cond->type == S4_COND_FILTER) {
 		if (cond->u.filter.free_func != NULL)
 			cond->u.filter.free_func (cond->u.filter.funcdata);
+		if (cond->u.filter.val != NULL)
+			s4_val_free (cond->u.filter.val);
 		if (cond->u.filter.sp != NULL)
 			s4_sourcepref_unref (cond->u.filter.sp);
 		if (!cond->u.filter.const_key && cond->u.filter.key != NULL)
@@ -685,5 +690,100 @@ void s4_cond_update_key (s4_condition_t *cond, s4_t *s4)
 }
 
 /**
+ * @{
+ * @internal
+ */
+
+/**
+ * Appends a normalized description of a condition to a string.
+ * Two conditions with the same description match the same entries.
+ *
+ * @param cond The condition to describe
+ * @param str The string to append to
+ * @param keys A list the keys the condition depends on are prepended to.
+ * A NULL key means the condition may depend on any key.
+ * @return 0 if the condition can not be described because it uses
+ * user specified functions, non-zero otherwise
+ */
+int _cond_normalize (s4_condition_t *cond, GString *str, GList **keys)
+{
+	int i;
+
+	if (cond->type == S4_COND_COMBINER) {
+		if (cond->u.combine.type == S4_COMBINE_CUSTOM)
+			return 0;
+
+		/* A NOT may match entries without any of the keys checked
+		 * by its operand, so it depends on every key.
+		 */
+		if (cond->u.combine.type == S4_COMBINE_NOT)
+			*keys = g_list_prepend (*keys, NULL);
+
+		g_string_append_printf (str, "C%i(", cond->u.combine.type);
+		for (i = 0; i < cond->u.combine.operands->len; i++) {
+			if (!_cond_normalize (g_ptr_array_index (cond->u.combine.operands, i), str, keys))
+				return 0;
+			g_string_append_c (str, ',');
+		}
+		g_string_append_c (str, ')');
+	} else {
+		if (cond->u.filter.type == S4_FILTER_CUSTOM)
+			return 0;
+
+		g_string_append_printf (str, "F%i,%i,%i,", cond->u.filter.type,
+				cond->u.filter.flags, cond->u.filter.cmp_mode);
+		_normalize_string (str, cond->u.filter.key);
+		_normalize_val (str, cond->u.filter.val);
+		_sourcepref_normalize (cond->u.filter.sp, str);
+
+		*keys = g_list_prepend (*keys, (void*)cond->u.filter.key);
+	}
+
+	return 1;
+}
+
+/**
+ * Changes the value a filter condition checks against.
+ *
+ * @param cond The filter to change
+ * @param val The new value
+ * @return 0 if the filter does not check against a value, non-zero otherwise
+ */
+int _cond_set_value (s4_condition_t *cond, const s4_val_t *val)
+{
+	if (cond->type != S4_COND_FILTER || val == NULL
+			|| cond->u.filter.type == S4_FILTER_EXISTS
+			|| cond->u.filter.type == S4_FILTER_CUSTOM) {
+		return 0;
+	}
+
+	if (cond->u.filter.free_func != NULL)
+		cond->u.filter.free_func (cond->u.filter.funcdata);
+	if (cond->u.filter.val != NULL)
+		s4_val_free (cond->u.filter.val);
+
+	cond->u.filter.val = s4_val_copy (val);
+	_set_filter_function (cond, cond->u.filter.type, val);
+
+	return 1;
+}
+
+/**
+ * Collects all the filters in a condition, depth first.
+ *
+ * @param cond The condition to collect the filters of
+ * @param filters The array to add the filters to
+ */
+void _cond_get_filters (s4_condition_t *cond, GPtrArray *filters)
+{
+	if (cond->type == S4_COND_COMBINER) {
+		g_ptr_array_foreach (cond->u.combine.operands, (GFunc)_cond_get_filters, filters);
+	} else {
+		g_ptr_array_add (filters, cond);
+	}
+}
+
+/**
+ * @}
  * @}
  */
@@ -14,6 +14,7 @@
 
 #include "s4_priv.h"
 #include <stdlib.h>
+#include <string.h>
 
 /**
  *
@@ -22,14 +23,31 @@
  * @ingroup S4
  * @brief Handles constant values in S4
  *
+ * Every constant value gets a 32-bit id, and the entries store ids
+ * instead of pointers. Constant strings are stored with their id in
+ * front of them, so the id of a key or source can be found without
+ * a lookup.
+ *
+ * The id table is made of blocks that never move. When the array of
+ * blocks has to grow the old array is kept around until the database
+ * is freed, so the table can be read without taking a lock.
+ *
  * @{
  */
 
+#define ID_BLOCK_SIZE 1024
+
 struct s4_const_data_St {
 	GStringChunk *strings;
 	GHashTable *strings_table;
 	GMutex strings_lock;
 
+	const s4_val_t ***id_blocks;
+	int id_block_count;
+	uint32_t id_count;
+	GPtrArray *old_blocks;
+	GMutex id_lock;
+
 	GHashTable *int_table;
 	GMutex int_lock;
 
@@ -52,7 +70,15 @@ s4_const_data_t *_const_create_data ()
 	data->coll_table = g_hash_table_new (NULL, NULL);
 	data->case_table = g_hash_table_new (NULL, NULL);
 
+	/* Id 0 is never used, it stands for NULL */
+	data->id_block_count = 16;
+	data->id_blocks = calloc (data->id_block_count, sizeof (s4_val_t**));
+	data->id_blocks[0] = calloc (ID_BLOCK_SIZE, sizeof (s4_val_t*));
+	data->id_count = 1;
+	data->old_blocks = g_ptr_array_new_with_free_func (free);
+
 	g_mutex_init (&data->strings_lock);
+	g_mutex_init (&data->id_lock);
 	g_mutex_init (&data->int_lock);
 	g_mutex_init (&data->coll_lock);
 	g_mutex_init (&data->case_lock);
@@ -62,13 +88,22 @@ s4_const_data_t *_const_create_data ()
 
 void _const_free_data (s4_const_data_t *data)
 {
+	int i;
+
 	g_hash_table_destroy (data->coll_table);
 	g_hash_table_destroy (data->case_table);
 	g_hash_table_destroy (data->strings_table);
 	g_hash_table_destroy (data->int_table);
 	g_string_chunk_free (data->strings);
 
+	for (i = 0; i < data->id_block_count; i++) {
+		free (data->id_blocks[i]);
+	}
+	free (data->id_blocks);
+	g_ptr_array_free (data->old_blocks, TRUE);
+
 	g_mutex_clear (&data->strings_lock);
+	g_mutex_clear (&data->id_lock);
 	g_mutex_clear (&data->case_lock);
 	g_mutex_clear (&data->coll_lock);
 	g_mutex_clear (&data->int_lock);
@@ -76,6 +111,102 @@ void _const_free_data (s4_const_data_t *data)
 	free (data);
 }
 
+/**
+ * Reserves a new id, making room for it in the id table.
+ *
+ * @param data The constant data to reserve the id in
+ * @return The new id
+ */
+static uint32_t _id_reserve (s4_const_data_t *data)
+{
+	uint32_t id;
+	int block;
+
+	g_mutex_lock (&data->id_lock);
+	id = data->id_count++;
+	block = id / ID_BLOCK_SIZE;
+
+	if (block >= data->id_block_count) {
+		const s4_val_t ***blocks = calloc (data->id_block_count * 2, sizeof (s4_val_t**));
+
+		memcpy (blocks, data->id_blocks, sizeof (s4_val_t**) * data->id_block_count);
+		g_ptr_array_add (data->old_blocks, data->id_blocks);
+		data->id_block_count *= 2;
+		g_atomic_pointer_set (&data->id_blocks, blocks);
+	}
+	if (data->id_blocks[block] == NULL) {
+		data->id_blocks[block] = calloc (ID_BLOCK_SIZE, sizeof (s4_val_t*));
+	}
+	g_mutex_unlock (&data->id_lock);
+
+	return id;
+}
+
+/**
+ * Makes a value the value of an id reserved with _id_reserve.
+ *
+ * @param data The constant data the id was reserved in
+ * @param id The id
+ * @param val The value
+ */
+static void _id_set (s4_const_data_t *data, uint32_t id, s4_val_t *val)
+{
+	const s4_val_t ***blocks = g_atomic_pointer_get (&data->id_blocks);
+
+	_val_set_id (val, id);
+	blocks[id / ID_BLOCK_SIZE][id % ID_BLOCK_SIZE] = val;
+}
+
+/**
+ * Gets the constant value with the given id.
+ *
+ * @param s4 The database the id belongs to
+ * @param id The id
+ * @return The value, or NULL if id is 0
+ */
+const s4_val_t *_const_get (s4_t *s4, uint32_t id)
+{
+	const s4_val_t ***blocks = g_atomic_pointer_get (&s4->const_data->id_blocks);
+
+	return blocks[id / ID_BLOCK_SIZE][id % ID_BLOCK_SIZE];
+}
+
+/**
+ * Gets the constant string with the given id.
+ *
+ * @param s4 The database the id belongs to
+ * @param id The id of a constant string
+ * @return The string, or NULL if id is 0
+ */
+const char *_const_get_string (s4_t *s4, uint32_t id)
+{
+	const char *ret = NULL;
+	const s4_val_t *val = _const_get (s4, id);
+
+	if (val != NULL)
+		s4_val_get_str (val, &ret);
+
+	return ret;
+}
+
+/**
+ * Gets the id of a constant string.
+ *
+ * @param str A string obtained from _string_lookup, or NULL
+ * @return The id of the string, 0 if str is NULL
+ */
+uint32_t _string_id (const char *str)
+{
+	uint32_t id;
+
+	if (str == NULL)
+		return 0;
+
+	memcpy (&id, str - sizeof (uint32_t), sizeof (uint32_t));
+
+	return id;
+}
+
 /**
  * Gets a pointer to a constant string that's equal to str.
  * _string_lookup will always return the same pointer for the same string
@@ -114,8 +245,18 @@ const s4_val_t *_string_lookup_val (s4_t *s4, const char *str)
 
 	ret = g_hash_table_lookup (s4->const_data->strings_table, str);
 	if (ret == NULL) {
-		str = g_string_chunk_insert (s4->const_data->strings, str);
+		uint32_t id = _id_reserve (s4->const_data);
+		int len = strlen (str);
+		char *buf = malloc (len + sizeof (uint32_t));
+
+		memcpy (buf, &id, sizeof (uint32_t));
+		memcpy (buf + sizeof (uint32_t), str, len);
+		str = g_string_chunk_insert_len (s4->const_data->strings, buf,
+				len + sizeof (uint32_t)) + sizeof (uint32_t);
+		free (buf);
+
 		ret = s4_val_new_internal_string (str, s4);
+		_id_set (s4->const_data, id, ret);
 		g_hash_table_insert (s4->const_data->strings_table, (void*)str, ret);
 	}
 
@@ -204,13 +345,14 @@ const char *_string_lookup_collated (s4_t *s4, const char *str)
 
 const s4_val_t *_int_lookup_val (s4_t *s4, int32_t i)
 {
-	const s4_val_t *ret;
+	s4_val_t *ret;
 
 	g_mutex_lock (&s4->const_data->int_lock);
 	ret = g_hash_table_lookup (s4->const_data->int_table, GINT_TO_POINTER (i));
 
 	if (ret == NULL) {
 		ret = s4_val_new_int (i);
+		_id_set (s4->const_data, _id_reserve (s4->const_data), ret);
 		g_hash_table_insert (s4->const_data->int_table, GINT_TO_POINTER (i), (void*)ret);
 	}
 
@@ -190,5 +190,35 @@ int s4_fetchspec_get_flags (s4_fetchspec_t *spec, int index)
 }
 
 /**
+ * @{
+ * @internal
+ */
+
+/**
+ * Appends a normalized description of a fetchspec to a string.
+ *
+ * @param spec The fetchspec to describe
+ * @param str The string to append to
+ * @param keys A list the keys fetched are prepended to.
+ * A NULL key means every key is fetched.
+ */
+void _fetchspec_normalize (s4_fetchspec_t *spec, GString *str, GList **keys)
+{
+	int i;
+
+	for (i = 0; i < spec->array->len; i++) {
+		fetch_data_t *data = &g_array_index (spec->array, fetch_data_t, i);
+
+		g_string_append_printf (str, "%i,", data->flags);
+		_normalize_string (str, data->key);
+		_sourcepref_normalize (data->pref, str);
+		g_string_append_c (str, ';');
+
+		*keys = g_list_prepend (*keys, (void*)data->key);
+	}
+}
+
+/**
+ * @}
  * @}
  */
@@ -27,16 +27,42 @@ typedef struct {
 	index_data_t *data;
 } index_t;
 
+typedef struct {
+	int32_t key;
+	void *data;
+} int_slot_t;
+
+/* An open addressing hash table from integers to data,
+ * slots with data == NULL are empty
+ */
+typedef struct {
+	int size, bits;
+	int_slot_t *slots;
+} int_map_t;
+
 struct s4_index_St {
 	int size, alloc;
 	s4_lock_t *lock;
 
 	index_t *data;
+
+	/* Integer values -> data, only kept for a-indexes */
+	int_map_t *ints;
+
+	/* Set while s4_index_create fills in a b-index, and when it has
+	 * been dropped. They are only changed with the index locked exclusively.
+	 */
+	int building, dropped;
 };
 
 struct s4_index_data_St {
 	GHashTable *indexb_table, *indexa_table;
 	GMutex indexb_table_lock, indexa_table_lock;
+
+	/* Dropped b-indexes. A transaction may still hold a pointer to
+	 * one, so they are not freed until the database is closed.
+	 */
+	GList *dropped;
 };
 
 /**
@@ -48,9 +74,12 @@ struct s4_index_data_St {
  *
  */
 
+static int_map_t *_int_map_create (void);
+static void _int_map_free (int_map_t *map);
+
 s4_index_data_t *_index_create_data ()
 {
-	s4_index_data_t *ret = malloc (sizeof (s4_index_data_t));
+	s4_index_data_t *ret = calloc (1, sizeof (s4_index_data_t));
 
 	ret->indexa_table = g_hash_table_new_full (NULL, NULL,
 	                                           NULL, (GDestroyNotify)_index_free);
@@ -66,6 +95,7 @@ void _index_free_data (s4_index_data_t *data)
 {
 	g_hash_table_destroy (data->indexa_table);
 	g_hash_table_destroy (data->indexb_table);
+	g_list_free_full (data->dropped, (GDestroyNotify)_index_free);
 	g_mutex_clear (&data->indexa_table_lock);
 	g_mutex_clear (&data->indexb_table_lock);
 	free (data);
@@ -90,6 +120,7 @@ s4_index_t *_index_get_a (s4_t *s4, const char *key, int create)
 	ret = g_hash_table_lookup (s4->index_data->indexa_table, key);
 	if (ret == NULL && create) {
 		ret = _index_create ();
+		ret->ints = _int_map_create ();
 		g_hash_table_insert (s4->index_data->indexa_table, (void*)key, ret);
 	}
 	g_mutex_unlock (&s4->index_data->indexa_table_lock);
@@ -98,14 +129,13 @@ s4_index_t *_index_get_a (s4_t *s4, const char *key, int create)
 }
 
 /**
- * Gets the b-index associated with key.
- * A b-index is used to lookup entries by the b-value.
+ * Looks up the b-index associated with key, even if it is being built.
  *
  * @param s4 The database to look for the index in
  * @param key The key the index should be indexing
  * @return The index, or NULL if it is not found
  */
-s4_index_t *_index_get_b (s4_t *s4, const char *key)
+static s4_index_t *_index_lookup_b (s4_t *s4, const char *key)
 {
 	s4_index_t *ret;
 
@@ -116,6 +146,151 @@ s4_index_t *_index_get_b (s4_t *s4, const char *key)
 	return ret;
 }
 
+/**
+ * Gets the b-index associated with key.
+ * A b-index is used to lookup entries by the b-value.
+ * Indexes still being built are not returned. The index is not locked,
+ * so use _index_get_b_shared to look entries up in it.
+ *
+ * @param s4 The database to look for the index in
+ * @param key The key the index should be indexing
+ * @return The index, or NULL if it is not found
+ */
+s4_index_t *_index_get_b (s4_t *s4, const char *key)
+{
+	s4_index_t *ret = _index_lookup_b (s4, key);
+
+	if (ret != NULL && g_atomic_int_get (&ret->building))
+		ret = NULL;
+
+	return ret;
+}
+
+/**
+ * Gets the b-index associated with key and locks it shared,
+ * so entries can be looked up in it.
+ *
+ * @param s4 The database to look for the index in
+ * @param key The key the index should be indexing
+ * @param trans The transaction to lock the index for
+ * @param index Set to the index, or NULL if there is none, it is still
+ * being built or it was dropped before we got the lock
+ * @return 0 if the transaction deadlocked, non-zero otherwise
+ */
+int _index_get_b_shared (s4_t *s4, const char *key,
+		s4_transaction_t *trans, s4_index_t **index)
+{
+	*index = _index_lookup_b (s4, key);
+
+	/* No need to hold back the build */
+	if (*index == NULL || g_atomic_int_get (&(*index)->building)) {
+		*index = NULL;
+		return 1;
+	}
+	if (!_index_lock_shared (*index, trans))
+		return 0;
+	if ((*index)->building || (*index)->dropped)
+		*index = NULL;
+
+	return 1;
+}
+
+/**
+ * Gets the b-index associated with key and locks it exclusively,
+ * so it can be updated. Indexes being built are returned too,
+ * as they have to see every change made while they are built.
+ *
+ * @param s4 The database to look for the index in
+ * @param key The key the index should be indexing
+ * @param trans The transaction to lock the index for
+ * @param index Set to the index, or NULL if there is none
+ * or it was dropped before we got the lock
+ * @return 0 if the transaction deadlocked, non-zero otherwise
+ */
+int _index_get_b_exclusive (s4_t *s4, const char *key,
+		s4_transaction_t *trans, s4_index_t **index)
+{
+	*index = _index_lookup_b (s4, key);
+
+	if (*index == NULL)
+		return 1;
+	if (!_index_lock_exclusive (*index, trans))
+		return 0;
+	if ((*index)->dropped)
+		*index = NULL;
+
+	return 1;
+}
+
+/**
+ * Drops the b-index associated with key.
+ * It waits for the transactions using the index to finish,
+ * the ones finding it after that see it has been dropped.
+ *
+ * @param s4 The database to drop the index from
+ * @param key The key of the index
+ * @return 0 if there is no such index, non-zero otherwise
+ */
+int _index_drop (s4_t *s4, const char *key)
+{
+	s4_index_data_t *data = s4->index_data;
+	s4_index_t *index = _index_lookup_b (s4, key);
+	s4_transaction_t *trans;
+	void *orig_key;
+	int i, ret = 0;
+
+	if (index == NULL)
+		return 0;
+
+	/* We hold no other locks, so this can not deadlock */
+	trans = _transaction_dummy_alloc (s4);
+	_index_lock_exclusive (index, trans);
+
+	g_mutex_lock (&data->indexb_table_lock);
+	if (!index->dropped && g_hash_table_lookup_extended (data->indexb_table,
+				key, &orig_key, NULL)) {
+		g_hash_table_steal (data->indexb_table, key);
+		free (orig_key);
+
+		for (i = 0; i < index->size; i++) {
+			free (index->data[i].data);
+		}
+		index->size = 0;
+		index->dropped = 1;
+
+		data->dropped = g_list_prepend (data->dropped, index);
+		ret = 1;
+	}
+	g_mutex_unlock (&data->indexb_table_lock);
+
+	_transaction_dummy_free (trans);
+
+	return ret;
+}
+
+/**
+ * Marks an index as being built, or as ready to be used.
+ *
+ * @param index The index
+ * @param building Non-zero if it is being built
+ */
+void _index_set_building (s4_index_t *index, int building)
+{
+	g_atomic_int_set (&index->building, building);
+}
+
+/**
+ * Checks if an index has been dropped.
+ * The index must be locked.
+ *
+ * @param index The index
+ * @return non-zero if it has been dropped, 0 otherwise
+ */
+int _index_is_dropped (s4_index_t *index)
+{
+	return index->dropped;
+}
+
 /* A helper function for the _index_get_all_... functions.
  * It will prepend all values in an hash-table to a list
  */
@@ -173,6 +348,8 @@ s4_index_t *_index_create ()
 	ret->alloc = 1;
 	ret->data = malloc (sizeof (index_t) * ret->alloc);
 	ret->lock = _lock_alloc ();
+	ret->ints = NULL;
+	ret->building = ret->dropped = 0;
 
 	return ret;
 }
@@ -199,6 +376,117 @@ int _index_add (s4_t *s4, const char *key, s4_index_t *index)
 	return ret;
 }
 
+static int_map_t *_int_map_create (void)
+{
+	int_map_t *map = malloc (sizeof (int_map_t));
+
+	map->size = 0;
+	map->bits = 4;
+	map->slots = calloc (1 << map->bits, sizeof (int_slot_t));
+
+	return map;
+}
+
+static void _int_map_free (int_map_t *map)
+{
+	free (map->slots);
+	free (map);
+}
+
+static unsigned int _int_hash (int_map_t *map, int32_t key)
+{
+	return ((uint32_t)key * 2654435769U) >> (32 - map->bits);
+}
+
+/**
+ * Finds the slot of key, or the empty slot where it should go
+ *
+ * @param map The map to look in
+ * @param key The key to look for
+ * @return The slot
+ */
+static int_slot_t *_int_map_slot (int_map_t *map, int32_t key)
+{
+	unsigned int mask = (1 << map->bits) - 1;
+	unsigned int i = _int_hash (map, key);
+
+	while (map->slots[i].data != NULL && map->slots[i].key != key)
+		i = (i + 1) & mask;
+
+	return map->slots + i;
+}
+
+static void _int_map_set (int_map_t *map, int32_t key, void *data)
+{
+	int_slot_t *slot;
+
+	if ((map->size + 1) * 2 > (1 << map->bits)) {
+		int_slot_t *old = map->slots;
+		int i, old_count = 1 << map->bits;
+
+		map->bits++;
+		map->slots = calloc (1 << map->bits, sizeof (int_slot_t));
+
+		for (i = 0; i < old_count; i++) {
+			if (old[i].data != NULL)
+				*_int_map_slot (map, old[i].key) = old[i];
+		}
+		free (old);
+	}
+
+	slot = _int_map_slot (map, key);
+	if (slot->data == NULL)
+		map->size++;
+	slot->key = key;
+	slot->data = data;
+}
+
+static void _int_map_remove (int_map_t *map, int32_t key)
+{
+	unsigned int mask = (1 << map->bits) - 1;
+	unsigned int i, j, k;
+
+	i = _int_map_slot (map, key) - map->slots;
+	if (map->slots[i].data == NULL)
+		return;
+
+	/* Move back the slots that would no longer be found
+	 * when there's a hole in front of them
+	 */
+	for (j = (i + 1) & mask; map->slots[j].data != NULL; j = (j + 1) & mask) {
+		k = _int_hash (map, map->slots[j].key);
+
+		if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+			map->slots[i] = map->slots[j];
+			i = j;
+		}
+	}
+
+	map->slots[i].data = NULL;
+	map->size--;
+}
+
+/**
+ * Keeps the integer map of an index up to date with the slot for val
+ *
+ * @param index The index that has changed
+ * @param val The value that was inserted or deleted
+ * @param i The position of the slot of val, if it still exists
+ */
+static void _int_map_update (s4_index_t *index, const s4_val_t *val, int i)
+{
+	int32_t ival;
+
+	if (index->ints == NULL || !s4_val_get_int (val, &ival))
+		return;
+
+	if (i < index->size && !s4_val_cmp (index->data[i].val, val, S4_CMP_CASELESS)) {
+		_int_map_set (index->ints, ival, index->data[i].data[0].data);
+	} else {
+		_int_map_remove (index->ints, ival);
+	}
+}
+
 static int _data_search (index_t *index, void *data)
 {
 	int lo = 0;
@@ -288,6 +576,31 @@ int _index_insert (s4_index_t *index, const s4_val_t *val, void *new_data)
 		index->data[i].data[j].count++;
 	}
 
+	_int_map_update (index, val, i);
+
+	return 1;
+}
+
+/**
+ * Sets the number of times a value-data pair is in the index,
+ * inserting it if it is not there.
+ *
+ * @param index The index to insert into
+ * @param val The value to associate the data with
+ * @param data The data
+ * @param count The number of times the pair is in the index, at least 1
+ * @return 1
+ */
+int _index_set_count (s4_index_t *index, const s4_val_t *val, void *data, int count)
+{
+	int i, j;
+
+	_index_insert (index, val, data);
+
+	i = _bsearch (index, (index_function_t)_val_cmp, (void*)val);
+	j = _data_search (index->data + i, data);
+	index->data[i].data[j].count = count;
+
 	return 1;
 }
 
@@ -309,7 +622,7 @@ int _index_delete (s4_index_t *index, const s4_val_t *val, void *data)
 	}
 
 	j = _data_search (index->data + i, data);
-	if (j >= index->size || data != index->data[i].data) {
+	if (j >= index->data[i].size || data != index->data[i].data[j].data) {
 		return 0;
 	}
 
@@ -321,13 +634,31 @@ int _index_delete (s4_index_t *index, const s4_val_t *val, void *data)
 
 	if (index->data[i].size <= 0) {
 		free (index->data[i].data);
-		memmove (index->data + i, index->data + i + i, (index->size - i - 1) * sizeof (index_t));
+		memmove (index->data + i, index->data + i + 1, (index->size - i - 1) * sizeof (index_t));
 		index->size--;
 	}
 
+	_int_map_update (index, val, i);
+
 	return 1;
 }
 
+/**
+ * Looks up the data of an integer in an a-index.
+ * This is a hash lookup and does not allocate anything.
+ *
+ * @param index The a-index to look in
+ * @param i The integer to look for
+ * @return The data associated with i, or NULL if there is none
+ */
+void *_index_lookup_int (s4_index_t *index, int32_t i)
+{
+	if (index->ints == NULL)
+		return NULL;
+
+	return _int_map_slot (index->ints, i)->data;
+}
+
 /**
  * Searches an index
  *
@@ -406,6 +737,65 @@ GList *_index_lsearch (s4_index_t *index, index_function_t func, void *func_data
 	return ret;
 }
 
+/**
+ * Calls a function on the distinct values in an index, in sorted order.
+ * Values are compared caselessly, so values differing only in case
+ * are seen as one.
+ *
+ * @param index The index to look in
+ * @param start The smallest value to include, or NULL to start at the first
+ * @param end The largest value to include, or NULL to stop at the last
+ * @param prefix If non-NULL only strings starting with prefix are
+ * included, compared caselessly
+ * @param func The function to call. It is passed the value and the number
+ * of data associated with it. If it returns 0 the iteration stops
+ * @param userdata Passed as the last argument to func
+ * @return The number of values func was called on
+ */
+int _index_foreach_value (s4_index_t *index, const s4_val_t *start,
+		const s4_val_t *end, const char *prefix,
+		index_value_function_t func, void *userdata)
+{
+	int i, ret = 0;
+	char *folded = NULL;
+	s4_val_t *prefix_val = NULL;
+
+	if (prefix != NULL) {
+		/* Strings sort before integers and casefolded strings with a
+		 * common prefix are adjacent, so the matches are one run
+		 * starting at the prefix itself
+		 */
+		folded = s4_string_casefold (prefix);
+		prefix_val = s4_val_new_string (prefix);
+
+		if (start == NULL || _val_cmp (start, prefix_val) < 0)
+			start = prefix_val;
+	}
+
+	i = (start == NULL)?0:_bsearch (index, (index_function_t)_val_cmp, (void*)start);
+
+	for (; i < index->size; i++) {
+		const s4_val_t *val = index->data[i].val;
+		const char *str;
+
+		if (end != NULL && _val_cmp (val, end) > 0)
+			break;
+		if (folded != NULL && (!s4_val_get_casefolded_str (val, &str)
+					|| strncmp (str, folded, strlen (folded))))
+			break;
+
+		ret++;
+		if (!func (val, index->data[i].size, userdata))
+			break;
+	}
+
+	if (prefix_val != NULL)
+		s4_val_free (prefix_val);
+	g_free (folded);
+
+	return ret;
+}
+
 /**
  * Frees an index. The values and data is NOT freed
  *
@@ -419,6 +809,9 @@ void _index_free (s4_index_t *index)
 		free (index->data[i].data);
 	}
 
+	if (index->ints != NULL)
+		_int_map_free (index->ints);
+
 	_lock_free (index->lock);
 	free (index->data);
 	free (index);
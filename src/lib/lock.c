@@ -27,9 +27,28 @@
  *   exclusive lock later on.
  * - Exclusive locks can only be held by one transaction.
  *
+ * Read-only locks are taken without touching the mutex as long as no
+ * transaction holds or waits for the lock exclusively. Such readers are
+ * only counted in the lock, and are added to the table of holders when
+ * they have to wait for another lock, so deadlocks can still be found.
+ *
  * @{
  */
 
+/* Set in s4_lock_St.fast when read-only locks must take the slow path */
+#define LOCK_CLOSED (1 << 30)
+
+/* Bounds on how many times to retry a closed lock before taking the slow path */
+#define LOCK_MIN_SPINS 16
+#define LOCK_MAX_SPINS 1024
+
+/* How a transaction holds a lock, stored in s4_lock_St.transactions */
+typedef enum {
+	LOCK_HOLDER_PLAIN = 1,
+	LOCK_HOLDER_UPGRADABLE,
+	LOCK_HOLDER_FAST
+} lock_holder_t;
+
 struct s4_lock_St {
 	GMutex lock;
 	GCond upgrade_signal, signal;
@@ -38,6 +57,21 @@ struct s4_lock_St {
 	int readers;
 	int exclusive;
 	int upgrade, want_upgrade;
+
+	/* Bumped every time an exclusive lock is released, so optimistic
+	 * transactions can tell if the locked object may have changed
+	 */
+	unsigned int version;
+
+	/* The number of read-only holders that took the fast path, and
+	 * LOCK_CLOSED if new ones have to take the slow path. Only changed
+	 * with atomic operations.
+	 */
+	gint fast;
+	/* The number of fast holders added to the table of holders */
+	int shown;
+	/* How many times to retry a closed lock, adapted as we go */
+	int spins;
 };
 
 /* Creates a new lock structure */
@@ -68,10 +102,18 @@ static int _lock_has_trans (s4_lock_t *lock, s4_transaction_t *trans)
 	return g_hash_table_lookup (lock->transactions, trans) != NULL;
 }
 
+/* Gets how trans holds this lock, 0 if it does not hold it or only holds
+ * it through the fast path and has not been added to the table of holders
+ */
+static lock_holder_t _lock_get_holder (s4_lock_t *lock, s4_transaction_t *trans)
+{
+	return GPOINTER_TO_INT (g_hash_table_lookup (lock->transactions, trans));
+}
+
 /* Adds a transactions to the table of transactions holding this lock */
-static void _lock_add_trans (s4_lock_t *lock, s4_transaction_t *trans)
+static void _lock_add_trans (s4_lock_t *lock, s4_transaction_t *trans, lock_holder_t holder)
 {
-	g_hash_table_insert (lock->transactions, trans, GINT_TO_POINTER (1));
+	g_hash_table_insert (lock->transactions, trans, GINT_TO_POINTER (holder));
 }
 
 /* Removes a transactions from the table of transactions holding this lock */
@@ -80,6 +122,98 @@ static void _lock_del_trans (s4_lock_t *lock, s4_transaction_t *trans)
 	g_hash_table_remove (lock->transactions, trans);
 }
 
+/* Gets the number of transactions holding the lock through the fast path */
+static int _lock_fast_readers (s4_lock_t *lock)
+{
+	return g_atomic_int_get (&lock->fast) & ~LOCK_CLOSED;
+}
+
+/* Opens or closes the fast path depending on whether a transaction holds
+ * or waits for the lock exclusively. Must be called with the mutex held
+ * every time one of those change.
+ */
+static void _lock_update_closed (s4_lock_t *lock)
+{
+	if (lock->exclusive || lock->writers_waiting || lock->want_upgrade) {
+		g_atomic_int_or ((guint *)&lock->fast, LOCK_CLOSED);
+	} else {
+		g_atomic_int_and ((guint *)&lock->fast, ~LOCK_CLOSED);
+	}
+}
+
+/* Tries to take a read-only lock without the mutex.
+ * If the lock is closed we retry it for a while, as it is often opened
+ * again shortly. How long we retry is adapted to how long it took the
+ * last times, and shrinks when retrying does not pay off.
+ *
+ * Returns 1 if the lock was taken, 0 if the slow path must be used
+ */
+static int _lock_try_fast (s4_lock_t *lock)
+{
+	int spins = g_atomic_int_get (&lock->spins);
+	int max = MIN (spins + LOCK_MIN_SPINS, LOCK_MAX_SPINS);
+	int state, i = 0;
+
+	for (;;) {
+		state = g_atomic_int_get (&lock->fast);
+		if (!(state & LOCK_CLOSED)) {
+			if (g_atomic_int_compare_and_exchange (&lock->fast, state, state + 1))
+				break;
+		} else if (++i >= max) {
+			g_atomic_int_set (&lock->spins, spins / 2);
+			return 0;
+		}
+	}
+
+	if (i > 0) {
+		g_atomic_int_set (&lock->spins, spins + (2 * i - spins) / 8);
+	}
+
+	return 1;
+}
+
+/* Releases a lock taken with _lock_try_fast */
+static void _lock_unlock_fast (s4_lock_t *lock, s4_transaction_t *trans)
+{
+	if (g_atomic_int_get (&lock->shown)) {
+		g_mutex_lock (&lock->lock);
+		if (_lock_get_holder (lock, trans) == LOCK_HOLDER_FAST) {
+			_lock_del_trans (lock, trans);
+			g_atomic_int_add (&lock->shown, -1);
+		}
+		g_mutex_unlock (&lock->lock);
+	}
+
+	/* If we were the last fast holder of a closed lock,
+	 * someone may be waiting for us
+	 */
+	if (g_atomic_int_add (&lock->fast, -1) == (LOCK_CLOSED | 1)) {
+		g_mutex_lock (&lock->lock);
+		g_cond_broadcast (&lock->signal);
+		g_cond_broadcast (&lock->upgrade_signal);
+		g_mutex_unlock (&lock->lock);
+	}
+}
+
+/* Adds trans to the holders of the locks it took through the fast path.
+ * This must be done before trans waits for anything, as finding deadlocks
+ * and letting trans take a lock again relies on the table of holders.
+ */
+static void _lock_show_fast_one (s4_lock_t *lock, s4_transaction_t *trans)
+{
+	g_mutex_lock (&lock->lock);
+	if (!_lock_has_trans (lock, trans)) {
+		_lock_add_trans (lock, trans, LOCK_HOLDER_FAST);
+		g_atomic_int_inc (&lock->shown);
+	}
+	g_mutex_unlock (&lock->lock);
+}
+
+static void _lock_show_fast (s4_transaction_t *trans)
+{
+	_transaction_foreach_fast_lock (trans, (GFunc)_lock_show_fast_one, trans);
+}
+
 /* Checks if making trans wait for lock would deadlock.
  * Deadlock happens when we have to wait on a lock held by
  * a transaction waiting for a lock this transaction holds.
@@ -143,15 +277,51 @@ static int _lock_will_deadlock (s4_lock_t *lock, s4_transaction_t *trans)
 	return ret;
 }
 
+/* Records the time spent waiting for a lock since start, if start is non-zero.
+ * Returns the time waited.
+ */
+static gint64 _lock_record_wait (s4_transaction_t *trans, gint64 start)
+{
+	s4_t *s4 = _transaction_get_db (trans);
+	gint64 waited;
+
+	if (!start)
+		return 0;
+
+	waited = g_get_monotonic_time () - start;
+	_stats_inc (s4, S4_STATS_LOCK_WAITS);
+	_stats_sample (s4, S4_STATS_LOCK_WAIT, waited);
+
+	return waited;
+}
+
+/* Records that trans acquired a new lock */
+static void _lock_record_acquired (s4_transaction_t *trans, gint64 start)
+{
+	gint64 waited = _lock_record_wait (trans, start);
+
+	_transaction_count_lock (trans);
+	_query_stats_add_lock (_transaction_get_stats (trans), waited);
+}
+
+static int _lock_deadlocked (s4_transaction_t *trans)
+{
+	_transaction_set_waiting_for (trans, NULL);
+	_stats_inc (_transaction_get_db (trans), S4_STATS_DEADLOCKS);
+	s4_set_errno (S4E_DEADLOCK);
+	return 0;
+}
+
 /* Aquires an exclusive lock. */
 int _lock_exclusive (s4_lock_t *lock, s4_transaction_t *trans)
 {
+	gint64 start = 0;
+
 	_transaction_set_waiting_for (trans, lock);
+	_lock_show_fast (trans);
 
 	if (_lock_will_deadlock (lock, trans)) {
-		_transaction_set_waiting_for (trans, NULL);
-		s4_set_errno (S4E_DEADLOCK);
-		return 0;
+		return _lock_deadlocked (trans);
 	}
 
 	g_mutex_lock (&lock->lock);
@@ -162,25 +332,37 @@ int _lock_exclusive (s4_lock_t *lock, s4_transaction_t *trans)
 		 */
 		if (!lock->exclusive) {
 			lock->want_upgrade = 1;
+			_lock_update_closed (lock);
 			lock->readers--;
-			while (lock->readers) {
+			if (lock->readers || _lock_fast_readers (lock))
+				start = g_get_monotonic_time ();
+			while (lock->readers || _lock_fast_readers (lock)) {
 				g_cond_wait (&lock->upgrade_signal, &lock->lock);
 			}
 			lock->want_upgrade = 0;
+
+			_stats_inc (_transaction_get_db (trans), S4_STATS_LOCK_UPGRADES);
+			_query_stats_add_lock (_transaction_get_stats (trans),
+					_lock_record_wait (trans, start));
 		}
 	} else {
 		lock->writers_waiting++;
-		while (lock->readers || lock->exclusive || lock->upgrade) {
+		_lock_update_closed (lock);
+		if (lock->readers || lock->exclusive || lock->upgrade || _lock_fast_readers (lock))
+			start = g_get_monotonic_time ();
+		while (lock->readers || lock->exclusive || lock->upgrade || _lock_fast_readers (lock)) {
 			g_cond_wait (&lock->signal, &lock->lock);
 		}
 		lock->writers_waiting--;
 
-		_lock_add_trans (lock, trans);
+		_lock_add_trans (lock, trans, LOCK_HOLDER_PLAIN);
 		_transaction_add_lock (trans, lock);
+		_lock_record_acquired (trans, start);
 	}
 
 	_transaction_set_waiting_for (trans, NULL);
 	lock->exclusive = 1;
+	_lock_update_closed (lock);
 
 	g_mutex_unlock (&lock->lock);
 	return 1;
@@ -189,24 +371,46 @@ int _lock_exclusive (s4_lock_t *lock, s4_transaction_t *trans)
 /* Aquires a shared (upgradable if this is not a read-only transcation) lock */
 int _lock_shared (s4_lock_t *lock, s4_transaction_t *trans)
 {
+	/* Optimistic transactions only hold locks while they read,
+	 * and remember the version of what they read instead
+	 */
+	int optimistic = _transaction_is_optimistic (trans);
+
 	/* If this is not a read-only transaction, we might want to
 	 * aquire this lock exclusively later on, therefore it must be
 	 * upgradable
 	 */
-	int upgrade = !(_transaction_get_flags (trans) & S4_TRANS_READONLY);
+	int upgrade = !(_transaction_get_flags (trans) & S4_TRANS_READONLY) && !optimistic;
+
+	if (!upgrade) {
+		/* Already held through the fast path */
+		if (_transaction_has_fast_lock (trans, lock))
+			return 1;
+
+		if (_lock_try_fast (lock)) {
+			_transaction_add_fast_lock (trans, lock);
+			_lock_record_acquired (trans, 0);
+			if (optimistic)
+				_transaction_add_read (trans, lock, lock->version);
+			return 1;
+		}
+	}
 
 	_transaction_set_waiting_for (trans, lock);
+	_lock_show_fast (trans);
 
 	if (_lock_will_deadlock (lock, trans)) {
-		_transaction_set_waiting_for (trans, NULL);
-		s4_set_errno (S4E_DEADLOCK);
-		return 0;
+		return _lock_deadlocked (trans);
 	}
 
 	g_mutex_lock (&lock->lock);
 
 	/* If we do not already hold this lock we have to aquire it */
 	if (!_lock_has_trans (lock, trans)) {
+		gint64 start = 0;
+
+		if (lock->exclusive || lock->writers_waiting || (lock->upgrade && upgrade))
+			start = g_get_monotonic_time ();
 		while (lock->exclusive || lock->writers_waiting || (lock->upgrade && upgrade)) {
 			g_cond_wait (&lock->signal, &lock->lock);
 		}
@@ -215,10 +419,14 @@ int _lock_shared (s4_lock_t *lock, s4_transaction_t *trans)
 		if (upgrade) {
 			lock->upgrade = 1;
 		}
-		_lock_add_trans (lock, trans);
+		_lock_add_trans (lock, trans, upgrade ? LOCK_HOLDER_UPGRADABLE : LOCK_HOLDER_PLAIN);
 		_transaction_add_lock (trans, lock);
+		_lock_record_acquired (trans, start);
 	}
 
+	if (optimistic)
+		_transaction_add_read (trans, lock, lock->version);
+
 	_transaction_set_waiting_for (trans, NULL);
 	g_mutex_unlock (&lock->lock);
 	return 1;
@@ -227,11 +435,15 @@ int _lock_shared (s4_lock_t *lock, s4_transaction_t *trans)
 /* Unlocks a single lock held by trans */
 static void _lock_unlock (s4_lock_t *lock, s4_transaction_t *trans)
 {
-	int upgrade = !(_transaction_get_flags (trans) & S4_TRANS_READONLY);
+	int upgrade;
 
 	g_mutex_lock (&lock->lock);
+	upgrade = _lock_get_holder (lock, trans) == LOCK_HOLDER_UPGRADABLE;
+
 	if (lock->exclusive) {
 		lock->exclusive = 0;
+		lock->version++;
+		_lock_update_closed (lock);
 		g_cond_signal (&lock->signal);
 	} else if (lock->readers) {
 		lock->readers--;
@@ -254,15 +466,59 @@ static void _lock_unlock (s4_lock_t *lock, s4_transaction_t *trans)
 	g_mutex_unlock (&lock->lock);
 }
 
+/* Gets the version of a lock, it changes every time an exclusive
+ * holder lets go of it
+ */
+unsigned int _lock_get_version (s4_lock_t *lock)
+{
+	unsigned int ret;
+
+	g_mutex_lock (&lock->lock);
+	ret = lock->version;
+	g_mutex_unlock (&lock->lock);
+
+	return ret;
+}
+
+/* Checks that no other transaction has held lock exclusively since trans
+ * saw version, and that no other transaction holds it exclusively now.
+ * If so trans gets a shared lock on it, without waiting, so it stays
+ * that way until trans is done.
+ * Returns 1 if the lock is unchanged, 0 otherwise
+ */
+int _lock_validate (s4_lock_t *lock, s4_transaction_t *trans, unsigned int version)
+{
+	int ret;
+
+	g_mutex_lock (&lock->lock);
+
+	ret = (lock->version == version);
+	if (ret && !_lock_has_trans (lock, trans)) {
+		ret = !lock->exclusive;
+		if (ret) {
+			lock->readers++;
+			_lock_add_trans (lock, trans, LOCK_HOLDER_PLAIN);
+			_transaction_add_lock (trans, lock);
+		}
+	}
+
+	g_mutex_unlock (&lock->lock);
+
+	return ret;
+}
+
 /* Unlocks all locks held by trans */
 void _lock_unlock_all (s4_transaction_t *trans)
 {
 	GList *locks = _transaction_get_locks (trans);
+	s4_lock_t *lock;
 
 	for (; locks != NULL; locks = g_list_next (locks)) {
-		s4_lock_t *lock = locks->data;
+		lock = locks->data;
 		_lock_unlock (lock, trans);
 	}
+
+	_transaction_foreach_fast_lock (trans, (GFunc)_lock_unlock_fast, trans);
 }
 
 /**
@@ -23,6 +23,7 @@
 #else
 #include <unistd.h>  /* For ftruncate */
 #include <fcntl.h>
+#include <errno.h>
 #endif
 
 /**
@@ -41,16 +42,50 @@ typedef enum {
 	LOG_ENTRY_BEGIN = 0x1,
 	LOG_ENTRY_END = 0x2,
 	LOG_ENTRY_WRITING = 0x3,
-	LOG_ENTRY_CHECKPOINT = 0x4
+	LOG_ENTRY_CHECKPOINT = 0x4,
+	LOG_ENTRY_RECORD = 0x5
 } log_type_t;
 
+/* The operations in a record */
+typedef enum {
+	LOG_OP_ADD = 0x1,
+	LOG_OP_DEL = 0x2,
+	/* Deletes every relation from a source in an entry,
+	 * only key_a, val_a and src are written
+	 */
+	LOG_OP_DEL_SOURCE = 0x3,
+	/* Deletes every relation in an entry, only key_a and val_a are written */
+	LOG_OP_DEL_ENTRY = 0x4
+} log_op_t;
+
+/* Set in the flags of a record if the transaction was writing
+ * the database to disk.
+ */
+#define LOG_RECORD_WRITING 0x1
+
 #define LOG_SIZE (2*1024*1024)
 
+/* The longest time, in microseconds, a transaction committed with
+ * S4_DURABILITY_ASYNC waits before it is synced to disk
+ */
+#define LOG_FLUSH_DELAY (200 * 1000)
+
+/* How often, in microseconds, a follower looks for new entries in the log */
+#define LOG_FOLLOW_INTERVAL (50 * 1000)
+
+/* How long, in microseconds, to back off before locking the log file
+ * again when waiting for it would deadlock with another process
+ */
+#define LOG_DEADLOCK_WAIT (10 * 1000)
+
 struct log_header {
 	log_type_t type;
 	log_number_t num;
 };
 
+/* Old style add and del entries are no longer written,
+ * but are still read so old logs can be redone.
+ */
 struct mod_header {
 	int32_t ka_len;
 	int32_t va_len;
@@ -59,10 +94,48 @@ struct mod_header {
 	int32_t s_len;
 };
 
+/* Keys and sources are written to the log once and referred to
+ * by their id after that. The dictionary is emptied on every
+ * checkpoint and every record written by a writing transaction,
+ * so a redo started at the last checkpoint sees every string
+ * before it is referred to.
+ */
+typedef struct {
+	GPtrArray *strings;
+	GHashTable *ids;
+} log_dict_t;
+
+/* The strings a record adds to the dictionary. They are only added
+ * once the record has been written, or read in full.
+ */
+typedef struct {
+	log_dict_t *dict;
+	log_dict_t added;
+	int reset;
+} log_record_t;
+
 struct s4_log_data_St {
 	FILE *logfile;
-	int log_users;
+	/* The transactions in this process holding the log file,
+	 * and how many of them are writing
+	 */
+	int log_users, log_writers;
 	GMutex lock;
+	log_dict_t dict;
+
+	/* dirty is set when records have been written but not synced,
+	 * flush_at is when the flusher should sync them, 0 if it should not
+	 */
+	int dirty;
+	gint64 flush_at;
+	GThread *flusher;
+	GCond flush_cond;
+	int flusher_run;
+
+	/* Tails the log of a database opened with S4_FOLLOWER */
+	GThread *follower;
+	GCond follow_cond;
+	int follower_run;
 
 	log_number_t last_checkpoint;
 	log_number_t last_synced;
@@ -75,132 +148,263 @@ s4_log_data_t *_log_create_data ()
 	s4_log_data_t *ret = calloc (1, sizeof (s4_log_data_t));
 
 	g_mutex_init (&ret->lock);
+	g_cond_init (&ret->flush_cond);
+	g_cond_init (&ret->follow_cond);
+	ret->dict.strings = g_ptr_array_new ();
+	ret->dict.ids = g_hash_table_new (NULL, NULL);
 
 	return ret;
 }
 
 void _log_free_data (s4_log_data_t *data)
 {
+	g_ptr_array_free (data->dict.strings, TRUE);
+	g_hash_table_destroy (data->dict.ids);
 	g_mutex_clear (&data->lock);
+	g_cond_clear (&data->flush_cond);
+	g_cond_clear (&data->follow_cond);
 	free (data);
 }
 
 /**
- * Calculates the size of a log entry from the header
- * @param hdr The header to calculate the size of.
- * @return The calculated size.
+ * Empties a dictionary.
+ * @param dict The dictionary to empty.
  */
-static int _get_size (struct mod_header *hdr)
+static void _dict_clear (log_dict_t *dict)
 {
-	int ret = sizeof (struct mod_header);
+	g_ptr_array_set_size (dict->strings, 0);
+	g_hash_table_remove_all (dict->ids);
+}
 
-	ret += hdr->ka_len + hdr->kb_len + hdr->s_len;
+/**
+ * Starts a new record.
+ * @param rec The record to initialize.
+ * @param dict The dictionary of the log.
+ * @param reset Non-zero if the record starts with an empty dictionary.
+ */
+static void _record_init (log_record_t *rec, log_dict_t *dict, int reset)
+{
+	rec->dict = dict;
+	rec->reset = reset;
+	rec->added.strings = g_ptr_array_new ();
+	rec->added.ids = g_hash_table_new (NULL, NULL);
+}
 
-	if (hdr->va_len == -1)
-		ret += sizeof (int32_t);
-	else
-		ret += hdr->va_len;
+/**
+ * Frees the strings added by a record without adding them to the log dictionary.
+ * @param rec The record.
+ */
+static void _record_clear (log_record_t *rec)
+{
+	if (rec->added.strings == NULL)
+		return;
 
-	if (hdr->vb_len == -1)
-		ret += sizeof (int32_t);
-	else
-		ret += hdr->vb_len;
+	g_ptr_array_free (rec->added.strings, TRUE);
+	g_hash_table_destroy (rec->added.ids);
+	rec->added.strings = NULL;
+	rec->added.ids = NULL;
+}
 
-	return ret;
+/**
+ * Adds the strings of a record to the log dictionary.
+ * @param rec The record.
+ */
+static void _record_commit (log_record_t *rec)
+{
+	int i;
+
+	if (rec->added.strings == NULL)
+		return;
+
+	if (rec->reset)
+		_dict_clear (rec->dict);
+
+	for (i = 0; i < rec->added.strings->len; i++) {
+		const char *str = g_ptr_array_index (rec->added.strings, i);
+
+		g_ptr_array_add (rec->dict->strings, (void*)str);
+		g_hash_table_insert (rec->dict->ids, (void*)str,
+				GINT_TO_POINTER (rec->dict->strings->len));
+	}
+
+	_record_clear (rec);
 }
 
 /**
- * Writes a string to a file.
- * @param str The string to write.
- * @param len The length of the string.
- * @param file The file to write to.
+ * Gets the id of the first string added by a record.
+ * @param rec The record.
+ * @return The id.
  */
-static void _write_str (const char *str, int len, FILE *file)
+static int _record_base (log_record_t *rec)
 {
-	fwrite (str, 1, len, file);
+	return rec->reset ? 0 : rec->dict->strings->len;
 }
 
 /**
- * Writes a value to a file.
- * @param val The value to write.
- * @param len The lenght of the value.
- * @param file The file to write to.
+ * Finds the id of a string, adding it to the record if it is not known.
+ * @param rec The record.
+ * @param str The string to find. It must come from _string_lookup.
+ * @param new Set to 1 if the string was added, 0 otherwise.
+ * @return The id of the string.
  */
-static void _write_val (const s4_val_t *val, int len, FILE *file)
+static int _record_get_id (log_record_t *rec, const char *str, int *new)
 {
-	const char *s;
-	int32_t i;
+	int id = 0;
+
+	if (!rec->reset)
+		id = GPOINTER_TO_INT (g_hash_table_lookup (rec->dict->ids, str));
+	if (id == 0)
+		id = GPOINTER_TO_INT (g_hash_table_lookup (rec->added.ids, str));
+
+	*new = (id == 0);
+	if (id == 0) {
+		g_ptr_array_add (rec->added.strings, (void*)str);
+		id = _record_base (rec) + rec->added.strings->len;
+		g_hash_table_insert (rec->added.ids, (void*)str, GINT_TO_POINTER (id));
+	}
 
-	if (len == -1) {
-		s4_val_get_int (val, &i);
-		fwrite (&i, sizeof (int32_t), 1, file);
+	return id - 1;
+}
+
+/**
+ * Gets the string with the given id.
+ * @param rec The record.
+ * @param id The id of the string.
+ * @return The string, or NULL if there is no string with that id.
+ */
+static const char *_record_get_str (log_record_t *rec, uint64_t id)
+{
+	int base = _record_base (rec);
+
+	if (id < base)
+		return g_ptr_array_index (rec->dict->strings, id);
+	if (id - base < rec->added.strings->len)
+		return g_ptr_array_index (rec->added.strings, id - base);
+
+	return NULL;
+}
+
+/**
+ * Appends a variable length integer to a buffer.
+ * Seven bits are stored in every byte, the high bit is
+ * set if more bytes follow.
+ *
+ * @param buf The buffer to append to.
+ * @param x The integer to append.
+ */
+static void _put_varint (GString *buf, uint64_t x)
+{
+	while (x >= 0x80) {
+		g_string_append_c (buf, (char)(x | 0x80));
+		x >>= 7;
+	}
+	g_string_append_c (buf, (char)x);
+}
+
+/**
+ * Appends a string to a buffer, as a reference to the dictionary.
+ * The first time a string is used it is written in full.
+ *
+ * @param rec The record the buffer belongs to.
+ * @param buf The buffer to append to.
+ * @param str The string to append.
+ */
+static void _put_str (log_record_t *rec, GString *buf, const char *str)
+{
+	int new;
+	int id = _record_get_id (rec, str, &new);
+
+	if (new) {
+		int len = strlen (str);
+		_put_varint (buf, ((uint64_t)len << 1) | 1);
+		g_string_append_len (buf, str, len);
 	} else {
-		s4_val_get_str (val, &s);
-		_write_str (s, len, file);
+		_put_varint (buf, (uint64_t)id << 1);
 	}
 }
 
 /**
- * Returns the length of a value.
+ * Appends a value to a buffer.
+ * Integers are zigzag encoded so small negative numbers stay small.
  *
- * @param val The value to get the lenght of.
- * @return If it is a string value it will return the string length.
- * If it is an integer value it will return -1.
+ * @param buf The buffer to append to.
+ * @param val The value to append.
  */
-static int _get_val_len (const s4_val_t *val)
+static void _put_val (GString *buf, const s4_val_t *val)
 {
 	const char *s;
+	int32_t i;
 
 	if (s4_val_get_str (val, &s)) {
-		return strlen (s);
+		int len = strlen (s);
+		_put_varint (buf, ((uint64_t)len << 1) | 1);
+		g_string_append_len (buf, s, len);
+	} else {
+		uint32_t zz;
+
+		s4_val_get_int (val, &i);
+		zz = ((uint32_t)i << 1) ^ (uint32_t)(i >> 31);
+		_put_varint (buf, (uint64_t)zz << 1);
 	}
-	return -1;
 }
 
 /**
- * Estimates the size needed to write the entire oplist to the log.
+ * Encodes an oplist into a record.
+ * The buffer starts with room for the record header and its length,
+ * and ends with room for the end header, so the whole record can be
+ * written at once.
  *
- * @param list The oplist to estimate the size of
- * @param writing A pointer to an int that will be set to 1
- * if the oplist contains a write.
- * @return The estimated size.
+ * @param list The oplist to encode.
+ * @param rec The record to add new strings to.
+ * @param writing Non-zero if the oplist contains a write.
+ * @return A new buffer with the record, or NULL if the oplist is empty.
  */
-static int _estimate_size (oplist_t *list, int *writing) {
-	int ret = 0, largest = 0;
-	_oplist_first (list);
+static GString *_encode_record (oplist_t *list, log_record_t *rec, int writing)
+{
+	GString *buf = g_string_sized_new (256);
+	int ops = 0;
 
+	g_string_set_size (buf, sizeof (struct log_header) + sizeof (uint32_t));
+	g_string_append_c (buf, writing ? LOG_RECORD_WRITING : 0);
+
+	_oplist_first (list);
 	while (_oplist_next (list)) {
 		const char *key_a, *key_b, *src;
 		const s4_val_t *val_a, *val_b;
-		int size = sizeof (struct log_header);
+		GPtrArray *deleted;
 
 		if (_oplist_get_add (list, &key_a, &val_a, &key_b, &val_b, &src)) {
-			size += sizeof (struct mod_header);
-			size += strlen (key_a) + strlen (key_a) + strlen (src);
-			size += _get_val_len (val_a) + _get_val_len (val_b);
+			g_string_append_c (buf, LOG_OP_ADD);
 		} else if (_oplist_get_del (list, &key_a, &val_a, &key_b, &val_b, &src)) {
-			size += sizeof (struct mod_header);
-			size += strlen (key_a) + strlen (key_a) + strlen (src);
-			size += _get_val_len (val_a) + _get_val_len (val_b);
-		} else if (_oplist_get_writing (list)) {
-			/* A write is only the size of a log header */
-			*writing = 1;
+			g_string_append_c (buf, LOG_OP_DEL);
+		} else if (_oplist_get_del_source (list, &key_a, &val_a, &src, &deleted)) {
+			g_string_append_c (buf, (src == NULL)?LOG_OP_DEL_ENTRY:LOG_OP_DEL_SOURCE);
+			_put_str (rec, buf, key_a);
+			_put_val (buf, val_a);
+			if (src != NULL)
+				_put_str (rec, buf, src);
+			ops++;
+			continue;
+		} else {
+			continue;
 		}
 
-		largest = MAX (size, largest);
-		ret += size;
+		_put_str (rec, buf, key_a);
+		_put_val (buf, val_a);
+		_put_str (rec, buf, key_b);
+		_put_val (buf, val_b);
+		_put_str (rec, buf, src);
+		ops++;
 	}
 
-	if (ret == 0) {
-		return 0;
+	if (ops == 0 && !writing) {
+		g_string_free (buf, TRUE);
+		return NULL;
 	}
 
-	/* Add the size of begin, end and a warp-around header.
-	 * We also add the size of the largest entry as this is the
-	 * most extra space that could be needed on a wrap-around.
-	 */
-	ret += 3 * sizeof (struct log_header) + largest;
-	return ret;
+	g_string_set_size (buf, buf->len + sizeof (struct log_header));
+
+	return buf;
 }
 
 /**
@@ -223,79 +427,106 @@ static void _log_unlock (s4_t *s4)
 
 
 /**
- * Writes a log header to the log.
+ * Finds the log number the next entry will be written at,
+ * wrapping around if there is not room for it at the end of the log.
  *
  * @param s4 The database handle.
- * @param hdr The header to write.
- * @param size The size of the data following the header.
+ * @param size The size of the entry.
+ * @param wrap Set to 1 if the entry will be written at the
+ * start of the log, 0 otherwise.
+ * @return The log number of the entry.
  */
-static void _log_write_header (s4_t *s4, struct log_header hdr, int size)
+static log_number_t _log_next_number (s4_t *s4, int size, int *wrap)
 {
 	log_number_t pos, round;
 
-	if (s4->log_data->logfile == NULL)
-		return;
-
 	pos = s4->log_data->next_logpoint % LOG_SIZE;
 	round = s4->log_data->next_logpoint / LOG_SIZE;
 
-	/* Wrap around if we're at the end */
-	if ((pos + size) > (LOG_SIZE - sizeof (struct log_header) * 2)) {
-		struct log_header hdr;
-
-		hdr.num = pos + round * LOG_SIZE;
-		hdr.type = LOG_ENTRY_WRAP;
-		fwrite (&hdr, sizeof (struct log_header), 1, s4->log_data->logfile);
+	*wrap = (pos + size) > (LOG_SIZE - sizeof (struct log_header) * 2);
+	if (*wrap) {
 		pos = 0;
 		round++;
-		rewind (s4->log_data->logfile);
 	}
 
-	hdr.num = pos + round * LOG_SIZE;
-	fwrite (&hdr, sizeof (struct log_header), 1, s4->log_data->logfile);
+	return pos + round * LOG_SIZE;
+}
+
+/**
+ * Writes a wrap-around header and rewinds the log.
+ * @param s4 The database handle.
+ */
+static void _log_wrap (s4_t *s4)
+{
+	struct log_header hdr;
 
-	s4->log_data->last_logpoint = s4->log_data->next_logpoint;
-	s4->log_data->next_logpoint = ftell (s4->log_data->logfile) + round * LOG_SIZE + size;
+	hdr.num = s4->log_data->next_logpoint;
+	hdr.type = LOG_ENTRY_WRAP;
+	fwrite (&hdr, sizeof (struct log_header), 1, s4->log_data->logfile);
+	rewind (s4->log_data->logfile);
 }
 
 /**
- * Writes a log entry for a modification operation (add or del).
- * @param s4 The database we are writing the log entry to.
- * @param type The log entry type.
- * @param key_a The key_a string.
- * @param val_a The val_a value.
- * @param key_b The key_b string.
- * @param val_b The val_b value.
- * @param src The source string.
+ * Writes a log header to the log.
+ *
+ * @param s4 The database handle.
+ * @param hdr The header to write.
+ * @param size The size of the data following the header.
  */
-static void _log_mod (s4_t *s4, log_type_t type, const char *key_a, const s4_val_t *val_a,
-		const char *key_b, const s4_val_t *val_b, const char *src)
+static void _log_write_header (s4_t *s4, struct log_header hdr, int size)
 {
-	struct log_header lhdr;
-	struct mod_header mhdr;
-	int size;
+	int wrap;
 
 	if (s4->log_data->logfile == NULL)
 		return;
 
-	lhdr.type = type;
-	mhdr.ka_len = strlen (key_a);
-	mhdr.kb_len = strlen (key_b);
-	mhdr.s_len = strlen (src);
-	mhdr.va_len = _get_val_len (val_a);
-	mhdr.vb_len = _get_val_len (val_b);
+	hdr.num = _log_next_number (s4, size, &wrap);
+	if (wrap)
+		_log_wrap (s4);
+
+	fwrite (&hdr, sizeof (struct log_header), 1, s4->log_data->logfile);
+
+	s4->log_data->last_logpoint = hdr.num;
+	s4->log_data->next_logpoint = hdr.num + sizeof (struct log_header) + size;
+}
+
+/**
+ * Writes an encoded record to the log with a single write.
+ *
+ * @param s4 The database handle.
+ * @param buf The record, as returned by _encode_record.
+ * @return 0 if there is no room for the record in the log, non-zero otherwise.
+ */
+static int _log_write_record (s4_t *s4, GString *buf)
+{
+	struct log_header hdr;
+	log_number_t num;
+	uint32_t len = buf->len - sizeof (uint32_t) - sizeof (struct log_header) * 2;
+	int wrap;
+
+	num = _log_next_number (s4, buf->len, &wrap);
+
+	if ((num + buf->len) > (s4->log_data->last_checkpoint + LOG_SIZE))
+		return 0;
+
+	if (wrap)
+		_log_wrap (s4);
+
+	hdr.type = LOG_ENTRY_RECORD;
+	hdr.num = num;
+	memcpy (buf->str, &hdr, sizeof (struct log_header));
+	memcpy (buf->str + sizeof (struct log_header), &len, sizeof (uint32_t));
 
-	size = _get_size (&mhdr);
+	hdr.type = LOG_ENTRY_END;
+	hdr.num = num + buf->len - sizeof (struct log_header);
+	memcpy (buf->str + hdr.num - num, &hdr, sizeof (struct log_header));
 
-	_log_write_header (s4, lhdr, size);
+	fwrite (buf->str, 1, buf->len, s4->log_data->logfile);
 
-	fwrite (&mhdr, sizeof (struct mod_header), 1, s4->log_data->logfile);
+	s4->log_data->last_logpoint = hdr.num;
+	s4->log_data->next_logpoint = num + buf->len;
 
-	_write_str (key_a, mhdr.ka_len, s4->log_data->logfile);
-	_write_val (val_a, mhdr.va_len, s4->log_data->logfile);
-	_write_str (key_b, mhdr.kb_len, s4->log_data->logfile);
-	_write_val (val_b, mhdr.vb_len, s4->log_data->logfile);
-	_write_str (src, mhdr.s_len, s4->log_data->logfile);
+	return 1;
 }
 
 /**
@@ -312,9 +543,39 @@ static void _log_simple (s4_t *s4, log_type_t type)
 	_log_write_header (s4, hdr, 0);
 }
 
+/**
+ * Syncs the log file to disk.
+ * @param s4 The database to sync the log of.
+ */
+static void _log_fsync (s4_t *s4)
+{
+	gint64 start = g_get_monotonic_time ();
+
+	fsync (fileno (s4->log_data->logfile));
+
+	_stats_inc (s4, S4_STATS_LOG_SYNCS);
+	_stats_sample (s4, S4_STATS_LOG_SYNC, g_get_monotonic_time () - start);
+}
+
+/**
+ * Flushes file buffers and syncs the log to disk.
+ * @param s4 The database to flush the log of.
+ */
+static void _log_flush (s4_t *s4)
+{
+	s4->log_data->dirty = 0;
+	s4->log_data->flush_at = 0;
+
+	fflush (s4->log_data->logfile);
+	_log_fsync (s4);
+}
+
 /**
  * Writes a checkpoint entry to the log, marking that the
  * database has finished being written to disk.
+ * The log file is locked while writing, so the entry goes after
+ * what other processes have written, and it is flushed before
+ * they get to write after it.
  * @param s4 The database to write the log entry to.
  */
 void _log_checkpoint (s4_t *s4)
@@ -322,72 +583,172 @@ void _log_checkpoint (s4_t *s4)
 	struct log_header hdr;
 	hdr.type = LOG_ENTRY_CHECKPOINT;
 
+	_log_lock_file (s4, 1);
 	_log_lock (s4);
 	_log_simple (s4, LOG_ENTRY_BEGIN);
 	_log_write_header (s4, hdr, sizeof (int32_t));
 	fwrite (&s4->log_data->last_synced, sizeof (log_number_t), 1, s4->log_data->logfile);
 	s4->log_data->last_checkpoint = s4->log_data->last_synced;
 	_log_simple (s4, LOG_ENTRY_END);
+	_dict_clear (&s4->log_data->dict);
+	_log_flush (s4);
 	_log_unlock (s4);
+	_log_unlock_file (s4, 1);
 }
 
 /**
- * Flushes file buffers and syncs the log to disk.
- * @param s4 The database to flush the log of.
+ * Syncs records written with S4_DURABILITY_ASYNC to disk once they
+ * have waited LOG_FLUSH_DELAY, or right away when the log is closed.
+ * The log is unlocked while syncing so other transactions can commit.
+ *
+ * @param s4 The database to sync the log of.
  */
-static void _log_flush (s4_t *s4)
+static void *_log_flusher (s4_t *s4)
 {
-	fflush (s4->log_data->logfile);
-	fsync (fileno (s4->log_data->logfile));
+	s4_log_data_t *data = s4->log_data;
+
+	_log_lock (s4);
+	while (data->flusher_run || data->flush_at != 0) {
+		if (data->flush_at == 0) {
+			g_cond_wait (&data->flush_cond, &data->lock);
+			continue;
+		}
+		if (data->flusher_run && g_get_monotonic_time () < data->flush_at) {
+			g_cond_wait_until (&data->flush_cond, &data->lock, data->flush_at);
+			continue;
+		}
+
+		data->flush_at = 0;
+		if (data->dirty) {
+			data->dirty = 0;
+			fflush (data->logfile);
+
+			_log_unlock (s4);
+			_log_fsync (s4);
+			_log_lock (s4);
+		}
+	}
+	_log_unlock (s4);
+
+	return NULL;
+}
+
+/**
+ * Makes sure a record that was just written gets the durability it asks for.
+ * Must be called with the log locked.
+ *
+ * @param s4 The database the record was written to.
+ * @param durability The durability wanted.
+ */
+static void _log_commit_record (s4_t *s4, s4_durability_t durability)
+{
+	s4_log_data_t *data = s4->log_data;
+
+	if (durability == S4_DURABILITY_FULL) {
+		_log_flush (s4);
+		return;
+	}
+
+	/* Other processes read the log file, so the record
+	 * has to leave our buffers even if it is not synced
+	 */
+	fflush (data->logfile);
+	data->dirty = 1;
+
+	if (durability == S4_DURABILITY_ASYNC && data->flush_at == 0) {
+		data->flush_at = g_get_monotonic_time () + LOG_FLUSH_DELAY;
+
+		if (data->flusher == NULL) {
+			data->flusher_run = 1;
+			data->flusher = g_thread_new ("s4 log flusher", (GThreadFunc)_log_flusher, s4);
+		} else {
+			g_cond_signal (&data->flush_cond);
+		}
+	}
+}
+
+/**
+ * Syncs every record written to the log to disk.
+ * @param s4 The database to sync the log of.
+ */
+void _log_flush_pending (s4_t *s4)
+{
+	if (s4->log_data->logfile == NULL)
+		return;
+
+	_log_lock (s4);
+	if (s4->log_data->dirty)
+		_log_flush (s4);
+	_log_unlock (s4);
 }
 
 /**
  * Writes all the operations in an oplist to disk.
+ * The whole transaction is encoded as one record
+ * and written with a single write.
  *
  * @param list The oplist to write.
+ * @param durability The durability wanted. It is set to the
+ * durability reached.
  * @return 0 on error, non-zero on success.
  */
-int _log_write (oplist_t *list)
+int _log_write (oplist_t *list, s4_durability_t *durability)
 {
 	s4_t *s4 = _oplist_get_db (list);
-	int writing = 0;
-	int size = _estimate_size (list, &writing);
+	log_record_t rec;
+	GString *buf;
+	int writing = 0, ops = 0;
 
-	if (s4->log_data->logfile == NULL || size == 0)
+	if (s4->log_data->logfile == NULL) {
+		*durability = S4_DURABILITY_NONE;
+		return 1;
+	}
+
+	_oplist_first (list);
+	while (_oplist_next (list)) {
+		ops++;
+		if (_oplist_get_writing (list))
+			writing = 1;
+	}
+
+	/* Nothing to log, so there is no need to wait for the log. This keeps
+	 * read-only transactions going while the log file is being waited for.
+	 */
+	if (ops == 0)
 		return 1;
 
+	/* The checkpoint depends on the log being synced */
+	if (writing)
+		*durability = S4_DURABILITY_FULL;
+
 	_log_lock (s4);
+	_record_init (&rec, &s4->log_data->dict, writing);
+
+	buf = _encode_record (list, &rec, writing);
+	if (buf == NULL) {
+		_record_clear (&rec);
+		_log_unlock (s4);
+		return 1;
+	}
+
 	if (writing) {
 		s4->log_data->last_synced = s4->log_data->last_logpoint;
 	}
 
-	if ((s4->log_data->next_logpoint + size) > (s4->log_data->last_checkpoint + LOG_SIZE)) {
+	if (!_log_write_record (s4, buf)) {
+		_record_clear (&rec);
+		g_string_free (buf, TRUE);
 		_log_unlock (s4);
 		return writing;
 	}
 
-	_log_simple (s4, LOG_ENTRY_BEGIN);
-
-	_oplist_first (list);
-	while (_oplist_next (list)) {
-		const char *key_a, *key_b, *src;
-		const s4_val_t *val_a, *val_b;
-
-		if (_oplist_get_add (list, &key_a, &val_a, &key_b, &val_b, &src)) {
-			_log_mod (s4, LOG_ENTRY_ADD, key_a, val_a, key_b, val_b, src);
-		} else if (_oplist_get_del (list, &key_a, &val_a, &key_b, &val_b, &src)) {
-			_log_mod (s4, LOG_ENTRY_DEL, key_a, val_a, key_b, val_b, src);
-		} else if (_oplist_get_writing (list)) {
-			_log_simple (s4, LOG_ENTRY_WRITING);
-		}
-	}
-
-	_log_simple (s4, LOG_ENTRY_END);
+	_record_commit (&rec);
+	g_string_free (buf, TRUE);
 
 	if (s4->log_data->last_synced > (s4->log_data->last_checkpoint + LOG_SIZE / 2))
 		_start_sync (s4);
 
-	_log_flush (s4);
+	_log_commit_record (s4, *durability);
 	_log_unlock (s4);
 	return 1;
 }
@@ -483,6 +844,189 @@ static int _read_mod (s4_t *s4, oplist_t *list, log_type_t type)
 	return 1;
 }
 
+/**
+ * Reads a variable length integer from a buffer.
+ *
+ * @param p A pointer to the position in the buffer, moved past the integer.
+ * @param end The end of the buffer.
+ * @param x Set to the integer read.
+ * @return 0 on error, non-zero on success.
+ */
+static int _get_varint (const unsigned char **p, const unsigned char *end, uint64_t *x)
+{
+	int shift;
+
+	*x = 0;
+	for (shift = 0; *p < end && shift < 64; shift += 7) {
+		unsigned char c = *(*p)++;
+
+		*x |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Reads len bytes from a buffer and finds the constant string equal to them.
+ *
+ * @param s4 The database.
+ * @param p A pointer to the position in the buffer, moved past the string.
+ * @param end The end of the buffer.
+ * @param len The length of the string.
+ * @return A pointer to a constant string, or NULL on error.
+ */
+static const char *_get_bytes (s4_t *s4, const unsigned char **p,
+		const unsigned char *end, uint64_t len)
+{
+	const char *ret;
+	char *str;
+
+	if (len > end - *p)
+		return NULL;
+
+	str = malloc (len + 1);
+	memcpy (str, *p, len);
+	str[len] = '\0';
+	*p += len;
+
+	ret = _string_lookup (s4, str);
+	free (str);
+
+	return ret;
+}
+
+/**
+ * Reads a string reference from a buffer.
+ *
+ * @param s4 The database.
+ * @param rec The record being read.
+ * @param p A pointer to the position in the buffer, moved past the string.
+ * @param end The end of the buffer.
+ * @return A pointer to a constant string, or NULL on error.
+ */
+static const char *_get_str (s4_t *s4, log_record_t *rec,
+		const unsigned char **p, const unsigned char *end)
+{
+	const char *ret;
+	uint64_t x;
+	int new;
+
+	if (!_get_varint (p, end, &x))
+		return NULL;
+
+	if (!(x & 1))
+		return _record_get_str (rec, x >> 1);
+
+	ret = _get_bytes (s4, p, end, x >> 1);
+	if (ret != NULL)
+		_record_get_id (rec, ret, &new);
+
+	return ret;
+}
+
+/**
+ * Reads a value from a buffer.
+ *
+ * @param s4 The database.
+ * @param p A pointer to the position in the buffer, moved past the value.
+ * @param end The end of the buffer.
+ * @return A pointer to a constant value, or NULL on error.
+ */
+static const s4_val_t *_get_val (s4_t *s4, const unsigned char **p, const unsigned char *end)
+{
+	const char *str;
+	uint32_t zz;
+	uint64_t x;
+
+	if (!_get_varint (p, end, &x))
+		return NULL;
+
+	if (x & 1) {
+		str = _get_bytes (s4, p, end, x >> 1);
+		return str == NULL ? NULL : _string_lookup_val (s4, str);
+	}
+
+	zz = x >> 1;
+	return _int_lookup_val (s4, (int32_t)((zz >> 1) ^ -(zz & 1)));
+}
+
+/**
+ * Reads a record and inserts its operations in an oplist.
+ *
+ * @param s4 The database.
+ * @param list The oplist to insert the operations in.
+ * @param rec The record to add new strings to. It is initialized here.
+ * @param writing Set to 1 if the record was written by a writing transaction.
+ * @return 0 on error, non-zero on success.
+ */
+static int _read_record (s4_t *s4, oplist_t *list, log_record_t *rec, int *writing)
+{
+	const unsigned char *p, *end;
+	unsigned char *buf;
+	uint32_t len;
+	int ret = 0;
+
+	if (fread (&len, sizeof (uint32_t), 1, s4->log_data->logfile) != 1
+			|| len == 0 || len > LOG_SIZE)
+		return 0;
+
+	buf = malloc (len);
+	if (fread (buf, 1, len, s4->log_data->logfile) != len)
+		goto cleanup;
+
+	p = buf;
+	end = buf + len;
+	*writing = (*p & LOG_RECORD_WRITING) != 0;
+	_record_init (rec, &s4->log_data->dict, *writing);
+	p++;
+
+	while (p < end) {
+		const char *key_a, *key_b, *src;
+		const s4_val_t *val_a, *val_b;
+		log_op_t type = *p++;
+
+		key_a = _get_str (s4, rec, &p, end);
+		val_a = _get_val (s4, &p, end);
+
+		if (type == LOG_OP_DEL_SOURCE || type == LOG_OP_DEL_ENTRY) {
+			src = NULL;
+			if (type == LOG_OP_DEL_SOURCE && (src = _get_str (s4, rec, &p, end)) == NULL)
+				goto cleanup;
+			if (key_a == NULL || val_a == NULL)
+				goto cleanup;
+
+			_oplist_insert_del_source (list, key_a, val_a, src);
+			continue;
+		}
+
+		key_b = _get_str (s4, rec, &p, end);
+		val_b = _get_val (s4, &p, end);
+		src = _get_str (s4, rec, &p, end);
+
+		if (key_a == NULL || key_b == NULL
+				|| val_a == NULL || val_b == NULL
+				|| src == NULL) {
+			goto cleanup;
+		}
+
+		if (type == LOG_OP_ADD) {
+			_oplist_insert_add (list, key_a, val_a, key_b, val_b, src);
+		} else if (type == LOG_OP_DEL) {
+			_oplist_insert_del (list, key_a, val_a, key_b, val_b, src);
+		} else {
+			goto cleanup;
+		}
+	}
+
+	ret = 1;
+
+cleanup:
+	free (buf);
+	return ret;
+}
+
 /**
  * Redoes everything that happened since the last checkpoint
  *
@@ -495,7 +1039,8 @@ static int _log_redo (s4_t *s4)
 	log_number_t pos, round, new_checkpoint = -1, new_synced = -1;
 	log_number_t last_valid_logpoint;
 	oplist_t *oplist = NULL;
-	int invalid_entry = 0;
+	log_record_t rec = {NULL};
+	int invalid_entry = 0, writing;
 
 	fflush (s4->log_data->logfile);
 
@@ -550,6 +1095,25 @@ static int _log_redo (s4_t *s4)
 			new_synced = s4->log_data->last_logpoint;
 			break;
 
+		case LOG_ENTRY_RECORD:
+			if (oplist != NULL) {
+				_transaction_dummy_free (_oplist_get_trans (oplist));
+				_oplist_free (oplist);
+			}
+			_record_clear (&rec);
+
+			oplist = _oplist_new (_transaction_dummy_alloc (s4));
+			new_checkpoint = -1;
+			new_synced = -1;
+
+			if (!_read_record (s4, oplist, &rec, &writing)) {
+				invalid_entry = 1;
+			} else if (writing) {
+				/* Same as the writer, the entry before the record */
+				new_synced = last_valid_logpoint;
+			}
+			break;
+
 		case LOG_ENTRY_BEGIN:
 			oplist = _oplist_new (_transaction_dummy_alloc (s4));
 			new_checkpoint = -1;
@@ -562,12 +1126,16 @@ static int _log_redo (s4_t *s4)
 			}
 
 			_oplist_execute (oplist, 0);
+			_cache_invalidate (s4, oplist);
 			_transaction_dummy_free (_oplist_get_trans (oplist));
 			_oplist_free (oplist);
 			oplist = NULL;
 
+			_record_commit (&rec);
+
 			if (new_checkpoint != -1) {
 				s4->log_data->last_synced = s4->log_data->last_checkpoint = new_checkpoint;
+				_dict_clear (&s4->log_data->dict);
 			} else if (new_synced != -1) {
 				s4->log_data->last_synced = new_synced;
 			}
@@ -592,6 +1160,7 @@ static int _log_redo (s4_t *s4)
 		_transaction_dummy_free (_oplist_get_trans (oplist));
 		_oplist_free (oplist);
 	}
+	_record_clear (&rec);
 
 	s4->log_data->last_logpoint = last_valid_logpoint;
 	s4->log_data->next_logpoint = last_valid_logpoint + sizeof (struct log_header);
@@ -616,22 +1185,35 @@ static void _log_truncate (s4_t *s4)
 
 /**
  * Locks a byte in the logfile.
+ * The lock keeps other processes using the same database out,
+ * threads in this process are kept out by the log lock.
+ * A shared lock held by this process is turned into an exclusive
+ * one and the other way around.
  * @param s4 The databae to lock the log of.
  * @param offset The offset of the byte to lock.
+ * @param exclusive Non-zero to keep out every other process, 0 to
+ * only keep out the ones that want it exclusively. Windows can not
+ * change a lock it holds, so there it is always exclusive.
+ * @return 0 if waiting for the lock would deadlock with another
+ * process, non-zero otherwise.
  */
-static void _log_lockf (s4_t *s4, int offset)
+static int _log_lockf (s4_t *s4, int offset, int exclusive)
 {
 #ifdef _WIN32
 	while (!LockFile (fileno (s4->log_data->logfile), offset, 0, 1, 0));
 #else
 	struct flock lock;
-	lock.l_type = F_UNLCK;
+	lock.l_type = exclusive?F_WRLCK:F_RDLCK;
 	lock.l_whence = SEEK_SET;
 	lock.l_start = offset;
 	lock.l_len = 1;
 
-	while (fcntl (fileno (s4->log_data->logfile), F_SETLKW, &lock) == -1);
+	while (fcntl (fileno (s4->log_data->logfile), F_SETLKW, &lock) == -1) {
+		if (errno == EDEADLK)
+			return 0;
+	}
 #endif
+	return 1;
 }
 
 /**
@@ -687,50 +1269,119 @@ int _log_open (s4_t *s4)
  */
 int _log_close (s4_t *s4)
 {
+	s4_log_data_t *data = s4->log_data;
+
+	/* The flusher syncs what is left before it stops */
+	if (data->flusher != NULL) {
+		_log_lock (s4);
+		data->flusher_run = 0;
+		g_cond_signal (&data->flush_cond);
+		_log_unlock (s4);
+
+		g_thread_join (data->flusher);
+		data->flusher = NULL;
+	}
+
+	if (data->follower != NULL) {
+		_log_lock (s4);
+		data->follower_run = 0;
+		g_cond_signal (&data->follow_cond);
+		_log_unlock (s4);
+
+		g_thread_join (data->follower);
+		data->follower = NULL;
+	}
+
 	if (fclose (s4->log_data->logfile) != 0) {
 		return 0;
 	}
 	return 1;
 }
 
+/**
+ * Takes the log file for this process if it does not hold it already.
+ * Must be called with the log locked.
+ * @param s4 The database to lock the log of.
+ * @param write Non-zero if the caller will write to the log.
+ * @param redo Non-zero to redo everything new in the log
+ * when the process did not hold the log file.
+ */
+static void _log_take_file (s4_t *s4, int write, int redo)
+{
+	s4_log_data_t *data = s4->log_data;
+
+#ifdef _WIN32
+	write = 0;
+#endif
+	while (write?(data->log_writers == 0):(data->log_users == 0)) {
+		if (_log_lockf (s4, 0, write)) {
+			if (redo && data->log_users == 0)
+				_log_redo (s4);
+			break;
+		}
+
+		/* Another process holding the log shared waits for us to let go
+		 * of our shared lock. Back off, so the transactions in this
+		 * process reading the log can finish and let go of it.
+		 */
+		_log_unlock (s4);
+		g_usleep (LOG_DEADLOCK_WAIT);
+		_log_lock (s4);
+	}
+
+	data->log_users++;
+	if (write)
+		data->log_writers++;
+}
+
 /**
  * Locks the log file.
  * It will redo everything new in the log.
+ * While a process only reads, other processes that only read can
+ * hold the log file at the same time.
  * @param s4 The database to lock the log of.
+ * @param write Non-zero if the caller will write to the log.
  */
-void _log_lock_file (s4_t *s4)
+void _log_lock_file (s4_t *s4, int write)
 {
 	if (s4->log_data->logfile == NULL)
 		return;
 
 	_log_lock (s4);
-	if (s4->log_data->log_users == 0) {
-		_log_lockf (s4, 0);
-		_log_redo (s4);
-	}
-
-	s4->log_data->log_users++;
+	_log_take_file (s4, write, 1);
 	_log_unlock (s4);
 }
 
 /**
  * Unlocks the log file.
  * @param s4 The database to unlock the log of.
+ * @param write The value given to _log_lock_file.
  */
-void _log_unlock_file (s4_t *s4)
+void _log_unlock_file (s4_t *s4, int write)
 {
-	if (s4->log_data->logfile == NULL)
+	s4_log_data_t *data = s4->log_data;
+
+	if (data->logfile == NULL)
 		return;
 
 	_log_lock (s4);
-	s4->log_data->log_users--;
+#ifdef _WIN32
+	write = 0;
+#endif
+	data->log_users--;
+	if (write)
+		data->log_writers--;
 
-	if (s4->log_data->log_users < 0) {
+	if (data->log_users < 0 || data->log_writers < 0) {
 		S4_ERROR ("_log_unlock_file called more time than _log_lock_file!");
-		s4->log_data->log_users = 0;
+		data->log_users = MAX (data->log_users, 0);
+		data->log_writers = MAX (data->log_writers, 0);
 	}
-	if (s4->log_data->log_users == 0) {
+	if (data->log_users == 0) {
 		_log_unlockf (s4, 0);
+	} else if (write && data->log_writers == 0) {
+		/* Only readers left, let other readers in */
+		_log_lockf (s4, 0, 0);
 	}
 	_log_unlock (s4);
 }
@@ -743,7 +1394,8 @@ void _log_unlock_file (s4_t *s4)
  */
 void _log_lock_db (s4_t *s4)
 {
-	_log_lockf (s4, 1);
+	while (!_log_lockf (s4, 1, 1))
+		g_usleep (LOG_DEADLOCK_WAIT);
 }
 
 /**
@@ -756,6 +1408,103 @@ void _log_unlock_db (s4_t *s4)
 	_log_unlockf (s4, 1);
 }
 
+/**
+ * Checks if anything has been written to the log since we last redid it.
+ * It only peeks at the log, so it does not need the log file locked.
+ * Must be called with the log locked.
+ *
+ * @param s4 The database to check the log of.
+ * @return non-zero if there is something new, 0 otherwise.
+ */
+static int _log_changed (s4_t *s4)
+{
+	s4_log_data_t *data = s4->log_data;
+	struct log_header hdr;
+
+	/* Drop what stdio has buffered, it may be stale */
+	fflush (data->logfile);
+
+	/* The next entry, or a wrap-around header, is written here */
+	if (fseek (data->logfile, data->next_logpoint % LOG_SIZE, SEEK_SET) != 0
+			|| fread (&hdr, sizeof (struct log_header), 1, data->logfile) != 1
+			|| hdr.num == data->next_logpoint) {
+		return 1;
+	}
+
+	/* The log may have wrapped all the way past our last entry */
+	if (fseek (data->logfile, data->last_logpoint % LOG_SIZE, SEEK_SET) != 0
+			|| fread (&hdr, sizeof (struct log_header), 1, data->logfile) != 1) {
+		return 1;
+	}
+
+	return hdr.num != data->last_logpoint;
+}
+
+/**
+ * Redoes what other processes have written to the log since the last
+ * time. The gate is closed while the log is redone, so a transaction
+ * on a follower sees each commit either in full or not at all.
+ * Waiting for a writer in another process to let go of the log file
+ * is done with the gate open, so transactions on the follower
+ * are only held back while the new records are applied.
+ *
+ * @param s4 The database to bring up to date.
+ */
+void _log_follow (s4_t *s4)
+{
+	_log_lock (s4);
+	_log_take_file (s4, 0, 0);
+	_log_unlock (s4);
+
+	_gate_close (s4);
+	_log_lock (s4);
+	_log_redo (s4);
+	_log_unlock (s4);
+	_gate_open (s4);
+
+	_log_unlock_file (s4, 0);
+}
+
+/**
+ * Looks for new entries in the log every LOG_FOLLOW_INTERVAL, and
+ * redoes them when there are some. The log file is only locked when
+ * there is something to redo, so an idle follower does not hold back
+ * the writers.
+ *
+ * @param s4 The database to follow the log of.
+ */
+static void *_log_follower (s4_t *s4)
+{
+	s4_log_data_t *data = s4->log_data;
+
+	_log_lock (s4);
+	while (data->follower_run) {
+		g_cond_wait_until (&data->follow_cond, &data->lock,
+				g_get_monotonic_time () + LOG_FOLLOW_INTERVAL);
+
+		if (data->follower_run && _log_changed (s4)) {
+			_log_unlock (s4);
+			_log_follow (s4);
+			_log_lock (s4);
+		}
+	}
+	_log_unlock (s4);
+
+	return NULL;
+}
+
+/**
+ * Starts the thread following the log.
+ * It is stopped by _log_close.
+ *
+ * @param s4 The database to follow the log of.
+ */
+void _log_follow_start (s4_t *s4)
+{
+	s4->log_data->follower_run = 1;
+	s4->log_data->follower = g_thread_new ("s4 log follower", (GThreadFunc)_log_follower, s4);
+}
+
 log_number_t _log_last_synced (s4_t *s4)
 {
 	return s4->log_data->last_synced;
@@ -766,6 +1515,7 @@ void _log_init (s4_t *s4, log_number_t last_checkpoint)
 	s4->log_data->last_synced = last_checkpoint;
 	s4->log_data->last_logpoint = last_checkpoint;
 	s4->log_data->last_checkpoint = last_checkpoint;
+	_dict_clear (&s4->log_data->dict);
 }
 
 /**
@@ -4,6 +4,7 @@
 typedef enum {
 	OP_ADD,
 	OP_DEL,
+	OP_DEL_SOURCE,
 	OP_WRITING
 } op_type_t;
 
@@ -12,18 +13,33 @@ typedef struct {
 
 	const char *key_a, *key_b, *src;
 	const s4_val_t *val_a, *val_b;
+
+	/* The key, value and source of every relation an OP_DEL_SOURCE deleted */
+	GPtrArray *deleted;
 } op_t;
 
+/* The operations are stored in the order they were inserted.
+ * cur is the index of the current operation, -1 before the first one.
+ * The first executed operations have been applied to the database,
+ * the rest are staged by a deferred transaction.
+ */
 struct oplist_St {
 	s4_transaction_t *trans;
-	GList *ops, *cur;
+	op_t *ops;
+	int size, alloc, cur;
+	int executed;
 };
 
+#define OPLIST_INITIAL_SIZE 16
+
 oplist_t *_oplist_new (s4_transaction_t *trans)
 {
 	oplist_t *ret = malloc (sizeof (oplist_t));
 	ret->ops = NULL;
-	ret->cur = NULL;
+	ret->size = 0;
+	ret->alloc = 0;
+	ret->cur = -1;
+	ret->executed = 0;
 	ret->trans = trans;
 
 	return ret;
@@ -41,25 +57,65 @@ s4_transaction_t *_oplist_get_trans (oplist_t *list)
 
 void _oplist_free (oplist_t *list)
 {
-	g_list_foreach (list->ops, (GFunc)free, NULL);
-	g_list_free (list->ops);
+	int i;
+
+	for (i = 0; i < list->size; i++) {
+		if (list->ops[i].type == OP_DEL_SOURCE)
+			g_ptr_array_free (list->ops[i].deleted, TRUE);
+	}
+
+	free (list->ops);
 	free (list);
 }
 
+/**
+ * Appends a new operation to an oplist.
+ * The pointer is only valid until the next operation is appended.
+ *
+ * @param list The oplist to append to
+ * @param type The type of the operation
+ * @return The new operation
+ */
+static op_t *_oplist_append (oplist_t *list, op_type_t type)
+{
+	op_t *op;
+
+	if (list->size >= list->alloc) {
+		list->alloc = (list->alloc == 0)?OPLIST_INITIAL_SIZE:list->alloc * 2;
+		list->ops = realloc (list->ops, sizeof (op_t) * list->alloc);
+	}
+
+	op = list->ops + list->size++;
+	op->type = type;
+
+	return op;
+}
+
+/**
+ * Gets the current operation of an oplist.
+ *
+ * @param list The oplist
+ * @return The current operation, or NULL if there is none
+ */
+static op_t *_oplist_current (oplist_t *list)
+{
+	if (list->cur < 0 || list->cur >= list->size)
+		return NULL;
+
+	return list->ops + list->cur;
+}
+
 void _oplist_insert_add (oplist_t *list,
 		const char *key_a, const s4_val_t *val_a,
 		const char *key_b, const s4_val_t *val_b,
 		const char *src)
 {
-	op_t *op = malloc (sizeof (op_t));
-	op->type = OP_ADD;
+	op_t *op = _oplist_append (list, OP_ADD);
 	op->key_a = key_a;
 	op->key_b = key_b;
 	op->src = src;
 	op->val_a = val_a;
 	op->val_b = val_b;
-
-	list->ops = g_list_prepend (list->ops, op);
 }
 
 void _oplist_insert_del (oplist_t *list,
@@ -67,48 +123,76 @@ void _oplist_insert_del (oplist_t *list,
 		const char *key_b, const s4_val_t *val_b,
 		const char *src)
 {
-	op_t *op = malloc (sizeof (op_t));
-	op->type = OP_DEL;
+	op_t *op = _oplist_append (list, OP_DEL);
 	op->key_a = key_a;
 	op->key_b = key_b;
 	op->src = src;
 	op->val_a = val_a;
 	op->val_b = val_b;
+}
+
+/**
+ * Inserts an operation deleting every relation from a source in an entry.
+ *
+ * @param list The oplist to insert into
+ * @param key_a The key of the entry
+ * @param val_a The value of the entry
+ * @param src The source, or NULL for every source
+ * @return An array the key, value and source of every relation
+ * deleted should be appended to, so the operation can be rolled back
+ */
+GPtrArray *_oplist_insert_del_source (oplist_t *list,
+		const char *key_a, const s4_val_t *val_a, const char *src)
+{
+	op_t *op = _oplist_append (list, OP_DEL_SOURCE);
+	op->key_a = key_a;
+	op->val_a = val_a;
+	op->src = src;
+	op->deleted = g_ptr_array_new ();
 
-	list->ops = g_list_prepend (list->ops, op);
+	return op->deleted;
 }
 
 void _oplist_insert_writing (oplist_t *list)
 {
-	op_t *op = malloc (sizeof (op_t));
-	op->type = OP_WRITING;
-
-	list->ops = g_list_prepend (list->ops, op);
+	_oplist_append (list, OP_WRITING);
 }
 
 int _oplist_next (oplist_t *list)
 {
-	if (list->ops == NULL) {
+	if (list->cur + 1 >= list->size)
 		return 0;
-	} else if (list->cur == NULL) {
-		list->cur = g_list_last (list->ops);
-	} else if (list->cur != list->ops) {
-		list->cur = g_list_previous (list->cur);
-	} else {
-		return 0;
-	}
+
+	list->cur++;
 
 	return 1;
 }
 
 void _oplist_first (oplist_t *list)
 {
-	list->cur = NULL;
+	list->cur = -1;
 }
 
+/**
+ * Moves to the last operation that has been executed,
+ * so the executed operations can be rolled back.
+ *
+ * @param list The oplist
+ */
 void _oplist_last (oplist_t *list)
 {
-	list->cur = list->ops;
+	list->cur = list->executed - 1;
+}
+
+/**
+ * Marks every operation in an oplist as executed.
+ * Used when the operations are executed as they are inserted.
+ *
+ * @param list The oplist
+ */
+void _oplist_set_executed (oplist_t *list)
+{
+	list->executed = list->size;
 }
 
 int _oplist_get_add (oplist_t *list,
@@ -116,13 +200,11 @@ int _oplist_get_add (oplist_t *list,
 		const char **key_b, const s4_val_t **val_b,
 		const char **src)
 {
-	op_t *op;
+	op_t *op = _oplist_current (list);
 
-	if (list->cur == NULL)
+	if (op == NULL)
 		return 0;
 
-	op = list->cur->data;
-
 	if (op->type != OP_ADD)
 		return 0;
 
@@ -140,13 +222,11 @@ int _oplist_get_del (oplist_t *list,
 		const char **key_b, const s4_val_t **val_b,
 		const char **src)
 {
-	op_t *op;
+	op_t *op = _oplist_current (list);
 
-	if (list->cur == NULL)
+	if (op == NULL)
 		return 0;
 
-	op = list->cur->data;
-
 	if (op->type != OP_DEL)
 		return 0;
 
@@ -159,14 +239,32 @@ int _oplist_get_del (oplist_t *list,
 	return 1;
 }
 
-int _oplist_get_writing (oplist_t *list)
+int _oplist_get_del_source (oplist_t *list,
+		const char **key_a, const s4_val_t **val_a,
+		const char **src, GPtrArray **deleted)
 {
-	op_t *op;
+	op_t *op = _oplist_current (list);
 
-	if (list->cur == NULL)
+	if (op == NULL)
 		return 0;
 
-	op = list->cur->data;
+	if (op->type != OP_DEL_SOURCE)
+		return 0;
+
+	*key_a = op->key_a;
+	*val_a = op->val_a;
+	*src = op->src;
+	*deleted = op->deleted;
+
+	return 1;
+}
+
+int _oplist_get_writing (oplist_t *list)
+{
+	op_t *op = _oplist_current (list);
+
+	if (op == NULL)
+		return 0;
 
 	if (op->type != OP_WRITING)
 		return 0;
@@ -176,41 +274,90 @@ int _oplist_get_writing (oplist_t *list)
 
 int _oplist_rollback (oplist_t *list)
 {
-	for (; list->cur != NULL; list->cur = g_list_next (list->cur)) {
+	for (; list->cur >= 0; list->cur--) {
 		const char *key_a, *key_b, *src;
 		const s4_val_t *val_a, *val_b;
+		GPtrArray *deleted;
 
 		if (_oplist_get_add (list, &key_a, &val_a, &key_b, &val_b, &src)) {
 			_s4_del (list->trans, key_a, val_a, key_b, val_b, src);
 		} else if (_oplist_get_del (list, &key_a, &val_a, &key_b, &val_b, &src)) {
 			_s4_add (list->trans, key_a, val_a, key_b, val_b, src);
+		} else if (_oplist_get_del_source (list, &key_a, &val_a, &src, &deleted)) {
+			int i;
+
+			for (i = 0; i < deleted->len; i += 3) {
+				_s4_add (list->trans, key_a, val_a, g_ptr_array_index (deleted, i),
+						g_ptr_array_index (deleted, i + 1), g_ptr_array_index (deleted, i + 2));
+			}
 		}
 	}
 
 	return 1;
 }
 
+/**
+ * Executes the current operation of an oplist.
+ *
+ * @param list The oplist
+ * @return 0 if the operation failed, non-zero otherwise
+ */
+static int _oplist_execute_current (oplist_t *list)
+{
+	const char *key_a, *key_b, *src;
+	const s4_val_t *val_a, *val_b;
+	GPtrArray *deleted;
+	int ret = 1;
+
+	if (_oplist_get_add (list, &key_a, &val_a, &key_b, &val_b, &src)) {
+		ret = _s4_add (list->trans, key_a, val_a, key_b, val_b, src);
+	} else if (_oplist_get_del (list, &key_a, &val_a, &key_b, &val_b, &src)) {
+		ret = _s4_del (list->trans, key_a, val_a, key_b, val_b, src);
+	} else if (_oplist_get_del_source (list, &key_a, &val_a, &src, &deleted)) {
+		g_ptr_array_set_size (deleted, 0);
+		ret = _s4_del_source (list->trans, key_a, val_a, src, deleted);
+	}
+
+	return ret;
+}
+
 int _oplist_execute (oplist_t *list, int rollback_on_failure)
 {
 	_oplist_first (list);
 
 	while (_oplist_next (list)) {
-		const char *key_a, *key_b, *src;
-		const s4_val_t *val_a, *val_b;
-		int ret = 1;
-
-		if (_oplist_get_add (list, &key_a, &val_a, &key_b, &val_b, &src)) {
-			ret = _s4_add (list->trans, key_a, val_a, key_b, val_b, src);
-		} else if (_oplist_get_del (list, &key_a, &val_a, &key_b, &val_b, &src)) {
-			ret = _s4_del (list->trans, key_a, val_a, key_b, val_b, src);
-		}
-
-		if (!ret && rollback_on_failure) {
+		if (!_oplist_execute_current (list) && rollback_on_failure) {
 			_oplist_rollback (list);
 			s4_set_errno (S4E_EXECUTE);
 			return 0;
 		}
 	}
 
+	list->executed = list->size;
+
+	return 1;
+}
+
+/**
+ * Executes the operations that have not been executed yet.
+ * If one fails the operations before it stay executed,
+ * so they can be rolled back with the rest of the transaction.
+ *
+ * @param list The oplist
+ * @return 0 if an operation failed, non-zero otherwise
+ */
+int _oplist_execute_pending (oplist_t *list)
+{
+	list->cur = list->executed - 1;
+
+	while (_oplist_next (list)) {
+		if (!_oplist_execute_current (list)) {
+			list->executed = list->cur;
+			return 0;
+		}
+	}
+
+	list->executed = list->size;
+
 	return 1;
 }
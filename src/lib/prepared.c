@@ -0,0 +1,126 @@
+/*  S4 - An XMMS2 medialib backend
+ *  Copyright (C) 2009, 2010 Sivert Berg
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include "s4_priv.h"
+#include <stdlib.h>
+
+struct s4_prepared_St {
+	s4_t *s4;
+	s4_fetchspec_t *fs;
+	s4_condition_t *cond;
+
+	/* The filters of cond, in the order they are bound */
+	GPtrArray *params;
+	query_path_t path;
+};
+
+/**
+ * @defgroup Prepared Prepared Queries
+ * @ingroup S4
+ * @brief Queries that are set up once and run many times
+ *
+ * @{
+ */
+
+/**
+ * Prepares a query for repeated execution.
+ * The keys of the condition and fetchspec are made constant and the
+ * access path is decided once, so running the query only has to find
+ * and fetch the entries.
+ *
+ * The condition and fetchspec are referenced by the prepared query.
+ * They must not be used with another database while the prepared query
+ * is alive, and s4_prepared_bind changes the condition in place.
+ *
+ * @param s4 The database the query will run on
+ * @param fs The fetchspec to use
+ * @param cond The condition to check entries against
+ * @return A new prepared query
+ */
+s4_prepared_t *s4_prepare (s4_t *s4, s4_fetchspec_t *fs, s4_condition_t *cond)
+{
+	s4_prepared_t *prep = malloc (sizeof (s4_prepared_t));
+
+	s4_cond_update_key (cond, s4);
+	s4_fetchspec_update_key (s4, fs);
+
+	prep->s4 = s4;
+	prep->fs = s4_fetchspec_ref (fs);
+	prep->cond = s4_cond_ref (cond);
+	prep->params = g_ptr_array_new ();
+	prep->path = _s4_query_path (s4, cond);
+
+	_cond_get_filters (cond, prep->params);
+
+	return prep;
+}
+
+/**
+ * Binds a new value to one of the filters in a prepared query.
+ * The filters are numbered depth first, starting at 0.
+ *
+ * @param prep The prepared query
+ * @param param The number of the filter to bind
+ * @param val The value the filter should check against
+ * @return 0 if param is out of bounds or the filter does not
+ * take a value (exists and custom filters), non-zero otherwise
+ */
+int s4_prepared_bind (s4_prepared_t *prep, int param, const s4_val_t *val)
+{
+	if (param < 0 || param >= prep->params->len)
+		return 0;
+
+	return _cond_set_value (g_ptr_array_index (prep->params, param), val);
+}
+
+/**
+ * Frees a prepared query.
+ *
+ * @param prep The prepared query to free
+ */
+void s4_prepared_free (s4_prepared_t *prep)
+{
+	g_ptr_array_free (prep->params, TRUE);
+	s4_cond_unref (prep->cond);
+	s4_fetchspec_unref (prep->fs);
+	free (prep);
+}
+
+/**
+ * @{
+ * @internal
+ */
+
+/**
+ * Runs a prepared query.
+ *
+ * @param trans The transaction to run the query in
+ * @param prep The prepared query
+ * @return A resultset with a row for every entry that matched
+ */
+s4_resultset_t *_prepared_run (s4_transaction_t *trans, s4_prepared_t *prep)
+{
+	s4_t *s4 = _transaction_get_db (trans);
+
+	if (s4->cache_data != NULL && (_transaction_get_flags (trans) & S4_TRANS_READONLY)) {
+		return _cache_query (trans, prep->fs, prep->cond, prep->path);
+	}
+
+	return _s4_query_prepared (trans, prep->fs, prep->cond, prep->path);
+}
+
+/**
+ * @}
+ * @}
+ */
@@ -0,0 +1,248 @@
+/*  S4 - An XMMS2 medialib backend
+ *  Copyright (C) 2009, 2010 Sivert Berg
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include "s4_priv.h"
+#include <stdlib.h>
+
+struct s4_query_stats_St {
+	int ref_count;
+
+	s4_access_path_t path;
+	int candidates;
+	int rows;
+	int locks;
+
+	gint64 start;
+	int64_t total_us;
+	int64_t lock_wait_us;
+	int64_t fetch_us;
+	int64_t sort_us;
+};
+
+/**
+ * @defgroup QueryStats Query Statistics
+ * @ingroup S4
+ * @brief Finds out how a query was executed and where the time went
+ *
+ * A statistics object is attached to a transaction with
+ * s4_transaction_set_stats. Every query run in the transaction then
+ * replaces the statistics with its own. The time spent sorting the
+ * resultset of the query is added when the resultset is sorted.
+ *
+ * @{
+ */
+
+/**
+ * Creates a new statistics object.
+ *
+ * @return A new statistics object with a reference count of 1
+ */
+s4_query_stats_t *s4_query_stats_create (void)
+{
+	s4_query_stats_t *stats = calloc (1, sizeof (s4_query_stats_t));
+	stats->ref_count = 1;
+
+	return stats;
+}
+
+/**
+ * Increases the reference count of a statistics object.
+ *
+ * @param stats The statistics object
+ * @return stats
+ */
+s4_query_stats_t *s4_query_stats_ref (s4_query_stats_t *stats)
+{
+	if (stats != NULL)
+		g_atomic_int_inc (&stats->ref_count);
+
+	return stats;
+}
+
+/**
+ * Decreases the reference count of a statistics object,
+ * freeing it if it reaches zero.
+ *
+ * @param stats The statistics object
+ */
+void s4_query_stats_unref (s4_query_stats_t *stats)
+{
+	if (stats != NULL && g_atomic_int_dec_and_test (&stats->ref_count))
+		free (stats);
+}
+
+/**
+ * Gets the access path the last query used to find its candidates.
+ *
+ * @param stats The statistics object
+ * @return The access path, S4_PATH_NONE if no query has been run
+ */
+s4_access_path_t s4_query_stats_get_path (const s4_query_stats_t *stats)
+{
+	return stats->path;
+}
+
+/**
+ * Gets the number of entries the last query checked the condition on.
+ *
+ * @param stats The statistics object
+ * @return The number of candidates
+ */
+int s4_query_stats_get_candidates (const s4_query_stats_t *stats)
+{
+	return stats->candidates;
+}
+
+/**
+ * Gets the number of entries that matched the condition
+ * in the last query.
+ *
+ * @param stats The statistics object
+ * @return The number of rows
+ */
+int s4_query_stats_get_rows (const s4_query_stats_t *stats)
+{
+	return stats->rows;
+}
+
+/**
+ * Gets the number of locks the last query acquired.
+ *
+ * @param stats The statistics object
+ * @return The number of lock acquisitions
+ */
+int s4_query_stats_get_locks (const s4_query_stats_t *stats)
+{
+	return stats->locks;
+}
+
+/**
+ * Gets the time the last query spent in total, in microseconds.
+ * This does not include the time spent sorting.
+ *
+ * @param stats The statistics object
+ * @return The time in microseconds
+ */
+int64_t s4_query_stats_get_total_us (const s4_query_stats_t *stats)
+{
+	return stats->total_us;
+}
+
+/**
+ * Gets the time the last query spent blocked waiting for
+ * other transactions to release locks, in microseconds.
+ *
+ * @param stats The statistics object
+ * @return The time in microseconds
+ */
+int64_t s4_query_stats_get_lock_wait_us (const s4_query_stats_t *stats)
+{
+	return stats->lock_wait_us;
+}
+
+/**
+ * Gets the time the last query spent fetching data from the
+ * matching entries, in microseconds.
+ *
+ * @param stats The statistics object
+ * @return The time in microseconds
+ */
+int64_t s4_query_stats_get_fetch_us (const s4_query_stats_t *stats)
+{
+	return stats->fetch_us;
+}
+
+/**
+ * Gets the time spent sorting the resultset of the last query,
+ * in microseconds.
+ *
+ * @param stats The statistics object
+ * @return The time in microseconds
+ */
+int64_t s4_query_stats_get_sort_us (const s4_query_stats_t *stats)
+{
+	return stats->sort_us;
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @{
+ * @internal
+ */
+
+/* All of the functions below accept NULL stats and do nothing,
+ * so the query code does not need to check if stats are wanted.
+ */
+
+void _query_stats_begin (s4_query_stats_t *stats)
+{
+	if (stats == NULL)
+		return;
+
+	stats->path = S4_PATH_NONE;
+	stats->candidates = stats->rows = stats->locks = 0;
+	stats->total_us = stats->lock_wait_us = stats->fetch_us = stats->sort_us = 0;
+	stats->start = g_get_monotonic_time ();
+}
+
+void _query_stats_end (s4_query_stats_t *stats)
+{
+	if (stats != NULL)
+		stats->total_us = g_get_monotonic_time () - stats->start;
+}
+
+void _query_stats_set_path (s4_query_stats_t *stats, s4_access_path_t path)
+{
+	if (stats != NULL)
+		stats->path = path;
+}
+
+void _query_stats_add_candidates (s4_query_stats_t *stats, int candidates)
+{
+	if (stats != NULL)
+		stats->candidates += candidates;
+}
+
+void _query_stats_add_rows (s4_query_stats_t *stats, int rows)
+{
+	if (stats != NULL)
+		stats->rows += rows;
+}
+
+void _query_stats_add_lock (s4_query_stats_t *stats, int64_t wait_us)
+{
+	if (stats != NULL) {
+		stats->locks++;
+		stats->lock_wait_us += wait_us;
+	}
+}
+
+void _query_stats_add_fetch (s4_query_stats_t *stats, int64_t us)
+{
+	if (stats != NULL)
+		stats->fetch_us += us;
+}
+
+void _query_stats_add_sort (s4_query_stats_t *stats, int64_t us)
+{
+	if (stats != NULL)
+		stats->sort_us += us;
+}
+
+/**
+ * @}
+ */
@@ -16,25 +16,50 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* The key, value and source are constant ids, see const.c */
 typedef struct {
-	const char *key;
-	const s4_val_t *val;
-	const char *src;
+	uint32_t key, val, src;
 } entry_data_t;
 
-typedef struct {
+/* The number of tuples stored inside the entry itself.
+ * With 2 an entry fills exactly one 64 byte cache line on 64-bit.
+ */
+#define ENTRY_INLINE_SIZE 2
+
+typedef struct s4_entry_St {
 	s4_lock_t *lock;
 	const char *key;
 	const s4_val_t *val;
 	int size, alloc;
 
+	/* Points to inline_data until the entry outgrows it */
 	entry_data_t *data;
+	entry_data_t inline_data[ENTRY_INLINE_SIZE];
 } entry_t;
 
+/* The data of an entry as it was when the running checkpoint started */
+typedef struct {
+	int size;
+	entry_data_t data[];
+} entry_snap_t;
+
 struct s4_entry_data_St {
 	entry_t *entry;
 	const char *prev_key;
 	const s4_val_t *prev_val;
+
+	/* The source index maps a constant source to a table of the
+	 * entries with relations from it, and how many each has.
+	 * source_lock is only held while the tables are read or changed,
+	 * the entries themselves are protected by their own locks.
+	 */
+	GMutex source_lock;
+	GHashTable *sources;
+
+	/* Checkpoint snapshot. snapshot_lock protects everything below */
+	GMutex snapshot_lock;
+	int snapshot_active;
+	GHashTable *copies;
 };
 
 #define LINEAR_SEARCH_SIZE 0
@@ -56,11 +81,21 @@ s4_entry_data_t *_entry_create_data ()
 {
 	s4_entry_data_t *ret = calloc (1, sizeof (s4_entry_data_t));
 
+	g_mutex_init (&ret->source_lock);
+	ret->sources = g_hash_table_new_full (NULL, NULL, NULL,
+			(GDestroyNotify)g_hash_table_destroy);
+	g_mutex_init (&ret->snapshot_lock);
+	ret->copies = g_hash_table_new_full (NULL, NULL, NULL, free);
+
 	return ret;
 }
 
 void _entry_free_data (s4_entry_data_t *data)
 {
+	g_mutex_clear (&data->source_lock);
+	g_hash_table_destroy (data->sources);
+	g_mutex_clear (&data->snapshot_lock);
+	g_hash_table_destroy (data->copies);
 	free (data);
 }
 
@@ -72,7 +107,7 @@ void _entry_free_data (s4_entry_data_t *data)
  * @return The index of the item before the first item with key=key,
  * or the index of the first item with key=key.
  */
-static int _entry_search (entry_t *entry, const char *key)
+static int _entry_search (entry_t *entry, uint32_t key)
 {
 	int lo = 0;
 	int hi = entry->size;
@@ -95,23 +130,28 @@ static int _entry_search (entry_t *entry, const char *key)
  * Inserts a key,value,source tuple into an entry
  *
  * @param entry The entry to insert into
- * @param key The key to insert
- * @param val The value to insert
- * @param src The source to insert
+ * @param key The id of the key to insert
+ * @param val The id of the value to insert
+ * @param src The id of the source to insert
  * @return 0 if the tuple already exists, non-zero otherwise
  */
-static int _entry_insert (entry_t *entry, const char *key, const s4_val_t *val, const char *src)
+static int _entry_insert (entry_t *entry, uint32_t key, uint32_t val, uint32_t src)
 {
 	int i = _entry_search (entry, key);
 
 	for (; i < entry->size && entry->data[i].key == key; i++) {
-		if (entry->data[i].src == src && !s4_val_cmp (entry->data[i].val, val, S4_CMP_BINARY))
+		if (entry->data[i].src == src && entry->data[i].val == val)
 			return 0;
 	}
 
 	if (entry->size >= entry->alloc) {
 		entry->alloc *= 2;
-		entry->data = realloc (entry->data, sizeof (entry_data_t) * entry->alloc);
+		if (entry->data == entry->inline_data) {
+			entry->data = malloc (sizeof (entry_data_t) * entry->alloc);
+			memcpy (entry->data, entry->inline_data, sizeof (entry->inline_data));
+		} else {
+			entry->data = realloc (entry->data, sizeof (entry_data_t) * entry->alloc);
+		}
 	}
 
 	memmove (entry->data + i + 1, entry->data + i, (entry->size - i) * sizeof (entry_data_t));
@@ -128,18 +168,18 @@ static int _entry_insert (entry_t *entry, const char *key, const s4_val_t *val,
  * Deletes a key,value,source tuple from an entry
  *
  * @param entry The entry to delete from
- * @param key The key to delete
- * @param val The value to delete
- * @param src The source to delete
+ * @param key The id of the key to delete
+ * @param val The id of the value to delete
+ * @param src The id of the source to delete
  * @return 0 if the tuple was not found, 1 otherwise
  */
-static int _entry_delete (entry_t *entry, const char *key, const s4_val_t *val, const char *src)
+static int _entry_delete (entry_t *entry, uint32_t key, uint32_t val, uint32_t src)
 {
 	int i = _entry_search (entry, key);
 	int found = 0;
 
 	for (; i < entry->size && entry->data[i].key == key; i++) {
-		if (entry->data[i].src == src && !s4_val_cmp (entry->data[i].val, val, S4_CMP_BINARY)) {
+		if (entry->data[i].src == src && entry->data[i].val == val) {
 			found = 1;
 			break;
 		}
@@ -169,13 +209,121 @@ static entry_t *_entry_create (const char *key, const s4_val_t *val)
 	entry->key = key;
 	entry->val = val;
 	entry->size = 0;
-	entry->alloc = 1;
-
-	entry->data = malloc (sizeof (entry_data_t) * entry->alloc);
+	entry->alloc = ENTRY_INLINE_SIZE;
+	entry->data = entry->inline_data;
 
 	return entry;
 }
 
+/**
+ * Copies the data of an entry before it is changed, if a checkpoint
+ * is running and the entry has not been copied yet. The checkpoint
+ * then writes the copy instead of the changed data.
+ *
+ * @param s4 The database the entry belongs to
+ * @param entry The entry about to be changed
+ */
+static void _entry_copy_on_write (s4_t *s4, entry_t *entry)
+{
+	s4_entry_data_t *data = s4->entry_data;
+
+	if (!g_atomic_int_get (&data->snapshot_active))
+		return;
+
+	g_mutex_lock (&data->snapshot_lock);
+	if (data->snapshot_active && !g_hash_table_contains (data->copies, entry)) {
+		entry_snap_t *snap = malloc (sizeof (entry_snap_t) + sizeof (entry_data_t) * entry->size);
+
+		snap->size = entry->size;
+		memcpy (snap->data, entry->data, sizeof (entry_data_t) * entry->size);
+		g_hash_table_insert (data->copies, entry, snap);
+	}
+	g_mutex_unlock (&data->snapshot_lock);
+}
+
+/**
+ * Changes the number of relations an entry has from a source
+ * in the source index.
+ *
+ * @param s4 The database the entry belongs to
+ * @param entry The entry
+ * @param src The constant source
+ * @param n The number of relations added, negative if they were deleted
+ */
+static void _entry_source_count (s4_t *s4, entry_t *entry, const char *src, int n)
+{
+	s4_entry_data_t *data = s4->entry_data;
+	GHashTable *entries;
+	int count;
+
+	g_mutex_lock (&data->source_lock);
+	entries = g_hash_table_lookup (data->sources, src);
+	if (entries == NULL) {
+		entries = g_hash_table_new (NULL, NULL);
+		g_hash_table_insert (data->sources, (void*)src, entries);
+	}
+
+	count = GPOINTER_TO_INT (g_hash_table_lookup (entries, entry)) + n;
+	if (count > 0) {
+		g_hash_table_insert (entries, entry, GINT_TO_POINTER (count));
+	} else {
+		g_hash_table_remove (entries, entry);
+		if (g_hash_table_size (entries) == 0)
+			g_hash_table_remove (data->sources, src);
+	}
+	g_mutex_unlock (&data->source_lock);
+}
+
+/**
+ * Gets the entries with relations from a source.
+ * The entries can change after the source lock is released,
+ * so they have to be locked and checked again.
+ *
+ * @param s4 The database
+ * @param src The constant source
+ * @return A list of entries, free it with g_list_free
+ */
+static GList *_entry_source_get (s4_t *s4, const char *src)
+{
+	s4_entry_data_t *data = s4->entry_data;
+	GHashTable *entries;
+	GList *ret = NULL;
+
+	g_mutex_lock (&data->source_lock);
+	entries = g_hash_table_lookup (data->sources, src);
+	if (entries != NULL)
+		ret = g_hash_table_get_keys (entries);
+	g_mutex_unlock (&data->source_lock);
+
+	return ret;
+}
+
+/**
+ * Finds the entry with a value in an a-index.
+ * Integer values are looked up in the integer map of the index.
+ *
+ * @param index The a-index to look in
+ * @param val The value of the entry
+ * @return The entry, or NULL if it does not exist
+ */
+static entry_t *_entry_find (s4_index_t *index, const s4_val_t *val)
+{
+	entry_t *ret = NULL;
+	GList *entries;
+	int32_t i;
+
+	if (s4_val_get_int (val, &i))
+		return _index_lookup_int (index, i);
+
+	entries = _index_search (index, NULL, (void*)val);
+	if (entries != NULL) {
+		ret = entries->data;
+		g_list_free (entries);
+	}
+
+	return ret;
+}
+
 static int _entry_lock_shared (entry_t *entry, s4_transaction_t *trans)
 {
 	return _lock_shared (entry->lock, trans);
@@ -186,6 +334,146 @@ static int _entry_lock_exclusive (entry_t *entry, s4_transaction_t *trans)
 	return _lock_exclusive (entry->lock, trans);
 }
 
+/**
+ * Inserts the rows of an entry into a composite index, or removes them.
+ * There is a row for every combination of the values the entry has
+ * for the keys of the index, using the values from the most
+ * preferred source, or NULL if it has no value for a key.
+ *
+ * @param s4 The database the entry lives in
+ * @param index The composite index, it must be locked exclusively
+ * @param entry The entry
+ * @param insert Non-zero to insert the rows, 0 to remove them
+ */
+static void _entry_composite_rows (s4_t *s4, s4_composite_t *index,
+		entry_t *entry, int insert)
+{
+	s4_sourcepref_t *sp = _composite_get_sourcepref (index);
+	int n = _composite_get_key_count (index);
+	int cover = _composite_get_cover_count (index);
+	GArray *values = g_array_new (FALSE, FALSE, sizeof (composite_value_t));
+	GPtrArray **vals = g_newa (GPtrArray*, n);
+	const s4_val_t **row = g_newa (const s4_val_t*, n);
+	int *pos = g_newa (int, n);
+	int i, k, start, src, best_src;
+
+	/* The values of the covered keys, the first n of them are indexed */
+	for (k = 0; k < cover; k++) {
+		const char *key = _composite_get_cover_key (index, k);
+		uint32_t key_id = _string_id (key);
+
+		start = _entry_search (entry, key_id);
+		best_src = INT_MAX;
+
+		for (i = start; i < entry->size && entry->data[i].key == key_id; i++) {
+			src = s4_sourcepref_get_priority (sp, _const_get_string (s4, entry->data[i].src));
+			if (src < best_src) {
+				best_src = src;
+			}
+		}
+
+		if (k < n)
+			vals[k] = g_ptr_array_new ();
+
+		for (i = start; best_src < INT_MAX && i < entry->size && entry->data[i].key == key_id; i++) {
+			const char *fsrc = _const_get_string (s4, entry->data[i].src);
+
+			if (s4_sourcepref_get_priority (sp, fsrc) == best_src) {
+				composite_value_t value = {key, _const_get (s4, entry->data[i].val), fsrc};
+
+				g_array_append_val (values, value);
+				if (k < n)
+					g_ptr_array_add (vals[k], (void*)value.val);
+			}
+		}
+
+		if (k < n && vals[k]->len == 0)
+			g_ptr_array_add (vals[k], NULL);
+	}
+
+	for (k = 0; k < n; k++) {
+		pos[k] = 0;
+	}
+
+	/* Count through the combinations like an odometer */
+	for (k = 0; k < n;) {
+		for (i = 0; i < n; i++) {
+			row[i] = g_ptr_array_index (vals[i], pos[i]);
+		}
+
+		if (insert)
+			_composite_insert (index, row, entry, (composite_value_t*)values->data, values->len);
+		else
+			_composite_delete (index, row, entry);
+
+		for (k = 0; k < n && ++pos[k] == vals[k]->len; k++) {
+			pos[k] = 0;
+		}
+	}
+
+	for (k = 0; k < n; k++) {
+		g_ptr_array_free (vals[k], TRUE);
+	}
+	g_array_free (values, TRUE);
+}
+
+/**
+ * Locks the composite indexes that index or cover a key exclusively,
+ * and then removes the rows of an entry about to change from them.
+ * Pass the list to _entry_composite_end when the entry has changed.
+ *
+ * @param trans The transaction changing the entry
+ * @param entry The entry, it must be locked exclusively
+ * @param key The constant key that will change
+ * @param indexes Set to the list of indexes to update
+ * @return 0 if the transaction deadlocked, non-zero otherwise
+ */
+static int _entry_composite_begin (s4_transaction_t *trans, entry_t *entry,
+		const char *key, GList **indexes)
+{
+	s4_t *s4 = _transaction_get_db (trans);
+	GList *l, *next;
+
+	*indexes = _composite_get_for_key (s4, key);
+
+	/* Lock them all before removing any rows, so a deadlock
+	 * leaves every index as it was
+	 */
+	for (l = *indexes; l != NULL; l = next) {
+		next = l->next;
+
+		if (!_composite_lock_exclusive (l->data, trans)) {
+			g_list_free (*indexes);
+			*indexes = NULL;
+			return 0;
+		}
+		if (_composite_is_dropped (l->data)) {
+			*indexes = g_list_delete_link (*indexes, l);
+		}
+	}
+
+	for (l = *indexes; l != NULL; l = l->next) {
+		_entry_composite_rows (s4, l->data, entry, 0);
+	}
+
+	return 1;
+}
+
+/**
+ * Inserts the rows of an entry that has changed into the indexes
+ * found by _entry_composite_begin, and frees the list.
+ *
+ * @param s4 The database the entry lives in
+ * @param entry The entry
+ * @param indexes The list of indexes
+ */
+static void _entry_composite_end (s4_t *s4, entry_t *entry, GList *indexes)
+{
+	for (; indexes != NULL; indexes = g_list_delete_link (indexes, indexes)) {
+		_entry_composite_rows (s4, indexes->data, entry, 1);
+	}
+}
+
 /**
  * @}
  */
@@ -205,34 +493,32 @@ int _s4_add (s4_transaction_t *trans, const char *key_a, const s4_val_t *val_a,
 		const char *key_b, const s4_val_t *val_b, const char *src)
 {
 	s4_index_t *index;
+	GList *composites;
 	entry_t *entry;
-	GList *entries;
 	int ret;
 	s4_t *s4 = _transaction_get_db (trans);
 
 	index = _index_get_a (s4, key_a, 1);
 	if (!_index_lock_shared (index, trans)) goto deadlocked;
-	entries = _index_search (index, NULL, (void*)val_a);
+	entry = _entry_find (index, val_a);
 
-	if (entries == NULL) {
+	if (entry == NULL) {
 		entry = _entry_create (key_a, val_a);
 		if (!_index_lock_exclusive (index, trans)) goto deadlocked;
 		_index_insert (index, val_a, entry);
-	} else {
-		entry = entries->data;
-		g_list_free (entries);
 	}
 
 	if (!_entry_lock_exclusive (entry, trans)) goto deadlocked;
-	ret = _entry_insert (entry, key_b, val_b, src);
+	if (!_entry_composite_begin (trans, entry, key_b, &composites)) goto deadlocked;
+	_entry_copy_on_write (s4, entry);
+	ret = _entry_insert (entry, _string_id (key_b), _val_get_id (val_b), _string_id (src));
+	_entry_composite_end (s4, entry, composites);
 
 	if (ret) {
-		index = _index_get_b (s4, key_b);
-
-		if (index != NULL) {
-			if (!_index_lock_exclusive (index, trans)) goto deadlocked;
+		_entry_source_count (s4, entry, src, 1);
+		if (!_index_get_b_exclusive (s4, key_b, trans, &index)) goto deadlocked;
+		if (index != NULL)
 			_index_insert (index, val_b, entry);
-		}
 	}
 
 	return ret;
@@ -259,26 +545,23 @@ int _s4_add_internal (s4_t *s4, const char *key_a, const s4_val_t *value_a,
 	 */
 	if (s4->entry_data->prev_key != key_a
 	    || s4->entry_data->prev_val != value_a) {
-		GList *entries;
-
 		index = _index_get_a (s4, key_a, 1);
-		entries = _index_search (index, NULL, (void*)value_a);
+		s4->entry_data->entry = _entry_find (index, value_a);
 
-		if (entries == NULL) {
+		if (s4->entry_data->entry == NULL) {
 			s4->entry_data->entry = _entry_create (key_a, value_a);
 			_index_insert (index, value_a, s4->entry_data->entry);
-		} else {
-			s4->entry_data->entry = entries->data;
-			g_list_free (entries);
 		}
 
 		s4->entry_data->prev_key = key_a;
 		s4->entry_data->prev_val = value_a;
 	}
 
-	ret = _entry_insert (s4->entry_data->entry, key_b, value_b, src);
+	ret = _entry_insert (s4->entry_data->entry, _string_id (key_b),
+			_val_get_id (value_b), _string_id (src));
 
 	if (ret) {
+		_entry_source_count (s4, s4->entry_data->entry, src, 1);
 		index = _index_get_b (s4, key_b);
 
 		if (index != NULL) {
@@ -304,8 +587,8 @@ int _s4_del (s4_transaction_t *trans, const char *key_a, const s4_val_t *val_a,
 		const char *key_b, const s4_val_t *val_b, const char *src)
 {
 	s4_index_t *index;
+	GList *composites;
 	entry_t *entry;
-	GList *entries;
 	int ret;
 	s4_t *s4 = _transaction_get_db (trans);
 
@@ -315,25 +598,23 @@ int _s4_del (s4_transaction_t *trans, const char *key_a, const s4_val_t *val_a,
 	}
 
 	if (!_index_lock_shared (index, trans)) goto deadlocked;
-	entries = _index_search (index, NULL, (void*)val_a);
+	entry = _entry_find (index, val_a);
 
-	if (entries == NULL) {
+	if (entry == NULL) {
 		return 0;
-	} else {
-		entry = entries->data;
-		g_list_free (entries);
 	}
 
 	if (!_entry_lock_exclusive (entry, trans)) goto deadlocked;
-	ret = _entry_delete (entry, key_b, val_b, src);
+	if (!_entry_composite_begin (trans, entry, key_b, &composites)) goto deadlocked;
+	_entry_copy_on_write (s4, entry);
+	ret = _entry_delete (entry, _string_id (key_b), _val_get_id (val_b), _string_id (src));
+	_entry_composite_end (s4, entry, composites);
 
 	if (ret) {
-		index = _index_get_b (s4, key_b);
-
-		if (index != NULL) {
-			if (!_index_lock_exclusive (index, trans)) goto deadlocked;
+		_entry_source_count (s4, entry, src, -1);
+		if (!_index_get_b_exclusive (s4, key_b, trans, &index)) goto deadlocked;
+		if (index != NULL)
 			_index_delete (index, val_b, entry);
-		}
 	}
 
 	return ret;
@@ -343,6 +624,217 @@ deadlocked:
 	return 0;
 }
 
+/**
+ * Adds or deletes relations of an entry, stopping at the first
+ * one that fails.
+ *
+ * @param trans The transaction to use
+ * @param entry The entry, it must be locked exclusively
+ * @param tuples The relations, they must all belong to entry
+ * @param count The number of relations
+ * @param add Non-zero to add the relations, 0 to delete them
+ * @return The number of relations changed before one failed
+ */
+static int _entry_change_many (s4_transaction_t *trans, entry_t *entry,
+		const s4_tuple_t *tuples, int count, int add)
+{
+	s4_t *s4 = _transaction_get_db (trans);
+	s4_index_t *index;
+	GList *composites;
+	int i, ret;
+
+	for (i = 0; i < count; i++) {
+		const s4_tuple_t *t = tuples + i;
+		uint32_t key_id = _string_id (t->key_b);
+		uint32_t val_id = _val_get_id (t->val_b);
+		uint32_t src_id = _string_id (t->src);
+
+		/* Take all the locks first, so a deadlock leaves
+		 * the entry and its indexes as they were
+		 */
+		if (!_index_get_b_exclusive (s4, t->key_b, trans, &index)) goto deadlocked;
+		if (!_entry_composite_begin (trans, entry, t->key_b, &composites)) goto deadlocked;
+		_entry_copy_on_write (s4, entry);
+		if (add)
+			ret = _entry_insert (entry, key_id, val_id, src_id);
+		else
+			ret = _entry_delete (entry, key_id, val_id, src_id);
+		_entry_composite_end (s4, entry, composites);
+
+		if (!ret)
+			break;
+
+		_entry_source_count (s4, entry, t->src, add ? 1 : -1);
+		if (index != NULL && add)
+			_index_insert (index, t->val_b, entry);
+		else if (index != NULL)
+			_index_delete (index, t->val_b, entry);
+	}
+
+	return i;
+
+deadlocked:
+	_transaction_set_deadlocked (trans);
+	return i;
+}
+
+/**
+ * Adds relations to one entry, locking it only once.
+ * All the relations must have the same key_a and val_a.
+ *
+ * @param trans The transaction to use
+ * @param tuples The relations to add
+ * @param count The number of relations
+ * @return The number of relations added before one failed
+ */
+int _s4_add_many (s4_transaction_t *trans, const s4_tuple_t *tuples, int count)
+{
+	s4_index_t *index;
+	entry_t *entry;
+	s4_t *s4 = _transaction_get_db (trans);
+
+	index = _index_get_a (s4, tuples->key_a, 1);
+	if (!_index_lock_shared (index, trans)) goto deadlocked;
+	entry = _entry_find (index, tuples->val_a);
+
+	if (entry == NULL) {
+		entry = _entry_create (tuples->key_a, tuples->val_a);
+		if (!_index_lock_exclusive (index, trans)) goto deadlocked;
+		_index_insert (index, tuples->val_a, entry);
+	}
+
+	if (!_entry_lock_exclusive (entry, trans)) goto deadlocked;
+
+	return _entry_change_many (trans, entry, tuples, count, 1);
+
+deadlocked:
+	_transaction_set_deadlocked (trans);
+	return 0;
+}
+
+/**
+ * Deletes relations from one entry, locking it only once.
+ * All the relations must have the same key_a and val_a.
+ *
+ * @param trans The transaction to use
+ * @param tuples The relations to delete
+ * @param count The number of relations
+ * @return The number of relations deleted before one failed
+ */
+int _s4_del_many (s4_transaction_t *trans, const s4_tuple_t *tuples, int count)
+{
+	s4_index_t *index;
+	entry_t *entry;
+	s4_t *s4 = _transaction_get_db (trans);
+
+	index = _index_get_a (s4, tuples->key_a, 0);
+	if (index == NULL) {
+		return 0;
+	}
+
+	if (!_index_lock_shared (index, trans)) goto deadlocked;
+	entry = _entry_find (index, tuples->val_a);
+
+	if (entry == NULL) {
+		return 0;
+	}
+
+	if (!_entry_lock_exclusive (entry, trans)) goto deadlocked;
+
+	return _entry_change_many (trans, entry, tuples, count, 0);
+
+deadlocked:
+	_transaction_set_deadlocked (trans);
+	return 0;
+}
+
+/**
+ * Deletes every relation from a source in an entry
+ *
+ * @param trans The transaction to use
+ * @param key_a The key of the entry
+ * @param val_a The value of the entry
+ * @param src The source to delete the relations of, or NULL to
+ * delete every relation of the entry
+ * @param deleted The key, value and source of every relation deleted
+ * are appended to this
+ * @return 0 if the transaction deadlocked, non-zero otherwise
+ */
+int _s4_del_source (s4_transaction_t *trans, const char *key_a, const s4_val_t *val_a,
+		const char *src, GPtrArray *deleted)
+{
+	s4_index_t *index;
+	GList *composites;
+	entry_t *entry;
+	int i, j, end;
+	s4_t *s4 = _transaction_get_db (trans);
+	uint32_t src_id = (src == NULL)?0:_string_id (src);
+
+	index = _index_get_a (s4, key_a, 0);
+	if (index == NULL) {
+		return 1;
+	}
+
+	if (!_index_lock_shared (index, trans)) goto deadlocked;
+	entry = _entry_find (index, val_a);
+
+	if (entry == NULL) {
+		return 1;
+	}
+
+	if (!_entry_lock_exclusive (entry, trans)) goto deadlocked;
+
+	/* Delete the relations one key at a time, so only the b-index
+	 * and composite indexes of the keys the source used are locked
+	 */
+	for (i = 0; i < entry->size; i = end) {
+		uint32_t key_id = entry->data[i].key;
+		const char *key_b = _const_get_string (s4, key_id);
+		int found = 0, removed = 0;
+
+		for (end = i; end < entry->size && entry->data[end].key == key_id; end++) {
+			if (src == NULL || entry->data[end].src == src_id)
+				found = 1;
+		}
+		if (!found)
+			continue;
+
+		if (!_index_get_b_exclusive (s4, key_b, trans, &index)) goto deadlocked;
+		if (!_entry_composite_begin (trans, entry, key_b, &composites)) goto deadlocked;
+		_entry_copy_on_write (s4, entry);
+
+		for (j = i; j < end; j++) {
+			if (src == NULL || entry->data[j].src == src_id) {
+				const s4_val_t *val_b = _const_get (s4, entry->data[j].val);
+				const char *fsrc = _const_get_string (s4, entry->data[j].src);
+
+				if (index != NULL)
+					_index_delete (index, val_b, entry);
+				_entry_source_count (s4, entry, fsrc, -1);
+				g_ptr_array_add (deleted, (void*)key_b);
+				g_ptr_array_add (deleted, (void*)val_b);
+				g_ptr_array_add (deleted, (void*)fsrc);
+				removed++;
+			} else {
+				entry->data[j - removed] = entry->data[j];
+			}
+		}
+
+		memmove (entry->data + end - removed, entry->data + end,
+				(entry->size - end) * sizeof (entry_data_t));
+		entry->size -= removed;
+		end -= removed;
+
+		_entry_composite_end (s4, entry, composites);
+	}
+
+	return 1;
+
+deadlocked:
+	_transaction_set_deadlocked (trans);
+	return 0;
+}
+
 /**
  * @{
  * @internal
@@ -378,62 +870,481 @@ void _free_relations (s4_t *s4)
 			entry_t *entry = entries->data;
 
 			_lock_free (entry->lock);
-			free (entry->data);
+			if (entry->data != entry->inline_data)
+				free (entry->data);
 			free (entry);
 		}
 	}
 }
 
+/* The number of entries a thread building an index takes at a time */
+#define INDEX_BUILD_CHUNK 256
+
+/* An index being built, either a b-index or a composite index */
 typedef struct {
 	s4_t *s4;
-	entry_t *l;
-} check_data_t;
+	s4_index_t *index;
+	uint32_t key;
+	s4_composite_t *composite;
+	GPtrArray *entries;
+	int next;
+
+	/* The values collected for a b-index, and the lock guarding them */
+	GArray *values;
+	GMutex lock;
+} build_data_t;
+
+/* A value an entry has for the key of a b-index being built */
+typedef struct {
+	const s4_val_t *val;
+	entry_t *entry;
+	int count;
+	unsigned int version;
+} build_value_t;
 
 /**
- * Checks an entry against a condition
+ * Finds the values an entry has for the key of a b-index being built,
+ * and how many times each of them is in the entry.
  *
- * @param cond The condition to check
- * @param d The database and entry to check
- * @return 0 if the entry matched, non-zero otherwise
+ * @param bd The index being built
+ * @param entry The entry, it must be locked
+ * @param version The version of the entry lock
+ * @param values The array to append the values to
  */
-static int _check_cond (s4_condition_t *cond, void *d)
+static void _entry_index_values (build_data_t *bd, entry_t *entry,
+		unsigned int version, GArray *values)
 {
-	check_data_t *data = d;
-	entry_t *l = data->l;
-	int ret = 1;
-	int i;
+	int start, i, j;
+	build_value_t value;
 
-	if (s4_cond_is_combiner (cond)) {
-		ret = s4_cond_get_combine_function (cond)(cond, _check_cond, d);
-	} else if (s4_cond_is_filter (cond)) {
-		const char *key = s4_cond_get_key (cond);
-		int null = key == NULL;
+	start = _entry_search (entry, bd->key);
 
-		if ((s4_cond_get_flags (cond) & S4_COND_PARENT)) {
-			if (key == l->key || null) {
+	for (i = start; i < entry->size && entry->data[i].key == bd->key; i++) {
+		value.val = _const_get (bd->s4, entry->data[i].val);
+		value.entry = entry;
+		value.version = version;
+
+		/* The index does not tell apart values differing only in case */
+		for (value.count = 0, j = start; j < entry->size && entry->data[j].key == bd->key; j++) {
+			if (entry->data[j].val == entry->data[i].val
+					|| !s4_val_cmp (value.val, _const_get (bd->s4, entry->data[j].val), S4_CMP_CASELESS))
+				value.count++;
+		}
+
+		g_array_append_val (values, value);
+	}
+}
+
+/**
+ * Puts the values an entry has for the key of an index being built
+ * into the index. The entry is locked while the index is updated, and
+ * the counts are set rather than added to, so the index ends up
+ * agreeing with the entry whatever transactions did to both before.
+ *
+ * @param bd The index being built
+ * @param entry The entry to add
+ * @return 0 if it deadlocked and has to be tried again, non-zero otherwise
+ */
+static int _entry_index (build_data_t *bd, entry_t *entry)
+{
+	s4_transaction_t *trans = _transaction_dummy_alloc (bd->s4);
+	GArray *values = g_array_new (FALSE, FALSE, sizeof (build_value_t));
+	int ret, i;
+
+	ret = _entry_lock_shared (entry, trans)
+		&& _index_lock_exclusive (bd->index, trans);
+
+	if (ret && !_index_is_dropped (bd->index)) {
+		_entry_index_values (bd, entry, 0, values);
+
+		for (i = 0; i < values->len; i++) {
+			build_value_t *value = &g_array_index (values, build_value_t, i);
+			_index_set_count (bd->index, value->val, entry, value->count);
+		}
+	}
+
+	_transaction_dummy_free (trans);
+	g_array_free (values, TRUE);
+
+	return ret;
+}
+
+/**
+ * Collects the values an entry has for the key of a b-index being
+ * built, along with the version of the entry lock. Only the entry is
+ * locked, the values are put into the index by _entry_build_merge.
+ *
+ * @param bd The index being built
+ * @param entry The entry to collect the values of
+ * @param values The array to append the values to
+ * @return 0 if it deadlocked and has to be tried again, non-zero otherwise
+ */
+static int _entry_index_collect (build_data_t *bd, entry_t *entry, GArray *values)
+{
+	s4_transaction_t *trans = _transaction_dummy_alloc (bd->s4);
+	int ret;
+
+	ret = _entry_lock_shared (entry, trans);
+
+	if (ret) {
+		_entry_index_values (bd, entry, _lock_get_version (entry->lock), values);
+	}
+
+	_transaction_dummy_free (trans);
+
+	return ret;
+}
+
+/**
+ * Puts the values collected for a b-index being built into it, with
+ * the index locked once. Entries changed since their values were
+ * collected may already have updated the index with their changes,
+ * so they are put in again one at a time by _entry_index instead.
+ *
+ * @param bd The index being built
+ */
+static void _entry_build_merge (build_data_t *bd)
+{
+	s4_transaction_t *trans = _transaction_dummy_alloc (bd->s4);
+	GPtrArray *changed = g_ptr_array_new ();
+	entry_t *last = NULL;
+	int i, valid = 0;
+
+	_index_lock_exclusive (bd->index, trans);
+	if (_index_is_dropped (bd->index))
+		g_array_set_size (bd->values, 0);
+
+	for (i = 0; i < bd->values->len; i++) {
+		build_value_t *value = &g_array_index (bd->values, build_value_t, i);
+
+		/* The values of an entry are next to each other */
+		if (value->entry != last) {
+			last = value->entry;
+			valid = _lock_validate (last->lock, trans, value->version);
+			if (!valid)
+				g_ptr_array_add (changed, last);
+		}
+
+		if (valid)
+			_index_set_count (bd->index, value->val, value->entry, value->count);
+	}
+
+	_transaction_dummy_free (trans);
+
+	for (i = 0; i < changed->len; i++) {
+		while (!_entry_index (bd, g_ptr_array_index (changed, i)))
+			g_thread_yield ();
+	}
+
+	g_ptr_array_free (changed, TRUE);
+}
+
+/**
+ * Puts the rows of an entry into a composite index being built.
+ * Transactions changing the entry first remove its rows, so the
+ * index either has all the rows of the entry or none of them.
+ * Removing them before inserting them makes sure they end up there once.
+ *
+ * @param bd The index being built
+ * @param entry The entry to add
+ * @return 0 if it deadlocked and has to be tried again, non-zero otherwise
+ */
+static int _entry_index_composite (build_data_t *bd, entry_t *entry)
+{
+	s4_transaction_t *trans = _transaction_dummy_alloc (bd->s4);
+	int ret;
+
+	ret = _entry_lock_shared (entry, trans)
+		&& _composite_lock_exclusive (bd->composite, trans);
+
+	if (ret && !_composite_is_dropped (bd->composite)) {
+		_entry_composite_rows (bd->s4, bd->composite, entry, 0);
+		_entry_composite_rows (bd->s4, bd->composite, entry, 1);
+	}
+
+	_transaction_dummy_free (trans);
+
+	return ret;
+}
+
+/* Adds chunks of entries to an index being built until there are none left.
+ * For a b-index the values are only collected, to be merged afterwards.
+ */
+static void *_entry_build_worker (build_data_t *bd)
+{
+	GArray *values = g_array_new (FALSE, FALSE, sizeof (build_value_t));
+	int i, end;
+
+	while ((i = g_atomic_int_add (&bd->next, INDEX_BUILD_CHUNK)) < bd->entries->len) {
+		end = MIN (i + INDEX_BUILD_CHUNK, bd->entries->len);
+
+		for (; i < end; i++) {
+			entry_t *entry = g_ptr_array_index (bd->entries, i);
+
+			while (!(bd->composite == NULL ? _entry_index_collect (bd, entry, values)
+						: _entry_index_composite (bd, entry)))
+				g_thread_yield ();
+		}
+	}
+
+	g_mutex_lock (&bd->lock);
+	g_array_append_vals (bd->values, values->data, values->len);
+	g_mutex_unlock (&bd->lock);
+	g_array_free (values, TRUE);
+
+	return NULL;
+}
+
+/**
+ * Puts every entry in the database into an index being built.
+ * The entries are split between one thread per processor. The threads
+ * building a b-index do not lock it, it is only locked once to merge
+ * what they collected.
+ *
+ * @param bd The index being built
+ */
+static void _entry_build (build_data_t *bd)
+{
+	GPtrArray *threads = g_ptr_array_new ();
+	s4_transaction_t *trans;
+	GList *indexes, *entries;
+	int i, n;
+
+	bd->entries = g_ptr_array_new ();
+	bd->values = g_array_new (FALSE, FALSE, sizeof (build_value_t));
+	bd->next = 0;
+	g_mutex_init (&bd->lock);
+
+	/* Transactions hold the a-index exclusively from when they create
+	 * an entry until they finish, so locking it finds every entry
+	 * created before the index was published
+	 */
+	indexes = _index_get_all_a (bd->s4);
+	for (; indexes != NULL; indexes = g_list_delete_link (indexes, indexes)) {
+		trans = _transaction_dummy_alloc (bd->s4);
+		_index_lock_shared (indexes->data, trans);
+		entries = _index_search (indexes->data, (index_function_t)_everything, NULL);
+		_transaction_dummy_free (trans);
+
+		for (; entries != NULL; entries = g_list_delete_link (entries, entries)) {
+			g_ptr_array_add (bd->entries, entries->data);
+		}
+	}
+
+	n = MIN (g_get_num_processors (), bd->entries->len / INDEX_BUILD_CHUNK + 1);
+	for (i = 1; i < n; i++) {
+		g_ptr_array_add (threads, g_thread_new ("s4 index build",
+					(GThreadFunc)_entry_build_worker, bd));
+	}
+	_entry_build_worker (bd);
+
+	for (i = 0; i < threads->len; i++) {
+		g_thread_join (g_ptr_array_index (threads, i));
+	}
+
+	if (bd->composite == NULL)
+		_entry_build_merge (bd);
+
+	g_ptr_array_free (threads, TRUE);
+	g_ptr_array_free (bd->entries, TRUE);
+	g_array_free (bd->values, TRUE);
+	g_mutex_clear (&bd->lock);
+}
+
+/**
+ * Fills in a b-index with the entries in the database.
+ * The index must already be published and marked as being built,
+ * so transactions running meanwhile keep it up to date with their
+ * changes. When it returns the index is ready to be used by queries.
+ *
+ * @param s4 The database
+ * @param index The index
+ * @param key The key of the index
+ */
+void _entry_build_index (s4_t *s4, s4_index_t *index, const char *key)
+{
+	s4_transaction_t *trans;
+	build_data_t bd;
+
+	bd.s4 = s4;
+	bd.index = index;
+	bd.key = _string_id (_string_lookup (s4, key));
+	bd.composite = NULL;
+	_entry_build (&bd);
+
+	trans = _transaction_dummy_alloc (s4);
+	_index_lock_exclusive (index, trans);
+	_index_set_building (index, 0);
+	_transaction_dummy_free (trans);
+}
+
+/**
+ * Fills in a composite index with the entries in the database,
+ * like _entry_build_index.
+ *
+ * @param s4 The database
+ * @param index The composite index
+ */
+void _entry_build_composite (s4_t *s4, s4_composite_t *index)
+{
+	s4_transaction_t *trans;
+	build_data_t bd;
+
+	bd.s4 = s4;
+	bd.index = NULL;
+	bd.composite = index;
+	_entry_build (&bd);
+
+	trans = _transaction_dummy_alloc (s4);
+	_composite_lock_exclusive (index, trans);
+	_composite_set_building (index, 0);
+	_transaction_dummy_free (trans);
+}
+
+/**
+ * Starts a checkpoint snapshot. From now on entries are copied
+ * before they are changed, until _entry_snapshot_end is called.
+ * No transaction may change the database while this runs.
+ *
+ * @param s4 The database to take a snapshot of
+ * @return An array with every entry in the database
+ */
+GPtrArray *_entry_snapshot_begin (s4_t *s4)
+{
+	s4_entry_data_t *data = s4->entry_data;
+	GPtrArray *ret = g_ptr_array_new ();
+	GList *indexes, *entries;
+
+	indexes = _index_get_all_a (s4);
+
+	for (; indexes != NULL; indexes = g_list_delete_link (indexes, indexes)) {
+		entries = _index_search (indexes->data, (index_function_t)_everything, NULL);
+
+		for (; entries != NULL; entries = g_list_delete_link (entries, entries)) {
+			g_ptr_array_add (ret, entries->data);
+		}
+	}
+
+	g_mutex_lock (&data->snapshot_lock);
+	g_atomic_int_set (&data->snapshot_active, 1);
+	g_mutex_unlock (&data->snapshot_lock);
+
+	return ret;
+}
+
+/**
+ * Calls a function for every relation in the snapshot.
+ * Transactions may change the database while this runs.
+ *
+ * @param s4 The database
+ * @param entries The entries returned by _entry_snapshot_begin
+ * @param func The function to call
+ * @param userdata Passed to func
+ */
+void _entry_snapshot_foreach (s4_t *s4, GPtrArray *entries, tuple_func_t func, void *userdata)
+{
+	s4_entry_data_t *data = s4->entry_data;
+	int i, j;
+
+	for (i = 0; i < entries->len; i++) {
+		entry_t *entry = g_ptr_array_index (entries, i);
+		entry_snap_t *snap;
+		entry_data_t *d;
+		int size;
+
+		/* Entries that have not been copied can not change while we
+		 * hold the lock, as they have to be copied first
+		 */
+		g_mutex_lock (&data->snapshot_lock);
+		snap = g_hash_table_lookup (data->copies, entry);
+		if (snap != NULL) {
+			d = snap->data;
+			size = snap->size;
+		} else {
+			d = entry->data;
+			size = entry->size;
+		}
+
+		for (j = 0; j < size; j++) {
+			func (entry->key, entry->val, _const_get_string (s4, d[j].key),
+					_const_get (s4, d[j].val), _const_get_string (s4, d[j].src), userdata);
+		}
+		g_mutex_unlock (&data->snapshot_lock);
+	}
+}
+
+/**
+ * Ends a checkpoint snapshot, freeing the copies made.
+ *
+ * @param s4 The database
+ * @param entries The entries returned by _entry_snapshot_begin
+ */
+void _entry_snapshot_end (s4_t *s4, GPtrArray *entries)
+{
+	s4_entry_data_t *data = s4->entry_data;
+
+	g_mutex_lock (&data->snapshot_lock);
+	g_atomic_int_set (&data->snapshot_active, 0);
+	g_hash_table_remove_all (data->copies);
+	g_mutex_unlock (&data->snapshot_lock);
+
+	g_ptr_array_free (entries, TRUE);
+}
+
+typedef struct {
+	s4_t *s4;
+	entry_t *l;
+} check_data_t;
+
+/**
+ * Checks an entry against a condition
+ *
+ * @param cond The condition to check
+ * @param d The database and entry to check
+ * @return 0 if the entry matched, non-zero otherwise
+ */
+static int _check_cond (s4_condition_t *cond, void *d)
+{
+	check_data_t *data = d;
+	entry_t *l = data->l;
+	int ret = 1;
+	int i;
+
+	if (s4_cond_is_combiner (cond)) {
+		ret = s4_cond_get_combine_function (cond)(cond, _check_cond, d);
+	} else if (s4_cond_is_filter (cond)) {
+		const char *key = s4_cond_get_key (cond);
+		int null = key == NULL;
+
+		if ((s4_cond_get_flags (cond) & S4_COND_PARENT)) {
+			if (key == l->key || null) {
 				ret = s4_cond_get_filter_function (cond)(l->val, cond);
 			}
 		} else {
+			s4_t *s4 = data->s4;
+			uint32_t key_id = _string_id (key);
+
 			i = 0;
 			do {
 				s4_sourcepref_t *sp = s4_cond_get_sourcepref (cond);
 				int start, src, best_src = INT_MAX;
 
 				if (null) {
-					key = l->data[i].key;
+					key_id = l->data[i].key;
 				}
 
-				start = _entry_search (l, key);
+				start = _entry_search (l, key_id);
 
-				for (i = start; i < l->size && l->data[i].key == key; i++) {
-					if ((src = s4_sourcepref_get_priority (sp, l->data[i].src)) < best_src) {
+				for (i = start; i < l->size && l->data[i].key == key_id; i++) {
+					src = s4_sourcepref_get_priority (sp, _const_get_string (s4, l->data[i].src));
+					if (src < best_src) {
 						best_src = src;
 					}
 				}
-				for (i = start; i < l->size && ret && l->data[i].key == key; i++) {
+				for (i = start; i < l->size && ret && l->data[i].key == key_id; i++) {
 					if (best_src < INT_MAX &&
-							s4_sourcepref_get_priority (sp, l->data[i].src) == best_src) {
-						ret = s4_cond_get_filter_function (cond)(l->data[i].val, cond);
+							s4_sourcepref_get_priority (sp, _const_get_string (s4, l->data[i].src)) == best_src) {
+						ret = s4_cond_get_filter_function (cond)(_const_get (s4, l->data[i].val), cond);
 					}
 				}
 			} while (i < l->size && ret && null);
@@ -443,6 +1354,55 @@ static int _check_cond (s4_condition_t *cond, void *d)
 	return ret;
 }
 
+/**
+ * Finds the entries with relations from a source that match a condition.
+ * The source index is used, so only those entries are looked at.
+ * The entries found are locked shared.
+ *
+ * @param trans The transaction to use
+ * @param src The constant source
+ * @param cond The condition the entries must match, or NULL to match all
+ * @param entries Set to a list of the entries found, free it with g_list_free
+ * @return 0 if the transaction deadlocked, non-zero otherwise
+ */
+int _s4_source_entries (s4_transaction_t *trans, const char *src,
+		s4_condition_t *cond, GList **entries)
+{
+	s4_t *s4 = _transaction_get_db (trans);
+	GList *candidates = _entry_source_get (s4, src);
+	uint32_t src_id = _string_id (src);
+	check_data_t data;
+	int i;
+
+	*entries = NULL;
+	data.s4 = s4;
+
+	for (; candidates != NULL; candidates = g_list_delete_link (candidates, candidates)) {
+		entry_t *entry = candidates->data;
+		int found = 0;
+
+		if (!_index_lock_shared (_index_get_a (s4, entry->key, 1), trans)
+				|| !_entry_lock_shared (entry, trans)) {
+			g_list_free (candidates);
+			g_list_free (*entries);
+			*entries = NULL;
+			_transaction_set_deadlocked (trans);
+			return 0;
+		}
+
+		for (i = 0; i < entry->size && !found; i++) {
+			found = entry->data[i].src == src_id;
+		}
+
+		data.l = entry;
+		if (found && (cond == NULL || !_check_cond (cond, &data))) {
+			*entries = g_list_prepend (*entries, entry);
+		}
+	}
+
+	return 1;
+}
+
 /**
  * Fetches values from an entry
  *
@@ -461,6 +1421,7 @@ static s4_resultrow_t *_fetch (s4_t *s4, entry_t *l, s4_fetchspec_t *fs)
 
 	for (k = 0; k < fetch_size; k++) {
 		const char *fkey = s4_fetchspec_get_key (fs, k);
+		uint32_t fkey_id = _string_id (fkey);
 		int flags = s4_fetchspec_get_flags (fs, k);
 		int null = fkey == NULL;
 		s4_result_t *result;
@@ -478,21 +1439,24 @@ static s4_resultrow_t *_fetch (s4_t *s4, entry_t *l, s4_fetchspec_t *fs)
 				int src, start, best_src = INT_MAX;
 
 				if (null && l->size > 0) {
-					fkey = l->data[f].key;
+					fkey_id = l->data[f].key;
 				}
 
-				start = _entry_search (l, fkey);
+				start = _entry_search (l, fkey_id);
 
-				for (f = start; f < l->size && l->data[f].key == fkey; f++) {
-					if ((src = s4_sourcepref_get_priority (sp, l->data[f].src)) < best_src) {
+				for (f = start; f < l->size && l->data[f].key == fkey_id; f++) {
+					src = s4_sourcepref_get_priority (sp, _const_get_string (s4, l->data[f].src));
+					if (src < best_src) {
 						best_src = src;
 					}
 				}
-				for (f = start; f < l->size && l->data[f].key == fkey; f++) {
+				for (f = start; f < l->size && l->data[f].key == fkey_id; f++) {
+					const char *fsrc = _const_get_string (s4, l->data[f].src);
+
 					if (best_src < INT_MAX &&
-							s4_sourcepref_get_priority (sp, l->data[f].src) == best_src) {
-						result = s4_result_create (result, l->data[f].key,
-								l->data[f].val, l->data[f].src);
+							s4_sourcepref_get_priority (sp, fsrc) == best_src) {
+						result = s4_result_create (result, _const_get_string (s4, l->data[f].key),
+								_const_get (s4, l->data[f].val), fsrc);
 					}
 				}
 			} while (f < l->size && null);
@@ -508,6 +1472,39 @@ static s4_resultrow_t *_fetch (s4_t *s4, entry_t *l, s4_fetchspec_t *fs)
  * @}
  */
 
+/**
+ * Decides how a query should find the entries that may match a condition.
+ * The keys in the condition must already be constant.
+ *
+ * @param s4 The database the query will run on
+ * @param cond The condition of the query
+ * @return The access path to use
+ */
+query_path_t _s4_query_path (s4_t *s4, s4_condition_t *cond)
+{
+	int keys, index_b;
+
+	if (s4_cond_is_filter (cond)
+			&& (s4_cond_get_flags (cond) & S4_COND_PARENT)
+			&& s4_cond_get_key (cond) != NULL) {
+		return QUERY_PATH_INDEX_A;
+	}
+
+	index_b = s4_cond_is_filter (cond)
+		&& s4_cond_get_key (cond) != NULL
+		&& _index_get_b (s4, s4_cond_get_key (cond)) != NULL;
+
+	/* A composite index beats a b-index when it narrows by more keys */
+	_composite_find (s4, cond, &keys);
+	if (keys > index_b) {
+		return QUERY_PATH_COMPOSITE;
+	} else if (index_b) {
+		return QUERY_PATH_INDEX_B;
+	}
+
+	return QUERY_PATH_SCAN;
+}
+
 /**
  * Queries a database for all entries matching a condition,
  * then fetches data from them.
@@ -521,35 +1518,171 @@ s4_resultset_t *_s4_query (
 		s4_transaction_t *trans,
 		s4_fetchspec_t *fs,
 		s4_condition_t *cond)
+{
+	s4_t *s4 = _transaction_get_db (trans);
+
+	s4_cond_update_key (cond, s4);
+	s4_fetchspec_update_key (s4, fs);
+
+	return _s4_query_prepared (trans, fs, cond, _s4_query_path (s4, cond));
+}
+
+typedef struct {
+	s4_t *s4;
+	s4_fetchspec_t *fs;
+	s4_resultset_t *set;
+	s4_query_stats_t *stats;
+} fetch_data_t;
+
+static void _fetch_row (entry_t *entry, void *d)
+{
+	fetch_data_t *data = d;
+	gint64 start = (data->stats == NULL)?0:g_get_monotonic_time ();
+
+	s4_resultset_add_row (data->set, _fetch (data->s4, entry, data->fs));
+
+	if (data->stats != NULL)
+		_query_stats_add_fetch (data->stats, g_get_monotonic_time () - start);
+}
+
+/**
+ * Answers a query from a covering composite index, if there is one
+ * covering both the condition and the fetchspec. Only the index is
+ * locked. Every transaction changing a covered key of an entry holds
+ * the index exclusively, so the rows agree with the entries.
+ *
+ * @param trans The transaction this query belongs to.
+ * @param fs The fetchspec to use when fetching data
+ * @param cond The condition to check entries against
+ * @param data Where the rows are added
+ * @return 0 if no index covers the query, non-zero otherwise
+ */
+static int _s4_query_covered (s4_transaction_t *trans, s4_fetchspec_t *fs,
+		s4_condition_t *cond, fetch_data_t *data)
+{
+	s4_composite_t *index;
+	gint64 start;
+	int rows;
+
+	if (!_composite_get_shared (data->s4, cond, trans, &index)) {
+		_transaction_set_deadlocked (trans);
+		return 1;
+	}
+	if (index == NULL || !_composite_covers (index, cond, fs))
+		return 0;
+
+	start = (data->stats == NULL)?0:g_get_monotonic_time ();
+	_query_stats_set_path (data->stats, S4_PATH_INDEX_COMPOSITE);
+	rows = _composite_fetch (index, cond, fs, data->set);
+
+	if (data->stats != NULL)
+		_query_stats_add_fetch (data->stats, g_get_monotonic_time () - start);
+	_query_stats_add_candidates (data->stats, rows);
+	_query_stats_add_rows (data->stats, rows);
+
+	return 1;
+}
+
+/**
+ * Runs a query whose keys are already constant and whose access
+ * path has already been decided.
+ *
+ * @param trans The transaction this query belongs to.
+ * @param fs The fetchspec to use when fetching data
+ * @param cond The condition to check entries against
+ * @param path The access path returned by _s4_query_path
+ * @return A resultset with a row for every entry that matched
+ */
+s4_resultset_t *_s4_query_prepared (
+		s4_transaction_t *trans,
+		s4_fetchspec_t *fs,
+		s4_condition_t *cond,
+		query_path_t path)
+{
+	fetch_data_t data;
+
+	data.s4 = _transaction_get_db (trans);
+	data.fs = fs;
+	data.set = s4_resultset_create (s4_fetchspec_size (fs));
+	data.stats = _transaction_get_stats (trans);
+
+	if (path != QUERY_PATH_COMPOSITE || !_s4_query_covered (trans, fs, cond, &data))
+		_s4_query_foreach (trans, cond, path, _fetch_row, &data);
+
+	return data.set;
+}
+
+/**
+ * Finds all entries matching a condition and calls a function on them.
+ * The entries are locked shared while the function runs.
+ * The keys in the condition must already be constant.
+ *
+ * @param trans The transaction this query belongs to.
+ * @param cond The condition to check entries against
+ * @param path The access path returned by _s4_query_path
+ * @param func The function to call for every entry that matched
+ * @param userdata Passed to func
+ * @return 0 if the transaction deadlocked, non-zero otherwise
+ */
+int _s4_query_foreach (
+		s4_transaction_t *trans,
+		s4_condition_t *cond,
+		query_path_t path,
+		entry_func_t func,
+		void *userdata)
 {
 	check_data_t data;
 	GList *entries;
 	s4_index_t *index;
-	s4_resultset_t *ret = s4_resultset_create (s4_fetchspec_size (fs));
+	s4_composite_t *composite;
 	s4_t *s4 = _transaction_get_db (trans);
+	s4_query_stats_t *stats = _transaction_get_stats (trans);
+	int candidates = 0, rows = 0;
 
-	s4_cond_update_key (cond, s4);
-	s4_fetchspec_update_key (s4, fs);
+	/* The index may have been dropped since the path was chosen,
+	 * then the entries are scanned instead
+	 */
+	if (path == QUERY_PATH_INDEX_B) {
+		if (!_index_get_b_shared (s4, s4_cond_get_key (cond), trans, &index)) goto deadlocked;
+		if (index == NULL)
+			path = QUERY_PATH_SCAN;
+	} else if (path == QUERY_PATH_COMPOSITE) {
+		if (!_composite_get_shared (s4, cond, trans, &composite)) goto deadlocked;
+		if (composite == NULL)
+			path = QUERY_PATH_SCAN;
+	}
 
-	if (s4_cond_is_filter (cond)
-			&& (s4_cond_get_flags (cond) & S4_COND_PARENT)
-			&& s4_cond_get_key (cond) != NULL) {
+	if (path == QUERY_PATH_INDEX_A) {
+		_query_stats_set_path (stats, S4_PATH_INDEX_A);
 		index = _index_get_a (s4, s4_cond_get_key (cond), 0);
 
 		if (index == NULL) {
 			entries = NULL;
 		} else {
+			const s4_val_t *val = s4_cond_get_funcdata (cond);
+			int32_t i;
+
 			if (!_index_lock_shared (index, trans)) goto deadlocked;
-			if (s4_cond_is_monotonic (cond)) {
+
+			/* Integers only equal strings when collating,
+			 * otherwise the entry is in the integer map
+			 */
+			if (s4_cond_get_filter_type (cond) == S4_FILTER_EQUAL
+					&& s4_cond_get_cmp_mode (cond) != S4_CMP_COLLATE
+					&& s4_val_get_int (val, &i)) {
+				entry_t *entry = _index_lookup_int (index, i);
+				entries = (entry == NULL)?NULL:g_list_prepend (NULL, entry);
+			} else if (s4_cond_is_monotonic (cond)) {
 				entries = _index_search (index, (index_function_t)s4_cond_get_filter_function (cond), cond);
 			} else {
 				entries = _index_lsearch (index, (index_function_t)s4_cond_get_filter_function (cond), cond);
 			}
 		}
-	} else if (s4_cond_is_filter (cond)
-			&& s4_cond_get_key (cond) != NULL
-			&& (index = _index_get_b (s4, s4_cond_get_key (cond))) != NULL) {
-		if (!_index_lock_shared (index, trans)) goto deadlocked;
+	} else if (path == QUERY_PATH_COMPOSITE) {
+		_query_stats_set_path (stats, S4_PATH_INDEX_COMPOSITE);
+		entries = _composite_search (composite, cond);
+	} else if (path == QUERY_PATH_INDEX_B) {
+		_query_stats_set_path (stats, S4_PATH_INDEX_B);
 		if (s4_cond_is_monotonic (cond)) {
 			entries = _index_search (index, (index_function_t)s4_cond_get_filter_function (cond), cond);
 		} else {
@@ -557,10 +1690,15 @@ s4_resultset_t *_s4_query (
 		}
 	} else {
 		GList *indices;
+		_query_stats_set_path (stats, S4_PATH_SCAN);
 		indices = _index_get_all_a (s4);
 
 		for (entries = NULL; indices != NULL; indices = g_list_delete_link (indices, indices)) {
-			if (!_index_lock_shared (indices->data, trans)) goto deadlocked;
+			if (!_index_lock_shared (indices->data, trans)) {
+				g_list_free (indices);
+				g_list_free (entries);
+				goto deadlocked;
+			}
 			entries = g_list_concat (entries, _index_lsearch (indices->data, (index_function_t)_everything, NULL));
 		}
 	}
@@ -570,15 +1708,85 @@ s4_resultset_t *_s4_query (
 		entry_t *entry = entries->data;
 		data.l = entry;
 
-		if (!_entry_lock_shared (entry, trans)) goto deadlocked;
-		if (entry->size != 0 && !_check_cond (cond, &data))
-			s4_resultset_add_row (ret, _fetch (s4, entry, fs));
+		if (!_entry_lock_shared (entry, trans)) {
+			g_list_free (entries);
+			goto deadlocked;
+		}
+
+		candidates++;
+		if (entry->size != 0 && !_check_cond (cond, &data)) {
+			rows++;
+			func (entry, userdata);
+		}
 	}
 
-	return ret;
+	_query_stats_add_candidates (stats, candidates);
+	_query_stats_add_rows (stats, rows);
+	return 1;
 
 deadlocked:
+	_query_stats_add_candidates (stats, candidates);
+	_query_stats_add_rows (stats, rows);
 	_transaction_set_deadlocked (trans);
+	return 0;
+}
+
+/**
+ * Gets the key of an entry.
+ *
+ * @param entry The entry
+ * @return The constant key the entry was created with
+ */
+const char *_entry_get_key (s4_entry_t *entry)
+{
+	return entry->key;
+}
+
+/**
+ * Gets the value of an entry.
+ *
+ * @param entry The entry
+ * @return The constant value the entry was created with
+ */
+const s4_val_t *_entry_get_val (s4_entry_t *entry)
+{
+	return entry->val;
+}
+
+/**
+ * Calls a function on every value of a key in an entry that
+ * comes from the most preferred source, like _fetch does.
+ * The entry must be locked.
+ *
+ * @param s4 The database the entry lives in
+ * @param entry The entry to look in
+ * @param key The constant key to look for
+ * @param sp The sourcepref deciding which values to use
+ * @param func The function to call
+ * @param userdata Passed to func
+ * @return The number of values func was called on
+ */
+int _entry_foreach_value (s4_t *s4, s4_entry_t *entry, const char *key,
+		s4_sourcepref_t *sp, value_func_t func, void *userdata)
+{
+	int i, src, start, best_src = INT_MAX, ret = 0;
+	uint32_t key_id = _string_id (key);
+
+	start = _entry_search (entry, key_id);
+
+	for (i = start; i < entry->size && entry->data[i].key == key_id; i++) {
+		src = s4_sourcepref_get_priority (sp, _const_get_string (s4, entry->data[i].src));
+		if (src < best_src) {
+			best_src = src;
+		}
+	}
+	for (i = start; best_src < INT_MAX && i < entry->size && entry->data[i].key == key_id; i++) {
+		if (s4_sourcepref_get_priority (sp, _const_get_string (s4, entry->data[i].src)) == best_src) {
+			func (_const_get (s4, entry->data[i].val), userdata);
+			ret++;
+		}
+	}
+
 	return ret;
 }
 
@@ -16,6 +16,7 @@
 #include "s4_priv.h"
 #include "logging.h"
 #include <stdlib.h>
+#include <string.h>
 #include <glib.h>
 
 struct s4_resultset_St {
@@ -24,6 +25,9 @@ struct s4_resultset_St {
 	int ref_count;
 
 	GPtrArray *results;
+
+	/* The statistics of the query that made this set, sorting time is added to them */
+	s4_query_stats_t *stats;
 };
 
 struct s4_resultrow_St {
@@ -82,12 +86,32 @@ s4_resultset_t *s4_resultset_create (int col_count)
 	ret->ref_count = 1;
 	ret->col_count = col_count;
 	ret->row_count = 0;
+	ret->stats = NULL;
 
 	ret->results = g_ptr_array_new_with_free_func ((GDestroyNotify)s4_resultrow_unref);
 
 	return ret;
 }
 
+/**
+ * Creates a copy of a resultset. The rows are shared with the original
+ * set, but the copy can be sorted and freed independently.
+ *
+ * @param set The set to copy
+ * @return A new resultset with the same rows as set
+ */
+s4_resultset_t *s4_resultset_copy (const s4_resultset_t *set)
+{
+	s4_resultset_t *ret = s4_resultset_create (set->col_count);
+	int i;
+
+	for (i = 0; i < set->row_count; i++) {
+		s4_resultset_add_row (ret, g_ptr_array_index (set->results, i));
+	}
+
+	return ret;
+}
+
 /**
  * @}
  */
@@ -202,6 +226,26 @@ static int _compare_rows (const s4_resultrow_t **row1, const s4_resultrow_t **ro
 	return (ret == 0) ? (row1 - row2) : ret;
 }
 
+/**
+ * Sets the statistics object that sorting time is added to.
+ *
+ * @param set The set
+ * @param stats The statistics of the query that made the set
+ */
+void _resultset_set_stats (s4_resultset_t *set, s4_query_stats_t *stats)
+{
+	s4_query_stats_ref (stats);
+	s4_query_stats_unref (set->stats);
+	set->stats = stats;
+}
+
+static void _sort (s4_resultset_t *set, s4_order_t *order)
+{
+	if (order->size > 0) {
+		g_ptr_array_sort_with_data (set->results, (GCompareDataFunc)_compare_rows, (void*)order);
+	}
+}
+
 /**
  * Sorts a resultset.
  * @param set The set to sort
@@ -209,11 +253,140 @@ static int _compare_rows (const s4_resultrow_t **row1, const s4_resultrow_t **ro
  */
 void s4_resultset_sort (s4_resultset_t *set, s4_order_t *order)
 {
-	if (order->size > 0) {
-		g_ptr_array_sort_with_data (set->results, (GCompareDataFunc)_compare_rows, (void*)order);
+	gint64 start = (set->stats == NULL)?0:g_get_monotonic_time ();
+
+	_sort (set, order);
+
+	if (set->stats != NULL)
+		_query_stats_add_sort (set->stats, g_get_monotonic_time () - start);
+}
+
+static void _heap_sift_up (const s4_resultrow_t ***heap, int i, s4_order_t *order)
+{
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		const s4_resultrow_t **tmp;
+
+		if (_compare_rows (heap[parent], heap[i], order) >= 0)
+			break;
+
+		tmp = heap[parent];
+		heap[parent] = heap[i];
+		heap[i] = tmp;
+		i = parent;
 	}
 }
 
+static void _heap_sift_down (const s4_resultrow_t ***heap, int size, s4_order_t *order)
+{
+	int i = 0;
+
+	for (;;) {
+		int largest = i, l = 2 * i + 1, r = 2 * i + 2;
+		const s4_resultrow_t **tmp;
+
+		if (l < size && _compare_rows (heap[l], heap[largest], order) > 0)
+			largest = l;
+		if (r < size && _compare_rows (heap[r], heap[largest], order) > 0)
+			largest = r;
+		if (largest == i)
+			break;
+
+		tmp = heap[largest];
+		heap[largest] = heap[i];
+		heap[i] = tmp;
+		i = largest;
+	}
+}
+
+/* Sorts the k first rows of set into place using a bounded heap */
+static void _sort_window (s4_resultset_t *set, s4_order_t *order, int k)
+{
+	const s4_resultrow_t ***heap;
+	s4_resultrow_t **rows;
+	int i, j, size = 0;
+
+	if (order->size == 0 || k == 0)
+		return;
+
+	rows = (s4_resultrow_t**)set->results->pdata;
+	heap = malloc (sizeof (s4_resultrow_t**) * k);
+
+	/* Keep the k smallest rows in a max-heap, heap[0] being the largest.
+	 * The heap holds pointers to the slots in the array so that
+	 * _compare_rows can break ties on the original position.
+	 */
+	for (i = 0; i < set->row_count; i++) {
+		const s4_resultrow_t **slot = (const s4_resultrow_t**)&rows[i];
+
+		if (size < k) {
+			heap[size] = slot;
+			_heap_sift_up (heap, size++, order);
+		} else if (_compare_rows (slot, heap[0], order) < 0) {
+			heap[0] = slot;
+			_heap_sift_down (heap, size, order);
+		}
+	}
+
+	/* Pop the heap from the back to get the window in ascending order */
+	{
+		s4_resultrow_t **sorted = malloc (sizeof (s4_resultrow_t*) * set->row_count);
+
+		for (i = k - 1; i >= 0; i--) {
+			const s4_resultrow_t **slot = heap[0];
+
+			heap[0] = heap[--size];
+			_heap_sift_down (heap, size, order);
+
+			sorted[i] = (s4_resultrow_t*)*slot;
+			*(s4_resultrow_t**)slot = NULL;
+		}
+
+		for (i = 0, j = k; i < set->row_count; i++) {
+			if (rows[i] != NULL)
+				sorted[j++] = rows[i];
+		}
+
+		memcpy (rows, sorted, sizeof (s4_resultrow_t*) * set->row_count);
+		free (sorted);
+	}
+
+	free (heap);
+}
+
+/**
+ * Sorts a window of a resultset.
+ *
+ * Only the rows that would end up at positions [offset, offset + limit)
+ * after a full sort are selected, using a bounded heap, so the cost is
+ * O(n log k) with k = offset + limit instead of O(n log n).
+ * When it returns the first offset + limit rows are sorted, the rest of
+ * the rows follow in an unspecified order.
+ *
+ * @param set The set to sort
+ * @param order The columns to order the result by
+ * @param offset The index of the first row in the window
+ * @param limit The number of rows in the window, or -1 for all rows
+ */
+void s4_resultset_sort_window (s4_resultset_t *set, s4_order_t *order,
+                               int offset, int limit)
+{
+	gint64 start = (set->stats == NULL)?0:g_get_monotonic_time ();
+
+	offset = MAX (offset, 0);
+
+	/* Compared this way so offset + limit can not overflow */
+	if (limit < 0 || limit >= set->row_count - offset) {
+		_sort (set, order);
+	} else {
+		_sort_window (set, order, offset + limit);
+	}
+
+	if (set->stats != NULL)
+		_query_stats_add_sort (set->stats, g_get_monotonic_time () - start);
+}
+
+
 /**
  * Shuffles the resultset into a pseudo-random order
  * @param set The resultset to shuffle
@@ -230,6 +403,7 @@ void s4_resultset_shuffle (s4_resultset_t *set)
 void s4_resultset_free (s4_resultset_t *set)
 {
 	g_ptr_array_free (set->results, TRUE);
+	s4_query_stats_unref (set->stats);
 	free (set);
 }
 
@@ -308,7 +482,7 @@ int s4_resultrow_get_col (const s4_resultrow_t *row, int col_no, const s4_result
 s4_resultrow_t *s4_resultrow_ref (s4_resultrow_t *row)
 {
 	if (row != NULL)
-		row->refs++;
+		g_atomic_int_inc (&row->refs);
 	return row;
 }
 
@@ -318,13 +492,12 @@ s4_resultrow_t *s4_resultrow_ref (s4_resultrow_t *row)
  */
 void s4_resultrow_unref (s4_resultrow_t *row)
 {
-	if (row->refs <= 0) {
+	if (g_atomic_int_get (&row->refs) <= 0) {
 		S4_ERROR ("s4_resultrow_unref: ref_count <= 0");
 		return;
 	}
-	row->refs--;
 
-	if (row->refs <= 0) {
+	if (g_atomic_int_dec_and_test (&row->refs)) {
 		int i;
 		for (i = 0; i < row->col_count; i++) {
 			if (row->cols[i] != NULL) {
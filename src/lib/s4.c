@@ -21,6 +21,7 @@
 #include <errno.h>
 
 static GPrivate _errno = G_PRIVATE_INIT (g_free);
+static GPrivate _durability = G_PRIVATE_INIT (g_free);
 
 /**
  *
@@ -41,42 +42,67 @@ typedef struct {
 	log_number_t last_checkpoint;
 } s4_header_t;
 
+/* The part of a mapped database file that has not been read yet */
+typedef struct {
+	const char *pos, *end;
+} read_buf_t;
+
 /**
  * @{
  * @internal
  */
 
+/**
+ * Reads from a mapped file
+ *
+ * @param buf The buffer to read from
+ * @param dst Where to put what was read
+ * @param size The number of bytes to read
+ * @return 0 if there are less than size bytes left, non-zero otherwise
+ */
+static int _buf_read (read_buf_t *buf, void *dst, size_t size)
+{
+	if (buf->end - buf->pos < size)
+		return 0;
+
+	memcpy (dst, buf->pos, size);
+	buf->pos += size;
+
+	return 1;
+}
+
 /**
  * Reads strings from a file
  *
  * @param s4 The database to add the strings to
- * @param file The file to read from
+ * @param buf The mapped file to read from
  * @return A hashtable with the id as they key and the
  * corresponding string as they values or NULL on error
  */
-static GHashTable *_read_string (s4_t *s4, FILE *file)
+static GHashTable *_read_string (s4_t *s4, read_buf_t *buf)
 {
-	size_t r;
+	int r;
 	int32_t id, len;
-	char *str;
+	GString *str = g_string_new (NULL);
 	GHashTable *ret = g_hash_table_new (NULL, NULL);
 
-	while ((r = fread (&id, sizeof (int32_t), 1, file)) == 1 &&
+	while ((r = _buf_read (buf, &id, sizeof (int32_t))) &&
 			id != -1 &&
-			(r = fread (&len, sizeof (int32_t), 1, file)) == 1) {
-		str = malloc (len + 1);
-		r = fread (str, 1, len, file);
-
-		if (r != len) {
-			g_hash_table_destroy (ret);
-			return NULL;
+			(r = _buf_read (buf, &len, sizeof (int32_t)))) {
+		if (len < 0 || buf->end - buf->pos < len) {
+			r = 0;
+			break;
 		}
 
-		str[len] = '\0';
-		g_hash_table_insert (ret, GINT_TO_POINTER (id), (void*)_string_lookup (s4, str));
-		free (str);
+		g_string_truncate (str, 0);
+		g_string_append_len (str, buf->pos, len);
+		buf->pos += len;
+
+		g_hash_table_insert (ret, GINT_TO_POINTER (id), (void*)_string_lookup (s4, str->str));
 	}
 
+	g_string_free (str, TRUE);
+
 	if (r == 0) {
 		g_hash_table_destroy (ret);
 		return NULL;
@@ -88,16 +114,19 @@ static GHashTable *_read_string (s4_t *s4, FILE *file)
 /**
  * Reads relations from a file
  *
- * @param s4 The database to insert them into
- * @param file The file to read
+ * @param s4 The database to look up the constants in
+ * @param buf The mapped file to read from
  * @param strings A hashtable with string->int relationships
+ * @param func The function to call for every relation
+ * @param userdata Passed to func
  * @return -1 on error, 0 otherwise
  */
-static int _read_relations (s4_t *s4, FILE *file, GHashTable *strings)
+static int _read_relations (s4_t *s4, read_buf_t *buf, GHashTable *strings,
+		tuple_func_t func, void *userdata)
 {
 	s4_intpair_t rec;
 
-	while (fread (&rec, sizeof (s4_intpair_t), 1, file) == 1) {
+	while (_buf_read (buf, &rec, sizeof (s4_intpair_t))) {
 		const char *key_a, *key_b, *src;
 		const s4_val_t *val_a, *val_b;
 
@@ -118,58 +147,75 @@ static int _read_relations (s4_t *s4, FILE *file, GHashTable *strings)
 			val_b = _int_lookup_val (s4, rec.val_b);
 		}
 
-		_s4_add_internal (s4, key_a, val_a, key_b, val_b, src);
+		func (key_a, val_a, key_b, val_b, src, userdata);
 	}
 
 	return 0;
 }
 
+/* Adds a relation read from file to the database */
+static void _add_tuple (const char *key_a, const s4_val_t *val_a,
+		const char *key_b, const s4_val_t *val_b, const char *src, void *userdata)
+{
+	_s4_add_internal (userdata, key_a, val_a, key_b, val_b, src);
+}
+
 /**
  * Reads an S4 database from filename.
+ * The file is mapped read-only instead of read through stdio, so
+ * processes opening the same database share the pages of the file
+ * while they load it.
  *
  * @param s4 The s4 database to read the data into
  * @param filename The name of the file to read from
  * @param flags Flags passed to s4_open
+ * @param func The function to call for every relation in the file
+ * @param userdata Passed to func
  * @return 0 on success, non-zero on error
  */
-static int _read_file (s4_t *s4, const char *filename, int flags)
+static int _read_file (s4_t *s4, const char *filename, int flags,
+		tuple_func_t func, void *userdata)
 {
-	FILE *file = fopen (filename, "r");
+	GError *error = NULL;
+	GMappedFile *file = g_mapped_file_new (filename, FALSE, &error);
+	read_buf_t buf;
 	s4_header_t hdr;
 	int i;
 
 	if (file == NULL) {
 		int ret = 0;
-		switch (errno) {
-			case ENOENT:
-				if (flags & S4_EXISTS) {
-					s4_set_errno (S4E_NOENT);
-					ret = -1;
-				} else {
-					s4_create_uuid (s4->uuid);
-				}
-				break;
-			default:
-				s4_set_errno (S4E_OPEN);
+
+		if (error->domain == G_FILE_ERROR && error->code == G_FILE_ERROR_NOENT) {
+			if (flags & S4_EXISTS) {
+				s4_set_errno (S4E_NOENT);
 				ret = -1;
-				break;
+			} else {
+				s4_create_uuid (s4->uuid);
+			}
+		} else {
+			s4_set_errno (S4E_OPEN);
+			ret = -1;
 		}
+		g_error_free (error);
 		return ret;
 	} else if (flags & S4_NEW) {
-		fclose (file);
+		g_mapped_file_unref (file);
 		s4_set_errno (S4E_EXISTS);
 		return -1;
 	}
 
-	fread (&hdr, sizeof (s4_header_t), 1, file);
-	if (strncmp (S4_MAGIC, hdr.magic, S4_MAGIC_LEN)) {
-		fclose (file);
+	buf.pos = g_mapped_file_get_contents (file);
+	buf.end = buf.pos + g_mapped_file_get_length (file);
+
+	if (!_buf_read (&buf, &hdr, sizeof (s4_header_t))
+			|| strncmp (S4_MAGIC, hdr.magic, S4_MAGIC_LEN)) {
+		g_mapped_file_unref (file);
 		s4_set_errno (S4E_MAGIC);
 		return -1;
 	}
 
 	if (hdr.version != S4_VERSION) {
-		fclose (file);
+		g_mapped_file_unref (file);
 		s4_set_errno (S4E_VERSION);
 		return -1;
 	}
@@ -180,28 +226,130 @@ static int _read_file (s4_t *s4, const char *filename, int flags)
 		s4->uuid[i] = hdr.uuid[i];
 	}
 
-	GHashTable *strings = _read_string (s4, file);
-	if (strings == NULL || _read_relations (s4, file, strings) == -1) {
-		fclose (file);
+	GHashTable *strings = _read_string (s4, &buf);
+	if (strings == NULL || _read_relations (s4, &buf, strings, func, userdata) == -1) {
+		g_mapped_file_unref (file);
 		s4_set_errno (S4E_INCONS);
 		return -1;
 	}
 	g_hash_table_destroy (strings);
 
-	fclose (file);
+	g_mapped_file_unref (file);
 	return 0;
 }
 
+/* A relation, all the pointers are constants */
+typedef struct {
+	const char *key_a;
+	const s4_val_t *val_a;
+	const char *key_b;
+	const s4_val_t *val_b;
+	const char *src;
+} tuple_t;
+
+static guint _tuple_hash (gconstpointer p)
+{
+	const tuple_t *t = p;
+	guint ret = g_direct_hash (t->key_a);
+
+	ret = ret * 31 + g_direct_hash (t->val_a);
+	ret = ret * 31 + g_direct_hash (t->key_b);
+	ret = ret * 31 + g_direct_hash (t->val_b);
+	ret = ret * 31 + g_direct_hash (t->src);
+
+	return ret;
+}
+
+static gboolean _tuple_equal (gconstpointer a, gconstpointer b)
+{
+	return memcmp (a, b, sizeof (tuple_t)) == 0;
+}
+
+/* Collects the relations read from file in a hash table */
+static void _collect_tuple (const char *key_a, const s4_val_t *val_a,
+		const char *key_b, const s4_val_t *val_b, const char *src, void *userdata)
+{
+	tuple_t *t = malloc (sizeof (tuple_t));
+
+	t->key_a = key_a;
+	t->val_a = val_a;
+	t->key_b = key_b;
+	t->val_b = val_b;
+	t->src = src;
+
+	g_hash_table_add (userdata, t);
+}
+
+typedef struct {
+	GHashTable *tuples;
+	oplist_t *list;
+} delta_data_t;
+
+/* Deletes the relations in the database that are not in the file,
+ * and removes the ones that are from the table
+ */
+static void _delta_tuple (const char *key_a, const s4_val_t *val_a,
+		const char *key_b, const s4_val_t *val_b, const char *src, void *userdata)
+{
+	delta_data_t *dd = userdata;
+	tuple_t t = {key_a, val_a, key_b, val_b, src};
+
+	if (!g_hash_table_remove (dd->tuples, &t))
+		_oplist_insert_del (dd->list, key_a, val_a, key_b, val_b, src);
+}
+
+/**
+ * Brings the database up to date with the file on disk.
+ * This is used when the log has wrapped past what we had redone,
+ * so the changes in between are only found in the file.
+ *
+ * Only the relations that differ between the database and the file
+ * are added or deleted, so the entries, indexes and cached queries
+ * that did not change are kept.
+ * No transaction may use the database while this runs.
+ *
+ * @param s4 The database
+ * @return 0 on success, non-zero on error
+ */
 int _reread_file (s4_t *s4)
 {
-	_free_relations (s4);
+	GHashTable *tuples;
+	GHashTableIter iter;
+	GPtrArray *entries;
+	delta_data_t dd;
+	tuple_t *t;
+	int ret;
+
+	tuples = g_hash_table_new_full (_tuple_hash, _tuple_equal, free, NULL);
+	ret = _read_file (s4, s4->filename, S4_EXISTS, _collect_tuple, tuples);
+	if (ret) {
+		g_hash_table_destroy (tuples);
+		return ret;
+	}
 
-	_index_free_data (s4->index_data);
-	_entry_free_data (s4->entry_data);
-	s4->index_data = _index_create_data ();
-	s4->entry_data = _entry_create_data ();
+	dd.tuples = tuples;
+	dd.list = _oplist_new (_transaction_dummy_alloc (s4));
+
+	/* Wait for a running checkpoint to finish with the entries */
+	g_mutex_lock (&s4->snapshot_lock);
+	entries = _entry_snapshot_begin (s4);
+	_entry_snapshot_foreach (s4, entries, _delta_tuple, &dd);
+	_entry_snapshot_end (s4, entries);
 
-	return _read_file (s4, s4->filename, S4_EXISTS);
+	g_hash_table_iter_init (&iter, tuples);
+	while (g_hash_table_iter_next (&iter, (void**)&t, NULL)) {
+		_oplist_insert_add (dd.list, t->key_a, t->val_a, t->key_b, t->val_b, t->src);
+	}
+
+	_oplist_execute (dd.list, 0);
+	_cache_invalidate (s4, dd.list);
+	g_mutex_unlock (&s4->snapshot_lock);
+
+	_transaction_dummy_free (_oplist_get_trans (dd.list));
+	_oplist_free (dd.list);
+	g_hash_table_destroy (tuples);
+
+	return 0;
 }
 
 /**
@@ -267,56 +415,72 @@ static int _get_string_number (save_data_t *sd, const char *str)
 }
 
 /*
- * A helper function converting a resultset into a list of int-pairs.
+ * A helper function converting a relation into an int-pair.
  */
-static void _result_to_pairs (s4_resultset_t *res, save_data_t *sd)
+static void _tuple_to_pair (const char *key_a, const s4_val_t *val_a,
+		const char *key_b, const s4_val_t *val_b, const char *src, void *userdata)
 {
-	const s4_resultrow_t *row;
-	int row_no;
-
-	for (row_no = 0; s4_resultset_get_row (res, row_no, &row); row_no++) {
-		int32_t va = 0, ka, i;
-		const s4_val_t *val_a, *val_b;
-		const char *key_a, *key_b, *src, *str;
-		const s4_result_t *id_res, *val_res;
-
-		s4_resultrow_get_col (row, 0, &id_res);
-		s4_resultrow_get_col (row, 1, &val_res);
+	save_data_t *sd = userdata;
+	s4_intpair_t *pair = malloc (sizeof (s4_intpair_t));
+	const char *str;
+	int32_t i;
 
-		val_a = s4_result_get_val (id_res);
-		key_a = s4_result_get_key (id_res);
+	pair->key_a = _get_string_number (sd, key_a);
+	pair->key_b = _get_string_number (sd, key_b);
+	pair->src = _get_string_number (sd, src);
 
-		ka = _get_string_number (sd, key_a);
+	if (s4_val_get_int (val_a, &i)) {
+		pair->val_a = i;
+		pair->key_a = -pair->key_a;
+	} else if (s4_val_get_str (val_a, &str)) {
+		pair->val_a = _get_string_number (sd, str);
+	}
 
-		if (s4_val_get_int (val_a, &i)) {
-			va = i;
-			ka = -ka;
-		} else if (s4_val_get_str (val_a, &str)) {
-			va = _get_string_number (sd, str);
-		}
+	if (s4_val_get_int (val_b, &i)) {
+		pair->val_b = i;
+		pair->key_b = -pair->key_b;
+	} else if (s4_val_get_str (val_b, &str)) {
+		pair->val_b = _get_string_number (sd, str);
+	}
 
-		for (; val_res != NULL; val_res = s4_result_next (val_res)) {
-			s4_intpair_t *pair = malloc (sizeof (s4_intpair_t));
+	sd->pairs = g_list_prepend (sd->pairs, pair);
+}
 
-			val_b = s4_result_get_val (val_res);
-			key_b = s4_result_get_key (val_res);
-			src = s4_result_get_src (val_res);
+/* Passes through the gate, waiting if a checkpoint has closed it */
+void _gate_enter (s4_t *s4)
+{
+	g_mutex_lock (&s4->gate_lock);
+	while (s4->gate_closed)
+		g_cond_wait (&s4->gate_cond, &s4->gate_lock);
+	s4->gate_users++;
+	g_mutex_unlock (&s4->gate_lock);
+}
 
-			pair->val_a = va;
-			pair->key_a = ka;
-			pair->key_b = _get_string_number (sd, key_b);
-			pair->src = _get_string_number (sd, src);
+void _gate_leave (s4_t *s4)
+{
+	g_mutex_lock (&s4->gate_lock);
+	s4->gate_users--;
+	if (s4->gate_users == 0)
+		g_cond_broadcast (&s4->gate_cond);
+	g_mutex_unlock (&s4->gate_lock);
+}
 
-			if (s4_val_get_int (val_b, &i)) {
-				pair->val_b = i;
-				pair->key_b = -pair->key_b;
-			} else if (s4_val_get_str (val_b, &str)) {
-				pair->val_b = _get_string_number (sd, str);
-			}
+/* Closes the gate and waits for everyone inside to leave */
+void _gate_close (s4_t *s4)
+{
+	g_mutex_lock (&s4->gate_lock);
+	s4->gate_closed = 1;
+	while (s4->gate_users)
+		g_cond_wait (&s4->gate_cond, &s4->gate_lock);
+	g_mutex_unlock (&s4->gate_lock);
+}
 
-			sd->pairs = g_list_prepend (sd->pairs, pair);
-		}
-	}
+void _gate_open (s4_t *s4)
+{
+	g_mutex_lock (&s4->gate_lock);
+	s4->gate_closed = 0;
+	g_cond_broadcast (&s4->gate_cond);
+	g_mutex_unlock (&s4->gate_lock);
 }
 
 /**
@@ -332,16 +496,16 @@ static int _write_file (s4_t *s4)
 	FILE *file;
 	s4_header_t hdr;
 	save_data_t sd;
-	s4_condition_t *cond;
-	s4_fetchspec_t *fs;
-	s4_resultset_t *res;
 	s4_transaction_t *trans;
+	GPtrArray *entries;
 
+	g_mutex_lock (&s4->checkpoint_lock);
 	_log_lock_db (s4);
 
 	file = fopen (s4->tmp_filename, "w");
 	if (file == NULL) {
 		_log_unlock_db (s4);
+		g_mutex_unlock (&s4->checkpoint_lock);
 		return 0;
 	}
 
@@ -349,30 +513,36 @@ static int _write_file (s4_t *s4)
 	sd.pairs = NULL;
 	sd.new_id = 1;
 
-	cond = s4_cond_new_filter (S4_FILTER_EXISTS, NULL, NULL, NULL, S4_CMP_BINARY, 0);
-
-	fs = s4_fetchspec_create ();
-	s4_fetchspec_add (fs, NULL, NULL, S4_FETCH_PARENT);
-	s4_fetchspec_add (fs, NULL, NULL, S4_FETCH_DATA);
+	/* Wait for the transactions that may change the database, and hold
+	 * new ones back only while the checkpoint is logged and the entries
+	 * are collected. Entries changed after that are copied first, so
+	 * the snapshot stays as it was when the checkpoint was logged.
+	 */
+	_gate_close (s4);
 
-	do {
-		trans = s4_begin (s4, 0);
-		res = s4_query (trans, fs, cond);
-		_transaction_writing (trans);
-	} while (!s4_commit (trans));
+	/* The transaction is read-only so it gets past the closed gate,
+	 * but it writes to the log, so the log is held exclusively
+	 */
+	_log_lock_file (s4, 1);
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+	_transaction_writing (trans);
+	s4_commit (trans);
+	_log_unlock_file (s4, 1);
+	hdr.last_checkpoint = _log_last_synced (s4);
 
-	_result_to_pairs (res, &sd);
+	g_mutex_lock (&s4->snapshot_lock);
+	entries = _entry_snapshot_begin (s4);
+	_gate_open (s4);
 
-	s4_cond_free (cond);
-	s4_fetchspec_free (fs);
-	s4_resultset_free (res);
+	_entry_snapshot_foreach (s4, entries, _tuple_to_pair, &sd);
+	_entry_snapshot_end (s4, entries);
+	g_mutex_unlock (&s4->snapshot_lock);
 
 	memcpy (hdr.magic, S4_MAGIC, S4_MAGIC_LEN);
 	hdr.version = S4_VERSION;
 	for (j = 0; j < 16; j++) {
 		hdr.uuid[j] = s4->uuid[j];
 	}
-	hdr.last_checkpoint = _log_last_synced (s4);
 
 	fwrite (&hdr, sizeof (s4_header_t), 1, file);
 	_write_strings (sd.strings, file);
@@ -388,6 +558,7 @@ static int _write_file (s4_t *s4)
 
 	_log_checkpoint (s4);
 	_log_unlock_db (s4);
+	g_mutex_unlock (&s4->checkpoint_lock);
 	return 1;
 }
 
@@ -431,6 +602,10 @@ static s4_t *_alloc (void)
 	s4_t* s4 = calloc (1, sizeof(s4_t));
 
 	g_mutex_init (&s4->sync_lock);
+	g_mutex_init (&s4->gate_lock);
+	g_mutex_init (&s4->checkpoint_lock);
+	g_mutex_init (&s4->snapshot_lock);
+	g_cond_init (&s4->gate_cond);
 	g_cond_init (&s4->sync_cond);
 	g_cond_init (&s4->sync_finished_cond);
 
@@ -438,6 +613,8 @@ static s4_t *_alloc (void)
 	s4->index_data = _index_create_data ();
 	s4->entry_data = _entry_create_data ();
 	s4->log_data = _log_create_data ();
+	s4->composite_data = _composite_create_data ();
+	s4->stats = _stats_create ();
 
 	return s4;
 }
@@ -452,6 +629,10 @@ static void _free (s4_t *s4)
 	_free_relations (s4);
 
 	g_mutex_clear (&s4->sync_lock);
+	g_mutex_clear (&s4->gate_lock);
+	g_mutex_clear (&s4->checkpoint_lock);
+	g_mutex_clear (&s4->snapshot_lock);
+	g_cond_clear (&s4->gate_cond);
 	g_cond_clear (&s4->sync_cond);
 	g_cond_clear (&s4->sync_finished_cond);
 
@@ -459,6 +640,9 @@ static void _free (s4_t *s4)
 	_index_free_data (s4->index_data);
 	_entry_free_data (s4->entry_data);
 	_log_free_data (s4->log_data);
+	_cache_free_data (s4->cache_data);
+	_composite_free_data (s4->composite_data);
+	_stats_free (s4->stats);
 
 	free (s4->filename);
 	g_free (s4->tmp_filename);
@@ -489,6 +673,23 @@ static void _free (s4_t *s4)
  * 		Creates a memory-only database. It will not read any files
  * 		on startup or write files on shutdown. Use this if you want
  * 		a temporary database.
+ * </P><P>
+ * @b S4_QUERY_CACHE
+ * <BR>
+ * 		Caches the results of queries run in read-only transactions.
+ * 		Identical queries are served from memory until a committed
+ * 		transaction changes one of the keys they depend on. Cached
+ * 		queries take no locks, they see the latest committed data.
+ * </P><P>
+ * @b S4_FOLLOWER
+ * <BR>
+ * 		Opens the database read-only, to follow changes made by
+ * 		other processes. Transactions do not lock the log, so they
+ * 		never hold back writers in other processes. Instead a
+ * 		background thread tails the log and applies new transactions
+ * 		as they are committed, between the transactions of this handle.
+ * 		Every transaction is read-only, and the follower never writes
+ * 		the database file.
  * <BR>
  *
  * @param filename The name of the file containing the database
@@ -509,13 +710,17 @@ s4_t *s4_open (const char *filename, const char **indices, int open_flags)
 
 	s4->open_flags = open_flags;
 
+	if (open_flags & S4_QUERY_CACHE) {
+		s4->cache_data = _cache_create_data ();
+	}
+
 	if (open_flags & S4_MEMORY) {
 		return s4;
 	}
 
 	s4->filename = strdup (filename);
 	s4->tmp_filename = g_strconcat (filename, ".chkpnt", NULL);
-	if (_read_file (s4, s4->filename, open_flags)) {
+	if (_read_file (s4, s4->filename, open_flags, _add_tuple, s4)) {
 		_free (s4);
 		return NULL;
 	}
@@ -530,6 +735,11 @@ s4_t *s4_open (const char *filename, const char **indices, int open_flags)
 	 */
 	s4_sync (s4);
 
+	if (open_flags & S4_FOLLOWER) {
+		_log_follow_start (s4);
+		return s4;
+	}
+
 	s4->sync_thread_run = 1;
 	s4->sync_thread = g_thread_new ("s4 sync", (GThreadFunc)_sync_thread, s4);
 
@@ -545,11 +755,14 @@ s4_t *s4_open (const char *filename, const char **indices, int open_flags)
 int s4_close (s4_t* s4)
 {
 	if (!(s4->open_flags & S4_MEMORY)) {
-		g_mutex_lock (&s4->sync_lock);
-		s4->sync_thread_run = 0;
-		g_cond_signal (&s4->sync_cond);
-		g_mutex_unlock (&s4->sync_lock);
-		g_thread_join (s4->sync_thread);
+		/* Followers never write the file, so they have no sync thread */
+		if (s4->sync_thread != NULL) {
+			g_mutex_lock (&s4->sync_lock);
+			s4->sync_thread_run = 0;
+			g_cond_signal (&s4->sync_cond);
+			g_mutex_unlock (&s4->sync_lock);
+			g_thread_join (s4->sync_thread);
+		}
 
 		_log_close (s4);
 	}
@@ -561,16 +774,216 @@ int s4_close (s4_t* s4)
 
 
 /**
- * Writes all changes to disk
+ * Writes all changes to disk.
+ * A database opened with S4_FOLLOWER is instead brought up to date
+ * with what other processes have committed.
  *
  * @param s4 The database to sync
  *
  */
 void s4_sync (s4_t *s4)
 {
+	gint64 start = g_get_monotonic_time ();
+
+	if (s4->open_flags & S4_FOLLOWER) {
+		_log_follow (s4);
+		return;
+	}
+
 	if (!_write_file (s4)) {
 		S4_ERROR ("s4_sync: could not write file");
 	}
+
+	_stats_inc (s4, S4_STATS_CHECKPOINTS);
+	_stats_sample (s4, S4_STATS_CHECKPOINT, g_get_monotonic_time () - start);
+}
+
+/**
+ * Sets the durability new transactions on the database get.
+ * Individual transactions may override it with s4_transaction_set_durability.
+ *
+ * S4_DURABILITY_ASYNC transactions are synced to disk at most a few
+ * hundred milliseconds after they are committed, so a crash may lose
+ * the last ones. S4_DURABILITY_NONE transactions are only synced when
+ * something else syncs the log, use it for databases that can be rebuilt.
+ *
+ * @param s4 The database
+ * @param durability The durability to use, S4_DURABILITY_FULL by default
+ */
+void s4_set_durability (s4_t *s4, s4_durability_t durability)
+{
+	g_atomic_int_set (&s4->durability, durability);
+}
+
+/**
+ * Gets the durability new transactions on the database get.
+ *
+ * @param s4 The database
+ * @return The durability
+ */
+s4_durability_t s4_get_durability (s4_t *s4)
+{
+	return g_atomic_int_get (&s4->durability);
+}
+
+/**
+ * Syncs every committed transaction to disk, including the ones
+ * committed with S4_DURABILITY_ASYNC or S4_DURABILITY_NONE.
+ *
+ * @param s4 The database
+ */
+void s4_flush (s4_t *s4)
+{
+	if (!(s4->open_flags & S4_MEMORY))
+		_log_flush_pending (s4);
+}
+
+/**
+ * Creates an index on a key while the database is in use, the same
+ * kind of index the indices passed to s4_open get. Transactions can
+ * keep running while the index is filled in from the entries already
+ * in the database, the work is split between one thread per processor.
+ * Queries start using the index once it is complete. Prepared queries
+ * keep the access path they were prepared with.
+ *
+ * @param s4 The database
+ * @param key The key to index
+ * @return 0 if the key already has an index, non-zero otherwise
+ */
+int s4_index_create (s4_t *s4, const char *key)
+{
+	s4_index_t *index = _index_create ();
+
+	_index_set_building (index, 1);
+	if (!_index_add (s4, key, index)) {
+		_index_free (index);
+		return 0;
+	}
+
+	_entry_build_index (s4, index, key);
+
+	return 1;
+}
+
+/**
+ * Drops the index on a key. It waits for the transactions using
+ * the index to finish, queries after that scan the entries instead.
+ *
+ * @param s4 The database
+ * @param key The key of the index
+ * @return 0 if the key has no index, non-zero otherwise
+ */
+int s4_index_drop (s4_t *s4, const char *key)
+{
+	return _index_drop (s4, key);
+}
+
+/* Creates a composite index, which is covering if include is non-NULL */
+static int _index_create_composite (s4_t *s4, const char **keys, const char **include,
+		s4_sourcepref_t *sp, s4_cmp_mode_t mode)
+{
+	s4_composite_t *index;
+
+	if (keys[0] == NULL)
+		return 0;
+
+	index = _composite_create (s4, keys, include, sp, mode);
+
+	_composite_set_building (index, 1);
+	if (!_composite_add (s4, index)) {
+		_composite_free (index);
+		return 0;
+	}
+
+	_entry_build_composite (s4, index);
+
+	return 1;
+}
+
+/**
+ * Creates an index over an ordered list of keys. It holds every
+ * combination of values an entry has for the keys, sorted by the
+ * first key, then the second and so on, so conditions on several
+ * keys at once are answered without checking the entries matching
+ * only one of them. Like s4_index_create it is filled in while
+ * transactions keep running.
+ *
+ * A query uses the index when its condition is a filter, or an AND of
+ * filters, using the same sourcepref and comparison mode as the index.
+ * There must be equality filters on the first keys of the index, and
+ * may be another monotonic filter on the key after them. The entries
+ * are then found in the order of the index, which is also the order
+ * of the rows in the resultset.
+ *
+ * @param s4 The database
+ * @param keys A NULL terminated list of the keys to index, in order
+ * @param sp The sourcepref deciding which values are indexed, like
+ * the sourcepref of a filter. May be NULL to index every value.
+ * @param mode The comparison mode to sort the values with
+ * @return 0 if there already is an index over the same keys
+ * or keys is empty, non-zero otherwise
+ */
+int s4_index_create_composite (s4_t *s4, const char **keys,
+		s4_sourcepref_t *sp, s4_cmp_mode_t mode)
+{
+	return _index_create_composite (s4, keys, NULL, sp, mode);
+}
+
+/**
+ * Creates a covering index over an ordered list of keys. It is used
+ * like the index s4_index_create_composite creates, but it also keeps
+ * copies of the values of its keys and of the included keys. A query
+ * whose condition only has filters the index narrows by, and whose
+ * fetchspec only fetches parents and covered keys using the
+ * sourcepref of the index, is answered from the copies. The entries
+ * are then not looked at or locked.
+ *
+ * @param s4 The database
+ * @param keys A NULL terminated list of the keys to index, in order
+ * @param include A NULL terminated list of other keys to copy into
+ * the index, may be empty
+ * @param sp The sourcepref deciding which values are indexed, like
+ * the sourcepref of a filter. May be NULL to index every value.
+ * @param mode The comparison mode to sort the values with
+ * @return 0 if there already is an index over the same keys
+ * or keys is empty, non-zero otherwise
+ */
+int s4_index_create_covering (s4_t *s4, const char **keys, const char **include,
+		s4_sourcepref_t *sp, s4_cmp_mode_t mode)
+{
+	return _index_create_composite (s4, keys, include, sp, mode);
+}
+
+/**
+ * Drops the index over a list of keys. Like s4_index_drop it
+ * waits for the transactions using the index to finish.
+ *
+ * @param s4 The database
+ * @param keys A NULL terminated list of the keys of the index, in order
+ * @return 0 if there is no such index, non-zero otherwise
+ */
+int s4_index_drop_composite (s4_t *s4, const char **keys)
+{
+	return _composite_drop (s4, keys);
+}
+
+/**
+ * Returns the durability the last successful s4_commit in this thread
+ * reached. Like s4_errno it is kept separately for every thread.
+ *
+ * The durability reached is S4_DURABILITY_NONE for memory databases,
+ * and S4_DURABILITY_FULL for transactions that write the database to disk.
+ *
+ * @return The durability reached, or S4_DURABILITY_NONE if nothing
+ * has been committed in this thread
+ */
+s4_durability_t s4_last_durability (void)
+{
+	s4_durability_t *d = g_private_get (&_durability);
+	if (d == NULL) {
+		return S4_DURABILITY_NONE;
+	}
+	return *d;
 }
 
 /**
@@ -605,6 +1018,22 @@ void s4_set_errno (s4_errno_t err)
 	*i = err;
 }
 
+/**
+ * Sets the durability returned by s4_last_durability
+ *
+ * @param durability The durability reached
+ */
+void _set_last_durability (s4_durability_t durability)
+{
+	s4_durability_t *d = g_private_get (&_durability);
+	if (d == NULL) {
+		d = malloc (sizeof (s4_durability_t));
+		g_private_set (&_durability, d);
+	}
+
+	*d = durability;
+}
+
 /**
  * @}
  */
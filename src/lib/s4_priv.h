@@ -25,6 +25,8 @@ typedef struct s4_index_data_St s4_index_data_t;
 typedef struct s4_const_data_St s4_const_data_t;
 typedef struct s4_entry_data_St s4_entry_data_t;
 typedef struct s4_log_data_St s4_log_data_t;
+typedef struct s4_cache_data_St s4_cache_data_t;
+typedef struct s4_composite_data_St s4_composite_data_t;
 
 struct s4_St {
 	int open_flags;
@@ -33,6 +35,18 @@ struct s4_St {
 	s4_const_data_t *const_data;
 	s4_entry_data_t *entry_data;
 	s4_log_data_t *log_data;
+	s4_cache_data_t *cache_data;
+	s4_composite_data_t *composite_data;
+	s4_stats_t *stats;
+	int durability;
+
+	/* Transactions that may change the database pass through the gate.
+	 * A checkpoint closes it while it starts its snapshot.
+	 */
+	GMutex gate_lock;
+	GCond gate_cond;
+	int gate_users, gate_closed;
+	GMutex checkpoint_lock, snapshot_lock;
 
 	GCond sync_cond, sync_finished_cond;
 	int sync_thread_run;
@@ -47,7 +61,12 @@ struct s4_St {
 typedef struct str_St str_t;
 
 void s4_set_errno (s4_errno_t err);
+void _set_last_durability (s4_durability_t durability);
 void _start_sync (s4_t *s4);
+void _gate_enter (s4_t *s4);
+void _gate_leave (s4_t *s4);
+void _gate_close (s4_t *s4);
+void _gate_open (s4_t *s4);
 void _sync (s4_t *s4);
 int _reread_file (s4_t *s4);
 
@@ -57,6 +76,8 @@ s4_entry_data_t *_entry_create_data (void);
 void _entry_free_data (s4_entry_data_t *data);
 
 s4_val_t *s4_val_new_internal_string (const char *str, s4_t *s4);
+uint32_t _val_get_id (const s4_val_t *val);
+void _val_set_id (s4_val_t *val, uint32_t id);
 
 const char *_string_lookup (s4_t *s4, const char *str);
 const char *_string_lookup_casefolded (s4_t *s4, const char *str);
@@ -64,6 +85,9 @@ const char *_string_lookup_collated (s4_t *s4, const char *str);
 const s4_val_t *_string_lookup_val (s4_t *s4, const char *str);
 const s4_val_t *_int_lookup_val (s4_t *s4, int32_t i);
 const s4_val_t *_const_lookup (s4_t *s4, const s4_val_t *val);
+uint32_t _string_id (const char *str);
+const s4_val_t *_const_get (s4_t *s4, uint32_t id);
+const char *_const_get_string (s4_t *s4, uint32_t id);
 s4_const_data_t *_const_create_data (void);
 void _const_free_data (s4_const_data_t *data);
 
@@ -75,23 +99,77 @@ typedef struct {
 
 typedef struct s4_index_St s4_index_t;
 typedef int (*index_function_t)(const s4_val_t *val, void *data);
+typedef int (*index_value_function_t)(const s4_val_t *val, int count, void *data);
 
 s4_index_data_t *_index_create_data (void);
 void _index_free_data (s4_index_data_t *data);
 s4_index_t *_index_get_a (s4_t *s4, const char *key, int create);
 s4_index_t *_index_get_b (s4_t *s4, const char *key);
+int _index_get_b_shared (s4_t *s4, const char *key,
+		s4_transaction_t *trans, s4_index_t **index);
+int _index_get_b_exclusive (s4_t *s4, const char *key,
+		s4_transaction_t *trans, s4_index_t **index);
+int _index_drop (s4_t *s4, const char *key);
+void _index_set_building (s4_index_t *index, int building);
+int _index_is_dropped (s4_index_t *index);
 GList *_index_get_all_a (s4_t *s4);
 GList *_index_get_all_b (s4_t *s4);
 s4_index_t *_index_create (void);
 int _index_add (s4_t *s4, const char *key, s4_index_t *index);
 int _index_insert (s4_index_t *index, const s4_val_t *val, void *data);
 int _index_delete (s4_index_t *index, const s4_val_t *val, void *data);
+int _index_set_count (s4_index_t *index, const s4_val_t *val, void *data, int count);
+void *_index_lookup_int (s4_index_t *index, int32_t i);
 GList *_index_search (s4_index_t *index, index_function_t func, void *data);
 GList *_index_lsearch (s4_index_t *index, index_function_t func, void *data);
+int _index_foreach_value (s4_index_t *index, const s4_val_t *start,
+		const s4_val_t *end, const char *prefix,
+		index_value_function_t func, void *data);
 void _index_free (s4_index_t *index);
 int _index_lock_shared (s4_index_t *index, s4_transaction_t *trans);
 int _index_lock_exclusive (s4_index_t *index, s4_transaction_t *trans);
 
+typedef struct s4_composite_St s4_composite_t;
+typedef struct {
+	const char *key;
+	const s4_val_t *val;
+	const char *src;
+} composite_value_t;
+s4_composite_data_t *_composite_create_data (void);
+void _composite_free_data (s4_composite_data_t *data);
+s4_composite_t *_composite_create (s4_t *s4, const char **keys,
+		const char **include, s4_sourcepref_t *sp, s4_cmp_mode_t mode);
+void _composite_free (s4_composite_t *index);
+int _composite_add (s4_t *s4, s4_composite_t *index);
+int _composite_drop (s4_t *s4, const char **keys);
+GList *_composite_get_for_key (s4_t *s4, const char *key);
+s4_composite_t *_composite_find (s4_t *s4, s4_condition_t *cond, int *keys);
+int _composite_get_shared (s4_t *s4, s4_condition_t *cond,
+		s4_transaction_t *trans, s4_composite_t **index);
+void _composite_set_building (s4_composite_t *index, int building);
+int _composite_is_dropped (s4_composite_t *index);
+int _composite_get_key_count (s4_composite_t *index);
+const char *_composite_get_key (s4_composite_t *index, int key);
+s4_sourcepref_t *_composite_get_sourcepref (s4_composite_t *index);
+int _composite_get_cover_count (s4_composite_t *index);
+const char *_composite_get_cover_key (s4_composite_t *index, int key);
+void _composite_insert (s4_composite_t *index, const s4_val_t **vals, void *data,
+		const composite_value_t *values, int value_count);
+int _composite_delete (s4_composite_t *index, const s4_val_t **vals, void *data);
+GList *_composite_search (s4_composite_t *index, s4_condition_t *cond);
+int _composite_covers (s4_composite_t *index, s4_condition_t *cond, s4_fetchspec_t *fs);
+int _composite_fetch (s4_composite_t *index, s4_condition_t *cond,
+		s4_fetchspec_t *fs, s4_resultset_t *set);
+int _composite_lock_shared (s4_composite_t *index, s4_transaction_t *trans);
+int _composite_lock_exclusive (s4_composite_t *index, s4_transaction_t *trans);
+
+
+int _cond_normalize (s4_condition_t *cond, GString *str, GList **keys);
+int _cond_set_value (s4_condition_t *cond, const s4_val_t *val);
+void _cond_get_filters (s4_condition_t *cond, GPtrArray *filters);
+void _fetchspec_normalize (s4_fetchspec_t *spec, GString *str, GList **keys);
+void _sourcepref_normalize (s4_sourcepref_t *sp, GString *str);
+int _sourcepref_equal (s4_sourcepref_t *sp1, s4_sourcepref_t *sp2);
 
 int32_t s4_cond_get_ikey (s4_condition_t *cond);
 void s4_cond_set_ikey (s4_condition_t *cond, int32_t ikey);
@@ -99,6 +177,21 @@ void s4_cond_set_ikey (s4_condition_t *cond, int32_t ikey);
 s4_result_t *s4_result_create (s4_result_t *next, const char *key, const s4_val_t *val, const char *src);
 void s4_result_free (s4_result_t *res);
 
+s4_resultset_t *s4_resultset_copy (const s4_resultset_t *set);
+/* GLib only has atomic operations on ints and pointers,
+ * these are used for the 64 bit statistics counters
+ */
+#define _atomic_get64(p) __sync_fetch_and_add ((p), 0)
+#define _atomic_add64(p,v) ((void) __sync_fetch_and_add ((p), (v)))
+#define _atomic_reset64(p) ((void) __sync_and_and_fetch ((p), 0))
+
+s4_stats_t *_stats_create (void);
+void _stats_free (s4_stats_t *stats);
+void _stats_inc (s4_t *s4, s4_stats_counter_t counter);
+void _stats_add (s4_t *s4, s4_stats_counter_t counter, int64_t n);
+void _stats_sample (s4_t *s4, s4_stats_histogram_t hist, int64_t us);
+
+void _resultset_set_stats (s4_resultset_t *set, s4_query_stats_t *stats);
 s4_resultrow_t *s4_resultrow_create (int colcount);
 s4_resultrow_t *s4_resultrow_ref (s4_resultrow_t *row);
 void s4_resultrow_unref (s4_resultrow_t *row);
@@ -107,14 +200,49 @@ int _s4_add (s4_transaction_t *trans, const char *key_a, const s4_val_t *val_a,
 		const char *key_b, const s4_val_t *val_b, const char *src);
 int _s4_del (s4_transaction_t *trans, const char *key_a, const s4_val_t *val_a,
 		const char *key_b, const s4_val_t *val_b, const char *src);
+int _s4_add_many (s4_transaction_t *trans, const s4_tuple_t *tuples, int count);
+int _s4_del_many (s4_transaction_t *trans, const s4_tuple_t *tuples, int count);
+int _s4_del_source (s4_transaction_t *trans, const char *key_a, const s4_val_t *val_a,
+		const char *src, GPtrArray *deleted);
+int _s4_source_entries (s4_transaction_t *trans, const char *src,
+		s4_condition_t *cond, GList **entries);
+typedef enum {
+	QUERY_PATH_INDEX_A,
+	QUERY_PATH_INDEX_B,
+	QUERY_PATH_COMPOSITE,
+	QUERY_PATH_SCAN
+} query_path_t;
+
+typedef struct s4_entry_St s4_entry_t;
+typedef void (*entry_func_t)(s4_entry_t *entry, void *userdata);
+typedef void (*value_func_t)(const s4_val_t *val, void *userdata);
+typedef void (*tuple_func_t)(const char *key_a, const s4_val_t *val_a,
+		const char *key_b, const s4_val_t *val_b, const char *src, void *userdata);
+
 s4_resultset_t *_s4_query (s4_transaction_t *trans, s4_fetchspec_t *fs, s4_condition_t *cond);
+query_path_t _s4_query_path (s4_t *s4, s4_condition_t *cond);
+s4_resultset_t *_s4_query_prepared (s4_transaction_t *trans, s4_fetchspec_t *fs,
+		s4_condition_t *cond, query_path_t path);
+int _s4_query_foreach (s4_transaction_t *trans, s4_condition_t *cond,
+		query_path_t path, entry_func_t func, void *userdata);
+int _entry_foreach_value (s4_t *s4, s4_entry_t *entry, const char *key,
+		s4_sourcepref_t *sp, value_func_t func, void *userdata);
+const char *_entry_get_key (s4_entry_t *entry);
+const s4_val_t *_entry_get_val (s4_entry_t *entry);
 void _free_relations (s4_t *s4);
+GPtrArray *_entry_snapshot_begin (s4_t *s4);
+void _entry_snapshot_foreach (s4_t *s4, GPtrArray *entries, tuple_func_t func, void *userdata);
+void _entry_snapshot_end (s4_t *s4, GPtrArray *entries);
+void _entry_build_index (s4_t *s4, s4_index_t *index, const char *key);
+void _entry_build_composite (s4_t *s4, s4_composite_t *index);
 
 typedef struct s4_lock_St s4_lock_t;
 s4_lock_t *_lock_alloc (void);
 void _lock_free (s4_lock_t *lock);
 int _lock_exclusive (s4_lock_t *lock, s4_transaction_t *trans);
 int _lock_shared (s4_lock_t *lock, s4_transaction_t *trans);
+int _lock_validate (s4_lock_t *lock, s4_transaction_t *trans, unsigned int version);
+unsigned int _lock_get_version (s4_lock_t *lock);
 void _lock_unlock_all (s4_transaction_t *trans);
 
 s4_t *_transaction_get_db (s4_transaction_t *trans);
@@ -123,10 +251,27 @@ s4_lock_t *_transaction_get_waiting_for (s4_transaction_t *trans);
 void _transaction_set_waiting_for (s4_transaction_t *trans, s4_lock_t *waiting_for);
 GList *_transaction_get_locks (s4_transaction_t *trans);
 void  _transaction_add_lock (s4_transaction_t *trans, s4_lock_t *lock);
+void _transaction_foreach_fast_lock (s4_transaction_t *trans, GFunc func, void *data);
+int _transaction_has_fast_lock (s4_transaction_t *trans, s4_lock_t *lock);
+void  _transaction_add_fast_lock (s4_transaction_t *trans, s4_lock_t *lock);
+void _transaction_count_lock (s4_transaction_t *trans);
 void _transaction_set_deadlocked (s4_transaction_t *trans);
+int _transaction_is_optimistic (s4_transaction_t *trans);
+void _transaction_add_read (s4_transaction_t *trans, s4_lock_t *lock, unsigned int version);
 s4_transaction_t *_transaction_dummy_alloc (s4_t *s4);
 void _transaction_dummy_free (s4_transaction_t *trans);
 int _transaction_get_flags (s4_transaction_t *trans);
+int _transaction_is_failed (s4_transaction_t *trans);
+s4_query_stats_t *_transaction_get_stats (s4_transaction_t *trans);
+
+void _query_stats_begin (s4_query_stats_t *stats);
+void _query_stats_end (s4_query_stats_t *stats);
+void _query_stats_set_path (s4_query_stats_t *stats, s4_access_path_t path);
+void _query_stats_add_candidates (s4_query_stats_t *stats, int candidates);
+void _query_stats_add_rows (s4_query_stats_t *stats, int rows);
+void _query_stats_add_lock (s4_query_stats_t *stats, int64_t wait_us);
+void _query_stats_add_fetch (s4_query_stats_t *stats, int64_t us);
+void _query_stats_add_sort (s4_query_stats_t *stats, int64_t us);
 
 typedef struct oplist_St oplist_t;
 oplist_t *_oplist_new (s4_transaction_t *trans);
@@ -141,6 +286,8 @@ void _oplist_insert_del (oplist_t *list,
 		const char *key_a, const s4_val_t *val_a,
 		const char *key_b, const s4_val_t *val_b,
 		const char *src);
+GPtrArray *_oplist_insert_del_source (oplist_t *list,
+		const char *key_a, const s4_val_t *val_a, const char *src);
 void _oplist_insert_writing (oplist_t *list);
 int _oplist_get_add (oplist_t *list,
 		const char **key_a, const s4_val_t **val_a,
@@ -150,24 +297,47 @@ int _oplist_get_del (oplist_t *list,
 		const char **key_a, const s4_val_t **val_a,
 		const char **key_b, const s4_val_t **val_b,
 		const char **src);
+int _oplist_get_del_source (oplist_t *list,
+		const char **key_a, const s4_val_t **val_a,
+		const char **src, GPtrArray **deleted);
 int _oplist_get_writing (oplist_t *list);
 int _oplist_next (oplist_t *list);
 void _oplist_first (oplist_t *list);
 void _oplist_last (oplist_t *list);
 int _oplist_rollback (oplist_t *list);
 int _oplist_execute (oplist_t *list, int rollback_on_failure);
+int _oplist_execute_pending (oplist_t *list);
+void _oplist_set_executed (oplist_t *list);
 
 s4_log_data_t *_log_create_data (void);
 void _log_free_data (s4_log_data_t *data);
-void _log_lock_file (s4_t *s4);
-void _log_unlock_file (s4_t *s4);
+void _log_lock_file (s4_t *s4, int write);
+void _log_unlock_file (s4_t *s4, int write);
 void _log_lock_db (s4_t *s4);
 void _log_unlock_db (s4_t *s4);
-int _log_write (oplist_t *list);
+int _log_write (oplist_t *list, s4_durability_t *durability);
+void _log_flush_pending (s4_t *s4);
 void _log_checkpoint (s4_t *s4);
+void _log_follow (s4_t *s4);
+void _log_follow_start (s4_t *s4);
 int _log_open (s4_t *s4);
 int _log_close (s4_t *s4);
 log_number_t _log_last_synced (s4_t *s4);
 void _log_init (s4_t *s4, log_number_t last_checkpoint);
 
+s4_cache_data_t *_cache_create_data (void);
+void _cache_free_data (s4_cache_data_t *data);
+void _normalize_string (GString *str, const char *s);
+void _normalize_val (GString *str, const s4_val_t *val);
+s4_resultset_t *_cache_query (s4_transaction_t *trans, s4_fetchspec_t *fs,
+		s4_condition_t *cond, query_path_t path);
+void _cache_invalidate (s4_t *s4, oplist_t *list);
+void _cache_clear (s4_t *s4);
+
+s4_resultset_t *_prepared_run (s4_transaction_t *trans, s4_prepared_t *prep);
+
+s4_aggresult_t *_aggresult_create (int col_count);
+s4_aggresult_t *_aggregate_run (s4_transaction_t *trans, s4_aggspec_t *spec,
+		s4_condition_t *cond);
+
 #endif
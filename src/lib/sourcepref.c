@@ -22,6 +22,7 @@ struct s4_sourcepref_St {
 	GPatternSpec **specs;
 	int spec_count;
 	int ref_count;
+	char *normalized;
 };
 
 /**
@@ -56,6 +57,7 @@ static int _get_priority (s4_sourcepref_t *sp, const char *src)
 s4_sourcepref_t *s4_sourcepref_create (const char **srcprefs)
 {
 	int i;
+	GString *normalized = g_string_new (NULL);
 	s4_sourcepref_t *sp = malloc (sizeof (s4_sourcepref_t));
 	sp->table = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, free);
 	g_mutex_init (&sp->lock);
@@ -66,8 +68,12 @@ s4_sourcepref_t *s4_sourcepref_create (const char **srcprefs)
 	sp->spec_count = i;
 	sp->ref_count = 1;
 
-	for (i = 0; i < sp->spec_count; i++)
+	for (i = 0; i < sp->spec_count; i++) {
 		sp->specs[i] = g_pattern_spec_new (srcprefs[i]);
+		_normalize_string (normalized, srcprefs[i]);
+	}
+
+	sp->normalized = g_string_free (normalized, FALSE);
 
 	return sp;
 }
@@ -90,6 +96,7 @@ void s4_sourcepref_unref (s4_sourcepref_t *sp)
 			g_pattern_spec_free (sp->specs[i]);
 
 		free (sp->specs);
+		g_free (sp->normalized);
 		free (sp);
 	}
 }
@@ -136,5 +143,44 @@ int s4_sourcepref_get_priority (s4_sourcepref_t *sp, const char *src)
 }
 
 /**
+ * @{
+ * @internal
+ */
+
+/**
+ * Appends a normalized description of a sourcepref to a string.
+ * Sourceprefs created from the same patterns get the same description.
+ *
+ * @param sp The sourcepref to describe, may be NULL
+ * @param str The string to append to
+ */
+void _sourcepref_normalize (s4_sourcepref_t *sp, GString *str)
+{
+	if (sp == NULL) {
+		g_string_append_c (str, '-');
+	} else {
+		g_string_append_printf (str, "P%i:%s", sp->spec_count, sp->normalized);
+	}
+}
+
+/**
+ * Checks if two sourceprefs give sources the same priorities.
+ *
+ * @param sp1 The first sourcepref, may be NULL
+ * @param sp2 The second sourcepref, may be NULL
+ * @return non-zero if they were created from the same patterns, 0 otherwise
+ */
+int _sourcepref_equal (s4_sourcepref_t *sp1, s4_sourcepref_t *sp2)
+{
+	if (sp1 == sp2)
+		return 1;
+	if (sp1 == NULL || sp2 == NULL)
+		return 0;
+
+	return sp1->spec_count == sp2->spec_count && !strcmp (sp1->normalized, sp2->normalized);
+}
+
+/**
+ * @}
  * @}
  */
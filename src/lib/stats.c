@@ -0,0 +1,282 @@
+/*  S4 - An XMMS2 medialib backend
+ *  Copyright (C) 2009, 2010 Sivert Berg
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include "s4_priv.h"
+#include <stdlib.h>
+
+/* Used both for the live statistics of a database and for snapshots */
+struct s4_stats_St {
+	uint64_t counters[S4_STATS_COUNTER_COUNT];
+	uint64_t buckets[S4_STATS_HISTOGRAM_COUNT][S4_STATS_BUCKETS];
+	uint64_t sum_us[S4_STATS_HISTOGRAM_COUNT];
+};
+
+static const char *counter_names[S4_STATS_COUNTER_COUNT] = {
+	"locks",
+	"lock_waits",
+	"lock_upgrades",
+	"deadlocks",
+	"commits",
+	"commit_failures",
+	"aborts",
+	"logfull_syncs",
+	"log_syncs",
+	"checkpoints",
+	"conflicts"
+};
+
+static const char *histogram_names[S4_STATS_HISTOGRAM_COUNT] = {
+	"lock_wait",
+	"commit",
+	"log_sync",
+	"checkpoint"
+};
+
+/**
+ * @defgroup Stats Statistics
+ * @ingroup S4
+ * @brief Counters and latency histograms for a database
+ *
+ * Every database counts lock acquisitions, waits, deadlocks, commits
+ * and syncs, and keeps histograms of how long waits, commits and syncs
+ * take. The numbers are updated with atomic operations and only where
+ * the event happens, so keeping them costs close to nothing.
+ *
+ * Latencies are put in buckets by powers of two. Bucket 0 holds
+ * samples below 1 microsecond, bucket b holds samples in
+ * [2^(b-1), 2^b) microseconds, and the last bucket holds everything above.
+ *
+ * @{
+ */
+
+/**
+ * Takes a snapshot of the statistics of a database.
+ * The counters are read one by one while the database is in use,
+ * so they may be off by the events happening during the snapshot.
+ *
+ * @param s4 The database
+ * @return A snapshot, free it with s4_stats_free
+ */
+s4_stats_t *s4_stats_snapshot (s4_t *s4)
+{
+	s4_stats_t *ret = malloc (sizeof (s4_stats_t));
+	int i, j;
+
+	for (i = 0; i < S4_STATS_COUNTER_COUNT; i++) {
+		ret->counters[i] = _atomic_get64 (&s4->stats->counters[i]);
+	}
+	for (i = 0; i < S4_STATS_HISTOGRAM_COUNT; i++) {
+		for (j = 0; j < S4_STATS_BUCKETS; j++) {
+			ret->buckets[i][j] = _atomic_get64 (&s4->stats->buckets[i][j]);
+		}
+		ret->sum_us[i] = _atomic_get64 (&s4->stats->sum_us[i]);
+	}
+
+	return ret;
+}
+
+/**
+ * Sets all the statistics of a database to zero.
+ *
+ * @param s4 The database
+ */
+void s4_stats_reset (s4_t *s4)
+{
+	int i, j;
+
+	for (i = 0; i < S4_STATS_COUNTER_COUNT; i++) {
+		_atomic_reset64 (&s4->stats->counters[i]);
+	}
+	for (i = 0; i < S4_STATS_HISTOGRAM_COUNT; i++) {
+		for (j = 0; j < S4_STATS_BUCKETS; j++) {
+			_atomic_reset64 (&s4->stats->buckets[i][j]);
+		}
+		_atomic_reset64 (&s4->stats->sum_us[i]);
+	}
+}
+
+/**
+ * Frees a snapshot.
+ *
+ * @param stats The snapshot to free
+ */
+void s4_stats_free (s4_stats_t *stats)
+{
+	free (stats);
+}
+
+/**
+ * Gets the value of a counter.
+ *
+ * @param stats The snapshot
+ * @param counter The counter
+ * @return The number of times the event has happened
+ */
+uint64_t s4_stats_get_counter (const s4_stats_t *stats, s4_stats_counter_t counter)
+{
+	return stats->counters[counter];
+}
+
+/**
+ * Gets the number of samples in a histogram.
+ *
+ * @param stats The snapshot
+ * @param hist The histogram
+ * @return The number of samples
+ */
+uint64_t s4_stats_get_count (const s4_stats_t *stats, s4_stats_histogram_t hist)
+{
+	uint64_t ret = 0;
+	int i;
+
+	for (i = 0; i < S4_STATS_BUCKETS; i++) {
+		ret += stats->buckets[hist][i];
+	}
+
+	return ret;
+}
+
+/**
+ * Gets the sum of the samples in a histogram.
+ *
+ * @param stats The snapshot
+ * @param hist The histogram
+ * @return The sum in microseconds
+ */
+uint64_t s4_stats_get_sum_us (const s4_stats_t *stats, s4_stats_histogram_t hist)
+{
+	return stats->sum_us[hist];
+}
+
+/**
+ * Gets the number of samples in a bucket of a histogram.
+ *
+ * @param stats The snapshot
+ * @param hist The histogram
+ * @param bucket The bucket, from 0 to S4_STATS_BUCKETS - 1
+ * @return The number of samples, 0 if bucket is out of range
+ */
+uint64_t s4_stats_get_bucket (const s4_stats_t *stats, s4_stats_histogram_t hist, int bucket)
+{
+	if (bucket < 0 || bucket >= S4_STATS_BUCKETS)
+		return 0;
+
+	return stats->buckets[hist][bucket];
+}
+
+/**
+ * Estimates a percentile of a histogram.
+ *
+ * @param stats The snapshot
+ * @param hist The histogram
+ * @param p The percentile, between 0 and 100
+ * @return The upper bound of the bucket the percentile falls in,
+ * in microseconds. 0 if the histogram is empty.
+ */
+uint64_t s4_stats_get_percentile (const s4_stats_t *stats, s4_stats_histogram_t hist, double p)
+{
+	uint64_t count = s4_stats_get_count (stats, hist);
+	uint64_t seen = 0, wanted;
+	int i;
+
+	if (count == 0)
+		return 0;
+
+	wanted = (uint64_t)(count * p / 100.0);
+	if (wanted >= count)
+		wanted = count - 1;
+
+	for (i = 0; i < S4_STATS_BUCKETS - 1; i++) {
+		seen += stats->buckets[hist][i];
+		if (seen > wanted)
+			break;
+	}
+
+	return (uint64_t)1 << i;
+}
+
+/**
+ * Gets the name of a counter.
+ *
+ * @param counter The counter
+ * @return A short name, like "lock_waits"
+ */
+const char *s4_stats_counter_name (s4_stats_counter_t counter)
+{
+	if (counter < 0 || counter >= S4_STATS_COUNTER_COUNT)
+		return NULL;
+
+	return counter_names[counter];
+}
+
+/**
+ * Gets the name of a histogram.
+ *
+ * @param hist The histogram
+ * @return A short name, like "commit"
+ */
+const char *s4_stats_histogram_name (s4_stats_histogram_t hist)
+{
+	if (hist < 0 || hist >= S4_STATS_HISTOGRAM_COUNT)
+		return NULL;
+
+	return histogram_names[hist];
+}
+
+/**
+ * @}
+ */
+
+/**
+ * @{
+ * @internal
+ */
+
+s4_stats_t *_stats_create (void)
+{
+	return calloc (1, sizeof (s4_stats_t));
+}
+
+void _stats_free (s4_stats_t *stats)
+{
+	free (stats);
+}
+
+void _stats_inc (s4_t *s4, s4_stats_counter_t counter)
+{
+	_atomic_add64 (&s4->stats->counters[counter], 1);
+}
+
+void _stats_add (s4_t *s4, s4_stats_counter_t counter, int64_t n)
+{
+	_atomic_add64 (&s4->stats->counters[counter], n);
+}
+
+void _stats_sample (s4_t *s4, s4_stats_histogram_t hist, int64_t us)
+{
+	int bucket = 0;
+
+	if (us < 0)
+		us = 0;
+
+	while (bucket < S4_STATS_BUCKETS - 1 && ((uint64_t)1 << bucket) <= (uint64_t)us)
+		bucket++;
+
+	_atomic_add64 (&s4->stats->buckets[hist][bucket], 1);
+	_atomic_add64 (&s4->stats->sum_us[hist], us);
+}
+
+/**
+ * @}
+ */
@@ -15,6 +15,9 @@
 #include "s4_priv.h"
 #include <stdlib.h>
 
+/* The number of fast path locks a transaction keeps without a hash table */
+#define TRANSACTION_FAST_INLINE 8
+
 /**
  *
  * @defgroup Transactions Transactions
@@ -29,17 +32,67 @@ struct s4_transaction_St {
 	s4_t *s4;
 	oplist_t *ops;
 	GList *locks;
+	/* Read-only locks taken without the lock's mutex. The first few are
+	 * kept in fast_inline, the rest in the fast_locks set
+	 */
+	s4_lock_t *fast_inline[TRANSACTION_FAST_INLINE];
+	int fast_count;
+	GHashTable *fast_locks;
+	/* Locks taken, added to the database statistics when it is freed */
+	int lock_count;
 	s4_lock_t *waiting_for;
 	int error_code;
 	int restartable, failed;
+	s4_durability_t durability;
+
+	/* Set if the transaction passed through the checkpoint gate */
+	int gated;
+
+	/* Statistics for the queries run in this transaction, and
+	 * whether a query is running right now
+	 */
+	s4_query_stats_t *stats;
+	int querying;
+
+	/* The version of every lock an optimistic transaction has read
+	 * under, checked when it commits
+	 */
+	GHashTable *reads;
+	int committing;
 };
 
 
+/* Forgets the locks trans took through the fast path */
+static void _transaction_clear_fast_locks (s4_transaction_t *trans)
+{
+	if (trans->fast_locks != NULL)
+		g_hash_table_destroy (trans->fast_locks);
+	trans->fast_locks = NULL;
+	trans->fast_count = 0;
+}
+
+/* Adds the locks trans took to the statistics of the database */
+static void _transaction_flush_lock_count (s4_transaction_t *trans)
+{
+	if (trans->lock_count > 0)
+		_stats_add (trans->s4, S4_STATS_LOCKS, trans->lock_count);
+	trans->lock_count = 0;
+}
+
 static void _transaction_free (s4_transaction_t *trans)
 {
 	_lock_unlock_all (trans);
 	g_list_free (trans->locks);
+	_transaction_clear_fast_locks (trans);
+	_transaction_flush_lock_count (trans);
 	_oplist_free (trans->ops);
+	s4_query_stats_unref (trans->stats);
+	if (trans->reads != NULL)
+		g_hash_table_destroy (trans->reads);
+
+	if (trans->gated)
+		_gate_leave (trans->s4);
+
 	free (trans);
 }
 
@@ -68,6 +121,56 @@ void _transaction_add_lock (s4_transaction_t *trans, s4_lock_t *lock)
 	trans->locks = g_list_prepend (trans->locks, lock);
 }
 
+/* Calls func with every lock trans took through the fast path, and data */
+void _transaction_foreach_fast_lock (s4_transaction_t *trans, GFunc func, void *data)
+{
+	GHashTableIter iter;
+	s4_lock_t *lock;
+	int i;
+
+	for (i = 0; i < MIN (trans->fast_count, TRANSACTION_FAST_INLINE); i++) {
+		func (trans->fast_inline[i], data);
+	}
+
+	if (trans->fast_locks != NULL) {
+		g_hash_table_iter_init (&iter, trans->fast_locks);
+		while (g_hash_table_iter_next (&iter, (void**)&lock, NULL)) {
+			func (lock, data);
+		}
+	}
+}
+
+int _transaction_has_fast_lock (s4_transaction_t *trans, s4_lock_t *lock)
+{
+	int i;
+
+	for (i = 0; i < MIN (trans->fast_count, TRANSACTION_FAST_INLINE); i++) {
+		if (trans->fast_inline[i] == lock)
+			return 1;
+	}
+
+	return trans->fast_locks != NULL && g_hash_table_contains (trans->fast_locks, lock);
+}
+
+void _transaction_add_fast_lock (s4_transaction_t *trans, s4_lock_t *lock)
+{
+	if (trans->fast_count < TRANSACTION_FAST_INLINE) {
+		trans->fast_inline[trans->fast_count] = lock;
+	} else {
+		if (trans->fast_locks == NULL)
+			trans->fast_locks = g_hash_table_new (NULL, NULL);
+		g_hash_table_insert (trans->fast_locks, lock, lock);
+	}
+
+	trans->fast_count++;
+}
+
+/* Counts a lock taken by trans */
+void _transaction_count_lock (s4_transaction_t *trans)
+{
+	trans->lock_count++;
+}
+
 void _transaction_set_deadlocked (s4_transaction_t *trans)
 {
 	trans->failed = 1;
@@ -86,6 +189,8 @@ void _transaction_dummy_free (s4_transaction_t *trans)
 {
 	_lock_unlock_all (trans);
 	g_list_free (trans->locks);
+	_transaction_clear_fast_locks (trans);
+	_transaction_flush_lock_count (trans);
 	free (trans);
 }
 
@@ -94,9 +199,149 @@ int _transaction_get_flags (s4_transaction_t *trans)
 	return trans->flags;
 }
 
+/* Checks if a transaction reads optimistically. Optimistic transactions
+ * stop doing so when they commit, and lock what they apply as usual
+ */
+int _transaction_is_optimistic (s4_transaction_t *trans)
+{
+	return (trans->flags & S4_TRANS_OPTIMISTIC) && !trans->committing;
+}
+
+/* Remembers the version of a lock an optimistic transaction read under,
+ * if it has not read under it before
+ */
+void _transaction_add_read (s4_transaction_t *trans, s4_lock_t *lock, unsigned int version)
+{
+	if (trans->reads == NULL)
+		trans->reads = g_hash_table_new (NULL, NULL);
+
+	if (!g_hash_table_contains (trans->reads, lock))
+		g_hash_table_insert (trans->reads, lock, GUINT_TO_POINTER (version));
+}
+
+/* Lets go of the locks an optimistic transaction took while reading */
+static void _transaction_release_reads (s4_transaction_t *trans)
+{
+	if (!_transaction_is_optimistic (trans))
+		return;
+
+	_lock_unlock_all (trans);
+	g_list_free (trans->locks);
+	_transaction_clear_fast_locks (trans);
+	trans->locks = NULL;
+}
+
+/**
+ * Checks that nothing an optimistic transaction read has changed.
+ * What was read stays locked shared until the transaction is done.
+ *
+ * @param trans The transaction
+ * @return 0 if there was a conflict, non-zero otherwise
+ */
+static int _transaction_validate (s4_transaction_t *trans)
+{
+	GHashTableIter iter;
+	s4_lock_t *lock;
+	void *version;
+
+	if (trans->reads == NULL)
+		return 1;
+
+	g_hash_table_iter_init (&iter, trans->reads);
+	while (g_hash_table_iter_next (&iter, (void**)&lock, &version)) {
+		if (!_lock_validate (lock, trans, GPOINTER_TO_UINT (version))) {
+			_stats_inc (trans->s4, S4_STATS_CONFLICTS);
+			trans->failed = 1;
+			trans->error_code = S4E_CONFLICT;
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int _transaction_is_failed (s4_transaction_t *trans)
+{
+	return trans->failed;
+}
+
+/* Gets the statistics to update, NULL if no query is running
+ * or no statistics are wanted
+ */
+s4_query_stats_t *_transaction_get_stats (s4_transaction_t *trans)
+{
+	return trans->querying?trans->stats:NULL;
+}
+
+/**
+ * Applies the operations a deferred transaction has staged,
+ * so the database shows them to the transaction itself.
+ *
+ * @param trans The transaction
+ * @return 0 if the transaction has failed, non-zero otherwise
+ */
+static int _transaction_apply (s4_transaction_t *trans)
+{
+	if (trans->failed)
+		return 0;
+
+	if (!_oplist_execute_pending (trans->ops) && !trans->failed) {
+		trans->failed = 1;
+		trans->error_code = S4E_EXECUTE;
+	}
+
+	return !trans->failed;
+}
+
+/**
+ * Makes the changes a transaction has staged visible to its own reads.
+ * Optimistic transactions do not see their own changes until they commit.
+ *
+ * @param trans The transaction
+ * @return 0 if the transaction has failed, non-zero otherwise
+ */
+static int _transaction_flush (s4_transaction_t *trans)
+{
+	if (trans->flags & S4_TRANS_OPTIMISTIC)
+		return !trans->failed;
+
+	return _transaction_apply (trans);
+}
+
+static void _query_begin (s4_transaction_t *trans)
+{
+	trans->restartable = 0;
+	_transaction_flush (trans);
+
+	if (trans->stats != NULL) {
+		trans->querying = 1;
+		_query_stats_begin (trans->stats);
+	}
+}
+
+static void _query_end (s4_transaction_t *trans, s4_resultset_t *set)
+{
+	_transaction_release_reads (trans);
+
+	if (trans->stats != NULL) {
+		trans->querying = 0;
+		_query_stats_end (trans->stats);
+
+		if (set != NULL)
+			_resultset_set_stats (set, trans->stats);
+	}
+}
+
 /**
  * Starts a new transaction.
  *
+ * With S4_TRANS_DEFERRED, s4_add, s4_del and the other functions
+ * changing the database only stage the changes in the transaction.
+ * They are applied, and the exclusive locks taken, when the transaction
+ * commits or queries the database. A transaction that is aborted before
+ * then just throws the staged changes away. Changes that fail, like adding
+ * a relationship that already exists, make the commit fail instead.
+ *
  * @param s4 The database to run the transaction on.
  * @param flags Flags specifying what kind of transaction this should be.
  * @return A new transaction that can be used when calling s4_add, s4_del
@@ -105,20 +350,75 @@ int _transaction_get_flags (s4_transaction_t *trans)
 s4_transaction_t *s4_begin (s4_t *s4, int flags)
 {
 	s4_transaction_t *trans = calloc (sizeof (s4_transaction_t), 1);
+
+	if (s4->open_flags & S4_FOLLOWER) {
+		flags |= S4_TRANS_READONLY;
+	}
+	if (flags & S4_TRANS_OPTIMISTIC) {
+		flags |= S4_TRANS_DEFERRED;
+	}
+
 	trans->s4 = s4;
 	trans->flags = flags;
 	trans->ops = _oplist_new (trans);
 	trans->restartable = 1;
+	trans->durability = s4_get_durability (s4);
+
+	/* A checkpoint may be waiting for the transactions that can
+	 * change the database, read-only ones can always go ahead.
+	 * On a follower the log is redone in the background instead
+	 * of here, and every transaction has to wait for it to finish.
+	 */
+	if (s4->open_flags & S4_FOLLOWER) {
+		trans->gated = 1;
+		_gate_enter (s4);
+		return trans;
+	}
+
+	if (!(flags & S4_TRANS_READONLY)) {
+		trans->gated = 1;
+		_gate_enter (s4);
+	}
 
-	_log_lock_file (s4);
+	_log_lock_file (s4, !(flags & S4_TRANS_READONLY));
 
 	return trans;
 }
 
+/**
+ * Attaches a statistics object to a transaction. Every query run in the
+ * transaction afterwards records how it was executed in the object,
+ * replacing what the previous query recorded.
+ *
+ * @param trans The transaction.
+ * @param stats The statistics object, or NULL to stop recording.
+ * The transaction keeps a reference to it.
+ */
+void s4_transaction_set_stats (s4_transaction_t *trans, s4_query_stats_t *stats)
+{
+	s4_query_stats_ref (stats);
+	s4_query_stats_unref (trans->stats);
+	trans->stats = stats;
+}
+
+/**
+ * Sets how hard s4_commit should work to make the transaction survive
+ * a crash. See s4_set_durability.
+ *
+ * @param trans The transaction.
+ * @param durability The durability to use. Transactions get the
+ * durability of the database by default.
+ */
+void s4_transaction_set_durability (s4_transaction_t *trans, s4_durability_t durability)
+{
+	trans->durability = durability;
+}
+
 /**
  * Commits a transaction. On success the operations in the transactions
  * will be applied in one atomic step, on error none of the operations
- * in the transaction will be applied.
+ * in the transaction will be applied. On success s4_last_durability
+ * tells if the transaction has been synced to disk.
  *
  * @param trans The transaction to commit.
  * @return 0 on error (and sets s4_errno), non-zero on success.
@@ -127,16 +427,25 @@ int s4_commit (s4_transaction_t *trans)
 {
 	int ret = 0;
 	int need_sync = 0;
+	s4_durability_t durability = trans->durability;
 	s4_t *s4 = _transaction_get_db (trans);
+	gint64 start = g_get_monotonic_time ();
+
+	trans->committing = 1;
+	if (_transaction_apply (trans) && (trans->flags & S4_TRANS_OPTIMISTIC))
+		_transaction_validate (trans);
 
 	if (trans->failed) {
 		s4_set_errno (trans->error_code);
 	} else {
-		ret = _log_write (trans->ops);
+		ret = _log_write (trans->ops, &durability);
 
 		if (ret == 0) {
 			need_sync = 1;
 			s4_set_errno (S4E_LOGFULL);
+		} else {
+			_cache_invalidate (s4, trans->ops);
+			_set_last_durability (durability);
 		}
 	}
 
@@ -145,13 +454,18 @@ int s4_commit (s4_transaction_t *trans)
 		_oplist_rollback (trans->ops);
 	}
 
-	_log_unlock_file (s4);
+	if (!(s4->open_flags & S4_FOLLOWER))
+		_log_unlock_file (s4, !(trans->flags & S4_TRANS_READONLY));
 	_transaction_free (trans);
 
 	if (need_sync) {
+		_stats_inc (s4, S4_STATS_LOGFULL_SYNCS);
 		_sync (s4);
 	}
 
+	_stats_inc (s4, ret?S4_STATS_COMMITS:S4_STATS_COMMIT_FAILURES);
+	_stats_sample (s4, S4_STATS_COMMIT, g_get_monotonic_time () - start);
+
 	return ret;
 }
 
@@ -164,8 +478,14 @@ int s4_commit (s4_transaction_t *trans)
  */
 int s4_abort (s4_transaction_t *trans)
 {
+	s4_t *s4 = trans->s4;
+
+	_stats_inc (s4, S4_STATS_ABORTS);
 	_oplist_last (trans->ops);
 	_oplist_rollback (trans->ops);
+
+	if (!(s4->open_flags & S4_FOLLOWER))
+		_log_unlock_file (s4, !(trans->flags & S4_TRANS_READONLY));
 	_transaction_free (trans);
 
 	return 1;
@@ -216,7 +536,12 @@ int s4_add (s4_transaction_t *trans,
 		ret = 0;
 	} else {
 		_oplist_insert_add (trans->ops, key_a, val_a, key_b, val_b, src);
-		ret = _s4_add (trans, key_a, val_a, key_b, val_b, src);
+		if (trans->flags & S4_TRANS_DEFERRED) {
+			ret = 1;
+		} else {
+			ret = _s4_add (trans, key_a, val_a, key_b, val_b, src);
+			_oplist_set_executed (trans->ops);
+		}
 
 		if (!ret) {
 			trans->failed = 1;
@@ -267,7 +592,12 @@ int s4_del (s4_transaction_t *trans,
 		ret = 0;
 	} else {
 		_oplist_insert_del (trans->ops, key_a, val_a, key_b, val_b, src);
-		ret = _s4_del (trans, key_a, val_a, key_b, val_b, src);
+		if (trans->flags & S4_TRANS_DEFERRED) {
+			ret = 1;
+		} else {
+			ret = _s4_del (trans, key_a, val_a, key_b, val_b, src);
+			_oplist_set_executed (trans->ops);
+		}
 
 		if (!ret) {
 			trans->failed = 1;
@@ -278,6 +608,275 @@ int s4_del (s4_transaction_t *trans,
 	return ret;
 }
 
+/**
+ * Orders tuples by the entry they belong to, keeping
+ * the order of the tuples within an entry.
+ */
+static int _tuple_cmp (const void *a, const void *b)
+{
+	const s4_tuple_t *t1 = *(const s4_tuple_t**)a;
+	const s4_tuple_t *t2 = *(const s4_tuple_t**)b;
+
+	if (t1->key_a != t2->key_a)
+		return (t1->key_a < t2->key_a)?-1:1;
+	if (t1->val_a != t2->val_a)
+		return (t1->val_a < t2->val_a)?-1:1;
+
+	return (t1 < t2)?-1:(t1 > t2);
+}
+
+/**
+ * Adds or deletes many relationships, one entry at a time.
+ *
+ * @param trans The transaction to use.
+ * @param tuples The relationships.
+ * @param count The number of relationships.
+ * @param add Non-zero to add them, 0 to delete them.
+ * @return 0 on error, non-zero on success.
+ */
+static int _change_many (s4_transaction_t *trans,
+		const s4_tuple_t *tuples, int count, int add)
+{
+	s4_t *db = _transaction_get_db (trans);
+	s4_tuple_t *interned, *sorted;
+	s4_tuple_t **order;
+	int i, start, end, done;
+
+	if (trans->flags & S4_TRANS_READONLY) {
+		trans->failed = 1;
+		trans->error_code = S4E_READONLY;
+		return 0;
+	}
+
+	if (trans->failed)
+		return 0;
+
+	interned = malloc (sizeof (s4_tuple_t) * count);
+	sorted = malloc (sizeof (s4_tuple_t) * count);
+	order = malloc (sizeof (s4_tuple_t*) * count);
+
+	/* Callers tend to pass the same entry and source over and over,
+	 * so only the fields that changed since the last tuple are looked up
+	 */
+	for (i = 0; i < count; i++) {
+		int first = (i == 0);
+		const s4_tuple_t *t = tuples + i, *prev = first ? t : t - 1;
+		s4_tuple_t *it = interned + i;
+
+		if (!first)
+			*it = interned[i - 1];
+
+		if (first || t->key_a != prev->key_a)
+			it->key_a = _string_lookup (db, t->key_a);
+		if (first || t->val_a != prev->val_a)
+			it->val_a = _const_lookup (db, t->val_a);
+		if (first || t->key_b != prev->key_b)
+			it->key_b = _string_lookup (db, t->key_b);
+		if (first || t->val_b != prev->val_b)
+			it->val_b = _const_lookup (db, t->val_b);
+		if (first || t->src != prev->src)
+			it->src = _string_lookup (db, t->src);
+
+		order[i] = it;
+
+		/* Deferred transactions apply the tuples when they commit */
+		if (trans->flags & S4_TRANS_DEFERRED) {
+			if (add)
+				_oplist_insert_add (trans->ops, it->key_a, it->val_a, it->key_b, it->val_b, it->src);
+			else
+				_oplist_insert_del (trans->ops, it->key_a, it->val_a, it->key_b, it->val_b, it->src);
+		}
+	}
+
+	if (trans->flags & S4_TRANS_DEFERRED)
+		goto cleanup;
+
+	qsort (order, count, sizeof (s4_tuple_t*), _tuple_cmp);
+	for (i = 0; i < count; i++) {
+		sorted[i] = *order[i];
+	}
+
+	for (start = 0; start < count && !trans->failed; start = end) {
+		for (end = start + 1; end < count
+				&& sorted[end].key_a == sorted[start].key_a
+				&& sorted[end].val_a == sorted[start].val_a; end++);
+
+		if (add)
+			done = _s4_add_many (trans, sorted + start, end - start);
+		else
+			done = _s4_del_many (trans, sorted + start, end - start);
+
+		for (i = start; i < start + done; i++) {
+			const s4_tuple_t *t = sorted + i;
+
+			if (add)
+				_oplist_insert_add (trans->ops, t->key_a, t->val_a, t->key_b, t->val_b, t->src);
+			else
+				_oplist_insert_del (trans->ops, t->key_a, t->val_a, t->key_b, t->val_b, t->src);
+		}
+
+		if (start + done < end) {
+			trans->failed = 1;
+			trans->error_code = S4E_EXECUTE;
+		}
+	}
+	_oplist_set_executed (trans->ops);
+
+cleanup:
+	free (interned);
+	free (sorted);
+	free (order);
+
+	return !trans->failed;
+}
+
+/**
+ * Adds many relationships to the database.
+ * It works like calling s4_add for every relationship, but the
+ * relationships are grouped by the entry they belong to, so every
+ * entry is only looked up and locked once.
+ * Strings and values repeated from the previous relationship are
+ * only looked up once.
+ *
+ * @param trans The transaction to use.
+ * @param tuples The relationships to add.
+ * @param count The number of relationships.
+ * @return 0 on error, non-zero on success.
+ */
+int s4_add_many (s4_transaction_t *trans, const s4_tuple_t *tuples, int count)
+{
+	return _change_many (trans, tuples, count, 1);
+}
+
+/**
+ * Deletes many relationships from the database.
+ * It works like calling s4_del for every relationship, but the
+ * relationships are grouped by the entry they belong to, so every
+ * entry is only looked up and locked once.
+ *
+ * @param trans The transaction to use.
+ * @param tuples The relationships to delete.
+ * @param count The number of relationships.
+ * @return 0 on error, non-zero on success.
+ */
+int s4_del_many (s4_transaction_t *trans, const s4_tuple_t *tuples, int count)
+{
+	return _change_many (trans, tuples, count, 0);
+}
+
+/**
+ * Deletes the relationships from a source in a list of entries,
+ * and frees the list.
+ *
+ * @param trans The transaction to use.
+ * @param entries The entries, found with the transaction.
+ * @param src The source, or NULL to delete every relationship.
+ * @param ok 0 if finding the entries failed, then nothing is deleted.
+ * @return 0 on error, non-zero on success.
+ */
+static int _del_entries (s4_transaction_t *trans, GList *entries, const char *src, int ok)
+{
+	for (; entries != NULL; entries = g_list_delete_link (entries, entries)) {
+		const char *key_a = _entry_get_key (entries->data);
+		const s4_val_t *val_a = _entry_get_val (entries->data);
+		GPtrArray *deleted;
+
+		if (ok) {
+			deleted = _oplist_insert_del_source (trans->ops, key_a, val_a, src);
+			if (!(trans->flags & S4_TRANS_DEFERRED)) {
+				ok = _s4_del_source (trans, key_a, val_a, src, deleted);
+				_oplist_set_executed (trans->ops);
+			}
+		}
+	}
+
+	if (!ok) {
+		trans->failed = 1;
+		trans->error_code = S4E_EXECUTE;
+	}
+
+	return ok;
+}
+
+/**
+ * Deletes every relationship from a source in the entries
+ * matching a condition.
+ * The entries are found through an index of the sources,
+ * so only the entries with relationships from src are looked at.
+ * Every entry is written to the log as one operation, no matter
+ * how many relationships were deleted from it.
+ *
+ * @param trans The transaction to use.
+ * @param src The source to delete the relationships of.
+ * @param cond The condition the entries must match, or NULL for all entries.
+ * @return 0 on error, non-zero on success.
+ */
+int s4_del_source (s4_transaction_t *trans, const char *src, s4_condition_t *cond)
+{
+	GList *entries;
+	int ret;
+	s4_t *db = _transaction_get_db (trans);
+
+	if (trans->flags & S4_TRANS_READONLY) {
+		trans->failed = 1;
+		trans->error_code = S4E_READONLY;
+		return 0;
+	}
+
+	src = _string_lookup (db, src);
+	if (cond != NULL)
+		s4_cond_update_key (cond, db);
+
+	if (!_transaction_flush (trans)) {
+		ret = 0;
+	} else {
+		ret = _s4_source_entries (trans, src, cond, &entries);
+		ret = _del_entries (trans, entries, src, ret);
+		_transaction_release_reads (trans);
+	}
+
+	return ret;
+}
+
+static void _collect_entry (s4_entry_t *entry, void *entries)
+{
+	*(GList**)entries = g_list_prepend (*(GList**)entries, entry);
+}
+
+/**
+ * Deletes every relationship of the entries matching a condition.
+ * The entries are found the same way s4_query finds them,
+ * and every entry is written to the log as one operation.
+ *
+ * @param trans The transaction to use.
+ * @param cond The condition the entries must match.
+ * @return 0 on error, non-zero on success.
+ */
+int s4_del_where (s4_transaction_t *trans, s4_condition_t *cond)
+{
+	GList *entries = NULL;
+	int ret;
+	s4_t *db = _transaction_get_db (trans);
+
+	if (trans->flags & S4_TRANS_READONLY) {
+		trans->failed = 1;
+		trans->error_code = S4E_READONLY;
+		return 0;
+	}
+
+	s4_cond_update_key (cond, db);
+
+	if (!_transaction_flush (trans)) {
+		ret = 0;
+	} else {
+		ret = _s4_query_foreach (trans, cond, _s4_query_path (db, cond), _collect_entry, &entries);
+		ret = _del_entries (trans, entries, NULL, ret);
+		_transaction_release_reads (trans);
+	}
+
+	return ret;
+}
+
 /**
  * Queries an S4 database.
  *
@@ -292,17 +891,117 @@ s4_resultset_t *s4_query (s4_transaction_t *trans,
 {
 	s4_resultset_t *ret;
 
-	trans->restartable = 0;
+	_query_begin (trans);
 
 	if (trans->failed) {
 		ret = s4_resultset_create (0);
+	} else if (trans->s4->cache_data != NULL && (trans->flags & S4_TRANS_READONLY)) {
+		s4_cond_update_key (cond, trans->s4);
+		s4_fetchspec_update_key (trans->s4, spec);
+		ret = _cache_query (trans, spec, cond, _s4_query_path (trans->s4, cond));
 	} else {
 		ret = _s4_query (trans, spec, cond);
 	}
 
+	_query_end (trans, ret);
+
 	return ret;
 }
 
+/**
+ * Runs a prepared query.
+ *
+ * @param trans The transaction to use.
+ * @param prep The prepared query, created by s4_prepare on the same database.
+ * @return A resultset containing the fetched data.
+ */
+s4_resultset_t *s4_query_prepared (s4_transaction_t *trans, s4_prepared_t *prep)
+{
+	s4_resultset_t *ret;
+
+	_query_begin (trans);
+
+	if (trans->failed) {
+		ret = s4_resultset_create (0);
+	} else {
+		ret = _prepared_run (trans, prep);
+	}
+
+	_query_end (trans, ret);
+
+	return ret;
+}
+
+/**
+ * Runs an aggregate query. The matching entries are folded
+ * into the result directly instead of being fetched.
+ *
+ * @param trans The transaction to use.
+ * @param spec The aggregates to compute.
+ * @param cond The condition to use when querying.
+ * @return The aggregated result. If the transaction has failed it has no groups.
+ */
+s4_aggresult_t *s4_aggregate (s4_transaction_t *trans,
+		s4_aggspec_t *spec, s4_condition_t *cond)
+{
+	s4_aggresult_t *ret;
+
+	_query_begin (trans);
+
+	if (trans->failed) {
+		ret = _aggresult_create (0);
+	} else {
+		ret = _aggregate_run (trans, spec, cond);
+	}
+
+	_query_end (trans, NULL);
+
+	return ret;
+}
+
+/**
+ * Lists the distinct values of an indexed key without looking at the
+ * entries. The key must be one of the indices passed to s4_open
+ * or created with s4_index_create.
+ * Values are visited in caseless order, and values differing only
+ * in case are visited once.
+ *
+ * @param trans The transaction to use.
+ * @param key The key to list the values of.
+ * @param start The smallest value to list, or NULL to start at the first.
+ * @param end The largest value to list, or NULL to stop at the last.
+ * @param prefix If non-NULL only strings starting with prefix are listed,
+ * compared caselessly.
+ * @param func Called with every value and the number of entries having it.
+ * If it returns 0 no more values are listed.
+ * @param userdata Passed as the last argument to func.
+ * @return 0 if key has no index or the transaction failed, non-zero otherwise.
+ */
+int s4_index_foreach_value (s4_transaction_t *trans, const char *key,
+		const s4_val_t *start, const s4_val_t *end, const char *prefix,
+		s4_value_func_t func, void *userdata)
+{
+	s4_index_t *index;
+
+	trans->restartable = 0;
+
+	if (trans->failed)
+		return 0;
+
+	if (!_index_get_b_shared (trans->s4, key, trans, &index)) {
+		_transaction_set_deadlocked (trans);
+		return 0;
+	}
+	if (index == NULL) {
+		s4_set_errno (S4E_NOINDEX);
+		return 0;
+	}
+
+	_index_foreach_value (index, start, end, prefix, func, userdata);
+
+	return 1;
+}
+
 /**
  * @}
  */
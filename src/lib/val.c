@@ -25,6 +25,8 @@ typedef enum {
 
 struct s4_val_St {
 	s4_val_type_t type;
+	/* The id of a constant value, 0 for other values */
+	uint32_t id;
 	union {
 		struct {
 			s4_t *s4;
@@ -55,6 +57,7 @@ s4_val_t *s4_val_new_string (const char *str)
 {
 	s4_val_t *val = malloc (sizeof (s4_val_t));
 	val->type = S4_VAL_STR;
+	val->id = 0;
 	val->v.str.s = strdup (str);
 	val->v.str.co = NULL;
 	val->v.str.ca = NULL;
@@ -80,6 +83,7 @@ s4_val_t *s4_val_new_internal_string (const char *str, s4_t *s4)
 {
 	s4_val_t *val = malloc (sizeof (s4_val_t));
 	val->type = S4_VAL_STR_INTERNAL;
+	val->id = 0;
 	val->v.str.s = str;
 	val->v.str.co = NULL;
 	val->v.str.ca = NULL;
@@ -88,6 +92,29 @@ s4_val_t *s4_val_new_internal_string (const char *str, s4_t *s4)
 	return val;
 }
 
+/**
+ * Gets the constant id of a value.
+ *
+ * @param val The value, must have been obtained from _const_lookup
+ * or one of the other constant lookup functions
+ * @return The id of the value
+ */
+uint32_t _val_get_id (const s4_val_t *val)
+{
+	return val->id;
+}
+
+/**
+ * Sets the constant id of a value.
+ *
+ * @param val The value
+ * @param id The id to give it
+ */
+void _val_set_id (s4_val_t *val, uint32_t id)
+{
+	val->id = id;
+}
+
 /**
  * @}
  */
@@ -102,6 +129,7 @@ s4_val_t *s4_val_new_int (int32_t i)
 {
 	s4_val_t *val = malloc (sizeof (s4_val_t));
 	val->type = S4_VAL_INT;
+	val->id = 0;
 	val->v.i = i;
 
 	return val;
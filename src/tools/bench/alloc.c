@@ -0,0 +1,70 @@
+/*  S4 - An XMMS2 medialib backend
+ *  Copyright (C) 2009, 2010 Sivert Berg
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include "bench.h"
+#include <stdlib.h>
+
+/* Counts the allocations made by each thread by wrapping the allocator.
+ * This only works with glibc, where the real functions can be reached
+ * through their __libc_ names. Elsewhere the counts are not available.
+ */
+#ifdef __GLIBC__
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static __thread unsigned long count;
+
+void *malloc (size_t size)
+{
+	count++;
+	return __libc_malloc (size);
+}
+
+void *calloc (size_t nmemb, size_t size)
+{
+	count++;
+	return __libc_calloc (nmemb, size);
+}
+
+void *realloc (void *ptr, size_t size)
+{
+	count++;
+	return __libc_realloc (ptr, size);
+}
+
+int alloc_count_supported (void)
+{
+	return 1;
+}
+
+unsigned long alloc_count (void)
+{
+	return count;
+}
+
+#else
+
+int alloc_count_supported (void)
+{
+	return 0;
+}
+
+unsigned long alloc_count (void)
+{
+	return 0;
+}
+
+#endif
@@ -0,0 +1,48 @@
+/*  S4 - An XMMS2 medialib backend
+ *  Copyright (C) 2009, 2010 Sivert Berg
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include "s4.h"
+#include <glib.h>
+
+/* alloc.c */
+int alloc_count_supported (void);
+unsigned long alloc_count (void);
+
+/* medialib.c */
+typedef struct zipf_St zipf_t;
+
+zipf_t *zipf_new (int n, double s);
+int zipf_sample (zipf_t *z, GRand *rand);
+void zipf_free (zipf_t *z);
+
+typedef struct {
+	int songs;
+	int artists;
+	int albums_per_artist;
+
+	zipf_t *artist_dist;
+	zipf_t *album_dist;
+} medialib_t;
+
+extern const char *medialib_sources[];
+
+medialib_t *medialib_new (int songs);
+void medialib_free (medialib_t *ml);
+void medialib_artist_name (int artist, char *buf, int len);
+int medialib_add_song (s4_t *s4, medialib_t *ml, int id, GRand *rand);
+
+#endif /* _BENCH_H */
@@ -0,0 +1,185 @@
+/*  S4 - An XMMS2 medialib backend
+ *  Copyright (C) 2009, 2010 Sivert Berg
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ */
+
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+/* Synthetic medialib resembling what XMMS2 stores: a few artists with
+ * most of the songs, many with only a handful, several albums each,
+ * and tags coming from more than one source.
+ */
+
+#define SONGS_PER_ARTIST 20
+#define ALBUMS_PER_ARTIST 8
+
+struct zipf_St {
+	int n;
+	double *cdf;
+};
+
+static const char *genres[] = {
+	"Rock", "Pop", "Jazz", "Classical", "Electronic", "Hip-Hop",
+	"Metal", "Folk", "Blues", "Reggae", "Soundtrack", "Ambient"
+};
+
+const char *medialib_sources[] = {
+	"server", "client/*", "plugin/musicbrainz", "plugin/*", "*", NULL
+};
+
+/**
+ * Creates a Zipf distribution over n items, where item k
+ * (counting from 1) is picked with a probability proportional to 1/k^s.
+ *
+ * @param n The number of items
+ * @param s The exponent
+ * @return A new distribution
+ */
+zipf_t *zipf_new (int n, double s)
+{
+	zipf_t *z = malloc (sizeof (zipf_t));
+	double sum = 0;
+	int i;
+
+	z->n = n;
+	z->cdf = malloc (sizeof (double) * n);
+
+	for (i = 0; i < n; i++) {
+		sum += 1.0 / pow (i + 1, s);
+		z->cdf[i] = sum;
+	}
+	for (i = 0; i < n; i++) {
+		z->cdf[i] /= sum;
+	}
+
+	return z;
+}
+
+/**
+ * Picks an item from a Zipf distribution.
+ *
+ * @param z The distribution
+ * @param rand The random number generator to use
+ * @return An item in the range [0, n)
+ */
+int zipf_sample (zipf_t *z, GRand *rand)
+{
+	double u = g_rand_double (rand);
+	int lo = 0, hi = z->n - 1;
+
+	while (lo < hi) {
+		int m = (lo + hi) / 2;
+
+		if (z->cdf[m] < u)
+			lo = m + 1;
+		else
+			hi = m;
+	}
+
+	return lo;
+}
+
+void zipf_free (zipf_t *z)
+{
+	free (z->cdf);
+	free (z);
+}
+
+medialib_t *medialib_new (int songs)
+{
+	medialib_t *ml = malloc (sizeof (medialib_t));
+
+	ml->songs = songs;
+	ml->artists = MAX (1, songs / SONGS_PER_ARTIST);
+	ml->albums_per_artist = ALBUMS_PER_ARTIST;
+	ml->artist_dist = zipf_new (ml->artists, 1.0);
+	ml->album_dist = zipf_new (ml->albums_per_artist, 1.0);
+
+	return ml;
+}
+
+void medialib_free (medialib_t *ml)
+{
+	zipf_free (ml->artist_dist);
+	zipf_free (ml->album_dist);
+	free (ml);
+}
+
+void medialib_artist_name (int artist, char *buf, int len)
+{
+	snprintf (buf, len, "Artist %i", artist);
+}
+
+static void _add_str (s4_transaction_t *trans, const s4_val_t *id,
+		const char *key, const char *str, const char *src)
+{
+	s4_val_t *val = s4_val_new_string (str);
+	s4_add (trans, "song_id", id, key, val, src);
+	s4_val_free (val);
+}
+
+static void _add_int (s4_transaction_t *trans, const s4_val_t *id,
+		const char *key, int32_t i, const char *src)
+{
+	s4_val_t *val = s4_val_new_int (i);
+	s4_add (trans, "song_id", id, key, val, src);
+	s4_val_free (val);
+}
+
+/**
+ * Adds a song to the database in a transaction of its own,
+ * the way a medialib import would.
+ *
+ * @param s4 The database to add to
+ * @param ml The medialib description
+ * @param id The id of the new song
+ * @param rand The random number generator to use
+ * @return The return value of s4_commit
+ */
+int medialib_add_song (s4_t *s4, medialib_t *ml, int id, GRand *rand)
+{
+	s4_transaction_t *trans = s4_begin (s4, 0);
+	s4_val_t *id_val = s4_val_new_int (id);
+	int artist = zipf_sample (ml->artist_dist, rand);
+	int album = zipf_sample (ml->album_dist, rand);
+	char buf[64];
+
+	medialib_artist_name (artist, buf, sizeof (buf));
+	_add_str (trans, id_val, "artist", buf, "plugin/id3v2");
+
+	/* Every third song has been looked up, and the lookup
+	 * disagrees with the tags on how to spell the artist
+	 */
+	if (id % 3 == 0) {
+		snprintf (buf, sizeof (buf), "The Artist %i", artist);
+		_add_str (trans, id_val, "artist", buf, "plugin/musicbrainz");
+	}
+
+	snprintf (buf, sizeof (buf), "Album %i-%i", artist, album);
+	_add_str (trans, id_val, "album", buf, "plugin/id3v2");
+	snprintf (buf, sizeof (buf), "Song %i", id);
+	_add_str (trans, id_val, "title", buf, "plugin/id3v2");
+	_add_str (trans, id_val, "genre", genres[artist % G_N_ELEMENTS (genres)], "plugin/id3v2");
+	snprintf (buf, sizeof (buf), "file:///music/%i/%i/%i.ogg", artist, album, id);
+	_add_str (trans, id_val, "url", buf, "server");
+
+	_add_int (trans, id_val, "tracknr", g_rand_int_range (rand, 1, 16), "plugin/id3v2");
+	_add_int (trans, id_val, "duration", g_rand_int_range (rand, 90000, 420000), "plugin/vorbis");
+	_add_int (trans, id_val, "timesplayed", 0, "server");
+
+	s4_val_free (id_val);
+
+	return s4_commit (trans);
+}
@@ -12,137 +12,449 @@
  *  Lesser General Public License for more details.
  */
 
-#include "s4.h"
+#include "bench.h"
 #include <stdio.h>
 #include <stdlib.h>
-#include <glib.h>
+#include <string.h>
+#include <unistd.h>
 #include <glib/gstdio.h>
 
-#define ENTRIES 10000
+#define DEFAULT_SONGS 10000
+#define DEFAULT_THREADS 4
+#define DEFAULT_OPS 2000
+
+/* Percentage of operations in the mixed scenario that are writes */
+#define MIXED_WRITE_PERCENT 10
 
 void log_init (GLogLevelFlags log_lev);
 
-long timediff (GTimeVal *prev, GTimeVal *cur)
+typedef enum {
+	FORMAT_JSON,
+	FORMAT_CSV
+} format_t;
+
+typedef struct {
+	s4_t *s4;
+	medialib_t *ml;
+	s4_sourcepref_t *sp;
+	s4_fetchspec_t *fs;
+} bench_db_t;
+
+typedef int (*op_func_t)(bench_db_t *db, GRand *rand);
+
+typedef struct {
+	const char *scenario;
+	int indexed;
+	int threads;
+	int ops;
+	int failures;
+	double seconds;
+	gint64 p50, p99, max;
+	double allocs_per_op;
+} result_t;
+
+typedef struct {
+	bench_db_t *db;
+	op_func_t op;
+	GRand *rand;
+	int ops;
+
+	gint64 *latencies;
+	unsigned long allocs;
+	int failures;
+} worker_t;
+
+static int _query (bench_db_t *db, s4_condition_t *cond)
 {
-	long ret;
+	s4_transaction_t *trans = s4_begin (db->s4, S4_TRANS_READONLY);
+	s4_resultset_t *set = s4_query (trans, db->fs, cond);
+	int ret = s4_commit (trans);
 
-   	ret = (cur->tv_sec - prev->tv_sec) * G_USEC_PER_SEC;
-	ret += cur->tv_usec - prev->tv_usec;
+	s4_resultset_free (set);
+	s4_cond_free (cond);
 
 	return ret;
 }
 
-void take_time (const char *message, GTimeVal *prev, GTimeVal *cur)
+/* Browses the songs of an artist, picked like a user would pick them */
+static int _op_query_artist (bench_db_t *db, GRand *rand)
 {
-	g_get_current_time (cur);
+	char buf[64];
+	s4_val_t *val;
+	s4_condition_t *cond;
 
-	printf ("%s %li.%.6li sec\n", message,
-			timediff (prev, cur) / G_USEC_PER_SEC,
-			timediff (prev, cur) % G_USEC_PER_SEC);
+	medialib_artist_name (zipf_sample (db->ml->artist_dist, rand), buf, sizeof (buf));
+	val = s4_val_new_string (buf);
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, "artist", val, db->sp, S4_CMP_CASELESS, 0);
+	s4_val_free (val);
 
-	g_get_current_time (prev);
+	return _query (db, cond);
 }
 
-int main (int argc, char *argv[])
+/* Searches titles with a pattern, which can never use the index order */
+static int _op_query_title (bench_db_t *db, GRand *rand)
 {
-	s4_t *s4;
-	s4_transaction_t *t;
-	int i, fd;
-	char *filename;
-	GTimeVal cur, prev;
+	char buf[64];
+	s4_val_t *val;
+	s4_condition_t *cond;
 
-	log_init(G_LOG_LEVEL_MASK & ~G_LOG_LEVEL_DEBUG);
-	g_get_current_time (&prev);
+	snprintf (buf, sizeof (buf), "song %i*", g_rand_int_range (rand, 1, 100));
+	val = s4_val_new_string (buf);
+	cond = s4_cond_new_filter (S4_FILTER_MATCH, "title", val, db->sp, S4_CMP_CASELESS, 0);
+	s4_val_free (val);
 
-	fd = g_file_open_tmp ("s4bench-XXXXXX", &filename, NULL);
-	g_close (fd, NULL);
-	g_unlink (filename);
+	return _query (db, cond);
+}
+
+/* Bumps the play count of a song, like the server does after playback */
+static int _op_play (bench_db_t *db, GRand *rand)
+{
+	s4_transaction_t *trans = s4_begin (db->s4, 0);
+	s4_val_t *val, *id = s4_val_new_int (g_rand_int_range (rand, 0, db->ml->songs));
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond;
+	s4_resultset_t *set;
+	const s4_result_t *res;
+	int32_t played = 0;
+
+	s4_fetchspec_add (fs, "timesplayed", NULL, S4_FETCH_DATA);
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, "song_id", id, NULL,
+			S4_CMP_CASELESS, S4_COND_PARENT);
+	set = s4_query (trans, fs, cond);
+	res = s4_resultset_get_result (set, 0, 0);
+
+	if (res != NULL && s4_val_get_int (s4_result_get_val (res), &played)) {
+		s4_del (trans, "song_id", id, "timesplayed", s4_result_get_val (res), "server");
+	}
+
+	val = s4_val_new_int (played + 1);
+	s4_add (trans, "song_id", id, "timesplayed", val, "server");
+	s4_val_free (val);
+
+	s4_resultset_free (set);
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+	s4_val_free (id);
+
+	return s4_commit (trans);
+}
+
+static int _op_mixed (bench_db_t *db, GRand *rand)
+{
+	if (g_rand_int_range (rand, 0, 100) < MIXED_WRITE_PERCENT)
+		return _op_play (db, rand);
+
+	return _op_query_artist (db, rand);
+}
+
+static gpointer _worker (gpointer data)
+{
+	worker_t *w = data;
+	int i;
 
-	s4 = s4_open (filename, NULL, S4_NEW);
+	for (i = 0; i < w->ops; i++) {
+		unsigned long allocs = alloc_count ();
+		gint64 start = g_get_monotonic_time ();
 
-	if (s4 == NULL) {
-		fprintf (stderr, "Could not open %s\n", argv[1]);
-		exit (1);
+		if (!w->op (w->db, w->rand))
+			w->failures++;
+
+		w->latencies[i] = g_get_monotonic_time () - start;
+		w->allocs += alloc_count () - allocs;
 	}
 
-	take_time ("s4_open took", &prev, &cur);
+	return NULL;
+}
+
+static int _gint64_cmp (const void *a, const void *b)
+{
+	gint64 x = *(const gint64*)a, y = *(const gint64*)b;
+	return (x > y) - (x < y);
+}
+
+static void _summarize (result_t *res, gint64 *latencies, int count,
+		unsigned long allocs, gint64 elapsed)
+{
+	qsort (latencies, count, sizeof (gint64), _gint64_cmp);
+
+	res->ops = count;
+	res->seconds = elapsed / (double)G_USEC_PER_SEC;
+	res->p50 = latencies[count / 2];
+	res->p99 = latencies[MIN (count - 1, (int)(count * 0.99))];
+	res->max = latencies[count - 1];
+	res->allocs_per_op = alloc_count_supported ()?(double)allocs / count:-1;
+}
 
-	for (i = 0; i < ENTRIES; i++) {
-		s4_val_t *val;
-		val = s4_val_new_int (i);
-		t = s4_begin (s4, 0);
-		s4_add (t, "a", val, "b", val, "src");
-		s4_commit (t);
-		s4_val_free (val);
+/* Runs op ops times in each of threads threads and summarizes the latencies */
+static void _run (result_t *res, bench_db_t *db, op_func_t op,
+		int threads, int ops, guint32 seed)
+{
+	worker_t *workers = calloc (threads, sizeof (worker_t));
+	GThread **thread = malloc (sizeof (GThread*) * threads);
+	gint64 *latencies = malloc (sizeof (gint64) * threads * ops);
+	unsigned long allocs = 0;
+	gint64 start;
+	int i;
+
+	for (i = 0; i < threads; i++) {
+		workers[i].db = db;
+		workers[i].op = op;
+		workers[i].ops = ops;
+		workers[i].rand = g_rand_new_with_seed (seed + i);
+		workers[i].latencies = latencies + i * ops;
 	}
 
-	take_time ("s4be_ip_add took", &prev, &cur);
+	start = g_get_monotonic_time ();
+	for (i = 0; i < threads; i++) {
+		thread[i] = g_thread_new ("bench", _worker, workers + i);
+	}
+	for (i = 0; i < threads; i++) {
+		g_thread_join (thread[i]);
+	}
 
-	for (i = 0; i < ENTRIES; i++) {
-		s4_val_t *val;
-		val = s4_val_new_int (i);
-		t = s4_begin (s4, 0);
-		s4_del (t, "a", val, "b", val, "src");
-		s4_commit (t);
-		s4_val_free (val);
+	res->threads = threads;
+	res->failures = 0;
+	for (i = 0; i < threads; i++) {
+		allocs += workers[i].allocs;
+		res->failures += workers[i].failures;
+		g_rand_free (workers[i].rand);
 	}
 
-	take_time ("s4be_ip_del took", &prev, &cur);
+	_summarize (res, latencies, threads * ops, allocs, g_get_monotonic_time () - start);
+
+	free (latencies);
+	free (thread);
+	free (workers);
+}
+
+/* Fills a database with the medialib, one transaction per song */
+static void _load (result_t *res, bench_db_t *db, guint32 seed)
+{
+	gint64 *latencies = malloc (sizeof (gint64) * db->ml->songs);
+	GRand *rand = g_rand_new_with_seed (seed);
+	unsigned long allocs = alloc_count ();
+	gint64 start = g_get_monotonic_time ();
+	int i;
 
-	t = s4_begin (s4, 0);
-	for (i = 0; i < ENTRIES; i++) {
-		s4_val_t *val;
-		val = s4_val_new_int (i);
-		s4_add (t, "a", val, "b", val, "src");
-		s4_val_free (val);
+	res->threads = 1;
+	res->failures = 0;
+
+	for (i = 0; i < db->ml->songs; i++) {
+		gint64 t = g_get_monotonic_time ();
+
+		if (!medialib_add_song (db->s4, db->ml, i, rand))
+			res->failures++;
+
+		latencies[i] = g_get_monotonic_time () - t;
 	}
-	s4_commit (t);
 
-	take_time ("s4be_ip_add took", &prev, &cur);
+	_summarize (res, latencies, db->ml->songs, alloc_count () - allocs,
+			g_get_monotonic_time () - start);
+
+	g_rand_free (rand);
+	free (latencies);
+}
 
-	t = s4_begin (s4, 0);
-	for (i = 0; i < ENTRIES; i++) {
-		s4_val_t *val;
-		val = s4_val_new_int (i);
-		s4_del (t, "a", val, "b", val, "src");
-		s4_val_free (val);
+static void _print_results (FILE *out, format_t format, result_t *results, int count,
+		int songs, guint32 seed)
+{
+	int i;
+
+	if (format == FORMAT_CSV) {
+		fprintf (out, "scenario,indexed,threads,ops,failures,seconds,ops_per_sec,"
+				"p50_us,p99_us,max_us,allocs_per_op\n");
+		for (i = 0; i < count; i++) {
+			result_t *r = results + i;
+			fprintf (out, "%s,%i,%i,%i,%i,%.6f,%.1f,%" G_GINT64_FORMAT ",%"
+					G_GINT64_FORMAT ",%" G_GINT64_FORMAT ",",
+					r->scenario, r->indexed, r->threads, r->ops, r->failures,
+					r->seconds, r->ops / r->seconds, r->p50, r->p99, r->max);
+			if (r->allocs_per_op >= 0)
+				fprintf (out, "%.1f", r->allocs_per_op);
+			fprintf (out, "\n");
+		}
+		return;
+	}
+
+	fprintf (out, "{\n  \"songs\": %i,\n  \"seed\": %u,\n  \"results\": [\n", songs, seed);
+	for (i = 0; i < count; i++) {
+		result_t *r = results + i;
+		fprintf (out, "    {\"scenario\": \"%s\", \"indexed\": %s, \"threads\": %i, "
+				"\"ops\": %i, \"failures\": %i, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+				"\"p50_us\": %" G_GINT64_FORMAT ", \"p99_us\": %" G_GINT64_FORMAT
+				", \"max_us\": %" G_GINT64_FORMAT ", \"allocs_per_op\": ",
+				r->scenario, r->indexed?"true":"false", r->threads, r->ops, r->failures,
+				r->seconds, r->ops / r->seconds, r->p50, r->p99, r->max);
+		if (r->allocs_per_op >= 0)
+			fprintf (out, "%.1f}", r->allocs_per_op);
+		else
+			fprintf (out, "null}");
+		fprintf (out, "%s\n", (i < count - 1)?",":"");
 	}
-	s4_commit (t);
+	fprintf (out, "  ]\n}\n");
+}
 
-	take_time ("s4be_ip_del took", &prev, &cur);
+static void _usage (const char *name)
+{
+	fprintf (stderr, "Usage: %s [options]\n"
+			"  -s <songs>    Number of songs in the medialib (default %i)\n"
+			"  -t <threads>  Number of threads for the query scenarios (default %i)\n"
+			"  -n <ops>      Operations per thread and scenario (default %i)\n"
+			"  -f json|csv   Output format (default json)\n"
+			"  -o <file>     Write the results to file instead of stdout\n"
+			"  -r <seed>     Random seed (default 1)\n"
+			"  -m            Keep the databases in memory instead of on disk\n"
+			"  -d full|async|none  Durability of the transactions (default full)\n",
+			name, DEFAULT_SONGS, DEFAULT_THREADS, DEFAULT_OPS);
+}
+
+static s4_t *_open_db (const char *tmpl, const char **indices, int memory, char **filename)
+{
+	int fd;
+
+	*filename = NULL;
 
-	for (i = ENTRIES; i > 0; i--) {
-		s4_val_t *val;
-		val = s4_val_new_int (i);
-		t = s4_begin (s4, 0);
-		s4_add (t, "a", val, "b", val, "src");
-		s4_commit (t);
-		s4_val_free (val);
+	if (memory)
+		return s4_open (NULL, indices, S4_MEMORY);
+
+	fd = g_file_open_tmp (tmpl, filename, NULL);
+	g_close (fd, NULL);
+	g_unlink (*filename);
+
+	return s4_open (*filename, indices, S4_NEW);
+}
+
+static void _remove_db (char *filename)
+{
+	char *log_name;
+
+	if (filename == NULL)
+		return;
+
+	log_name = g_strconcat (filename, ".log", NULL);
+	g_unlink (filename);
+	g_unlink (log_name);
+	g_free (log_name);
+	g_free (filename);
+}
+
+int main (int argc, char *argv[])
+{
+	const char *indices[] = {"artist", "album", "title", NULL};
+	int songs = DEFAULT_SONGS, threads = DEFAULT_THREADS, ops = DEFAULT_OPS;
+	int memory = 0, count = 0, i, c;
+	s4_durability_t durability = S4_DURABILITY_FULL;
+	guint32 seed = 1;
+	format_t format = FORMAT_JSON;
+	FILE *out = stdout;
+	char *filename[2];
+	bench_db_t db[2];
+	result_t results[16];
+
+	while ((c = getopt (argc, argv, "s:t:n:f:o:r:d:mh")) != -1) {
+		switch (c) {
+		case 's': songs = atoi (optarg); break;
+		case 't': threads = atoi (optarg); break;
+		case 'n': ops = atoi (optarg); break;
+		case 'r': seed = strtoul (optarg, NULL, 10); break;
+		case 'm': memory = 1; break;
+		case 'f':
+			if (!strcmp (optarg, "csv")) {
+				format = FORMAT_CSV;
+			} else if (!strcmp (optarg, "json")) {
+				format = FORMAT_JSON;
+			} else {
+				_usage (argv[0]);
+				return 1;
+			}
+			break;
+		case 'd':
+			if (!strcmp (optarg, "full")) {
+				durability = S4_DURABILITY_FULL;
+			} else if (!strcmp (optarg, "async")) {
+				durability = S4_DURABILITY_ASYNC;
+			} else if (!strcmp (optarg, "none")) {
+				durability = S4_DURABILITY_NONE;
+			} else {
+				_usage (argv[0]);
+				return 1;
+			}
+			break;
+		case 'o':
+			out = fopen (optarg, "w");
+			if (out == NULL) {
+				perror (optarg);
+				return 1;
+			}
+			break;
+		default:
+			_usage (argv[0]);
+			return (c == 'h')?0:1;
+		}
 	}
 
-	take_time ("s4be_ip_add (backwards) took", &prev, &cur);
+	if (songs <= 0 || threads <= 0 || ops <= 0) {
+		_usage (argv[0]);
+		return 1;
+	}
 
-	for (i = ENTRIES; i > 0; i--) {
-		s4_val_t *val;
-		val = s4_val_new_int (i);
-		t = s4_begin (s4, 0);
-		s4_del (t, "a", val, "b", val, "src");
-		s4_commit (t);
-		s4_val_free (val);
+	log_init (G_LOG_LEVEL_MASK & ~G_LOG_LEVEL_DEBUG);
+
+	/* db[0] has b-indexes on the browsed keys, db[1] has none */
+	for (i = 0; i < 2; i++) {
+		db[i].s4 = _open_db ("s4bench-XXXXXX", i?NULL:indices, memory, filename + i);
+		if (db[i].s4 == NULL) {
+			fprintf (stderr, "Could not open database\n");
+			return 1;
+		}
+		s4_set_durability (db[i].s4, durability);
+
+		db[i].ml = medialib_new (songs);
+		db[i].sp = s4_sourcepref_create (medialib_sources);
+		db[i].fs = s4_fetchspec_create ();
+		s4_fetchspec_add (db[i].fs, "title", db[i].sp, S4_FETCH_DATA);
+		s4_fetchspec_add (db[i].fs, "album", db[i].sp, S4_FETCH_DATA);
+		s4_fetchspec_add (db[i].fs, "duration", db[i].sp, S4_FETCH_DATA);
+
+		results[count].scenario = "load";
+		results[count].indexed = !i;
+		_load (results + count++, db + i, seed);
 	}
 
-	take_time ("s4be_ip_del (backwards) took", &prev, &cur);
+	for (i = 0; i < 2; i++) {
+		results[count].scenario = "query_artist";
+		results[count].indexed = !i;
+		_run (results + count++, db + i, _op_query_artist, 1, ops, seed);
 
-	s4_close (s4);
+		results[count].scenario = "query_artist";
+		results[count].indexed = !i;
+		_run (results + count++, db + i, _op_query_artist, threads, ops, seed);
 
-	take_time ("s4_close took", &prev, &cur);
+		results[count].scenario = "query_title_pattern";
+		results[count].indexed = !i;
+		_run (results + count++, db + i, _op_query_title, threads, MAX (1, ops / 10), seed);
 
-	g_unlink (filename);
-	g_unlink (g_strconcat (filename, ".log", NULL));
+		results[count].scenario = "play";
+		results[count].indexed = !i;
+		_run (results + count++, db + i, _op_play, 1, ops, seed);
 
-	g_free (filename);
+		results[count].scenario = "mixed";
+		results[count].indexed = !i;
+		_run (results + count++, db + i, _op_mixed, threads, ops, seed);
+	}
+
+	_print_results (out, format, results, count, songs, seed);
 
-	take_time ("g_unlink took", &prev, &cur);
+	if (out != stdout)
+		fclose (out);
+
+	for (i = 0; i < 2; i++) {
+		s4_fetchspec_free (db[i].fs);
+		s4_sourcepref_unref (db[i].sp);
+		medialib_free (db[i].ml);
+		s4_close (db[i].s4);
+		_remove_db (filename[i]);
+	}
 
 	return 0;
 }
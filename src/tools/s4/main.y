@@ -62,7 +62,7 @@ s4_t *s4;
 
 %token <string> STRING QUOTED_STRING COND_VAR LIST_VAR RESULT_VAR FETCH_VAR PREF_VAR
 %token <number> INT
-%token INFO QUERY ADD DEL VARS SET HELP EXIT GR_EQ LE_EQ NOT_EQ
+%token INFO QUERY ADD DEL VARS SET STATS HELP EXIT GR_EQ LE_EQ NOT_EQ
 
 %type <value> value
 %type <condition> cond
@@ -110,6 +110,7 @@ command: /* Empty */
 	   | set
 	   | HELP { print_help (); }
 	   | VARS { print_vars (); }
+	   | STATS { print_stats (); }
 	   | EXIT { cleanup (); exit (0); }
 	   | COND_VAR '=' cond { g_hash_table_insert (cond_table, $1, $3); }
 	   | LIST_VAR '=' list { g_hash_table_insert (list_table, $1, $3); }
@@ -344,6 +344,33 @@ void print_vars ()
 	}
 }
 
+void print_stats ()
+{
+	s4_stats_t *stats = s4_stats_snapshot (s4);
+	int i;
+
+	printf ("Counters\n");
+	for (i = 0; i < S4_STATS_COUNTER_COUNT; i++) {
+		printf ("%-16s %" G_GUINT64_FORMAT "\n", s4_stats_counter_name (i),
+				(guint64)s4_stats_get_counter (stats, i));
+	}
+
+	printf ("\nLatencies (us)   count      avg      p50      p90      p99\n");
+	for (i = 0; i < S4_STATS_HISTOGRAM_COUNT; i++) {
+		uint64_t count = s4_stats_get_count (stats, i);
+
+		printf ("%-16s %-10" G_GUINT64_FORMAT " %-8" G_GUINT64_FORMAT
+				" %-8" G_GUINT64_FORMAT " %-8" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT "\n",
+				s4_stats_histogram_name (i), (guint64)count,
+				(guint64)(count?s4_stats_get_sum_us (stats, i) / count:0),
+				(guint64)s4_stats_get_percentile (stats, i, 50),
+				(guint64)s4_stats_get_percentile (stats, i, 90),
+				(guint64)s4_stats_get_percentile (stats, i, 99));
+	}
+
+	s4_stats_free (stats);
+}
+
 void print_help (void)
 {
 	printf("All statements must end with a semicolon\n\n"
@@ -357,6 +384,7 @@ void print_help (void)
 			".set key value        - Sets the option key to val\n"
 			".set key              - Shows the value of the key\n"
 			".set                  - Shows the value of all keys\n"
+			".stats                - Prints lock, commit and sync statistics\n"
 			".vars                 - Prints all bound variables\n\n"
 			"?var = <cond>         - Assigns cond to the condition variable var\n"
 			"%%var = <fetch>        - Assigns fetch to the fetch variable var\n"
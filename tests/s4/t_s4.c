@@ -18,6 +18,10 @@
 #include <stdlib.h>
 #include <glib.h>
 #include <glib/gstdio.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
 
 SETUP (S4) {
 	return 0;
@@ -152,6 +156,464 @@ CASE (test_log) {
 }
 
 
+CASE (test_log_record) {
+	struct db_struct db[] = {
+		{"a", {"x", "y", "z", NULL}, "plugin/id3v2"},
+		{"b", {"x", "y", NULL}, "plugin/id3v2"},
+		{"c", {"x", NULL}, "server"},
+		{NULL, {NULL}, NULL}};
+	s4_val_t *a = s4_val_new_string ("a");
+	s4_val_t *count = s4_val_new_int (-12345);
+	s4_val_t *gone = s4_val_new_string ("gone");
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond;
+	s4_transaction_t *trans;
+	s4_resultset_t *set;
+	const s4_result_t *res;
+	s4_t *first;
+	int32_t i;
+	_open (S4_NEW);
+
+	create_db (db);
+
+	/* Empties the string dictionary of the log */
+	s4_sync (s4);
+
+	trans = s4_begin (s4, 0);
+	CU_ASSERT (s4_add (trans, "entry", a, "count", count, "server"));
+	CU_ASSERT (s4_add (trans, "entry", a, "property", gone, "server"));
+	CU_ASSERT (s4_commit (trans));
+	trans = s4_begin (s4, 0);
+	CU_ASSERT (s4_del (trans, "entry", a, "property", gone, "server"));
+	CU_ASSERT (s4_commit (trans));
+
+	first = s4;
+	s4 = s4_open (name, NULL, 0);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	check_db (db);
+
+	s4_fetchspec_add (fs, "count", NULL, S4_FETCH_DATA);
+	s4_fetchspec_add (fs, "property", NULL, S4_FETCH_DATA);
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, "entry", a, NULL, S4_CMP_CASELESS, S4_COND_PARENT);
+	trans = s4_begin (s4, 0);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT (s4_commit (trans));
+
+	res = s4_resultset_get_result (set, 0, 0);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (res);
+	CU_ASSERT (s4_val_get_int (s4_result_get_val (res), &i));
+	CU_ASSERT_EQUAL (i, -12345);
+	for (res = s4_resultset_get_result (set, 0, 1); res != NULL; res = s4_result_next (res)) {
+		CU_ASSERT (strcmp (s4_result_get_src (res), "server"));
+	}
+
+	s4_resultset_free (set);
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+	s4_val_free (a);
+	s4_val_free (count);
+	s4_val_free (gone);
+	s4_close (first);
+	_close ();
+}
+
+CASE (test_durability) {
+	s4_val_t *a = s4_val_new_string ("a");
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond;
+	s4_transaction_t *trans;
+	s4_resultset_t *set;
+	const s4_result_t *res;
+	s4_stats_t *stats;
+	s4_t *first;
+	uint64_t syncs;
+	int32_t i;
+	_open (S4_NEW);
+
+	CU_ASSERT_EQUAL (s4_get_durability (s4), S4_DURABILITY_FULL);
+	s4_set_durability (s4, S4_DURABILITY_ASYNC);
+
+	for (i = 0; i < 3; i++) {
+		s4_val_t *val = s4_val_new_int (i);
+
+		trans = s4_begin (s4, 0);
+		CU_ASSERT (s4_add (trans, "entry", a, "timesplayed", val, "server"));
+		if (i == 2)
+			s4_transaction_set_durability (trans, S4_DURABILITY_NONE);
+		CU_ASSERT (s4_commit (trans));
+		CU_ASSERT_EQUAL (s4_last_durability (), (i < 2)?S4_DURABILITY_ASYNC:S4_DURABILITY_NONE);
+
+		s4_val_free (val);
+	}
+
+	stats = s4_stats_snapshot (s4);
+	syncs = s4_stats_get_counter (stats, S4_STATS_LOG_SYNCS);
+	s4_stats_free (stats);
+
+	s4_flush (s4);
+
+	stats = s4_stats_snapshot (s4);
+	CU_ASSERT_EQUAL (s4_stats_get_counter (stats, S4_STATS_LOG_SYNCS), syncs + 1);
+	s4_stats_free (stats);
+
+	trans = s4_begin (s4, 0);
+	s4_transaction_set_durability (trans, S4_DURABILITY_FULL);
+	CU_ASSERT (s4_add (trans, "entry", a, "lastplayed", a, "server"));
+	CU_ASSERT (s4_commit (trans));
+	CU_ASSERT_EQUAL (s4_last_durability (), S4_DURABILITY_FULL);
+
+	/* Another handle reads the records from the log */
+	first = s4;
+	s4 = s4_open (name, NULL, 0);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	s4_fetchspec_add (fs, "timesplayed", NULL, S4_FETCH_DATA);
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, "entry", a, NULL, S4_CMP_CASELESS, S4_COND_PARENT);
+	trans = s4_begin (s4, 0);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT (s4_commit (trans));
+
+	i = 0;
+	for (res = s4_resultset_get_result (set, 0, 0); res != NULL; res = s4_result_next (res)) {
+		i++;
+	}
+	CU_ASSERT_EQUAL (i, 3);
+
+	s4_resultset_free (set);
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+	s4_close (first);
+	_close ();
+
+	_mem_open ();
+	trans = s4_begin (s4, 0);
+	CU_ASSERT (s4_add (trans, "entry", a, "property", a, "server"));
+	CU_ASSERT (s4_commit (trans));
+	CU_ASSERT_EQUAL (s4_last_durability (), S4_DURABILITY_NONE);
+	_mem_close ();
+
+	s4_val_free (a);
+}
+
+#define CHECKPOINT_ENTRIES 200
+
+static gpointer _checkpoint_writer (gpointer data)
+{
+	s4_val_t *a = s4_val_new_string ("a");
+	int32_t i;
+
+	for (i = 0; i < CHECKPOINT_ENTRIES; i++) {
+		s4_val_t *val = s4_val_new_int (i);
+		s4_transaction_t *trans = s4_begin (s4, 0);
+
+		CU_ASSERT (s4_add (trans, "entry", a, "property", val, "src"));
+		CU_ASSERT (s4_commit (trans));
+		s4_val_free (val);
+	}
+
+	s4_val_free (a);
+	return NULL;
+}
+
+CASE (test_checkpoint_concurrent) {
+	s4_val_t *a = s4_val_new_string ("a");
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond;
+	s4_transaction_t *trans;
+	s4_resultset_t *set;
+	const s4_result_t *res;
+	GThread *writer;
+	s4_t *first;
+	int i;
+	_open (S4_NEW);
+
+	/* Checkpoint while another thread keeps committing */
+	writer = g_thread_new ("writer", _checkpoint_writer, NULL);
+	for (i = 0; i < 5; i++) {
+		s4_sync (s4);
+	}
+	g_thread_join (writer);
+
+	/* What was not in the last checkpoint is redone from the log */
+	first = s4;
+	s4 = s4_open (name, NULL, 0);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+
+	s4_fetchspec_add (fs, "property", NULL, S4_FETCH_DATA);
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, "entry", a, NULL, S4_CMP_CASELESS, S4_COND_PARENT);
+	trans = s4_begin (s4, 0);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT (s4_commit (trans));
+
+	i = 0;
+	for (res = s4_resultset_get_result (set, 0, 0); res != NULL; res = s4_result_next (res)) {
+		i++;
+	}
+	CU_ASSERT_EQUAL (i, CHECKPOINT_ENTRIES);
+
+	s4_resultset_free (set);
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+	s4_val_free (a);
+	s4_close (first);
+	_close ();
+}
+
+CASE (test_multi_process) {
+#ifndef _WIN32
+	s4_val_t *a = s4_val_new_string ("a");
+	s4_val_t *b = s4_val_new_string ("b");
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond;
+	s4_transaction_t *trans;
+	s4_resultset_t *set;
+	int go[2], ready[2], status;
+	pid_t pid;
+	char c;
+	int fd = g_file_open_tmp ("t_s4-XXXXXX", &name, NULL);
+
+	/* Fork before the database starts any threads, the child can not
+	 * safely use locks another thread might have held during the fork
+	 */
+	g_close (fd, NULL);
+	g_unlink (name);
+
+	CU_ASSERT_FATAL (pipe (go) == 0 && pipe (ready) == 0);
+	pid = fork ();
+	if (pid == 0) {
+		s4_t *child;
+
+		/* Die instead of hanging if the parent keeps the log locked */
+		alarm (10);
+		if (read (go[0], &c, 1) != 1)
+			_exit (1);
+		child = s4_open (name, NULL, 0);
+		if (write (ready[1], "x", 1) != 1 || read (go[0], &c, 1) != 1)
+			_exit (1);
+
+		/* Reads while the parent has a read-only transaction open */
+		trans = s4_begin (child, S4_TRANS_READONLY);
+		if (!s4_commit (trans) || write (ready[1], "x", 1) != 1)
+			_exit (1);
+
+		/* Hold a transaction open while the parent tries to start one */
+		trans = s4_begin (child, 0);
+		if (write (ready[1], "x", 1) != 1)
+			_exit (1);
+		g_usleep (200000);
+		s4_add (trans, "entry", a, "property", b, "child");
+		_exit (s4_commit (trans)?0:1);
+	}
+
+	close (go[0]);
+	close (ready[1]);
+
+	s4 = s4_open (name, NULL, S4_NEW);
+	s4_sync (s4);
+
+	/* An aborted transaction must let go of the log file */
+	trans = s4_begin (s4, 0);
+	CU_ASSERT (s4_add (trans, "entry", b, "property", a, "parent"));
+	CU_ASSERT (s4_abort (trans));
+
+	CU_ASSERT_FATAL (write (go[1], "x", 1) == 1);
+	CU_ASSERT_FATAL (read (ready[0], &c, 1) == 1);
+
+	/* Processes that only read do not keep each other out */
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+	CU_ASSERT_FATAL (write (go[1], "x", 1) == 1);
+	CU_ASSERT_FATAL (read (ready[0], &c, 1) == 1);
+	CU_ASSERT (s4_commit (trans));
+
+	CU_ASSERT_FATAL (read (ready[0], &c, 1) == 1);
+
+	/* Waits for the child to commit, then sees what it did */
+	s4_fetchspec_add (fs, "property", NULL, S4_FETCH_DATA);
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, "entry", a, NULL, S4_CMP_CASELESS, S4_COND_PARENT);
+	trans = s4_begin (s4, 0);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT (s4_commit (trans));
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 1);
+
+	CU_ASSERT (waitpid (pid, &status, 0) == pid);
+	CU_ASSERT (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+
+	close (go[1]);
+	close (ready[0]);
+	s4_resultset_free (set);
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+	s4_val_free (a);
+	s4_val_free (b);
+	_close ();
+#endif
+}
+
+/* Counts the values of property on the entry key=val in db */
+static int _count_values (s4_t *db, const char *key, s4_val_t *val)
+{
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond = s4_cond_new_filter (S4_FILTER_EQUAL, key, val,
+			NULL, S4_CMP_CASELESS, S4_COND_PARENT);
+	s4_transaction_t *trans = s4_begin (db, S4_TRANS_READONLY);
+	s4_resultset_t *set;
+	const s4_result_t *res;
+	int ret = 0;
+
+	s4_fetchspec_add (fs, "property", NULL, S4_FETCH_DATA);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT (s4_commit (trans));
+
+	for (res = s4_resultset_get_result (set, 0, 0); res != NULL; res = s4_result_next (res)) {
+		ret++;
+	}
+
+	s4_resultset_free (set);
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+
+	return ret;
+}
+
+CASE (test_follower) {
+	s4_val_t *a = s4_val_new_string ("a");
+	s4_val_t *first = s4_val_new_int (0);
+	s4_val_t *last = s4_val_new_int (2999);
+	s4_val_t *big;
+	s4_transaction_t *trans, *reader;
+	s4_t *follower;
+	char *str;
+	int i;
+	_open (S4_NEW);
+
+	follower = s4_open (name, NULL, S4_FOLLOWER | S4_EXISTS);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (follower);
+
+	/* Followers can not change the database */
+	trans = s4_begin (follower, 0);
+	CU_ASSERT (!s4_add (trans, "entry", a, "property", a, "follower"));
+	CU_ASSERT (!s4_commit (trans));
+	CU_ASSERT_EQUAL (s4_errno (), S4E_READONLY);
+
+	/* The follower picks up new commits in the background */
+	trans = s4_begin (s4, 0);
+	s4_add (trans, "entry", a, "property", a, "writer");
+	CU_ASSERT (s4_commit (trans));
+
+	for (i = 0; i < 100 && _count_values (follower, "entry", a) == 0; i++) {
+		g_usleep (20000);
+	}
+	CU_ASSERT_EQUAL (_count_values (follower, "entry", a), 1);
+
+	/* Hold the follower back while the log wraps around */
+	reader = s4_begin (follower, 0);
+
+	trans = s4_begin (s4, 0);
+	s4_del (trans, "entry", a, "property", a, "writer");
+	CU_ASSERT (s4_commit (trans));
+
+	s4_set_durability (s4, S4_DURABILITY_NONE);
+	str = g_strnfill (1000, 'x');
+	big = s4_val_new_string (str);
+	for (i = 0; i < 3000; i++) {
+		s4_val_t *val = s4_val_new_int (i);
+
+		trans = s4_begin (s4, 0);
+		s4_add (trans, "b", val, "property", big, "writer");
+		CU_ASSERT (s4_commit (trans));
+		s4_val_free (val);
+
+		if (i % 500 == 0)
+			s4_sync (s4);
+	}
+	s4_close (s4);
+
+	/* It catches up from the file, then from the log */
+	CU_ASSERT (s4_commit (reader));
+	s4_sync (follower);
+	s4 = follower;
+
+	CU_ASSERT_EQUAL (_count_values (s4, "entry", a), 0);
+	CU_ASSERT_EQUAL (_count_values (s4, "b", first), 1);
+	CU_ASSERT_EQUAL (_count_values (s4, "b", last), 1);
+
+	g_free (str);
+	s4_val_free (big);
+	s4_val_free (first);
+	s4_val_free (last);
+	s4_val_free (a);
+	_close ();
+}
+
+CASE (test_follower_busy_writer) {
+#ifndef _WIN32
+	s4_val_t *a = s4_val_new_string ("a");
+	s4_transaction_t *trans;
+	s4_t *follower;
+	int go[2], ready[2], status, i;
+	gint64 start;
+	pid_t pid;
+	char c;
+	_open (S4_NEW);
+	s4_close (s4);
+
+	/* The writer is another process, so it can keep the log file */
+	CU_ASSERT_FATAL (pipe (go) == 0 && pipe (ready) == 0);
+	pid = fork ();
+	if (pid == 0) {
+		s4_t *child;
+
+		alarm (10);
+		if (read (go[0], &c, 1) != 1)
+			_exit (1);
+		child = s4_open (name, NULL, 0);
+		trans = s4_begin (child, 0);
+		s4_add (trans, "entry", a, "property", a, "child");
+		if (!s4_commit (trans))
+			_exit (1);
+
+		/* Keep the log file while the follower wants to redo */
+		trans = s4_begin (child, 0);
+		if (write (ready[1], "x", 1) != 1)
+			_exit (1);
+		g_usleep (1000000);
+		_exit (s4_commit (trans)?0:1);
+	}
+
+	close (go[0]);
+	close (ready[1]);
+
+	follower = s4_open (name, NULL, S4_FOLLOWER | S4_EXISTS);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (follower);
+	CU_ASSERT_FATAL (write (go[1], "x", 1) == 1);
+	CU_ASSERT_FATAL (read (ready[0], &c, 1) == 1);
+
+	/* Give the follower time to see the commit and wait for the file */
+	g_usleep (200000);
+
+	/* Transactions on the follower are not held back meanwhile */
+	start = g_get_monotonic_time ();
+	trans = s4_begin (follower, 0);
+	CU_ASSERT (s4_commit (trans));
+	CU_ASSERT (g_get_monotonic_time () - start < 400000);
+
+	CU_ASSERT (waitpid (pid, &status, 0) == pid);
+	CU_ASSERT (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+
+	for (i = 0; i < 100 && _count_values (follower, "entry", a) == 0; i++) {
+		g_usleep (20000);
+	}
+	CU_ASSERT_EQUAL (_count_values (follower, "entry", a), 1);
+
+	close (go[1]);
+	close (ready[0]);
+	s4 = follower;
+	s4_val_free (a);
+	_close ();
+#endif
+}
+
 CASE (test_open) {
 	struct db_struct db[] = {
 		{"a", {"b", "c", NULL}, "src_a"},
@@ -295,3 +757,1286 @@ CASE (test_query) {
 
 	_mem_close ();
 }
+
+CASE (test_sort_window) {
+	s4_transaction_t *trans;
+	s4_condition_t *cond;
+	s4_fetchspec_t *fs;
+	s4_order_t *order;
+	s4_resultset_t *full, *window, *rest, *neg;
+	int i;
+	_mem_open ();
+
+	trans = s4_begin (s4, 0);
+	for (i = 0; i < 50; i++) {
+		s4_val_t *id = s4_val_new_int (i);
+		s4_val_t *val = s4_val_new_int ((i * 37) % 50);
+		CU_ASSERT (s4_add (trans, "entry", id, "property", val, "src"));
+		s4_val_free (id);
+		s4_val_free (val);
+	}
+	CU_ASSERT (s4_commit (trans));
+
+	fs = s4_fetchspec_create ();
+	s4_fetchspec_add (fs, "property", NULL, S4_FETCH_DATA);
+	cond = s4_cond_new_filter (S4_FILTER_EXISTS, "property", NULL, NULL, S4_CMP_CASELESS, 0);
+	order = s4_order_create ();
+	s4_order_entry_add_choice (s4_order_add_column (order, S4_CMP_CASELESS, S4_ORDER_DESCENDING), 0);
+
+	trans = s4_begin (s4, 0);
+	full = s4_query (trans, fs, cond);
+	window = s4_query (trans, fs, cond);
+	rest = s4_query (trans, fs, cond);
+	neg = s4_query (trans, fs, cond);
+	CU_ASSERT (s4_commit (trans));
+
+	s4_resultset_sort (full, order);
+	s4_resultset_sort_window (window, order, 10, 10);
+
+	/* offset + limit does not fit in an int, everything is sorted */
+	s4_resultset_sort_window (rest, order, 10, G_MAXINT);
+	for (i = 0; i < 50; i++) {
+		const s4_result_t *a = s4_resultset_get_result (rest, i, 0);
+		int32_t ia;
+
+		CU_ASSERT (s4_val_get_int (s4_result_get_val (a), &ia));
+		CU_ASSERT_EQUAL (ia, 49 - i);
+	}
+
+	/* A negative offset counts as 0 */
+	s4_resultset_sort_window (neg, order, -1, 5);
+	for (i = 0; i < 5; i++) {
+		const s4_result_t *a = s4_resultset_get_result (neg, i, 0);
+		int32_t ia;
+
+		CU_ASSERT (s4_val_get_int (s4_result_get_val (a), &ia));
+		CU_ASSERT_EQUAL (ia, 49 - i);
+	}
+
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (window), 50);
+	for (i = 0; i < 20; i++) {
+		const s4_result_t *a = s4_resultset_get_result (full, i, 0);
+		const s4_result_t *b = s4_resultset_get_result (window, i, 0);
+		int32_t ia, ib;
+
+		CU_ASSERT (s4_val_get_int (s4_result_get_val (a), &ia));
+		CU_ASSERT (s4_val_get_int (s4_result_get_val (b), &ib));
+		CU_ASSERT_EQUAL (ia, 49 - i);
+		CU_ASSERT_EQUAL (ia, ib);
+	}
+
+	s4_resultset_free (full);
+	s4_resultset_free (window);
+	s4_resultset_free (rest);
+	s4_resultset_free (neg);
+	s4_order_free (order);
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+
+	_mem_close ();
+}
+
+static int _count_rows (s4_fetchspec_t *fs, s4_condition_t *cond)
+{
+	s4_transaction_t *trans = s4_begin (s4, S4_TRANS_READONLY);
+	s4_resultset_t *set = s4_query (trans, fs, cond);
+	int ret = s4_resultset_get_rowcount (set);
+
+	CU_ASSERT (s4_commit (trans));
+	s4_resultset_free (set);
+
+	return ret;
+}
+
+CASE (test_query_cache) {
+	struct db_struct db[] = {
+		{"a", {"a", NULL}, "1"},
+		{"b", {"b", NULL}, "1"},
+		{NULL, {NULL}, NULL}};
+	struct db_struct more[] = {
+		{"c", {"a", NULL}, "1"},
+		{NULL, {NULL}, NULL}};
+	s4_transaction_t *trans;
+	s4_val_t *val = s4_val_new_string ("a");
+	s4_val_t *other = s4_val_new_string ("x");
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond = s4_cond_new_filter (S4_FILTER_EQUAL, "property",
+			val, NULL, S4_CMP_CASELESS, 0);
+
+	s4 = s4_open (NULL, NULL, S4_MEMORY | S4_QUERY_CACHE);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	s4_fetchspec_add (fs, "property", NULL, S4_FETCH_DATA);
+
+	create_db (db);
+	CU_ASSERT_EQUAL (_count_rows (fs, cond), 1);
+	CU_ASSERT_EQUAL (_count_rows (fs, cond), 1);
+
+	/* A write to an unrelated key keeps the cached set valid */
+	trans = s4_begin (s4, 0);
+	CU_ASSERT (s4_add (trans, "entry", val, "other", other, "1"));
+	CU_ASSERT (s4_commit (trans));
+	CU_ASSERT_EQUAL (_count_rows (fs, cond), 1);
+
+	create_db (more);
+	CU_ASSERT_EQUAL (_count_rows (fs, cond), 2);
+
+	del_db (more);
+	CU_ASSERT_EQUAL (_count_rows (fs, cond), 1);
+
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+	s4_val_free (val);
+	s4_val_free (other);
+	_mem_close ();
+}
+
+CASE (test_prepared) {
+	struct db_struct db[] = {
+		{"a", {"a", NULL}, "1"},
+		{"b", {"b", NULL}, "1"},
+		{"c", {"b", NULL}, "1"},
+		{NULL, {NULL}, NULL}};
+	s4_transaction_t *trans;
+	s4_resultset_t *set;
+	s4_prepared_t *prep;
+	s4_val_t *sa = s4_val_new_string ("a");
+	s4_val_t *sb = s4_val_new_string ("b");
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond = s4_cond_new_filter (S4_FILTER_EQUAL, "property",
+			sa, NULL, S4_CMP_CASELESS, 0);
+	_mem_open ();
+
+	create_db (db);
+	s4_fetchspec_add (fs, "property", NULL, S4_FETCH_DATA);
+	prep = s4_prepare (s4, fs, cond);
+	s4_cond_unref (cond);
+	s4_fetchspec_unref (fs);
+
+	trans = s4_begin (s4, 0);
+	set = s4_query_prepared (trans, prep);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 1);
+	check_result (s4_resultset_get_result (set, 0, 0), "property", "a", "1");
+	s4_resultset_free (set);
+
+	CU_ASSERT (s4_prepared_bind (prep, 0, sb));
+	CU_ASSERT (!s4_prepared_bind (prep, 1, sb));
+
+	set = s4_query_prepared (trans, prep);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 2);
+	check_result (s4_resultset_get_result (set, 0, 0), "property", "b", "1");
+	s4_resultset_free (set);
+	CU_ASSERT (s4_commit (trans));
+
+	s4_prepared_free (prep);
+	s4_val_free (sa);
+	s4_val_free (sb);
+	_mem_close ();
+}
+
+static void _add_int (const char *name, const char *key, int32_t i, const char *src)
+{
+	s4_val_t *name_val = s4_val_new_string (name);
+	s4_val_t *val = s4_val_new_int (i);
+	s4_transaction_t *trans = s4_begin (s4, 0);
+
+	CU_ASSERT (s4_add (trans, "entry", name_val, key, val, src));
+	CU_ASSERT (s4_commit (trans));
+
+	s4_val_free (name_val);
+	s4_val_free (val);
+}
+
+CASE (test_aggregate) {
+	struct db_struct db[] = {
+		{"a", {"x", NULL}, "1"},
+		{"b", {"x", NULL}, "1"},
+		{"c", {"y", NULL}, "1"},
+		{"a", {"z", NULL}, "2"},
+		{NULL, {NULL}, NULL}};
+	const char *sources[] = {"1", "*", NULL};
+	s4_sourcepref_t *sp = s4_sourcepref_create (sources);
+	s4_aggspec_t *spec = s4_aggspec_create ("property", sp);
+	s4_condition_t *cond = s4_cond_new_filter (S4_FILTER_EXISTS, "duration",
+			NULL, NULL, S4_CMP_CASELESS, 0);
+	s4_transaction_t *trans;
+	s4_aggresult_t *res;
+	const char *str;
+	int32_t i;
+	int64_t n;
+	_mem_open ();
+
+	create_db (db);
+	_add_int ("a", "duration", 10, "1");
+	_add_int ("b", "duration", 20, "1");
+	_add_int ("c", "duration", 30, "1");
+	_add_int ("d", "duration", 40, "1");
+
+	CU_ASSERT_EQUAL (s4_aggspec_add (spec, S4_AGGREGATE_COUNT, NULL, NULL), 0);
+	s4_aggspec_add (spec, S4_AGGREGATE_SUM, "duration", sp);
+	s4_aggspec_add (spec, S4_AGGREGATE_MAX, "duration", sp);
+	s4_aggspec_add (spec, S4_AGGREGATE_COUNT_DISTINCT, "entry", sp);
+
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+	res = s4_aggregate (trans, spec, cond);
+	CU_ASSERT (s4_commit (trans));
+
+	/* "d" has no property and ends up in the NULL group first,
+	 * the value from source "2" on "a" is never used */
+	CU_ASSERT_EQUAL_FATAL (s4_aggresult_get_groupcount (res), 3);
+	CU_ASSERT_PTR_NULL (s4_aggresult_get_group (res, 0));
+	CU_ASSERT (s4_val_get_str (s4_aggresult_get_group (res, 1), &str) && !strcmp (str, "x"));
+	CU_ASSERT (s4_val_get_str (s4_aggresult_get_group (res, 2), &str) && !strcmp (str, "y"));
+
+	CU_ASSERT (s4_aggresult_get_int (res, 1, 0, &n));
+	CU_ASSERT_EQUAL (n, 2);
+	CU_ASSERT (s4_aggresult_get_int (res, 1, 1, &n));
+	CU_ASSERT_EQUAL (n, 30);
+	CU_ASSERT (s4_val_get_int (s4_aggresult_get_val (res, 1, 2), &i));
+	CU_ASSERT_EQUAL (i, 20);
+	CU_ASSERT (s4_aggresult_get_int (res, 1, 3, &n));
+	CU_ASSERT_EQUAL (n, 2);
+	CU_ASSERT (s4_aggresult_get_int (res, 0, 1, &n));
+	CU_ASSERT_EQUAL (n, 40);
+	CU_ASSERT (!s4_aggresult_get_int (res, 3, 0, &n));
+
+	s4_aggresult_free (res);
+	s4_aggspec_free (spec);
+	s4_sourcepref_unref (sp);
+	s4_cond_free (cond);
+	_mem_close ();
+}
+
+static int _collect_value (const s4_val_t *val, int count, void *list)
+{
+	const char *str;
+	GString *s = list;
+
+	if (s4_val_get_str (val, &str))
+		g_string_append_printf (s, "%s:%i ", str, count);
+
+	return 1;
+}
+
+CASE (test_index_values) {
+	struct db_struct db[] = {
+		{"a", {"Beta", "alpha", NULL}, "1"},
+		{"b", {"beta", "alpine", NULL}, "1"},
+		{"c", {"gamma", NULL}, "1"},
+		{NULL, {NULL}, NULL}};
+	struct db_struct gone[] = {
+		{"c", {"gamma", NULL}, "1"},
+		{NULL, {NULL}, NULL}};
+	const char *indices[] = {"property", NULL};
+	s4_val_t *start = s4_val_new_string ("b");
+	GString *s = g_string_new (NULL);
+	s4_transaction_t *trans;
+
+	s4 = s4_open (NULL, indices, S4_MEMORY);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	create_db (db);
+
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+	CU_ASSERT (s4_index_foreach_value (trans, "property", NULL, NULL, NULL, _collect_value, s));
+	CU_ASSERT_STRING_EQUAL (s->str, "alpha:1 alpine:1 Beta:2 gamma:1 ");
+
+	g_string_truncate (s, 0);
+	CU_ASSERT (s4_index_foreach_value (trans, "property", NULL, NULL, "ALP", _collect_value, s));
+	CU_ASSERT_STRING_EQUAL (s->str, "alpha:1 alpine:1 ");
+
+	g_string_truncate (s, 0);
+	CU_ASSERT (s4_index_foreach_value (trans, "property", start, NULL, NULL, _collect_value, s));
+	CU_ASSERT_STRING_EQUAL (s->str, "Beta:2 gamma:1 ");
+
+	CU_ASSERT (!s4_index_foreach_value (trans, "entry", NULL, NULL, NULL, _collect_value, s));
+	CU_ASSERT_EQUAL (s4_errno (), S4E_NOINDEX);
+	CU_ASSERT (s4_commit (trans));
+
+	del_db (gone);
+
+	g_string_truncate (s, 0);
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+	CU_ASSERT (s4_index_foreach_value (trans, "property", start, NULL, NULL, _collect_value, s));
+	CU_ASSERT_STRING_EQUAL (s->str, "Beta:2 ");
+	CU_ASSERT (s4_commit (trans));
+
+	g_string_free (s, TRUE);
+	s4_val_free (start);
+	_mem_close ();
+}
+
+#define INDEX_WRITER_ENTRIES 5000
+
+/* Adds entries with ten different values while an index is built */
+static void *_index_writer (void *data)
+{
+	s4_val_t *x = s4_val_new_string ("x");
+	int i;
+
+	for (i = 0; i < INDEX_WRITER_ENTRIES; i++) {
+		char *str = g_strdup_printf ("v%i", i % 10);
+		s4_val_t *val = s4_val_new_string (str);
+		s4_val_t *id = s4_val_new_int (i);
+		s4_transaction_t *trans;
+
+		do {
+			trans = s4_begin (s4, 0);
+			s4_add (trans, "n", id, "property", val, "writer");
+			s4_add (trans, "n", id, "property", x, "writer");
+		} while (!s4_commit (trans));
+
+		do {
+			trans = s4_begin (s4, 0);
+			s4_del (trans, "n", id, "property", x, "writer");
+		} while (!s4_commit (trans));
+
+		s4_val_free (id);
+		s4_val_free (val);
+		g_free (str);
+	}
+
+	s4_val_free (x);
+	return NULL;
+}
+
+CASE (test_index_create) {
+	struct db_struct db[] = {
+		{"a", {"Beta", "alpha", NULL}, "1"},
+		{"b", {"beta", "alpine", NULL}, "1"},
+		{"c", {"gamma", NULL}, "1"},
+		{NULL, {NULL}, NULL}};
+	struct db_struct gone[] = {
+		{"c", {"gamma", NULL}, "1"},
+		{NULL, {NULL}, NULL}};
+	s4_val_t *val = s4_val_new_string ("beta");
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_query_stats_t *stats = s4_query_stats_create ();
+	s4_condition_t *cond;
+	s4_transaction_t *trans;
+	s4_resultset_t *set;
+	GString *s = g_string_new (NULL);
+	GString *expected = g_string_new ("alpha:1 alpine:1 Beta:2 ");
+	GThread *writer;
+	int i;
+
+	_mem_open ();
+	create_db (db);
+	s4_fetchspec_add (fs, "property", NULL, S4_FETCH_DATA);
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, "property", val, NULL, S4_CMP_CASELESS, 0);
+
+	CU_ASSERT (s4_index_create (s4, "property"));
+	CU_ASSERT (!s4_index_create (s4, "property"));
+
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+	s4_transaction_set_stats (trans, stats);
+	CU_ASSERT (s4_index_foreach_value (trans, "property", NULL, NULL, NULL, _collect_value, s));
+	/* Values differing only in case are shown as the first one the build found */
+	CU_ASSERT (!g_ascii_strcasecmp (s->str, "alpha:1 alpine:1 beta:2 gamma:1 "));
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT_EQUAL (s4_query_stats_get_path (stats), S4_PATH_INDEX_B);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 2);
+	CU_ASSERT (s4_commit (trans));
+	s4_resultset_free (set);
+
+	/* Dropped indexes are neither used nor listed */
+	CU_ASSERT (s4_index_drop (s4, "property"));
+	CU_ASSERT (!s4_index_drop (s4, "property"));
+
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+	s4_transaction_set_stats (trans, stats);
+	CU_ASSERT (!s4_index_foreach_value (trans, "property", NULL, NULL, NULL, _collect_value, s));
+	CU_ASSERT_EQUAL (s4_errno (), S4E_NOINDEX);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT_EQUAL (s4_query_stats_get_path (stats), S4_PATH_SCAN);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 2);
+	CU_ASSERT (s4_commit (trans));
+	s4_resultset_free (set);
+
+	del_db (gone);
+
+	/* Build it again while another thread keeps changing the database */
+	writer = g_thread_new ("writer", _index_writer, NULL);
+	g_usleep (10000);
+	CU_ASSERT (s4_index_create (s4, "property"));
+	g_thread_join (writer);
+
+	for (i = 0; i < 10; i++) {
+		g_string_append_printf (expected, "v%i:%i ", i, INDEX_WRITER_ENTRIES / 10);
+	}
+
+	g_string_truncate (s, 0);
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+	CU_ASSERT (s4_index_foreach_value (trans, "property", NULL, NULL, NULL, _collect_value, s));
+	CU_ASSERT (!g_ascii_strcasecmp (s->str, expected->str));
+	CU_ASSERT (s4_commit (trans));
+
+	g_string_free (s, TRUE);
+	g_string_free (expected, TRUE);
+	s4_query_stats_unref (stats);
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+	s4_val_free (val);
+	_mem_close ();
+}
+
+static void _song_set (int id, const char *key, s4_val_t *val, const char *src, int add)
+{
+	s4_val_t *id_val = s4_val_new_int (id);
+	s4_transaction_t *trans = s4_begin (s4, 0);
+
+	if (add)
+		CU_ASSERT (s4_add (trans, "song", id_val, key, val, src));
+	else
+		CU_ASSERT (s4_del (trans, "song", id_val, key, val, src));
+	CU_ASSERT (s4_commit (trans));
+
+	s4_val_free (id_val);
+	s4_val_free (val);
+}
+
+/* Runs a query and returns the ids of the songs found, in order */
+static char *_song_query (s4_condition_t *cond, s4_query_stats_t *stats)
+{
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_transaction_t *trans = s4_begin (s4, S4_TRANS_READONLY);
+	GString *ret = g_string_new (NULL);
+	s4_resultset_t *set;
+	int i;
+
+	s4_fetchspec_add (fs, "song", NULL, S4_FETCH_PARENT);
+	s4_transaction_set_stats (trans, stats);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT (s4_commit (trans));
+
+	for (i = 0; i < s4_resultset_get_rowcount (set); i++) {
+		int32_t id;
+
+		s4_val_get_int (s4_result_get_val (s4_resultset_get_result (set, i, 0)), &id);
+		g_string_append_printf (ret, "%i ", id);
+	}
+
+	s4_resultset_free (set);
+	s4_fetchspec_free (fs);
+
+	return g_string_free (ret, FALSE);
+}
+
+static s4_condition_t *_song_cond (s4_sourcepref_t *sp, const char *artist,
+		const char *album, s4_filter_type_t type, int tracknr)
+{
+	s4_condition_t *ret = s4_cond_new_combiner (S4_COMBINE_AND);
+	s4_condition_t *cond;
+	s4_val_t *val;
+
+	val = s4_val_new_string (artist);
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, "artist", val, sp, S4_CMP_CASELESS, 0);
+	s4_cond_add_operand (ret, cond);
+	s4_cond_unref (cond);
+	s4_val_free (val);
+
+	if (album != NULL) {
+		val = s4_val_new_string (album);
+		cond = s4_cond_new_filter (S4_FILTER_EQUAL, "album", val, sp, S4_CMP_CASELESS, 0);
+		s4_cond_add_operand (ret, cond);
+		s4_cond_unref (cond);
+		s4_val_free (val);
+	}
+
+	if (type != S4_FILTER_CUSTOM) {
+		val = s4_val_new_int (tracknr);
+		cond = s4_cond_new_filter (type, "tracknr", val, sp, S4_CMP_CASELESS, 0);
+		s4_cond_add_operand (ret, cond);
+		s4_cond_unref (cond);
+		s4_val_free (val);
+	}
+
+	return ret;
+}
+
+#define CHECK_SONGS(cond, stats, expected) do { \
+	char *_songs = _song_query (cond, stats); \
+	CU_ASSERT_STRING_EQUAL (_songs, expected); \
+	g_free (_songs); \
+} while (0)
+
+CASE (test_index_composite) {
+	struct {
+		int id;
+		const char *artist, *album;
+		int tracknr;
+	} songs[] = {
+		{1, "A", "X", 2},
+		{2, "A", "X", 1},
+		{3, "A", "Y", 1},
+		{4, "B", "X", 1},
+		{5, "a", "x", 3},
+		{6, "A", NULL, 1},
+		{0, NULL, NULL, 0}};
+	const char *keys[] = {"artist", "album", "tracknr", NULL};
+	const char *prefs[] = {"user", "*", NULL};
+	s4_sourcepref_t *sp = s4_sourcepref_create (prefs);
+	s4_sourcepref_t *same_sp = s4_sourcepref_create (prefs);
+	s4_query_stats_t *stats = s4_query_stats_create ();
+	s4_condition_t *cond, *range, *artist, *other_sp;
+	int i;
+
+	_mem_open ();
+
+	for (i = 0; songs[i].id != 0; i++) {
+		_song_set (songs[i].id, "artist", s4_val_new_string (songs[i].artist), "plugin", 1);
+		if (songs[i].album != NULL)
+			_song_set (songs[i].id, "album", s4_val_new_string (songs[i].album), "plugin", 1);
+		_song_set (songs[i].id, "tracknr", s4_val_new_int (songs[i].tracknr), "plugin", 1);
+	}
+	/* The user knows better than the plugin */
+	_song_set (2, "artist", s4_val_new_string ("C"), "user", 1);
+
+	CU_ASSERT (s4_index_create_composite (s4, keys, sp, S4_CMP_CASELESS));
+	CU_ASSERT (!s4_index_create_composite (s4, keys, NULL, S4_CMP_CASELESS));
+
+	cond = _song_cond (same_sp, "A", "X", S4_FILTER_CUSTOM, 0);
+	range = _song_cond (same_sp, "A", "X", S4_FILTER_GREATER, 2);
+	artist = _song_cond (same_sp, "A", NULL, S4_FILTER_CUSTOM, 0);
+	other_sp = _song_cond (NULL, "A", "X", S4_FILTER_CUSTOM, 0);
+
+	/* Only the matching entries are looked at, in the order of the index */
+	CHECK_SONGS (cond, stats, "1 5 ");
+	CU_ASSERT_EQUAL (s4_query_stats_get_path (stats), S4_PATH_INDEX_COMPOSITE);
+	CU_ASSERT_EQUAL (s4_query_stats_get_candidates (stats), 2);
+
+	CHECK_SONGS (range, stats, "5 ");
+	CU_ASSERT_EQUAL (s4_query_stats_get_path (stats), S4_PATH_INDEX_COMPOSITE);
+	CU_ASSERT_EQUAL (s4_query_stats_get_candidates (stats), 1);
+
+	CHECK_SONGS (artist, stats, "6 1 5 3 ");
+	CU_ASSERT_EQUAL (s4_query_stats_get_path (stats), S4_PATH_INDEX_COMPOSITE);
+
+	/* The index has the values from the wrong source for this one */
+	g_free (_song_query (other_sp, stats));
+	CU_ASSERT_EQUAL (s4_query_stats_get_path (stats), S4_PATH_SCAN);
+	CU_ASSERT_EQUAL (s4_query_stats_get_rows (stats), 3);
+
+	/* The index follows changes made after it was created */
+	_song_set (7, "artist", s4_val_new_string ("A"), "plugin", 1);
+	_song_set (7, "album", s4_val_new_string ("X"), "plugin", 1);
+	_song_set (7, "tracknr", s4_val_new_int (0), "plugin", 1);
+	_song_set (1, "album", s4_val_new_string ("X"), "plugin", 0);
+	_song_set (5, "artist", s4_val_new_string ("B"), "user", 1);
+	_song_set (2, "artist", s4_val_new_string ("C"), "user", 0);
+
+	CHECK_SONGS (cond, stats, "7 2 ");
+	CHECK_SONGS (artist, stats, "6 1 7 2 3 ");
+	CU_ASSERT_EQUAL (s4_query_stats_get_candidates (stats), 5);
+
+	CU_ASSERT (s4_index_drop_composite (s4, keys));
+	CU_ASSERT (!s4_index_drop_composite (s4, keys));
+
+	CHECK_SONGS (range, stats, "");
+	CU_ASSERT_EQUAL (s4_query_stats_get_path (stats), S4_PATH_SCAN);
+
+	s4_cond_free (cond);
+	s4_cond_free (range);
+	s4_cond_free (artist);
+	s4_cond_free (other_sp);
+	s4_query_stats_unref (stats);
+	s4_sourcepref_unref (sp);
+	s4_sourcepref_unref (same_sp);
+	_mem_close ();
+}
+
+/* Formats every column of every row of a query as "val/src" lists */
+static char *_song_fetch (s4_condition_t *cond, s4_fetchspec_t *fs, s4_query_stats_t *stats)
+{
+	s4_transaction_t *trans = s4_begin (s4, S4_TRANS_READONLY);
+	GString *ret = g_string_new (NULL);
+	s4_resultset_t *set;
+	int i, j;
+
+	s4_transaction_set_stats (trans, stats);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT (s4_commit (trans));
+
+	for (i = 0; i < s4_resultset_get_rowcount (set); i++) {
+		for (j = 0; j < s4_resultset_get_colcount (set); j++) {
+			const s4_result_t *res = s4_resultset_get_result (set, i, j);
+
+			for (; res != NULL; res = s4_result_next (res)) {
+				const char *str;
+				int32_t n;
+
+				if (s4_val_get_str (s4_result_get_val (res), &str))
+					g_string_append (ret, str);
+				else if (s4_val_get_int (s4_result_get_val (res), &n))
+					g_string_append_printf (ret, "%i", n);
+				if (s4_result_get_src (res) != NULL)
+					g_string_append_printf (ret, "/%s", s4_result_get_src (res));
+				g_string_append_c (ret, ',');
+			}
+			g_string_append_c (ret, ' ');
+		}
+		g_string_append_c (ret, ';');
+	}
+
+	s4_resultset_free (set);
+
+	return g_string_free (ret, FALSE);
+}
+
+#define CHECK_FETCH(cond, fs, stats, expected) do { \
+	char *_rows = _song_fetch (cond, fs, stats); \
+	CU_ASSERT_STRING_EQUAL (_rows, expected); \
+	g_free (_rows); \
+} while (0)
+
+CASE (test_index_covering) {
+	const char *keys[] = {"artist", "album", NULL};
+	const char *include[] = {"title", NULL};
+	const char *prefs[] = {"user", "*", NULL};
+	s4_sourcepref_t *sp = s4_sourcepref_create (prefs);
+	s4_query_stats_t *stats = s4_query_stats_create ();
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_fetchspec_t *uncovered = s4_fetchspec_create ();
+	s4_condition_t *cond, *title, *filter;
+	s4_val_t *val;
+
+	_mem_open ();
+
+	_song_set (1, "artist", s4_val_new_string ("A"), "plugin", 1);
+	_song_set (1, "album", s4_val_new_string ("Y"), "plugin", 1);
+	_song_set (1, "title", s4_val_new_string ("one"), "plugin", 1);
+	_song_set (1, "title", s4_val_new_string ("One"), "user", 1);
+	_song_set (2, "artist", s4_val_new_string ("A"), "plugin", 1);
+	_song_set (2, "album", s4_val_new_string ("X"), "plugin", 1);
+	_song_set (2, "title", s4_val_new_string ("two"), "plugin", 1);
+	_song_set (2, "title", s4_val_new_string ("deux"), "plugin", 1);
+	_song_set (2, "rating", s4_val_new_int (5), "plugin", 1);
+	_song_set (3, "artist", s4_val_new_string ("B"), "plugin", 1);
+
+	CU_ASSERT (s4_index_create_covering (s4, keys, include, sp, S4_CMP_CASELESS));
+
+	s4_fetchspec_add (fs, "song", NULL, S4_FETCH_PARENT);
+	s4_fetchspec_add (fs, "album", sp, S4_FETCH_DATA);
+	s4_fetchspec_add (fs, "title", sp, S4_FETCH_DATA);
+	s4_fetchspec_add (uncovered, "album", sp, S4_FETCH_DATA);
+	s4_fetchspec_add (uncovered, "rating", sp, S4_FETCH_DATA);
+
+	cond = _song_cond (sp, "A", NULL, S4_FILTER_CUSTOM, 0);
+	title = _song_cond (sp, "A", NULL, S4_FILTER_CUSTOM, 0);
+	val = s4_val_new_string ("two");
+	filter = s4_cond_new_filter (S4_FILTER_EQUAL, "title", val, sp, S4_CMP_CASELESS, 0);
+	s4_cond_add_operand (title, filter);
+	s4_cond_unref (filter);
+	s4_val_free (val);
+
+	/* Answered from the index alone, only the index is locked */
+	CHECK_FETCH (cond, fs, stats, "2, X/plugin, deux/plugin,two/plugin, ;1, Y/plugin, One/user, ;");
+	CU_ASSERT_EQUAL (s4_query_stats_get_path (stats), S4_PATH_INDEX_COMPOSITE);
+	CU_ASSERT_EQUAL (s4_query_stats_get_locks (stats), 1);
+	CU_ASSERT_EQUAL (s4_query_stats_get_rows (stats), 2);
+
+	/* Keys that are not covered have to be fetched from the entries */
+	CHECK_FETCH (cond, uncovered, stats, "X/plugin, 5/plugin, ;Y/plugin,  ;");
+	CU_ASSERT_EQUAL (s4_query_stats_get_path (stats), S4_PATH_INDEX_COMPOSITE);
+	CU_ASSERT (s4_query_stats_get_locks (stats) > 1);
+
+	/* And so do filters the index can not narrow by */
+	CHECK_FETCH (title, fs, stats, "2, X/plugin, deux/plugin,two/plugin, ;");
+	CU_ASSERT (s4_query_stats_get_locks (stats) > 1);
+
+	/* Changes to included keys are seen */
+	_song_set (2, "title", s4_val_new_string ("deux"), "plugin", 0);
+	_song_set (1, "album", s4_val_new_string ("W"), "user", 1);
+	CHECK_FETCH (cond, fs, stats, "1, W/user, One/user, ;2, X/plugin, two/plugin, ;");
+	CU_ASSERT_EQUAL (s4_query_stats_get_locks (stats), 1);
+
+	s4_cond_free (cond);
+	s4_cond_free (title);
+	s4_fetchspec_free (fs);
+	s4_fetchspec_free (uncovered);
+	s4_query_stats_unref (stats);
+	s4_sourcepref_unref (sp);
+	_mem_close ();
+}
+
+/* Fetches every value of a song in db */
+static char *_song_data (s4_t *db, int id)
+{
+	s4_val_t *val = s4_val_new_int (id);
+	s4_condition_t *cond = s4_cond_new_filter (S4_FILTER_EQUAL, "song", val,
+			NULL, S4_CMP_CASELESS, S4_COND_PARENT);
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_t *old = s4;
+	char *ret;
+
+	s4_fetchspec_add (fs, NULL, NULL, S4_FETCH_DATA);
+	s4 = db;
+	ret = _song_fetch (cond, fs, NULL);
+	s4 = old;
+
+	s4_fetchspec_free (fs);
+	s4_cond_free (cond);
+	s4_val_free (val);
+
+	return ret;
+}
+
+#define CHECK_DATA(db, id, expected) do { \
+	char *_data = _song_data (db, id); \
+	CU_ASSERT_STRING_EQUAL (_data, expected); \
+	g_free (_data); \
+} while (0)
+
+CASE (test_del_source) {
+	const char *prefs[] = {"user", "*", NULL};
+	s4_sourcepref_t *sp = s4_sourcepref_create (prefs);
+	s4_query_stats_t *stats = s4_query_stats_create ();
+	s4_condition_t *cond, *title;
+	s4_transaction_t *trans;
+	s4_val_t *val;
+	s4_t *follower;
+	int i, done;
+
+	_open (S4_NEW);
+	follower = s4_open (name, NULL, S4_FOLLOWER | S4_EXISTS);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (follower);
+	CU_ASSERT (s4_index_create (s4, "title"));
+
+	_song_set (1, "artist", s4_val_new_string ("A"), "plugin", 1);
+	_song_set (1, "title", s4_val_new_string ("one"), "plugin", 1);
+	_song_set (1, "title", s4_val_new_string ("One"), "user", 1);
+	_song_set (2, "artist", s4_val_new_string ("A"), "plugin", 1);
+	_song_set (2, "title", s4_val_new_string ("two"), "plugin", 1);
+	_song_set (3, "artist", s4_val_new_string ("B"), "plugin", 1);
+	_song_set (3, "title", s4_val_new_string ("three"), "plugin", 1);
+
+	cond = _song_cond (sp, "A", NULL, S4_FILTER_CUSTOM, 0);
+	val = s4_val_new_string ("two");
+	title = s4_cond_new_filter (S4_FILTER_EQUAL, "title", val, NULL, S4_CMP_CASELESS, 0);
+	s4_val_free (val);
+
+	/* Only the entries matching the condition lose the source */
+	trans = s4_begin (s4, 0);
+	CU_ASSERT (s4_del_source (trans, "plugin", cond));
+	CU_ASSERT (s4_commit (trans));
+
+	CHECK_DATA (s4, 1, "One/user, ;");
+	CHECK_DATA (s4, 2, "");
+	CHECK_DATA (s4, 3, "B/plugin,three/plugin, ;");
+
+	/* The b-index is kept up to date */
+	CHECK_SONGS (title, stats, "");
+	CU_ASSERT_EQUAL (s4_query_stats_get_path (stats), S4_PATH_INDEX_B);
+
+	/* An aborted delete puts everything back */
+	trans = s4_begin (s4, 0);
+	CU_ASSERT (s4_del_source (trans, "plugin", NULL));
+	CU_ASSERT (s4_abort (trans));
+	CHECK_DATA (s4, 3, "B/plugin,three/plugin, ;");
+
+	/* Read-only transactions can not delete */
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+	CU_ASSERT (!s4_del_source (trans, "plugin", NULL));
+	CU_ASSERT (!s4_commit (trans));
+	CU_ASSERT_EQUAL (s4_errno (), S4E_READONLY);
+
+	/* Without a condition every entry loses the source */
+	trans = s4_begin (s4, 0);
+	CU_ASSERT (s4_del_source (trans, "plugin", NULL));
+	CU_ASSERT (s4_commit (trans));
+	CHECK_DATA (s4, 1, "One/user, ;");
+	CHECK_DATA (s4, 3, "");
+
+	/* The follower replays the deletes from the log */
+	for (i = 0, done = 0; i < 100 && !done; i++) {
+		char *first = _song_data (follower, 1);
+		char *last = _song_data (follower, 3);
+
+		done = g_strcmp0 (first, "One/user, ;") == 0 && g_strcmp0 (last, "") == 0;
+		g_free (first);
+		g_free (last);
+		if (!done)
+			g_usleep (20000);
+	}
+	CU_ASSERT (done);
+	CHECK_DATA (follower, 2, "");
+
+	s4_close (follower);
+	s4_cond_free (cond);
+	s4_cond_free (title);
+	s4_query_stats_unref (stats);
+	s4_sourcepref_unref (sp);
+	_close ();
+}
+
+CASE (test_del_where) {
+	s4_query_stats_t *stats = s4_query_stats_create ();
+	s4_condition_t *cond, *title;
+	s4_transaction_t *trans;
+	s4_val_t *val;
+	s4_t *follower;
+	int i, done;
+
+	_open (S4_NEW);
+	follower = s4_open (name, NULL, S4_FOLLOWER | S4_EXISTS);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (follower);
+	CU_ASSERT (s4_index_create (s4, "title"));
+
+	_song_set (1, "artist", s4_val_new_string ("A"), "plugin", 1);
+	_song_set (1, "title", s4_val_new_string ("one"), "user", 1);
+	_song_set (2, "artist", s4_val_new_string ("A"), "plugin", 1);
+	_song_set (2, "title", s4_val_new_string ("two"), "plugin", 1);
+	_song_set (3, "artist", s4_val_new_string ("B"), "plugin", 1);
+
+	cond = _song_cond (NULL, "A", NULL, S4_FILTER_CUSTOM, 0);
+	val = s4_val_new_string ("two");
+	title = s4_cond_new_filter (S4_FILTER_EQUAL, "title", val, NULL, S4_CMP_CASELESS, 0);
+	s4_val_free (val);
+
+	/* An aborted delete puts everything back */
+	trans = s4_begin (s4, 0);
+	CU_ASSERT (s4_del_where (trans, cond));
+	CU_ASSERT (s4_abort (trans));
+	CHECK_DATA (s4, 1, "A/plugin,one/user, ;");
+	CHECK_SONGS (title, stats, "2 ");
+
+	/* Every relation of the matching entries goes, whatever the source */
+	trans = s4_begin (s4, 0);
+	CU_ASSERT (s4_del_where (trans, cond));
+	CU_ASSERT (s4_commit (trans));
+
+	CHECK_DATA (s4, 1, "");
+	CHECK_DATA (s4, 2, "");
+	CHECK_DATA (s4, 3, "B/plugin, ;");
+	CHECK_SONGS (cond, stats, "");
+	CHECK_SONGS (title, stats, "");
+	CU_ASSERT_EQUAL (s4_query_stats_get_path (stats), S4_PATH_INDEX_B);
+
+	/* The follower replays the delete from the log */
+	for (i = 0, done = 0; i < 100 && !done; i++) {
+		char *first = _song_data (follower, 1);
+		char *last = _song_data (follower, 3);
+
+		done = g_strcmp0 (first, "") == 0 && g_strcmp0 (last, "B/plugin, ;") == 0;
+		g_free (first);
+		g_free (last);
+		if (!done)
+			g_usleep (20000);
+	}
+	CU_ASSERT (done);
+	CHECK_DATA (follower, 2, "");
+
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+	CU_ASSERT (!s4_del_where (trans, cond));
+	CU_ASSERT (!s4_commit (trans));
+	CU_ASSERT_EQUAL (s4_errno (), S4E_READONLY);
+
+	s4_close (follower);
+	s4_cond_free (cond);
+	s4_cond_free (title);
+	s4_query_stats_unref (stats);
+	_close ();
+}
+
+CASE (test_add_many) {
+	s4_val_t *one = s4_val_new_int (1);
+	s4_val_t *two = s4_val_new_int (2);
+	s4_val_t *a = s4_val_new_string ("a");
+	s4_val_t *b = s4_val_new_string ("b");
+	s4_val_t *c = s4_val_new_string ("c");
+	s4_tuple_t tuples[] = {
+		{"song", one, "title", a, "plugin"},
+		{"song", two, "title", b, "plugin"},
+		{"song", one, "title", c, "plugin"},
+		{"song", one, "title", b, "user"},
+	};
+	s4_query_stats_t *stats = s4_query_stats_create ();
+	s4_condition_t *cond;
+	s4_transaction_t *trans;
+
+	_mem_open ();
+	CU_ASSERT (s4_index_create (s4, "title"));
+
+	/* Tuples for the same entry do not have to be next to each other */
+	trans = s4_begin (s4, 0);
+	CU_ASSERT (s4_add_many (trans, tuples, 4));
+	CU_ASSERT (s4_commit (trans));
+
+	CHECK_DATA (s4, 1, "b/user,c/plugin,a/plugin, ;");
+	CHECK_DATA (s4, 2, "b/plugin, ;");
+
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, "title", c, NULL, S4_CMP_CASELESS, 0);
+	CHECK_SONGS (cond, stats, "1 ");
+	CU_ASSERT_EQUAL (s4_query_stats_get_path (stats), S4_PATH_INDEX_B);
+
+	/* Adding a tuple that exists fails like s4_add */
+	trans = s4_begin (s4, 0);
+	CU_ASSERT (!s4_add_many (trans, tuples + 1, 2));
+	CU_ASSERT (!s4_commit (trans));
+	CU_ASSERT_EQUAL (s4_errno (), S4E_EXECUTE);
+
+	/* Aborted deletes are rolled back */
+	trans = s4_begin (s4, 0);
+	CU_ASSERT (s4_del_many (trans, tuples, 3));
+	CU_ASSERT (s4_abort (trans));
+	CHECK_DATA (s4, 1, "a/plugin,c/plugin,b/user, ;");
+
+	trans = s4_begin (s4, 0);
+	CU_ASSERT (s4_del_many (trans, tuples, 3));
+	CU_ASSERT (s4_commit (trans));
+	CHECK_DATA (s4, 1, "b/user, ;");
+	CHECK_DATA (s4, 2, "");
+	CHECK_SONGS (cond, stats, "");
+
+	/* Deleting a tuple that does not exist fails like s4_del */
+	trans = s4_begin (s4, 0);
+	CU_ASSERT (!s4_del_many (trans, tuples, 1));
+	CU_ASSERT (!s4_commit (trans));
+
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+	CU_ASSERT (!s4_add_many (trans, tuples, 4));
+	CU_ASSERT (!s4_commit (trans));
+	CU_ASSERT_EQUAL (s4_errno (), S4E_READONLY);
+
+	s4_cond_free (cond);
+	s4_query_stats_unref (stats);
+	s4_val_free (one);
+	s4_val_free (two);
+	s4_val_free (a);
+	s4_val_free (b);
+	s4_val_free (c);
+	_mem_close ();
+}
+
+CASE (test_deferred) {
+	s4_val_t *one = s4_val_new_int (1);
+	s4_val_t *a = s4_val_new_string ("a");
+	s4_val_t *b = s4_val_new_string ("b");
+	s4_condition_t *cond = s4_cond_new_filter (S4_FILTER_EQUAL, "song", one,
+			NULL, S4_CMP_CASELESS, S4_COND_PARENT);
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_transaction_t *trans;
+	s4_resultset_t *set;
+
+	_mem_open ();
+	s4_fetchspec_add (fs, "title", NULL, S4_FETCH_DATA);
+
+	/* Staged changes hold no locks, other transactions go ahead */
+	trans = s4_begin (s4, S4_TRANS_DEFERRED);
+	CU_ASSERT (s4_add (trans, "song", one, "title", a, "plugin"));
+	CHECK_DATA (s4, 1, "");
+	CU_ASSERT (s4_abort (trans));
+	CHECK_DATA (s4, 1, "");
+
+	/* The transaction sees its own changes */
+	trans = s4_begin (s4, S4_TRANS_DEFERRED);
+	CU_ASSERT (s4_add (trans, "song", one, "title", a, "plugin"));
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 1);
+	s4_resultset_free (set);
+	CU_ASSERT (s4_add (trans, "song", one, "title", b, "plugin"));
+	CU_ASSERT (s4_commit (trans));
+	CHECK_DATA (s4, 1, "b/plugin,a/plugin, ;");
+
+	/* Changes that fail make the commit fail, and nothing is applied */
+	trans = s4_begin (s4, S4_TRANS_DEFERRED);
+	CU_ASSERT (s4_del (trans, "song", one, "title", b, "plugin"));
+	CU_ASSERT (s4_add (trans, "song", one, "title", a, "plugin"));
+	CU_ASSERT (!s4_commit (trans));
+	CU_ASSERT_EQUAL (s4_errno (), S4E_EXECUTE);
+	CHECK_DATA (s4, 1, "b/plugin,a/plugin, ;");
+
+	/* Applied changes are rolled back on abort */
+	trans = s4_begin (s4, S4_TRANS_DEFERRED);
+	CU_ASSERT (s4_del (trans, "song", one, "title", b, "plugin"));
+	set = s4_query (trans, fs, cond);
+	s4_resultset_free (set);
+	CU_ASSERT (s4_del_where (trans, cond));
+	CU_ASSERT (s4_abort (trans));
+	CHECK_DATA (s4, 1, "b/plugin,a/plugin, ;");
+
+	trans = s4_begin (s4, S4_TRANS_DEFERRED);
+	CU_ASSERT (s4_del_where (trans, cond));
+	CHECK_DATA (s4, 1, "b/plugin,a/plugin, ;");
+	CU_ASSERT (s4_commit (trans));
+	CHECK_DATA (s4, 1, "");
+
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+	s4_val_free (one);
+	s4_val_free (a);
+	s4_val_free (b);
+	_mem_close ();
+}
+
+CASE (test_optimistic) {
+	s4_val_t *one = s4_val_new_int (1);
+	s4_val_t *two = s4_val_new_int (2);
+	s4_val_t *a = s4_val_new_string ("a");
+	s4_val_t *b = s4_val_new_string ("b");
+	s4_condition_t *cond = s4_cond_new_filter (S4_FILTER_EQUAL, "song", one,
+			NULL, S4_CMP_CASELESS, S4_COND_PARENT);
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_transaction_t *trans, *other;
+	s4_resultset_t *set;
+
+	_mem_open ();
+	s4_fetchspec_add (fs, "title", NULL, S4_FETCH_DATA);
+
+	/* Transactions that do not read what the other one writes both commit */
+	trans = s4_begin (s4, S4_TRANS_OPTIMISTIC);
+	other = s4_begin (s4, S4_TRANS_OPTIMISTIC);
+	CU_ASSERT (s4_add (trans, "song", one, "title", a, "plugin"));
+	CU_ASSERT (s4_add (other, "song", two, "title", a, "plugin"));
+	CU_ASSERT (s4_commit (trans));
+	CU_ASSERT (s4_commit (other));
+	CHECK_DATA (s4, 1, "a/plugin, ;");
+	CHECK_DATA (s4, 2, "a/plugin, ;");
+
+	/* Reads do not block writers, and nothing changed so the commit goes through */
+	trans = s4_begin (s4, S4_TRANS_OPTIMISTIC);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 1);
+	s4_resultset_free (set);
+	CU_ASSERT (s4_add (trans, "song", one, "title", b, "plugin"));
+	CHECK_DATA (s4, 1, "a/plugin, ;");
+	CU_ASSERT (s4_commit (trans));
+	CHECK_DATA (s4, 1, "b/plugin,a/plugin, ;");
+
+	/* A change to something read before the commit makes it fail */
+	trans = s4_begin (s4, S4_TRANS_OPTIMISTIC);
+	set = s4_query (trans, fs, cond);
+	s4_resultset_free (set);
+	CU_ASSERT (s4_del (trans, "song", one, "title", a, "plugin"));
+
+	other = s4_begin (s4, 0);
+	CU_ASSERT (s4_del (other, "song", one, "title", b, "plugin"));
+	CU_ASSERT (s4_commit (other));
+
+	CU_ASSERT (!s4_commit (trans));
+	CU_ASSERT_EQUAL (s4_errno (), S4E_CONFLICT);
+	CHECK_DATA (s4, 1, "a/plugin, ;");
+
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+	s4_val_free (one);
+	s4_val_free (two);
+	s4_val_free (a);
+	s4_val_free (b);
+	_mem_close ();
+}
+
+static int _count_id (int32_t id, s4_cmp_mode_t mode)
+{
+	s4_val_t *val = s4_val_new_int (id);
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond = s4_cond_new_filter (S4_FILTER_EQUAL, "song_id",
+			val, NULL, mode, S4_COND_PARENT);
+	int ret;
+
+	s4_fetchspec_add (fs, "title", NULL, S4_FETCH_DATA);
+	ret = _count_rows (fs, cond);
+
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+	s4_val_free (val);
+
+	return ret;
+}
+
+CASE (test_int_index) {
+	s4_transaction_t *trans;
+	s4_val_t *id, *title;
+	int i;
+
+	_mem_open ();
+
+	trans = s4_begin (s4, 0);
+	for (i = -500; i < 2000; i += 3) {
+		id = s4_val_new_int (i);
+		title = s4_val_new_int (i * 2);
+		CU_ASSERT (s4_add (trans, "song_id", id, "title", title, "src"));
+		s4_val_free (id);
+		s4_val_free (title);
+	}
+	id = s4_val_new_string ("7");
+	title = s4_val_new_string ("seven");
+	CU_ASSERT (s4_add (trans, "song_id", id, "title", title, "src"));
+	s4_val_free (id);
+	s4_val_free (title);
+	CU_ASSERT (s4_commit (trans));
+
+	for (i = -500; i < 2000; i++) {
+		CU_ASSERT_EQUAL (_count_id (i, S4_CMP_CASELESS), (i + 500) % 3 == 0);
+	}
+
+	/* The string "7" is not the integer 7 */
+	CU_ASSERT_EQUAL (_count_id (7, S4_CMP_CASELESS), 1);
+	CU_ASSERT_EQUAL (_count_id (8, S4_CMP_BINARY), 0);
+
+	_mem_close ();
+}
+
+CASE (test_query_stats) {
+	struct db_struct db[] = {
+		{"a", {"a", NULL}, "1"},
+		{"b", {"b", NULL}, "1"},
+		{"c", {"b", NULL}, "1"},
+		{NULL, {NULL}, NULL}};
+	const char *indices[] = {"property", NULL};
+	s4_val_t *val = s4_val_new_string ("b");
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_query_stats_t *stats = s4_query_stats_create ();
+	s4_condition_t *cond;
+	s4_transaction_t *trans;
+	s4_resultset_t *set;
+	s4_order_t *order = s4_order_create ();
+
+	s4 = s4_open (NULL, indices, S4_MEMORY | S4_QUERY_CACHE);
+	CU_ASSERT_PTR_NOT_NULL_FATAL (s4);
+	create_db (db);
+	s4_fetchspec_add (fs, "property", NULL, S4_FETCH_DATA);
+	s4_order_entry_add_choice (s4_order_add_column (order, S4_CMP_CASELESS, S4_ORDER_ASCENDING), 0);
+
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+	s4_transaction_set_stats (trans, stats);
+	CU_ASSERT_EQUAL (s4_query_stats_get_path (stats), S4_PATH_NONE);
+
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, "property", val, NULL, S4_CMP_CASELESS, 0);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT_EQUAL (s4_query_stats_get_path (stats), S4_PATH_INDEX_B);
+	CU_ASSERT_EQUAL (s4_query_stats_get_candidates (stats), 2);
+	CU_ASSERT_EQUAL (s4_query_stats_get_rows (stats), 2);
+	CU_ASSERT (s4_query_stats_get_locks (stats) >= 3);
+	CU_ASSERT (s4_query_stats_get_total_us (stats) >= s4_query_stats_get_fetch_us (stats));
+	s4_resultset_sort (set, order);
+	CU_ASSERT (s4_query_stats_get_sort_us (stats) >= 0);
+	s4_resultset_free (set);
+
+	/* The same query again is answered by the cache */
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT_EQUAL (s4_query_stats_get_path (stats), S4_PATH_CACHE);
+	CU_ASSERT_EQUAL (s4_query_stats_get_candidates (stats), 0);
+	CU_ASSERT_EQUAL (s4_query_stats_get_rows (stats), 2);
+	s4_resultset_free (set);
+	s4_cond_free (cond);
+
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, "entry", val, NULL, S4_CMP_CASELESS, S4_COND_PARENT);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT_EQUAL (s4_query_stats_get_path (stats), S4_PATH_INDEX_A);
+	CU_ASSERT_EQUAL (s4_query_stats_get_rows (stats), 1);
+	s4_resultset_free (set);
+	s4_cond_free (cond);
+
+	cond = s4_cond_new_filter (S4_FILTER_EXISTS, "other", NULL, NULL, S4_CMP_CASELESS, 0);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT_EQUAL (s4_query_stats_get_path (stats), S4_PATH_SCAN);
+	CU_ASSERT_EQUAL (s4_query_stats_get_candidates (stats), 3);
+	CU_ASSERT_EQUAL (s4_query_stats_get_rows (stats), 0);
+	s4_resultset_free (set);
+	s4_cond_free (cond);
+
+	CU_ASSERT (s4_commit (trans));
+
+	s4_query_stats_unref (stats);
+	s4_order_free (order);
+	s4_fetchspec_free (fs);
+	s4_val_free (val);
+	_mem_close ();
+}
+
+CASE (test_stats) {
+	s4_val_t *val = s4_val_new_int (1);
+	s4_transaction_t *trans;
+	s4_stats_t *stats;
+	int i;
+	_mem_open ();
+
+	for (i = 0; i < 3; i++) {
+		s4_val_t *b = s4_val_new_int (i);
+
+		trans = s4_begin (s4, 0);
+		CU_ASSERT (s4_add (trans, "a", val, "b", b, "src"));
+		CU_ASSERT (s4_commit (trans));
+		s4_val_free (b);
+	}
+	trans = s4_begin (s4, 0);
+	CU_ASSERT (s4_add (trans, "a", val, "c", val, "src"));
+	CU_ASSERT (s4_abort (trans));
+
+	stats = s4_stats_snapshot (s4);
+	CU_ASSERT_EQUAL (s4_stats_get_counter (stats, S4_STATS_COMMITS), 3);
+	CU_ASSERT_EQUAL (s4_stats_get_counter (stats, S4_STATS_ABORTS), 1);
+	CU_ASSERT (s4_stats_get_counter (stats, S4_STATS_LOCKS) >= 4);
+	CU_ASSERT (s4_stats_get_counter (stats, S4_STATS_LOCK_UPGRADES) >= 1);
+	CU_ASSERT_EQUAL (s4_stats_get_counter (stats, S4_STATS_DEADLOCKS), 0);
+	CU_ASSERT_EQUAL (s4_stats_get_count (stats, S4_STATS_COMMIT), 3);
+	CU_ASSERT (s4_stats_get_percentile (stats, S4_STATS_COMMIT, 99) > 0);
+	CU_ASSERT_EQUAL (s4_stats_get_percentile (stats, S4_STATS_LOCK_WAIT, 99), 0);
+	CU_ASSERT_STRING_EQUAL (s4_stats_counter_name (S4_STATS_COMMITS), "commits");
+	s4_stats_free (stats);
+
+	s4_stats_reset (s4);
+	stats = s4_stats_snapshot (s4);
+	CU_ASSERT_EQUAL (s4_stats_get_counter (stats, S4_STATS_COMMITS), 0);
+	CU_ASSERT_EQUAL (s4_stats_get_count (stats, S4_STATS_COMMIT), 0);
+	s4_stats_free (stats);
+
+	s4_val_free (val);
+	_mem_close ();
+}
+
+/* Returns the number of locks taken in s4 so far */
+static uint64_t _lock_count (void)
+{
+	s4_stats_t *stats = s4_stats_snapshot (s4);
+	uint64_t ret = s4_stats_get_counter (stats, S4_STATS_LOCKS);
+
+	s4_stats_free (stats);
+	return ret;
+}
+
+CASE (test_readonly_relock) {
+	s4_val_t *val = s4_val_new_int (1);
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond = s4_cond_new_filter (S4_FILTER_EQUAL, "b", val,
+			NULL, S4_CMP_BINARY, 0);
+	s4_transaction_t *trans;
+	s4_resultset_t *set;
+	uint64_t locks, once;
+	int i;
+	_mem_open ();
+
+	/* Enough entries that the transaction holds more than a few locks */
+	s4_fetchspec_add (fs, "b", NULL, S4_FETCH_DATA);
+	for (i = 0; i < 20; i++) {
+		s4_val_t *a = s4_val_new_int (i);
+
+		trans = s4_begin (s4, 0);
+		CU_ASSERT (s4_add (trans, "a", a, "b", val, "src"));
+		CU_ASSERT (s4_commit (trans));
+		s4_val_free (a);
+	}
+
+	locks = _lock_count ();
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 20);
+	s4_resultset_free (set);
+	CU_ASSERT (s4_commit (trans));
+	once = _lock_count () - locks;
+	CU_ASSERT (once > 20);
+
+	/* Locks a read-only transaction already holds are not taken again */
+	locks = _lock_count ();
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+	for (i = 0; i < 101; i++) {
+		set = s4_query (trans, fs, cond);
+		s4_resultset_free (set);
+	}
+	CU_ASSERT (s4_commit (trans));
+	CU_ASSERT_EQUAL (_lock_count () - locks, once);
+
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+	s4_val_free (val);
+	_mem_close ();
+}
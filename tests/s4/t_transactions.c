@@ -83,6 +83,183 @@ CASE (test_deadlock) {
 	_mem_close ();
 }
 
+static void _dead_writer (void)
+{
+	s4_transaction_t *trans = s4_begin (s4, 0);
+
+	CU_ASSERT_PTR_NOT_NULL (trans);
+	CU_ASSERT_TRUE (s4_add (trans, "a", val, "b", val, "src"));
+	g_usleep (G_USEC_PER_SEC);
+	CU_ASSERT_TRUE (s4_add (trans, "b", val, "a", val, "src"));
+
+	CU_ASSERT_TRUE (s4_commit (trans));
+}
+
+static void _dead_reader (void)
+{
+	s4_transaction_t *trans = s4_begin (s4, S4_TRANS_READONLY);
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond_a, *cond_b;
+	s4_resultset_t *set;
+
+	cond_a = s4_cond_new_filter (S4_FILTER_EQUAL, "a", val, NULL, S4_CMP_BINARY, S4_COND_PARENT);
+	cond_b = s4_cond_new_filter (S4_FILTER_EQUAL, "b", val, NULL, S4_CMP_BINARY, S4_COND_PARENT);
+	s4_fetchspec_add (fs, "c", NULL, S4_FETCH_DATA);
+
+	CU_ASSERT_PTR_NOT_NULL (trans);
+	g_usleep (G_USEC_PER_SEC / 2);
+	set = s4_query (trans, fs, cond_b);
+	CU_ASSERT_EQUAL (s4_resultset_get_rowcount (set), 1);
+	s4_resultset_free (set);
+
+	/* The writer is now waiting for our lock on b, and we wait for a */
+	g_usleep (G_USEC_PER_SEC);
+	set = s4_query (trans, fs, cond_a);
+	if (set != NULL)
+		s4_resultset_free (set);
+
+	CU_ASSERT_FALSE (s4_commit (trans));
+	CU_ASSERT_EQUAL (s4_errno (), S4E_DEADLOCK);
+
+	s4_cond_free (cond_a);
+	s4_cond_free (cond_b);
+	s4_fetchspec_free (fs);
+}
+
+/* Read-only locks are taken without registering the reader in the lock,
+ * make sure waiting for them still finds deadlocks instead of hanging
+ */
+CASE (test_readonly_deadlock) {
+	s4_transaction_t *trans;
+	GThread *t1, *t2;
+	_mem_open ();
+
+	trans = s4_begin (s4, 0);
+	CU_ASSERT_TRUE (s4_add (trans, "a", val, "c", val, "src"));
+	CU_ASSERT_TRUE (s4_add (trans, "b", val, "c", val, "src"));
+	CU_ASSERT_TRUE (s4_commit (trans));
+
+	t1 = g_thread_new ("writer", (GThreadFunc)_dead_writer, NULL);
+	t2 = g_thread_new ("reader", (GThreadFunc)_dead_reader, NULL);
+
+	g_thread_join (t1);
+	g_thread_join (t2);
+
+	_mem_close ();
+}
+
+static s4_sourcepref_t *composite_sp;
+
+/* Counts the entries with a=1, b=1 and key=x, found with a composite index */
+static int _composite_count (s4_transaction_t *trans, const char *key, int x)
+{
+	s4_condition_t *cond = s4_cond_new_combiner (S4_COMBINE_AND);
+	s4_condition_t *filter;
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_val_t *x_val = s4_val_new_int (x);
+	s4_resultset_t *set;
+	int ret = -1;
+
+	filter = s4_cond_new_filter (S4_FILTER_EQUAL, "b", val, composite_sp, S4_CMP_BINARY, 0);
+	s4_cond_add_operand (cond, filter);
+	s4_cond_unref (filter);
+	filter = s4_cond_new_filter (S4_FILTER_EQUAL, key, x_val, composite_sp, S4_CMP_BINARY, 0);
+	s4_cond_add_operand (cond, filter);
+	s4_cond_unref (filter);
+	s4_fetchspec_add (fs, "a", NULL, S4_FETCH_PARENT);
+
+	set = s4_query (trans, fs, cond);
+	if (set != NULL) {
+		ret = s4_resultset_get_rowcount (set);
+		s4_resultset_free (set);
+	}
+
+	s4_val_free (x_val);
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+
+	return ret;
+}
+
+static void _dead_composite_writer (void)
+{
+	s4_transaction_t *trans = s4_begin (s4, 0);
+
+	CU_ASSERT_PTR_NOT_NULL (trans);
+	g_usleep (G_USEC_PER_SEC / 4);
+	CU_ASSERT_TRUE (s4_add (trans, "a", val, "z", val, "src"));
+	g_usleep (G_USEC_PER_SEC);
+
+	/* Locks the index on b and y, then deadlocks on the one on b and x */
+	CU_ASSERT_FALSE (s4_add (trans, "a", val, "b", val, "other"));
+
+	CU_ASSERT_FALSE (s4_commit (trans));
+	CU_ASSERT_EQUAL (s4_errno (), S4E_DEADLOCK);
+}
+
+static void _dead_composite_reader (void)
+{
+	s4_transaction_t *trans = s4_begin (s4, S4_TRANS_READONLY);
+	s4_fetchspec_t *fs = s4_fetchspec_create ();
+	s4_condition_t *cond;
+	s4_resultset_t *set;
+
+	cond = s4_cond_new_filter (S4_FILTER_EQUAL, "z", val, NULL, S4_CMP_BINARY, 0);
+	s4_fetchspec_add (fs, "b", NULL, S4_FETCH_DATA);
+
+	/* Locks the index on b and x without finding the entry */
+	CU_ASSERT_EQUAL (_composite_count (trans, "x", 2), 0);
+
+	/* Waits for the writer, which will wait for the index */
+	g_usleep (G_USEC_PER_SEC / 2);
+	set = s4_query (trans, fs, cond);
+	CU_ASSERT_PTR_NOT_NULL (set);
+	if (set != NULL)
+		s4_resultset_free (set);
+	CU_ASSERT_TRUE (s4_commit (trans));
+
+	s4_cond_free (cond);
+	s4_fetchspec_free (fs);
+}
+
+/* A deadlock on the second composite index of a key must leave
+ * the rows of the entry in the first one
+ */
+CASE (test_composite_deadlock) {
+	const char *prefs[] = {"*", NULL};
+	const char *keys_x[] = {"b", "x", NULL};
+	const char *keys_y[] = {"b", "y", NULL};
+	s4_transaction_t *trans;
+	GThread *t1, *t2;
+	_mem_open ();
+
+	composite_sp = s4_sourcepref_create (prefs);
+
+	trans = s4_begin (s4, 0);
+	CU_ASSERT_TRUE (s4_add (trans, "a", val, "b", val, "src"));
+	CU_ASSERT_TRUE (s4_add (trans, "a", val, "x", val, "src"));
+	CU_ASSERT_TRUE (s4_add (trans, "a", val, "y", val, "src"));
+	CU_ASSERT_TRUE (s4_commit (trans));
+
+	CU_ASSERT_TRUE (s4_index_create (s4, "z"));
+	CU_ASSERT_TRUE (s4_index_create_composite (s4, keys_x, composite_sp, S4_CMP_BINARY));
+	CU_ASSERT_TRUE (s4_index_create_composite (s4, keys_y, composite_sp, S4_CMP_BINARY));
+
+	t1 = g_thread_new ("writer", (GThreadFunc)_dead_composite_writer, NULL);
+	t2 = g_thread_new ("reader", (GThreadFunc)_dead_composite_reader, NULL);
+
+	g_thread_join (t1);
+	g_thread_join (t2);
+
+	trans = s4_begin (s4, S4_TRANS_READONLY);
+	CU_ASSERT_EQUAL (_composite_count (trans, "x", 1), 1);
+	CU_ASSERT_EQUAL (_composite_count (trans, "y", 1), 1);
+	CU_ASSERT_TRUE (s4_commit (trans));
+
+	s4_sourcepref_unref (composite_sp);
+	_mem_close ();
+}
+
 CASE (test_failed) {
 	s4_transaction_t *trans;
 	_mem_open ();